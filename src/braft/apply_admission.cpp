@@ -0,0 +1,224 @@
+// Copyright (c) 2019 Baidu.com, Inc. All Rights Reserved
+// 
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+// 
+//     http://www.apache.org/licenses/LICENSE-2.0
+// 
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <algorithm>
+#include <gflags/gflags.h>
+#include <bvar/bvar.h>
+#include <brpc/reloadable_flags.h>
+#include "braft/apply_admission.h"
+
+namespace braft {
+
+DEFINE_int64(raft_max_inflight_apply_tasks, 0,
+             "Max tasks accepted by a node but not applied yet, 0 for unlimited");
+BRPC_VALIDATE_GFLAG(raft_max_inflight_apply_tasks, ::brpc::NonNegativeInteger);
+
+DEFINE_int64(raft_max_inflight_apply_bytes, 0,
+             "Max bytes of the tasks accepted by a node but not applied yet,"
+             " 0 for unlimited");
+BRPC_VALIDATE_GFLAG(raft_max_inflight_apply_bytes, ::brpc::NonNegativeInteger);
+
+DEFINE_int64(raft_max_process_inflight_apply_tasks, 0,
+             "Max tasks accepted by all the nodes in this process but not"
+             " applied yet, 0 for unlimited");
+BRPC_VALIDATE_GFLAG(raft_max_process_inflight_apply_tasks,
+                    ::brpc::NonNegativeInteger);
+
+DEFINE_int64(raft_max_process_inflight_apply_bytes, 0,
+             "Max bytes of the tasks accepted by all the nodes in this process"
+             " but not applied yet, 0 for unlimited");
+BRPC_VALIDATE_GFLAG(raft_max_process_inflight_apply_bytes,
+                    ::brpc::NonNegativeInteger);
+
+static butil::atomic<int64_t> g_process_inflight_tasks(0);
+static butil::atomic<int64_t> g_process_inflight_bytes(0);
+
+static int64_t get_process_inflight_tasks(void*) {
+    return g_process_inflight_tasks.load(butil::memory_order_relaxed);
+}
+static int64_t get_process_inflight_bytes(void*) {
+    return g_process_inflight_bytes.load(butil::memory_order_relaxed);
+}
+
+static bvar::PassiveStatus<int64_t> g_process_inflight_tasks_var(
+        "raft_inflight_apply_tasks", get_process_inflight_tasks, NULL);
+static bvar::PassiveStatus<int64_t> g_process_inflight_bytes_var(
+        "raft_inflight_apply_bytes", get_process_inflight_bytes, NULL);
+static bvar::Adder<int64_t> g_apply_rejected_by_admission(
+        "raft_apply_rejected_by_admission_count");
+
+static inline bool over_limit(int64_t value, int64_t limit) {
+    return limit > 0 && value > limit;
+}
+
+ApplyAdmission::ApplyAdmission()
+    : _inflight_tasks(0)
+    , _inflight_bytes(0)
+    , _applied_index(0)
+    , _stopped(false)
+{}
+
+ApplyAdmission::~ApplyAdmission() {
+    stop();
+    // Give back all the quota of this node to the process
+    g_process_inflight_tasks.fetch_sub(
+            _inflight_tasks.load(butil::memory_order_relaxed),
+            butil::memory_order_relaxed);
+    g_process_inflight_bytes.fetch_sub(
+            _inflight_bytes.load(butil::memory_order_relaxed),
+            butil::memory_order_relaxed);
+}
+
+bool ApplyAdmission::try_acquire(int64_t ntasks, int64_t bytes) {
+    const int64_t tasks = _inflight_tasks.fetch_add(
+            ntasks, butil::memory_order_relaxed) + ntasks;
+    const int64_t total_bytes = _inflight_bytes.fetch_add(
+            bytes, butil::memory_order_relaxed) + bytes;
+    const int64_t process_tasks = g_process_inflight_tasks.fetch_add(
+            ntasks, butil::memory_order_relaxed) + ntasks;
+    const int64_t process_bytes = g_process_inflight_bytes.fetch_add(
+            bytes, butil::memory_order_relaxed) + bytes;
+    // A single task larger than the limits would never be accepted, so
+    // admit it if the node is idle regardless of the limits of the node,
+    // and if the whole process is idle regardless of those of the process
+    const bool single_on_idle_node = (ntasks == 1 && tasks == 1);
+    const bool single_on_idle_process =
+            (single_on_idle_node && process_tasks == 1);
+    if ((!single_on_idle_node
+                && (over_limit(tasks, FLAGS_raft_max_inflight_apply_tasks)
+                    || over_limit(total_bytes,
+                                  FLAGS_raft_max_inflight_apply_bytes)))
+            || (!single_on_idle_process
+                && (over_limit(process_tasks,
+                               FLAGS_raft_max_process_inflight_apply_tasks)
+                    || over_limit(process_bytes,
+                                  FLAGS_raft_max_process_inflight_apply_bytes)))) {
+        release(ntasks, bytes);
+        g_apply_rejected_by_admission << ntasks;
+        return false;
+    }
+    return true;
+}
+
+bool ApplyAdmission::has_quota() const {
+    return !(over_limit(_inflight_tasks.load(butil::memory_order_relaxed) + 1,
+                        FLAGS_raft_max_inflight_apply_tasks)
+             || over_limit(_inflight_bytes.load(butil::memory_order_relaxed),
+                           FLAGS_raft_max_inflight_apply_bytes)
+             || over_limit(g_process_inflight_tasks.load(
+                                butil::memory_order_relaxed) + 1,
+                           FLAGS_raft_max_process_inflight_apply_tasks)
+             || over_limit(g_process_inflight_bytes.load(
+                                butil::memory_order_relaxed),
+                           FLAGS_raft_max_process_inflight_apply_bytes));
+}
+
+void ApplyAdmission::release(int64_t ntasks, int64_t bytes) {
+    _inflight_tasks.fetch_sub(ntasks, butil::memory_order_relaxed);
+    _inflight_bytes.fetch_sub(bytes, butil::memory_order_relaxed);
+    g_process_inflight_tasks.fetch_sub(ntasks, butil::memory_order_relaxed);
+    g_process_inflight_bytes.fetch_sub(bytes, butil::memory_order_relaxed);
+}
+
+void ApplyAdmission::on_appended(int64_t last_index, int64_t ntasks,
+                                 int64_t bytes) {
+    std::unique_lock<raft_mutex_t> lck(_mutex);
+    if (last_index <= _applied_index) {
+        // The logs were applied before being recorded
+        release(ntasks, bytes);
+        return wake_up_waiters(lck);
+    }
+    if (!_appended.empty() && _appended.back().last_index >= last_index) {
+        // The log was truncated and appended again since the last record,
+        // merge them as the former can't be applied before |last_index|
+        _appended.back().ntasks += ntasks;
+        _appended.back().bytes += bytes;
+        return;
+    }
+    AppendedTasks t;
+    t.last_index = last_index;
+    t.ntasks = ntasks;
+    t.bytes = bytes;
+    _appended.push_back(t);
+}
+
+void ApplyAdmission::on_applied(int64_t applied_index) {
+    std::unique_lock<raft_mutex_t> lck(_mutex);
+    _applied_index = std::max(_applied_index, applied_index);
+    int64_t ntasks = 0;
+    int64_t bytes = 0;
+    while (!_appended.empty() && _appended.front().last_index <= applied_index) {
+        ntasks += _appended.front().ntasks;
+        bytes += _appended.front().bytes;
+        _appended.pop_front();
+    }
+    if (ntasks == 0) {
+        return;
+    }
+    release(ntasks, bytes);
+    wake_up_waiters(lck);
+}
+
+void ApplyAdmission::wait(Closure* done) {
+    std::unique_lock<raft_mutex_t> lck(_mutex);
+    if (_stopped) {
+        lck.unlock();
+        done->status().set_error(EPERM, "Node is down");
+        return run_closure_in_bthread(done);
+    }
+    _waiters.push_back(done);
+    // Check again in case quota was given back before the waiter is added
+    wake_up_waiters(lck);
+}
+
+void ApplyAdmission::wake_up_waiters(std::unique_lock<raft_mutex_t>& lck) {
+    if (_waiters.empty() || !has_quota()) {
+        return;
+    }
+    std::vector<Closure*> waiters;
+    waiters.swap(_waiters);
+    lck.unlock();
+    for (size_t i = 0; i < waiters.size(); ++i) {
+        run_closure_in_bthread_nosig(waiters[i]);
+    }
+    bthread_flush();
+}
+
+void ApplyAdmission::stop() {
+    std::vector<Closure*> waiters;
+    {
+        BAIDU_SCOPED_LOCK(_mutex);
+        _stopped = true;
+        waiters.swap(_waiters);
+    }
+    for (size_t i = 0; i < waiters.size(); ++i) {
+        waiters[i]->status().set_error(EPERM, "Node is down");
+        run_closure_in_bthread_nosig(waiters[i]);
+    }
+    bthread_flush();
+}
+
+void ApplyAdmission::describe(std::ostream& os, bool use_html) {
+    const char* newline = use_html ? "<br>" : "\r\n";
+    size_t nwaiters = 0;
+    {
+        BAIDU_SCOPED_LOCK(_mutex);
+        nwaiters = _waiters.size();
+    }
+    os << "inflight_apply_tasks: " << inflight_tasks()
+       << " inflight_apply_bytes: " << inflight_bytes()
+       << " admission_waiters: " << nwaiters << newline;
+}
+
+}  //  namespace braft
@@ -0,0 +1,91 @@
+// Copyright (c) 2019 Baidu.com, Inc. All Rights Reserved
+// 
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+// 
+//     http://www.apache.org/licenses/LICENSE-2.0
+// 
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef BRAFT_APPLY_ADMISSION_H
+#define BRAFT_APPLY_ADMISSION_H
+
+#include <deque>
+#include <vector>
+#include <butil/atomicops.h>
+#include "braft/raft.h"
+#include "braft/util.h"
+
+namespace braft {
+
+// Admission control of Node::apply.
+//
+// Tasks are counted as in-flight from being accepted by Node::apply until
+// they are applied to the StateMachine (or rejected), which covers the apply
+// queue, the logs in memory, the BallotBox and the ClosureQueue. Both the
+// in-flight tasks of a node and those of the whole process are bounded by
+// raft_max_inflight_apply_{tasks,bytes} and
+// raft_max_process_inflight_apply_{tasks,bytes}, 0 means unlimited.
+class ApplyAdmission {
+    DISALLOW_COPY_AND_ASSIGN(ApplyAdmission);
+public:
+    ApplyAdmission();
+    ~ApplyAdmission();
+
+    // Try to admit |ntasks| tasks of |bytes| bytes in total.
+    // Returns true on success, false if any limit would be exceeded.
+    bool try_acquire(int64_t ntasks, int64_t bytes);
+
+    // Give back the quota of tasks that won't reach the log
+    void release(int64_t ntasks, int64_t bytes);
+
+    // The tasks are appended to the log, whose last index is |last_index|,
+    // the quota would be given back once |last_index| is applied, or right
+    // now if it has been applied already.
+    void on_appended(int64_t last_index, int64_t ntasks, int64_t bytes);
+
+    // Give back the quota of the tasks appended before |applied_index|
+    // (included)
+    void on_applied(int64_t applied_index);
+
+    // Run |done| once there's quota, with EPERM if stop() was called
+    void wait(Closure* done);
+
+    // Fail all the waiters, and the further ones
+    void stop();
+
+    int64_t inflight_tasks() const {
+        return _inflight_tasks.load(butil::memory_order_relaxed);
+    }
+    int64_t inflight_bytes() const {
+        return _inflight_bytes.load(butil::memory_order_relaxed);
+    }
+
+    void describe(std::ostream& os, bool use_html);
+
+private:
+    struct AppendedTasks {
+        int64_t last_index;
+        int64_t ntasks;
+        int64_t bytes;
+    };
+    bool has_quota() const;
+    void wake_up_waiters(std::unique_lock<raft_mutex_t>& lck);
+
+    butil::atomic<int64_t> _inflight_tasks;
+    butil::atomic<int64_t> _inflight_bytes;
+    raft_mutex_t _mutex;
+    std::deque<AppendedTasks> _appended;
+    int64_t _applied_index;
+    std::vector<Closure*> _waiters;
+    bool _stopped;
+};
+
+}  //  namespace braft
+
+#endif  //BRAFT_APPLY_ADMISSION_H
@@ -0,0 +1,140 @@
+// Copyright (c) 2019 Baidu.com, Inc. All Rights Reserved
+// 
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+// 
+//     http://www.apache.org/licenses/LICENSE-2.0
+// 
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <algorithm>
+#include <gflags/gflags.h>
+#include <butil/time.h>
+#include <brpc/reloadable_flags.h>
+#include "braft/apply_batch_window.h"
+
+namespace braft {
+
+DEFINE_int32(raft_apply_batch_max_wait_us, 0,
+             "Max time in microseconds the leader waits to accumulate applying"
+             " tasks into one batch, 0 to append the queued tasks immediately");
+BRPC_VALIDATE_GFLAG(raft_apply_batch_max_wait_us, ::brpc::NonNegativeInteger);
+
+DEFINE_int32(raft_apply_batch_p99_target_us, 0,
+             "The p99 latency of applying batches being committed that the"
+             " batching window is tuned against, 0 to use a fixed window of"
+             " raft_apply_batch_max_wait_us");
+BRPC_VALIDATE_GFLAG(raft_apply_batch_p99_target_us, ::brpc::NonNegativeInteger);
+
+DEFINE_int32(raft_apply_batch_window_samples, 128,
+             "Number of batches observed before adjusting the batching window");
+BRPC_VALIDATE_GFLAG(raft_apply_batch_window_samples, ::brpc::PositiveInteger);
+
+ApplyBatchWindow::ApplyBatchWindow()
+    : _nfull(0)
+    , _window_us(0)
+    , _last_p99_us(0)
+{}
+
+int64_t ApplyBatchWindow::window_us() const {
+    const int64_t max_wait_us = FLAGS_raft_apply_batch_max_wait_us;
+    if (FLAGS_raft_apply_batch_p99_target_us <= 0) {
+        return max_wait_us;
+    }
+    return std::min(_window_us.load(butil::memory_order_relaxed), max_wait_us);
+}
+
+bool ApplyBatchWindow::enabled() const {
+    return FLAGS_raft_apply_batch_p99_target_us > 0
+            && FLAGS_raft_apply_batch_max_wait_us > 0;
+}
+
+void ApplyBatchWindow::on_batch_appended(int64_t last_index,
+                                         int64_t open_time_us, bool full) {
+    if (!enabled()) {
+        return;
+    }
+    AppendedBatch batch;
+    batch.last_index = last_index;
+    batch.open_time_us = open_time_us;
+    batch.full = full;
+    BAIDU_SCOPED_LOCK(_mutex);
+    _appended_batches.push_back(batch);
+}
+
+void ApplyBatchWindow::on_committed(int64_t committed_index) {
+    std::vector<AppendedBatch> committed;
+    {
+        BAIDU_SCOPED_LOCK(_mutex);
+        while (!_appended_batches.empty()
+                && _appended_batches.front().last_index <= committed_index) {
+            committed.push_back(_appended_batches.front());
+            _appended_batches.pop_front();
+        }
+    }
+    for (size_t i = 0; i < committed.size(); ++i) {
+        on_batch_committed(committed[i].open_time_us, committed[i].full);
+    }
+}
+
+void ApplyBatchWindow::clear() {
+    BAIDU_SCOPED_LOCK(_mutex);
+    _appended_batches.clear();
+}
+
+void ApplyBatchWindow::on_batch_committed(int64_t open_time_us, bool full) {
+    if (!enabled()) {
+        return;
+    }
+    const int64_t latency_us = butil::cpuwide_time_us() - open_time_us;
+    std::unique_lock<raft_mutex_t> lck(_mutex);
+    _latency_samples.push_back(latency_us);
+    if (full) {
+        ++_nfull;
+    }
+    if (_latency_samples.size() < (size_t)FLAGS_raft_apply_batch_window_samples) {
+        return;
+    }
+    std::vector<int64_t> samples;
+    samples.swap(_latency_samples);
+    const bool all_full = (_nfull == samples.size());
+    _nfull = 0;
+    lck.unlock();
+    std::vector<int64_t>::iterator p99 = samples.begin() + samples.size() * 99 / 100;
+    std::nth_element(samples.begin(), p99, samples.end());
+    adjust(*p99, all_full);
+}
+
+void ApplyBatchWindow::adjust(int64_t p99_us, bool all_full) {
+    const int64_t target_us = FLAGS_raft_apply_batch_p99_target_us;
+    const int64_t max_wait_us = FLAGS_raft_apply_batch_max_wait_us;
+    int64_t window_us = std::min(_window_us.load(butil::memory_order_relaxed),
+                                 max_wait_us);
+    if (p99_us > target_us) {
+        // Back off quickly to protect the latency
+        window_us /= 2;
+    } else if (p99_us < target_us * 3 / 4 && !all_full) {
+        // Waiting longer is useless if all the batches were closed because
+        // of the size limit
+        window_us = std::min(max_wait_us,
+                             window_us + std::max<int64_t>(max_wait_us / 16, 1));
+    }
+    _window_us.store(window_us, butil::memory_order_relaxed);
+    _last_p99_us = p99_us;
+}
+
+void ApplyBatchWindow::describe(std::ostream& os, bool use_html) {
+    const char* newline = use_html ? "<br>" : "\r\n";
+    os << "apply_batch_window_us: " << window_us();
+    if (FLAGS_raft_apply_batch_p99_target_us > 0) {
+        os << " last_p99_us: " << _last_p99_us;
+    }
+    os << newline;
+}
+
+}  //  namespace braft
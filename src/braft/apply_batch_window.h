@@ -0,0 +1,79 @@
+// Copyright (c) 2019 Baidu.com, Inc. All Rights Reserved
+// 
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+// 
+//     http://www.apache.org/licenses/LICENSE-2.0
+// 
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef BRAFT_APPLY_BATCH_WINDOW_H
+#define BRAFT_APPLY_BATCH_WINDOW_H
+
+#include <vector>
+#include <deque>
+#include <butil/atomicops.h>
+#include "braft/util.h"
+
+namespace braft {
+
+// Decide how long the leader waits to accumulate applying tasks before
+// appending them to the log.
+//
+// The window is in [0, raft_apply_batch_max_wait_us]. If
+// raft_apply_batch_p99_target_us is positive, the window is tuned against
+// the p99 latency of the batches from being opened to being committed by the
+// quorum: it grows additively while the p99 is well under the target and is
+// halved once the p99 exceeds the target. Otherwise the window is fixed at
+// raft_apply_batch_max_wait_us.
+class ApplyBatchWindow {
+public:
+    ApplyBatchWindow();
+
+    // Current window in microseconds, 0 means the pending tasks should be
+    // appended immediately
+    int64_t window_us() const;
+
+    // Called by the leader when a batch opened at |open_time_us| is appended
+    // as the logs ending at |last_index|, |full| is true if the batch was
+    // closed because of the count or size limit.
+    void on_batch_appended(int64_t last_index, int64_t open_time_us, bool full);
+
+    // Called when the logs till |committed_index| are committed
+    void on_committed(int64_t committed_index);
+
+    // Forget the appended batches, e.g. when the leader steps down
+    void clear();
+
+    // Record the latency of a batch opened at |open_time_us| which is just
+    // committed
+    void on_batch_committed(int64_t open_time_us, bool full);
+
+    void describe(std::ostream& os, bool use_html);
+
+private:
+    void adjust(int64_t p99_us, bool all_full);
+    bool enabled() const;
+
+    struct AppendedBatch {
+        int64_t last_index;
+        int64_t open_time_us;
+        bool full;
+    };
+
+    raft_mutex_t _mutex;
+    std::deque<AppendedBatch> _appended_batches;
+    std::vector<int64_t> _latency_samples;
+    size_t _nfull;
+    butil::atomic<int64_t> _window_us;
+    int64_t _last_p99_us;
+};
+
+}  //  namespace braft
+
+#endif  //BRAFT_APPLY_BATCH_WINDOW_H
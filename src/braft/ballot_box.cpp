@@ -21,12 +21,14 @@
 #include "braft/util.h"
 #include "braft/fsm_caller.h"
 #include "braft/closure_queue.h"
+#include "braft/apply_batch_window.h"
 
 namespace braft {
 
 BallotBox::BallotBox()
     : _waiter(NULL)
     , _closure_queue(NULL)
+    , _batch_window(NULL)
     , _last_committed_index(0)
     , _pending_index(0)
 {
@@ -43,6 +45,7 @@ int BallotBox::init(const BallotBoxOptions &options) {
     }
     _waiter = options.waiter;
     _closure_queue = options.closure_queue;
+    _batch_window = options.batch_window;
     return 0;
 }
 
@@ -92,6 +95,9 @@ int BallotBox::commit_at(
     lck.unlock();
     // The order doesn't matter
     _waiter->on_committed(last_committed_index);
+    if (_batch_window) {
+        _batch_window->on_committed(last_committed_index);
+    }
     return 0;
 }
 
@@ -103,6 +109,9 @@ int BallotBox::clear_pending_tasks() {
         _pending_index = 0;
     }
     _closure_queue->clear();
+    if (_batch_window) {
+        _batch_window->clear();
+    }
     return 0;
 }
 
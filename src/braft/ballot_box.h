@@ -29,14 +29,19 @@ namespace braft {
 
 class FSMCaller;
 class ClosureQueue;
+class ApplyBatchWindow;
 
 struct BallotBoxOptions {
     BallotBoxOptions() 
         : waiter(NULL)
         , closure_queue(NULL)
+        , batch_window(NULL)
     {}
     FSMCaller* waiter;
     ClosureQueue* closure_queue;
+    // Notified of the committed index to measure the commit latency of the
+    // applying batches, optional
+    ApplyBatchWindow* batch_window;
 };
 
 struct BallotBoxStatus {
@@ -94,6 +99,7 @@ private:
 
     FSMCaller*                                      _waiter;
     ClosureQueue*                                   _closure_queue;                            
+    ApplyBatchWindow*                               _batch_window;
     raft_mutex_t                                    _mutex;
     butil::atomic<int64_t>                          _last_committed_index;
     int64_t                                         _pending_index;
@@ -69,6 +69,10 @@ void RaftStatImpl::default_method(::google::protobuf::RpcController* controller,
 
     std::string prev_group_id;
     const char *newline = html ? "<br>" : "\r\n";
+    if (group_id.empty()) {
+        global_node_manager->snapshot_scheduler()->describe(os, html);
+        os << newline;
+    }
     for (size_t i = 0; i < nodes.size(); ++i) {
         const NodeId node_id = nodes[i]->node_id();
         group_id = node_id.group_id;
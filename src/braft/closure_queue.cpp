@@ -20,24 +20,58 @@
 
 namespace braft {
 
+// Initial capacity of the ring, it doubles whenever the pending closures
+// don't fit in.
+static const size_t CLOSURE_QUEUE_INITIAL_CAPACITY = 1024;
+
+ClosureQueue::Ring::Ring(size_t capacity)
+    : mask(capacity - 1)
+    , slots(new butil::atomic<Closure*>[capacity])
+{
+    for (size_t i = 0; i < capacity; ++i) {
+        slots[i].store(NULL, butil::memory_order_relaxed);
+    }
+}
+
+ClosureQueue::Ring::~Ring() {
+    delete [] slots;
+}
+
 ClosureQueue::ClosureQueue(bool usercode_in_pthread) 
-    : _first_index(0)
+    : _head(0)
+    , _tail(0)
+    , _index_offset(0)
+    , _ring(new Ring(CLOSURE_QUEUE_INITIAL_CAPACITY))
     , _usercode_in_pthread(usercode_in_pthread)
 {}
 
 ClosureQueue::~ClosureQueue() {
     clear();
+    delete _ring.load(butil::memory_order_relaxed);
+    for (size_t i = 0; i < _retired_rings.size(); ++i) {
+        delete _retired_rings[i];
+    }
 }
 
 void ClosureQueue::clear() {
-    std::deque<Closure*> saved_queue;
-    {
-        BAIDU_SCOPED_LOCK(_mutex);
-        saved_queue.swap(_queue);
-        _first_index = 0;
+    std::vector<Closure*> saved_queue;
+    const int64_t tail = _tail.load(butil::memory_order_relaxed);
+    int64_t head = _head.load(butil::memory_order_acquire);
+    // Racing with pop_closure_until, whoever moves _head first owns the
+    // closures in between
+    while (head < tail) {
+        if (_head.compare_exchange_weak(head, tail,
+                                        butil::memory_order_acq_rel)) {
+            const Ring* ring = _ring.load(butil::memory_order_relaxed);
+            saved_queue.reserve(tail - head);
+            for (int64_t pos = head; pos < tail; ++pos) {
+                saved_queue.push_back(ring->get(pos));
+            }
+            break;
+        }
     }
     bool run_bthread = false;
-    for (std::deque<Closure*>::iterator 
+    for (std::vector<Closure*>::iterator 
             it = saved_queue.begin(); it != saved_queue.end(); ++it) {
         if (*it) {
             (*it)->status().set_error(EPERM, "leader stepped down");
@@ -51,36 +85,75 @@ void ClosureQueue::clear() {
 }
 
 void ClosureQueue::reset_first_index(int64_t first_index) {
-    BAIDU_SCOPED_LOCK(_mutex);
-    CHECK(_queue.empty());
-    _first_index = first_index;
+    const int64_t tail = _tail.load(butil::memory_order_relaxed);
+    CHECK_EQ(_head.load(butil::memory_order_acquire), tail);
+    // Published to the consumer along with the next _tail
+    _index_offset.store(first_index - tail, butil::memory_order_relaxed);
+}
+
+void ClosureQueue::grow(int64_t head, int64_t tail) {
+    Ring* old_ring = _ring.load(butil::memory_order_relaxed);
+    size_t capacity = (old_ring->mask + 1) * 2;
+    while ((int64_t)capacity <= tail - head) {
+        capacity *= 2;
+    }
+    Ring* new_ring = new Ring(capacity);
+    for (int64_t pos = head; pos < tail; ++pos) {
+        new_ring->set(pos, old_ring->get(pos));
+    }
+    _ring.store(new_ring, butil::memory_order_release);
+    _retired_rings.push_back(old_ring);
 }
 
 void ClosureQueue::append_pending_closure(Closure* c) {
-    BAIDU_SCOPED_LOCK(_mutex);
-    _queue.push_back(c);
+    const int64_t tail = _tail.load(butil::memory_order_relaxed);
+    const int64_t head = _head.load(butil::memory_order_acquire);
+    Ring* ring = _ring.load(butil::memory_order_relaxed);
+    if (tail - head > ring->mask) {
+        grow(head, tail);
+        ring = _ring.load(butil::memory_order_relaxed);
+    }
+    ring->set(tail, c);
+    _tail.store(tail + 1, butil::memory_order_release);
 }
 
 int ClosureQueue::pop_closure_until(int64_t index,
                                     std::vector<Closure*> *out, int64_t *out_first_index) {
     out->clear();
-    BAIDU_SCOPED_LOCK(_mutex);
-    if (_queue.empty() || index < _first_index) {
+    // Load _tail first, so that _head, _index_offset and _ring are at least
+    // as new as the closures it covers
+    const int64_t tail = _tail.load(butil::memory_order_acquire);
+    int64_t head = _head.load(butil::memory_order_acquire);
+    const int64_t offset = _index_offset.load(butil::memory_order_relaxed);
+    const Ring* ring = _ring.load(butil::memory_order_acquire);
+    if (head >= tail || index < head + offset) {
         *out_first_index = index + 1;
         return 0;
     }
-    if (index > _first_index + (int64_t)_queue.size() - 1) {
+    const int64_t last = index - offset;
+    if (last >= tail) {
+        if (_head.load(butil::memory_order_acquire) != head) {
+            // Cleared concurrently, |offset| may belong to the new term
+            *out_first_index = index + 1;
+            return 0;
+        }
         CHECK(false) << "Invalid index=" << index
-                     << " _first_index=" << _first_index
-                     << " _closure_queue_size=" << _queue.size();
+                     << " _first_index=" << head + offset
+                     << " _closure_queue_size=" << tail - head;
         return -1;
     }
-    *out_first_index = _first_index;
-    for (int64_t i = _first_index; i <= index; ++i) {
-        out->push_back(_queue.front());
-        _queue.pop_front();
+    out->reserve(last - head + 1);
+    for (int64_t pos = head; pos <= last; ++pos) {
+        out->push_back(ring->get(pos));
+    }
+    if (!_head.compare_exchange_strong(head, last + 1,
+                                       butil::memory_order_acq_rel)) {
+        // The closures were taken by clear()
+        out->clear();
+        *out_first_index = index + 1;
+        return 0;
     }
-    _first_index = index + 1;
+    *out_first_index = head + offset;
     return 0;
 }
 
@@ -17,11 +17,20 @@
 #ifndef  BRAFT_CLOSURE_QUEUE_H
 #define  BRAFT_CLOSURE_QUEUE_H
 
+#include <butil/atomicops.h>
 #include "braft/util.h"
 
 namespace braft {
 
-// Holding the closure waiting for the commitment of logs
+// Holding the closure waiting for the commitment of logs.
+//
+// The queue is a single-producer/single-consumer ring addressed by log index.
+// The producer side (append_pending_closure, reset_first_index and clear) is
+// driven by the leader and must be serialized by the caller, which is
+// NodeImpl::_mutex in practice. The consumer side (pop_closure_until) is
+// driven by FSMCaller. Neither append nor pop takes a lock, so the apply
+// thread and the FSMCaller thread no longer ping-pong on a mutex for every
+// batch.
 class ClosureQueue {
 public:
     explicit ClosureQueue(bool usercode_in_pthread);
@@ -45,10 +54,33 @@ public:
     int pop_closure_until(int64_t index,
                           std::vector<Closure*> *out, int64_t *out_first_index);
 private:
-    // TODO: a spsc lock-free queue would help
-    raft_mutex_t                                    _mutex;
-    int64_t                                         _first_index;
-    std::deque<Closure*>                            _queue;
+    struct Ring {
+        explicit Ring(size_t capacity);
+        ~Ring();
+        Closure* get(int64_t pos) const {
+            return slots[pos & mask].load(butil::memory_order_relaxed);
+        }
+        void set(int64_t pos, Closure* c) {
+            slots[pos & mask].store(c, butil::memory_order_relaxed);
+        }
+        const int64_t mask;
+        butil::atomic<Closure*>* const slots;
+    };
+
+    void grow(int64_t head, int64_t tail);
+
+    // Closures are stored at monotonic positions, [_head, _tail) being the
+    // pending ones. The log index of position p is p + _index_offset. Keeping
+    // positions monotonic across clear()/reset_first_index() makes the CAS
+    // on _head in pop_closure_until free from ABA.
+    butil::atomic<int64_t>                          _head;
+    butil::atomic<int64_t>                          _tail;
+    butil::atomic<int64_t>                          _index_offset;
+    butil::atomic<Ring*>                            _ring;
+    // Rings replaced by grow() may still be read by a concurrent pop, they
+    // are released in the destructor. Their total size is less than the
+    // current ring.
+    std::vector<Ring*>                              _retired_rings;
     bool                                            _usercode_in_pthread;
 
 };
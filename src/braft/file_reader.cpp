@@ -17,20 +17,270 @@
 //          Xiong,Kai(xiongkai@baidu.com)
 //          Yang,Guodong(yangguodong01@baidu.com)
 
+#include <gflags/gflags.h>
+#include <list>
+#include <butil/memory/singleton_on_pthread_once.h>
+#include <brpc/reloadable_flags.h>
+#include <brpc/policy/snappy_compress.h>
+#include <brpc/policy/gzip_compress.h>
 #include "braft/file_reader.h"
 #include "braft/util.h"
 
 namespace braft {
 
+DEFINE_int32(raft_file_reader_max_open_files, 64,
+             "Max number of files kept open by a reader of the file service");
+BRPC_VALIDATE_GFLAG(raft_file_reader_max_open_files, brpc::NonNegativeInteger);
+
+DEFINE_bool(raft_file_reader_prefetch, true,
+            "Read the next chunk of a file ahead in background after each read"
+            " of the file service");
+BRPC_VALIDATE_GFLAG(raft_file_reader_prefetch, ::brpc::PassValidate);
+
+DEFINE_bool(raft_file_reader_drop_page_cache, false,
+            "Drop the pages read by the file service from the page cache, so"
+            " that serving snapshots doesn't evict the hot data. Files with"
+            " more than one hardlink are skipped as they're likely shared"
+            " with the live data, but reflinked files aren't told apart, so"
+            " enable it only if the snapshot files are private copies");
+BRPC_VALIDATE_GFLAG(raft_file_reader_drop_page_cache, ::brpc::PassValidate);
+
+DEFINE_int64(raft_file_reader_cache_size, 64 * 1024 * 1024,
+             "Bytes of the chunks read by the file service which are cached in"
+             " memory for the other readers of the same directory, e.g. the"
+             " other followers installing the same snapshot. 0 disables it");
+BRPC_VALIDATE_GFLAG(raft_file_reader_cache_size, brpc::NonNegativeInteger);
+
+DEFINE_int32(raft_file_compress_min_saving_percent, 10,
+             "Send a file uncompressed if compressing its first chunk saves"
+             " less than this percent of bytes");
+BRPC_VALIDATE_GFLAG(raft_file_compress_min_saving_percent,
+                    brpc::NonNegativeInteger);
+
+static bvar::Adder<int64_t> g_file_compress_raw_bytes(
+        "raft_file_compress_raw_bytes");
+static bvar::Adder<int64_t> g_file_compress_wire_bytes(
+        "raft_file_compress_wire_bytes");
+
+static bvar::Adder<int64_t> g_file_reader_cache_hit_bytes(
+        "raft_file_reader_cache_hit_bytes");
+
+// LRU cache of the chunks read by the LocalDirReaders of this process, keyed
+// by directory, file and offset. The chunks of a directory are dropped once
+// it has no reader, as its files may be rewritten after that.
+class FileChunkCache {
+public:
+    FileChunkCache() : _size(0) {}
+
+    void add_reader(const FileSystemAdaptor* fs, const std::string& dir) {
+        BAIDU_SCOPED_LOCK(_mutex);
+        ++_nreaders[Dir(fs, dir)];
+    }
+
+    void remove_reader(const FileSystemAdaptor* fs, const std::string& dir) {
+        BAIDU_SCOPED_LOCK(_mutex);
+        const Dir d(fs, dir);
+        std::map<Dir, int>::iterator it = _nreaders.find(d);
+        if (it == _nreaders.end() || --it->second > 0) {
+            return;
+        }
+        _nreaders.erase(it);
+        EntryMap::iterator e = _entries.lower_bound(Key(d, std::string(), 0));
+        while (e != _entries.end() && e->first.dir == d) {
+            _size -= e->second.data.size();
+            _lru.erase(e->second.lru);
+            _entries.erase(e++);
+        }
+    }
+
+    // Get the chunk of at most |max_count| bytes at |offset|, which must have
+    // been cached by a read of at least the same size
+    bool get(const FileSystemAdaptor* fs, const std::string& dir,
+             const std::string& filename, off_t offset, size_t max_count,
+             butil::IOBuf* out, bool* is_eof) {
+        BAIDU_SCOPED_LOCK(_mutex);
+        EntryMap::iterator it =
+                _entries.find(Key(Dir(fs, dir), filename, offset));
+        if (it == _entries.end()) {
+            return false;
+        }
+        Entry& entry = it->second;
+        if (entry.data.size() < max_count && !entry.eof) {
+            return false;
+        }
+        entry.data.append_to(out, max_count);
+        *is_eof = entry.eof && out->size() == entry.data.size();
+        _lru.splice(_lru.begin(), _lru, entry.lru);
+        g_file_reader_cache_hit_bytes << out->size();
+        return true;
+    }
+
+    void put(const FileSystemAdaptor* fs, const std::string& dir,
+             const std::string& filename, off_t offset,
+             const butil::IOBuf& data, bool is_eof) {
+        const size_t capacity = FLAGS_raft_file_reader_cache_size;
+        if (data.size() > capacity) {
+            return;
+        }
+        BAIDU_SCOPED_LOCK(_mutex);
+        const Key key(Dir(fs, dir), filename, offset);
+        EntryMap::iterator it = _entries.find(key);
+        if (it != _entries.end()) {
+            if (it->second.data.size() >= data.size()) {
+                return;
+            }
+            erase(it);
+        }
+        while (!_lru.empty() && _size + data.size() > capacity) {
+            erase(_entries.find(_lru.back()));
+        }
+        Entry& entry = _entries[key];
+        entry.data = data;
+        entry.eof = is_eof;
+        _lru.push_front(key);
+        entry.lru = _lru.begin();
+        _size += data.size();
+    }
+
+private:
+    typedef std::pair<const FileSystemAdaptor*, std::string> Dir;
+    struct Key {
+        Key(const Dir& d, const std::string& f, off_t o)
+            : dir(d), filename(f), offset(o) {}
+        bool operator<(const Key& rhs) const {
+            if (dir != rhs.dir) {
+                return dir < rhs.dir;
+            }
+            if (filename != rhs.filename) {
+                return filename < rhs.filename;
+            }
+            return offset < rhs.offset;
+        }
+        Dir dir;
+        std::string filename;
+        off_t offset;
+    };
+    typedef std::list<Key> LRUList;
+    struct Entry {
+        butil::IOBuf data;
+        bool eof;
+        LRUList::iterator lru;
+    };
+    typedef std::map<Key, Entry> EntryMap;
+
+    void erase(EntryMap::iterator it) {
+        _size -= it->second.data.size();
+        _lru.erase(it->second.lru);
+        _entries.erase(it);
+    }
+
+    raft_mutex_t _mutex;
+    std::map<Dir, int> _nreaders;
+    EntryMap _entries;
+    LRUList _lru;
+    size_t _size;
+};
+
+static FileChunkCache* file_chunk_cache() {
+    return butil::get_leaky_singleton<FileChunkCache>();
+}
+
+LocalDirReader::LocalDirReader(FileSystemAdaptor* fs, const std::string& path)
+    : _path(path), _fs(fs) {
+    file_chunk_cache()->add_reader(fs, path);
+}
+
 LocalDirReader::~LocalDirReader() {
-    if (_current_file) {
-        _current_file->close();
-        delete _current_file;
-        _current_file = NULL;
+    for (FileMap::iterator it = _opened_files.begin();
+            it != _opened_files.end(); ++it) {
+        CHECK_EQ(0, it->second->nref);
+        close_file(it->second);
     }
+    _opened_files.clear();
+    file_chunk_cache()->remove_reader(_fs.get(), _path);
     _fs->close_snapshot(_path);
 }
 
+bool compress_file_data(FileCompressType type, const butil::IOBuf& in,
+                        butil::IOBuf* out) {
+    switch (type) {
+    case FILE_COMPRESS_SNAPPY:
+        return brpc::policy::SnappyCompress(in, out);
+    case FILE_COMPRESS_ZLIB:
+        return brpc::policy::ZlibCompress(in, out, NULL);
+    default:
+        return false;
+    }
+}
+
+bool decompress_file_data(FileCompressType type, const butil::IOBuf& in,
+                          butil::IOBuf* out) {
+    switch (type) {
+    case FILE_COMPRESS_NONE:
+        *out = in;
+        return true;
+    case FILE_COMPRESS_SNAPPY:
+        return brpc::policy::SnappyDecompress(in, out);
+    case FILE_COMPRESS_ZLIB:
+        return brpc::policy::ZlibDecompress(in, out);
+    default:
+        return false;
+    }
+}
+
+FileCompressType LocalDirReader::compress(const std::string& filename,
+                                          FileCompressType type,
+                                          const butil::IOBuf& data,
+                                          butil::IOBuf* out) const {
+    if (type == FILE_COMPRESS_NONE || data.empty()) {
+        return FILE_COMPRESS_NONE;
+    }
+    bool sampled = false;
+    {
+        BAIDU_SCOPED_LOCK(_mutex);
+        std::map<std::string, bool>::const_iterator
+                it = _compressible_files.find(filename);
+        if (it != _compressible_files.end()) {
+            if (!it->second) {
+                return FILE_COMPRESS_NONE;
+            }
+            sampled = true;
+        }
+    }
+    out->clear();
+    if (!compress_file_data(type, data, out)) {
+        LOG(WARNING) << "Fail to compress " << _path << '/' << filename
+                     << " with type=" << type;
+        out->clear();
+        return FILE_COMPRESS_NONE;
+    }
+    const int64_t saved = (int64_t)data.size() - (int64_t)out->size();
+    const bool worthy = saved * 100 >= (int64_t)data.size()
+                                * FLAGS_raft_file_compress_min_saving_percent;
+    if (!sampled) {
+        BRAFT_VLOG << "Compressing " << _path << '/' << filename << " saves "
+                   << saved << " of " << data.size() << " bytes, "
+                   << (worthy ? "compress" : "skip") << " it";
+        BAIDU_SCOPED_LOCK(_mutex);
+        _compressible_files[filename] = worthy;
+    }
+    if (saved <= 0 || (!sampled && !worthy)) {
+        out->clear();
+        return FILE_COMPRESS_NONE;
+    }
+    g_file_compress_raw_bytes << data.size();
+    g_file_compress_wire_bytes << out->size();
+    return type;
+}
+
+void LocalDirReader::close_file(OpenedFile* opened) {
+    if (opened->file) {
+        opened->file->close();
+        delete opened->file;
+    }
+    delete opened;
+}
+
 bool LocalDirReader::open() {
     return _fs->open_snapshot(_path);
 }
@@ -46,6 +296,133 @@ int LocalDirReader::read_file(butil::IOBuf* out,
                                max_count, read_count, is_eof);
 }
 
+int LocalDirReader::read_opened_file(OpenedFile* opened, off_t offset,
+                                     size_t max_count, butil::IOBuf* out,
+                                     bool* is_eof) {
+    butil::IOPortal buf;
+    ssize_t nread = opened->file->read(&buf, offset, max_count);
+    if (nread < 0) {
+        return EIO;
+    }
+    *is_eof = false;
+    if ((size_t)nread < max_count) {
+        *is_eof = true;
+    } else {
+        ssize_t size = opened->file->size();
+        if (size < 0) {
+            return EIO;
+        }
+        if (size == ssize_t(offset + max_count)) {
+            *is_eof = true;
+        }
+    }
+    if (opened->drop_page_cache && nread > 0) {
+        // The data is in |buf| now, and the reader of a snapshot doesn't read
+        // it again
+        opened->file->advise(offset, nread, FILE_ADVICE_DONTNEED);
+    }
+    out->swap(buf);
+    return 0;
+}
+
+bool LocalDirReader::take_prefetched(OpenedFile* opened, off_t offset,
+                                     size_t max_count, butil::IOBuf* out,
+                                     bool* is_eof) {
+    if (opened->prefetched.empty() && !opened->prefetched_eof) {
+        return false;
+    }
+    if (offset < opened->prefetched_offset) {
+        // An earlier chunk still in flight, the prefetched data is kept for
+        // the chunk following the highest one
+        return false;
+    }
+    if (opened->prefetched_offset != offset
+            || (opened->prefetched.size() < max_count
+                && !opened->prefetched_eof)) {
+        opened->prefetched.clear();
+        opened->prefetched_eof = false;
+        return false;
+    }
+    opened->prefetched.cutn(out, max_count);
+    opened->prefetched_offset += out->size();
+    *is_eof = opened->prefetched_eof && opened->prefetched.empty();
+    if (opened->prefetched.empty()) {
+        opened->prefetched_eof = false;
+    }
+    return true;
+}
+
+struct LocalDirReader::PrefetchArg {
+    const LocalDirReader* reader;
+    std::string filename;
+    OpenedFile* opened;
+    off_t offset;
+    size_t count;
+};
+
+void* LocalDirReader::run_prefetch(void* arg) {
+    PrefetchArg* pa = (PrefetchArg*)arg;
+    OpenedFile* opened = pa->opened;
+    {
+        BAIDU_SCOPED_LOCK(opened->mutex);
+        opened->prefetching = false;
+        butil::IOBuf buf;
+        bool is_eof = false;
+        // The file is kept open by the reference of this prefetch
+        if (opened->prefetched.empty()
+                && read_opened_file(opened, pa->offset, pa->count,
+                                    &buf, &is_eof) == 0) {
+            opened->prefetched.swap(buf);
+            opened->prefetched_offset = pa->offset;
+            opened->prefetched_eof = is_eof;
+        }
+    }
+    pa->reader->release_file(pa->filename, opened);
+    pa->reader->Release();
+    delete pa;
+    return NULL;
+}
+
+void LocalDirReader::start_prefetch(const std::string& filename,
+                                    OpenedFile* opened,
+                                    off_t offset, size_t count) const {
+    std::unique_lock<raft_mutex_t> lck(_mutex);
+    ++opened->nref;
+    lck.unlock();
+    AddRef();
+    PrefetchArg* pa = new PrefetchArg;
+    pa->reader = this;
+    pa->filename = filename;
+    pa->opened = opened;
+    pa->offset = offset;
+    pa->count = count;
+    bthread_t tid;
+    if (bthread_start_background(&tid, NULL, run_prefetch, pa) != 0) {
+        PLOG(WARNING) << "Fail to start bthread";
+        run_prefetch(pa);
+    }
+}
+
+void LocalDirReader::release_file(const std::string& filename,
+                                  OpenedFile* opened) const {
+    std::unique_lock<raft_mutex_t> lck(_mutex);
+    if (--opened->nref != 0) {
+        return;
+    }
+    bool to_close = false;
+    {
+        // The state of the file is written under its own lock
+        BAIDU_SCOPED_LOCK(opened->mutex);
+        to_close = opened->file == NULL || opened->eof_reached;
+    }
+    if (to_close || _opened_files.size()
+                        > (size_t)FLAGS_raft_file_reader_max_open_files) {
+        _opened_files.erase(filename);
+        lck.unlock();
+        close_file(opened);
+    }
+}
+
 int LocalDirReader::read_file_with_meta(butil::IOBuf* out,
                                         const std::string &filename,
                                         google::protobuf::Message* file_meta,
@@ -53,69 +430,80 @@ int LocalDirReader::read_file_with_meta(butil::IOBuf* out,
                                         size_t max_count,
                                         size_t* read_count,
                                         bool* is_eof) const {
+    const bool use_cache = FLAGS_raft_file_reader_cache_size > 0;
+    if (use_cache) {
+        butil::IOBuf buf;
+        if (file_chunk_cache()->get(_fs.get(), _path, filename, offset,
+                                    max_count, &buf, is_eof)) {
+            *read_count = buf.size();
+            out->swap(buf);
+            return 0;
+        }
+    }
     std::unique_lock<raft_mutex_t> lck(_mutex);
-    if (_is_reading) {
-        // Just let follower retry, if there already a reading request in process.
-        lck.unlock();
-        BRAFT_VLOG << "A courrent read file is in process, path: " << _path;
-        return EAGAIN;
-    }
-    int ret = EINVAL;
-    if (filename != _current_filename) {
-        if (!_eof_reached || offset != 0) {
-            lck.unlock();
-            BRAFT_VLOG << "Out of order read request, path: " << _path
-                      << " filename: " << filename << " offset: " << offset
-                      << " max_count: " << max_count;
-            return EINVAL;
-        }
-        if (_current_file) {
-            _current_file->close();
-            delete _current_file;
-            _current_file = NULL;
-            _current_filename.clear();
-        }
-        std::string file_path(_path + "/" + filename);
-        butil::File::Error e;
-        FileAdaptor* file = _fs->open(file_path, O_RDONLY | O_CLOEXEC, file_meta, &e);
-        if (!file) {
-            return file_error_to_os_error(e);
-        }
-        _current_filename = filename;
-        _current_file = file;
-        _eof_reached = false;
-    }
-    _is_reading = true;
+    OpenedFile*& slot = _opened_files[filename];
+    if (slot == NULL) {
+        slot = new OpenedFile;
+    }
+    OpenedFile* opened = slot;
+    ++opened->nref;
     lck.unlock();
 
-    do {
-        butil::IOPortal buf;
-        ssize_t nread = _current_file->read(&buf, offset, max_count);
-        if (nread < 0) {
-            ret = EIO;
-            break;
-        }
-        ret = 0;
-        *read_count = nread;
-        *is_eof = false;
-        if ((size_t)nread < max_count) {
-            *is_eof = true;
-        } else {
-            ssize_t size = _current_file->size();
-            if (size < 0) {
-                return EIO;
+    // NOTE: a read which misses both the cache and the prefetched chunk, e.g.
+    // the first one of a file, still reads the disk on the calling thread
+    int ret = 0;
+    bool to_prefetch = false;
+    off_t prefetch_offset = 0;
+    {
+        // Files are opened and read under their own lock, so that a slow
+        // file doesn't block the others
+        BAIDU_SCOPED_LOCK(opened->mutex);
+        if (opened->file == NULL) {
+            std::string file_path(_path + "/" + filename);
+            butil::File::Error e;
+            opened->file = _fs->open(file_path, O_RDONLY | O_CLOEXEC,
+                                     file_meta, &e);
+            if (opened->file == NULL) {
+                ret = file_error_to_os_error(e);
+            } else {
+                opened->file->advise(0, 0, FILE_ADVICE_SEQUENTIAL);
+                // The pages of a file hardlinked by another path, e.g. a
+                // table of the live data, are likely to be hot
+                opened->drop_page_cache = FLAGS_raft_file_reader_drop_page_cache
+                        && _fs->link_count(file_path) <= 1;
             }
-            if (size == ssize_t(offset + max_count)) {
-                *is_eof = true;
+        }
+        butil::IOBuf buf;
+        if (ret == 0 && !take_prefetched(opened, offset, max_count,
+                                         &buf, is_eof)) {
+            ret = read_opened_file(opened, offset, max_count, &buf, is_eof);
+        }
+        if (ret == 0) {
+            *read_count = buf.size();
+            out->swap(buf);
+            const off_t end = offset + *read_count;
+            if (*is_eof) {
+                opened->eof_reached = true;
+            } else if (end >= opened->read_end) {
+                // With several chunks of the file in flight, the next one
+                // requested follows the highest chunk rather than this one
+                opened->read_end = end;
+                if (FLAGS_raft_file_reader_prefetch && !opened->prefetching
+                        && opened->prefetched.empty()) {
+                    opened->prefetching = true;
+                    prefetch_offset = end;
+                    to_prefetch = true;
+                }
             }
         }
-        out->swap(buf);
-    } while (false);
-
-    lck.lock();
-    _is_reading = false;
-    if (!ret) {
-        _eof_reached = *is_eof;
+    }
+    if (to_prefetch) {
+        start_prefetch(filename, opened, prefetch_offset, max_count);
+    }
+    release_file(filename, opened);
+    if (ret == 0 && use_cache) {
+        file_chunk_cache()->put(_fs.get(), _path, filename, offset,
+                                *out, *is_eof);
     }
     return ret;
 }
@@ -21,10 +21,12 @@
 #define  BRAFT_FILE_READER_H
 
 #include <set>                              // std::set
+#include <map>                              // std::map
 #include <butil/memory/ref_counted.h>        // butil::RefCountedThreadsafe
 #include <butil/iobuf.h>                     // butil::IOBuf
 #include "braft/macros.h"
 #include "braft/file_system_adaptor.h"
+#include "braft/file_service.pb.h"
 
 namespace braft {
 
@@ -49,17 +51,33 @@ public:
                           bool* is_eof) const = 0;
     // Get the path of this reader
     virtual const std::string& path() const = 0;
+    // Compress |data| read from |filename| with |type| into |out| to send it
+    // on the wire. Returns the type actually applied, FILE_COMPRESS_NONE
+    // means |data| should be sent as it is.
+    virtual FileCompressType compress(const std::string& /*filename*/,
+                                      FileCompressType /*type*/,
+                                      const butil::IOBuf& /*data*/,
+                                      butil::IOBuf* /*out*/) const {
+        return FILE_COMPRESS_NONE;
+    }
 protected:
     FileReader() {}
     virtual ~FileReader() {}
 };
 
-// Read files within a local directory
+// Read files within a local directory.
+// Reads of different files and at any offset can be served concurrently,
+// reads of the same file are serialized as FileAdaptor isn't required to be
+// thread-safe. An opened file is closed once it's idle and its end has been
+// read, or there are more than raft_file_reader_max_open_files opened files.
+// After each read the next chunk of the file is read ahead in background, and
+// the pages read are dropped from the page cache, so that serving snapshots
+// doesn't evict the working set of the process. The chunks read are cached in
+// memory shared by all the readers of the same directory, so that followers
+// installing the same snapshot at once don't read it repeatedly.
 class LocalDirReader : public FileReader {
 public:
-    LocalDirReader(FileSystemAdaptor* fs, const std::string& path) 
-        : _path(path), _fs(fs), _current_file(NULL), _is_reading(false), _eof_reached(true)
-    {}
+    LocalDirReader(FileSystemAdaptor* fs, const std::string& path);
     virtual ~LocalDirReader();
 
     // Open a snapshot for read
@@ -80,6 +98,13 @@ public:
                           size_t* read_count,
                           bool* is_eof) const;
     virtual const std::string& path() const { return _path; }
+    // The first chunk compressed of each file is taken as a sample, the file
+    // is sent uncompressed if it saves less than
+    // raft_file_compress_min_saving_percent, e.g. it's compressed already.
+    virtual FileCompressType compress(const std::string& filename,
+                                      FileCompressType type,
+                                      const butil::IOBuf& data,
+                                      butil::IOBuf* out) const;
 protected:
     int read_file_with_meta(butil::IOBuf* out,
                             const std::string &filename,
@@ -91,15 +116,57 @@ protected:
     const scoped_refptr<FileSystemAdaptor>& file_system() const { return _fs; }
 
 private:
+    struct OpenedFile {
+        OpenedFile()
+            : file(NULL), nref(0), eof_reached(false), drop_page_cache(false)
+            , read_end(0), prefetched_offset(0), prefetched_eof(false)
+            , prefetching(false)
+        {}
+        raft_mutex_t mutex;
+        FileAdaptor* file;
+        int nref;
+        bool eof_reached;
+        // Drop the pages read from |file| from the page cache
+        bool drop_page_cache;
+        // End of the highest chunk read so far, where the next chunk
+        // requested starts
+        off_t read_end;
+        // Data read ahead at |prefetched_offset|, which ends at the end of the
+        // file if |prefetched_eof| is true
+        butil::IOBuf prefetched;
+        off_t prefetched_offset;
+        bool prefetched_eof;
+        bool prefetching;
+    };
+    typedef std::map<std::string, OpenedFile*> FileMap;
+    struct PrefetchArg;
+    static void close_file(OpenedFile* opened);
+    static int read_opened_file(OpenedFile* opened, off_t offset,
+                                size_t max_count, butil::IOBuf* out,
+                                bool* is_eof);
+    static bool take_prefetched(OpenedFile* opened, off_t offset,
+                                size_t max_count, butil::IOBuf* out,
+                                bool* is_eof);
+    static void* run_prefetch(void* arg);
+    void start_prefetch(const std::string& filename, OpenedFile* opened,
+                        off_t offset, size_t count) const;
+    void release_file(const std::string& filename, OpenedFile* opened) const;
+
     mutable raft_mutex_t _mutex;
     std::string _path;
     scoped_refptr<FileSystemAdaptor> _fs;
-    mutable FileAdaptor* _current_file;
-    mutable std::string _current_filename;
-    mutable bool _is_reading;
-    mutable bool _eof_reached;
+    mutable FileMap _opened_files;
+    // Whether the files are worth compressing, decided by the first chunk
+    mutable std::map<std::string, bool> _compressible_files;
 };
 
+// Compress or decompress the data of GetFileResponse with |type|.
+// Returns true on success.
+bool compress_file_data(FileCompressType type, const butil::IOBuf& in,
+                        butil::IOBuf* out);
+bool decompress_file_data(FileCompressType type, const butil::IOBuf& in,
+                          butil::IOBuf* out);
+
 }  //  namespace braft
 
 #endif  //BRAFT_FILE_READER_H
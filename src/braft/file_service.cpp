@@ -97,6 +97,17 @@ void FileServiceImpl::get_file(::google::protobuf::RpcController* controller,
             buf_off += p.size();
         }
     }
+    if (request->compress_type() != FILE_COMPRESS_NONE) {
+        butil::IOBuf compressed;
+        const FileCompressType type = reader->compress(
+                request->filename(), request->compress_type(),
+                seg_data.data(), &compressed);
+        if (type != FILE_COMPRESS_NONE) {
+            response->set_compress_type(type);
+            cntl->response_attachment().swap(compressed);
+            return;
+        }
+    }
     cntl->response_attachment().swap(seg_data.data());
 }
 
@@ -111,6 +122,16 @@ int FileServiceImpl::add_reader(FileReader* reader, int64_t* reader_id) {
     return 0;
 }
 
+int FileServiceImpl::add_reader_with_id(FileReader* reader,
+                                        int64_t reader_id) {
+    CHECK_LT(reader_id, 0);
+    BAIDU_SCOPED_LOCK(_mutex);
+    if (!_reader_map.insert(Map::value_type(reader_id, reader)).second) {
+        return -1;
+    }
+    return 0;
+}
+
 int FileServiceImpl::remove_reader(int64_t reader_id) {
     BAIDU_SCOPED_LOCK(_mutex);
     return _reader_map.erase(reader_id) == 1 ? 0 : -1;
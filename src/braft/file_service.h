@@ -34,6 +34,10 @@ public:
                   ::braft::GetFileResponse* response,
                   ::google::protobuf::Closure* done);
     int add_reader(FileReader* reader, int64_t* reader_id);
+    // Serve |reader| under the given |reader_id|, which must be negative so
+    // that it never collides with the ids allocated by add_reader.
+    // Returns -1 if |reader_id| is in use
+    int add_reader_with_id(FileReader* reader, int64_t reader_id);
     int remove_reader(int64_t reader_id);
 private:
 friend struct DefaultSingletonTraits<FileServiceImpl>;
@@ -53,6 +57,11 @@ inline int file_service_add(FileReader* reader, int64_t* reader_id) {
     return fs->add_reader(reader, reader_id);
 }
 
+inline int file_service_add_with_id(FileReader* reader, int64_t reader_id) {
+    FileServiceImpl* const fs = file_service();
+    return fs->add_reader_with_id(reader, reader_id);
+}
+
 inline int file_service_remove(int64_t reader_id) {
     FileServiceImpl* const fs = file_service();
     return fs->remove_reader(reader_id);
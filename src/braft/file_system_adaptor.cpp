@@ -14,6 +14,11 @@
 
 // Authors: Zheng,PengFei(zhengpengfei@baidu.com)
 
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#if defined(__linux__)
+#include <linux/fs.h>                                 // FICLONE
+#endif
 #include <butil/fd_utility.h>                        // butil::make_close_on_exec
 #include <butil/memory/singleton_on_pthread_once.h>  // butil::get_leaky_singleton
 #include "braft/file_system_adaptor.h"
@@ -56,6 +61,18 @@ bool PosixFileAdaptor::sync() {
     return raft_fsync(_fd) == 0;
 }
 
+void PosixFileAdaptor::advise(off_t offset, off_t len, FileAccessAdvice advice) {
+#if defined(__linux__)
+    const int posix_advice = (advice == FILE_ADVICE_SEQUENTIAL)
+            ? POSIX_FADV_SEQUENTIAL : POSIX_FADV_DONTNEED;
+    ::posix_fadvise(_fd, offset, len, posix_advice);
+#else
+    (void) offset;
+    (void) len;
+    (void) advice;
+#endif
+}
+
 bool PosixFileAdaptor::close() {
     if (_fd > 0) {
         bool res = ::close(_fd) == 0;
@@ -201,6 +218,39 @@ bool PosixFileSystemAdaptor::link(const std::string& old_path, const std::string
     return ::link(old_path.c_str(), new_path.c_str()) == 0;
 }
 
+bool PosixFileSystemAdaptor::clone(const std::string& old_path, const std::string& new_path) {
+#ifdef FICLONE
+    int source_fd = ::open(old_path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (source_fd < 0) {
+        return false;
+    }
+    int fd = ::open(new_path.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        ::close(source_fd);
+        return false;
+    }
+    const bool cloned = (::ioctl(fd, FICLONE, source_fd) == 0);
+    ::close(fd);
+    ::close(source_fd);
+    if (!cloned) {
+        ::unlink(new_path.c_str());
+    }
+    return cloned;
+#else
+    (void) old_path;
+    (void) new_path;
+    return false;
+#endif
+}
+
+int64_t PosixFileSystemAdaptor::link_count(const std::string& path) {
+    struct stat st;
+    if (::stat(path.c_str(), &st) != 0) {
+        return -1;
+    }
+    return st.st_nlink;
+}
+
 bool PosixFileSystemAdaptor::create_directory(const std::string& path, 
                                          butil::File::Error* error,
                                          bool create_parent_directories) {
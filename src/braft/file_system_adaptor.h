@@ -60,6 +60,14 @@ struct DestroyObj {
 };
 
 
+// Expected access pattern of a range of a file
+enum FileAccessAdvice {
+    // Read sequentially, so it's worth reading ahead aggressively
+    FILE_ADVICE_SEQUENTIAL = 0,
+    // Not accessed again soon, so it's not worth keeping in the page cache
+    FILE_ADVICE_DONTNEED = 1,
+};
+
 class FileAdaptor {
 public:
     virtual ~FileAdaptor() {}
@@ -83,6 +91,12 @@ public:
     // Close the descriptor of this file adaptor
     virtual bool close() = 0;
 
+    // Hint the access pattern of [offset, offset + len) like posix_fadvise(),
+    // |len| = 0 means to the end of the file.
+    // Default: do nothing
+    virtual void advise(off_t /*offset*/, off_t /*len*/,
+                        FileAccessAdvice /*advice*/) {}
+
 protected:
 
     FileAdaptor() {}
@@ -116,6 +130,17 @@ public:
     // The same as posix ::link(), will link the old path to the new path.
     virtual bool link(const std::string& old_path, const std::string& new_path) = 0;
 
+    // Create |new_path| as a copy of |old_path| sharing the data blocks with
+    // it (e.g. reflink), so that neither of them sees the later changes of the
+    // other one.
+    // Returns false if it fails or the file system doesn't support it.
+    virtual bool clone(const std::string& /*old_path*/,
+                       const std::string& /*new_path*/) { return false; }
+
+    // Returns the number of hard links to |path|, or -1 if it fails or the
+    // file system doesn't support it.
+    virtual int64_t link_count(const std::string& /*path*/) { return -1; }
+
     // Creates a directory. If create_parent_directories is true, parent directories
     // will be created if not exist, otherwise, the create operation will fail.
     // Returns 'true' on successful creation, or if the directory already exists. 
@@ -178,6 +203,7 @@ public:
     virtual ssize_t size();
     virtual bool sync();
     virtual bool close();
+    virtual void advise(off_t offset, off_t len, FileAccessAdvice advice);
 
 protected:
     PosixFileAdaptor(int fd) : _fd(fd) {}
@@ -279,6 +305,8 @@ public:
     virtual bool delete_file(const std::string& path, bool recursive);
     virtual bool rename(const std::string& old_path, const std::string& new_path);
     virtual bool link(const std::string& old_path, const std::string& new_path);
+    virtual bool clone(const std::string& old_path, const std::string& new_path);
+    virtual int64_t link_count(const std::string& path);
     virtual bool create_directory(const std::string& path, 
                                   butil::File::Error* error,
                                   bool create_parent_directories);
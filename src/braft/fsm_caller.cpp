@@ -27,17 +27,48 @@
 #include "braft/node.h"
 
 #include "braft/fsm_caller.h"
+#include "braft/snapshot_throttle.h"
 #include <bthread/unstable.h>
+#include <bthread/countdown_event.h>
 
 namespace braft {
 
 static bvar::CounterRecorder g_commit_tasks_batch_counter(
         "raft_commit_tasks_batch_counter");
+static bvar::CounterRecorder g_applied_closures_batch_counter(
+        "raft_applied_closures_batch_counter");
 
 DEFINE_int32(raft_fsm_caller_commit_batch, 512, 
              "Max numbers of logs for the state machine to commit in a single batch");
 BRPC_VALIDATE_GFLAG(raft_fsm_caller_commit_batch, brpc::PositiveInteger);
 
+DEFINE_int32(raft_fsm_executor_time_slice_us, 10 * 1000,
+             "Max time in microseconds a node applies at once in a thread of"
+             " the FSM executor before giving it to the other nodes waiting"
+             " for it, 0 for unlimited");
+BRPC_VALIDATE_GFLAG(raft_fsm_executor_time_slice_us, brpc::NonNegativeInteger);
+
+DEFINE_int32(raft_fsm_caller_fetch_batch, 64,
+             "Max numbers of logs fetched from LogManager in a bulk operation"
+             " when applying");
+BRPC_VALIDATE_GFLAG(raft_fsm_caller_fetch_batch, brpc::PositiveInteger);
+
+DEFINE_int64(raft_fsm_caller_read_ahead_bytes, 0,
+             "Max bytes of committed logs read from LogStorage in background"
+             " while applying, including the read ones not applied yet,"
+             " 0 to disable read ahead");
+BRPC_VALIDATE_GFLAG(raft_fsm_caller_read_ahead_bytes, brpc::NonNegativeInteger);
+
+static bvar::Adder<int64_t> g_read_ahead_hit_entries(
+        "raft_fsm_caller_read_ahead_hit_count");
+static bvar::Adder<int64_t> g_read_ahead_dropped_entries(
+        "raft_fsm_caller_read_ahead_dropped_count");
+
+DEFINE_int32(raft_fsm_apply_batch_size, 256,
+             "Max numbers of tasks passed to StateMachine::on_apply_batch"
+             " at once");
+BRPC_VALIDATE_GFLAG(raft_fsm_apply_batch_size, brpc::PositiveInteger);
+
 FSMCaller::FSMCaller()
     : _log_manager(NULL)
     , _fsm(NULL)
@@ -48,7 +79,13 @@ FSMCaller::FSMCaller()
     , _node(NULL)
     , _cur_task(IDLE)
     , _applying_index(0)
+    , _applied_entries(0)
+    , _apply_time_us(0)
     , _queue_started(false)
+    , _apply_in_batch(false)
+    , _run_done_after_apply(false)
+    , _usercode_in_pthread(false)
+    , _executor(NULL)
 {
 }
 
@@ -59,81 +96,173 @@ FSMCaller::~FSMCaller() {
 int FSMCaller::run(void* meta, bthread::TaskIterator<ApplyTask>& iter) {
     FSMCaller* caller = (FSMCaller*)meta;
     if (iter.is_queue_stopped()) {
-        caller->do_shutdown();
+        if (caller->_executor) {
+            caller->run_in_executor(NULL);
+        } else {
+            caller->do_shutdown();
+        }
         return 0;
     }
-    int64_t max_committed_index = -1;
-    int64_t counter = 0;
-    size_t  batch_size = FLAGS_raft_fsm_caller_commit_batch;
+    if (iter) {
+        const int64_t queue_delay_us =
+                butil::cpuwide_time_us() - iter->enqueue_time_us;
+        caller->_queue_delay << queue_delay_us;
+        record_apply_queue_delay(queue_delay_us);
+    }
+    std::deque<ApplyTask> tasks;
     for (; iter; ++iter) {
-        if (iter->type == COMMITTED && counter < batch_size) {
-            if (iter->committed_index > max_committed_index) {
-                max_committed_index = iter->committed_index;
-                counter++;
-            }
+        tasks.push_back(*iter);
+    }
+    if (!caller->_executor) {
+        caller->execute_tasks(&tasks, 0);
+        return 0;
+    }
+    // Give the thread of the executor back after each time slice, so that
+    // a group applying continuously can't starve the others sharing it
+    while (!tasks.empty()) {
+        caller->run_in_executor(&tasks);
+    }
+    return 0;
+}
+
+struct FSMCaller::ExecutorSlice {
+    FSMCaller* caller;
+    // NULL to shut down
+    std::deque<ApplyTask>* tasks;
+    bthread::CountdownEvent done;
+};
+
+void* FSMCaller::run_slice(void* arg) {
+    ExecutorSlice* slice = (ExecutorSlice*)arg;
+    if (slice->tasks) {
+        const int64_t time_slice_us = FLAGS_raft_fsm_executor_time_slice_us;
+        slice->caller->execute_tasks(slice->tasks, time_slice_us > 0
+                ? butil::cpuwide_time_us() + time_slice_us : 0);
+    } else {
+        // |caller| is likely to be destroyed after this
+        slice->caller->do_shutdown();
+    }
+    slice->done.signal();
+    return NULL;
+}
+
+void FSMCaller::run_in_executor(std::deque<ApplyTask>* tasks) {
+    // The queue runs in bthreads, which waits for the slice without
+    // occupying a thread of the executor
+    ExecutorSlice slice;
+    slice.caller = this;
+    slice.tasks = tasks;
+    if (_executor->submit(run_slice, &slice) != 0) {
+        // The executor has been stopped
+        if (tasks) {
+            execute_tasks(tasks, 0);
+            slice.done.signal();
         } else {
-            if (max_committed_index >= 0) {
-                caller->_cur_task = COMMITTED;
-                caller->do_committed(max_committed_index);
-                max_committed_index = -1;
-                g_commit_tasks_batch_counter << counter;
-                counter = 0;
-                batch_size = FLAGS_raft_fsm_caller_commit_batch;
+            run_slice(&slice);
+        }
+    }
+    slice.done.wait();
+}
+
+void FSMCaller::execute_tasks(std::deque<ApplyTask>* tasks,
+                              int64_t deadline_us) {
+    while (!tasks->empty()) {
+        if (deadline_us > 0 && butil::cpuwide_time_us() >= deadline_us) {
+            break;
+        }
+        const ApplyTask task = tasks->front();
+        tasks->pop_front();
+        switch (task.type) {
+        case COMMITTED: {
+            int64_t max_committed_index = task.committed_index;
+            int64_t counter = 1;
+            while (!tasks->empty() && tasks->front().type == COMMITTED
+                    && counter < FLAGS_raft_fsm_caller_commit_batch) {
+                max_committed_index = std::max(max_committed_index,
+                                               tasks->front().committed_index);
+                tasks->pop_front();
+                ++counter;
             }
-            switch (iter->type) {
-            case COMMITTED:
-                break;
-            case SNAPSHOT_SAVE:
-                caller->_cur_task = SNAPSHOT_SAVE;
-                if (caller->pass_by_status(iter->done)) {
-                    caller->do_snapshot_save((SaveSnapshotClosure*)iter->done);
-                }
-                break;
-            case SNAPSHOT_LOAD:
-                caller->_cur_task = SNAPSHOT_LOAD;
-                // TODO: do we need to allow the snapshot loading to recover the
-                // StateMachine if possible?
-                if (caller->pass_by_status(iter->done)) {
-                    caller->do_snapshot_load((LoadSnapshotClosure*)iter->done);
-                }
-                break;
-            case LEADER_STOP:
-                caller->_cur_task = LEADER_STOP;
-                caller->do_leader_stop(*(iter->status));
-                delete iter->status;
-                break;
-            case LEADER_START:
-                caller->do_leader_start(*(iter->leader_start_context));
-                delete iter->leader_start_context;
-                break;
-            case START_FOLLOWING:
-                caller->_cur_task = START_FOLLOWING;
-                caller->do_start_following(*(iter->leader_change_context));
-                delete iter->leader_change_context;
-                break;
-            case STOP_FOLLOWING:
-                caller->_cur_task = STOP_FOLLOWING;
-                caller->do_stop_following(*(iter->leader_change_context));
-                delete iter->leader_change_context;
-                break;
-            case ERROR:
-                caller->_cur_task = ERROR;
-                caller->do_on_error((OnErrorClousre*)iter->done);
-                break;
-            case IDLE:
-                CHECK(false) << "Can't reach here";
-                break;
-            };
+            _cur_task = COMMITTED;
+            g_commit_tasks_batch_counter << counter;
+            if (!apply_committed(max_committed_index, deadline_us)) {
+                // Go on applying in the next time slice
+                ApplyTask rest = task;
+                rest.committed_index = max_committed_index;
+                tasks->push_front(rest);
+            }
+            break;
         }
+        case SNAPSHOT_SAVE:
+            _cur_task = SNAPSHOT_SAVE;
+            if (pass_by_status(task.done)) {
+                do_snapshot_save((SaveSnapshotClosure*)task.done);
+            }
+            break;
+        case SNAPSHOT_LOAD:
+            _cur_task = SNAPSHOT_LOAD;
+            // TODO: do we need to allow the snapshot loading to recover the
+            // StateMachine if possible?
+            if (pass_by_status(task.done)) {
+                do_snapshot_load((LoadSnapshotClosure*)task.done);
+            }
+            break;
+        case LEADER_STOP:
+            _cur_task = LEADER_STOP;
+            do_leader_stop(*(task.status));
+            delete task.status;
+            break;
+        case LEADER_START:
+            do_leader_start(*(task.leader_start_context));
+            delete task.leader_start_context;
+            break;
+        case START_FOLLOWING:
+            _cur_task = START_FOLLOWING;
+            do_start_following(*(task.leader_change_context));
+            delete task.leader_change_context;
+            break;
+        case STOP_FOLLOWING:
+            _cur_task = STOP_FOLLOWING;
+            do_stop_following(*(task.leader_change_context));
+            delete task.leader_change_context;
+            break;
+        case ERROR:
+            _cur_task = ERROR;
+            do_on_error((OnErrorClousre*)task.done);
+            break;
+        case IDLE:
+            CHECK(false) << "Can't reach here";
+            break;
+        };
+    }
+    _cur_task = IDLE;
+}
+
+bool FSMCaller::apply_committed(int64_t committed_index, int64_t deadline_us) {
+    if (deadline_us <= 0) {
+        do_committed(committed_index);
+        return true;
     }
-    if (max_committed_index >= 0) {
-        caller->_cur_task = COMMITTED;
-        caller->do_committed(max_committed_index);
-        g_commit_tasks_batch_counter << counter;
-        counter = 0;
+    // Apply at most raft_fsm_caller_fetch_batch logs at once to check the
+    // deadline in between
+    while (true) {
+        const int64_t last_applied_index =
+                _last_applied_index.load(butil::memory_order_relaxed);
+        if (last_applied_index >= committed_index || !_error.status().ok()) {
+            return true;
+        }
+        do_committed(std::min(committed_index, last_applied_index
+                                + FLAGS_raft_fsm_caller_fetch_batch));
+        if (_last_applied_index.load(butil::memory_order_relaxed)
+                == last_applied_index) {
+            // Stopped applying, e.g. the node is shutting down
+            return true;
+        }
+        if (butil::cpuwide_time_us() >= deadline_us) {
+            return _last_applied_index.load(butil::memory_order_relaxed)
+                    >= committed_index;
+        }
     }
-    caller->_cur_task = IDLE;
-    return 0;
 }
 
 bool FSMCaller::pass_by_status(Closure* done) {
@@ -160,17 +289,25 @@ int FSMCaller::init(const FSMCallerOptions &options) {
     _closure_queue = options.closure_queue;
     _after_shutdown = options.after_shutdown;
     _node = options.node;
+    _apply_in_batch = options.apply_in_batch;
+    _run_done_after_apply = options.run_done_after_apply;
+    _usercode_in_pthread = options.usercode_in_pthread;
+    _read_ahead.init(_log_manager);
     _last_applied_index.store(options.bootstrap_id.index,
                               butil::memory_order_relaxed);
     _last_applied_term = options.bootstrap_id.term;
     if (_node) {
         _node->AddRef();
+        _queue_delay.expose("raft_fsm_queue_delay",
+                            _node->node_id().to_string());
     }
     
     bthread::ExecutionQueueOptions execq_opt;
     execq_opt.bthread_attr = options.usercode_in_pthread 
                              ? BTHREAD_ATTR_PTHREAD
                              : BTHREAD_ATTR_NORMAL;
+    // The tasks are passed to |executor| in time slices, see run()
+    _executor = options.executor;
     if (bthread::execution_queue_start(&_queue_id,
                                    &execq_opt,
                                    FSMCaller::run,
@@ -190,6 +327,7 @@ int FSMCaller::shutdown() {
 }
 
 void FSMCaller::do_shutdown() {
+    _read_ahead.reset();
     if (_node) {
         _node->Release();
         _node = NULL;
@@ -267,15 +405,33 @@ void FSMCaller::do_committed(int64_t committed_index) {
     if (last_applied_index >= committed_index) {
         return;
     }
+    const int64_t start_time_us = butil::cpuwide_time_us();
     std::vector<Closure*> closure;
     int64_t first_closure_index = 0;
     CHECK_EQ(0, _closure_queue->pop_closure_until(committed_index, &closure,
                                                   &first_closure_index));
 
     IteratorImpl iter_impl(_fsm, _log_manager, &closure, first_closure_index,
-                 last_applied_index, committed_index, &_applying_index);
+                 last_applied_index, committed_index, &_applying_index,
+                 &_read_ahead);
+    bool stopped = false;
     for (; iter_impl.is_good();) {
         if (iter_impl.entry()->type != ENTRY_TYPE_DATA) {
+            if (iter_impl.entry()->type == ENTRY_TYPE_INGEST) {
+                const int rc = do_ingest(iter_impl.entry());
+                if (rc == ECANCELED) {
+                    // The node is shutting down while fetching the files,
+                    // this entry is applied again after restart
+                    stopped = true;
+                    break;
+                }
+                if (rc != 0) {
+                    butil::Status st(rc, "Fail to ingest files: %s",
+                                     berror(rc));
+                    iter_impl.set_rollback_error(&st);
+                    break;
+                }
+            }
             if (iter_impl.entry()->type == ENTRY_TYPE_CONFIGURATION) {
                 if (iter_impl.entry()->old_peers == NULL) {
                     // Joint stage is not supposed to be noticeable by end users.
@@ -287,12 +443,19 @@ void FSMCaller::do_committed(int64_t committed_index) {
             // For other entries, we have nothing to do besides flush the
             // pending tasks and run this closure to notify the caller that the
             // entries before this one were successfully committed and applied.
-            if (iter_impl.done()) {
+            if (iter_impl.done() && !_run_done_after_apply) {
                 iter_impl.done()->Run();
             }
             iter_impl.next();
             continue;
         }
+        if (_apply_in_batch) {
+            ApplyBatch batch(&iter_impl);
+            iter_impl.start_batch(FLAGS_raft_fsm_apply_batch_size);
+            _fsm->on_apply_batch(batch);
+            iter_impl.finish_batch();
+            continue;
+        }
         Iterator iter(&iter_impl);
         _fsm->on_apply(iter);
         LOG_IF(ERROR, iter.valid())
@@ -303,15 +466,71 @@ void FSMCaller::do_committed(int64_t committed_index) {
         iter.next();
     }
     if (iter_impl.has_error()) {
+        _read_ahead.reset();
         set_error(iter_impl.error());
         iter_impl.run_the_rest_closure_with_error();
+    } else if (stopped) {
+        _read_ahead.reset();
+        iter_impl.run_the_rest_closure_with_error(
+                butil::Status(ESHUTDOWN, "Raft node is going to quit"));
+    }
+    if (_run_done_after_apply) {
+        run_applied_closures(closure, first_closure_index, iter_impl.index());
     }
     const int64_t last_index = iter_impl.index() - 1;
+    _applied_entries.fetch_add(last_index - last_applied_index,
+                               butil::memory_order_relaxed);
+    _apply_time_us.fetch_add(butil::cpuwide_time_us() - start_time_us,
+                             butil::memory_order_relaxed);
     const int64_t last_term = _log_manager->get_term(last_index);
     LogId last_applied_id(last_index, last_term);
-    _last_applied_index.store(committed_index, butil::memory_order_release);
+    _last_applied_index.store(stopped ? last_index : committed_index,
+                              butil::memory_order_release);
     _last_applied_term = last_term;
     _log_manager->set_applied_id(last_applied_id);
+    if (_node) {
+        _node->on_applied(last_index);
+    }
+}
+
+int FSMCaller::do_ingest(const LogEntry* entry) {
+    IngestMeta meta;
+    butil::IOBufAsZeroCopyInputStream wrapper(entry->data);
+    if (!meta.ParseFromZeroCopyStream(&wrapper)) {
+        LOG(ERROR) << "node " << _node->node_id()
+                   << " fail to parse IngestMeta at index=" << entry->id.index;
+        return EINVAL;
+    }
+    std::string path;
+    int rc = _node->prepare_ingest(meta, entry->id, &path);
+    if (rc != 0) {
+        return rc;
+    }
+    const std::vector<std::string> files(meta.files().begin(),
+                                         meta.files().end());
+    rc = _fsm->on_ingest(path, files, entry->id.index);
+    if (rc != 0) {
+        LOG(ERROR) << "node " << _node->node_id() << " fail to ingest "
+                   << files.size() << " files at index=" << entry->id.index;
+        return rc > 0 ? rc : EIO;
+    }
+    return 0;
+}
+
+void FSMCaller::run_applied_closures(const std::vector<Closure*>& closure,
+                                     int64_t first_closure_index,
+                                     int64_t end_index) {
+    // Hand off the closures of [first_closure_index, end_index) all at once,
+    // the rolled back ones have been run with error
+    std::vector<google::protobuf::Closure*> applied;
+    for (int64_t i = first_closure_index; i < end_index; ++i) {
+        Closure* done = closure[i - first_closure_index];
+        if (done) {
+            applied.push_back(done);
+        }
+    }
+    g_applied_closures_batch_counter << applied.size();
+    run_closures_in_bthread(&applied, _usercode_in_pthread);
 }
 
 int FSMCaller::on_snapshot_save(SaveSnapshotClosure* done) {
@@ -360,6 +579,11 @@ int FSMCaller::on_snapshot_load(LoadSnapshotClosure* done) {
     return bthread::execution_queue_execute(_queue_id, task);
 }
 
+SnapshotStreamLoader* FSMCaller::new_snapshot_stream_loader(
+        const SnapshotMeta& meta) {
+    return _fsm ? _fsm->new_snapshot_stream_loader(meta) : NULL;
+}
+
 void FSMCaller::do_snapshot_load(LoadSnapshotClosure* done) {
     //TODO done_guard
     SnapshotReader* reader = done->start();
@@ -398,7 +622,10 @@ void FSMCaller::do_snapshot_load(LoadSnapshotClosure* done) {
         return done->Run();
     }
 
-    ret = _fsm->on_snapshot_load(reader);
+    // Logs prefetched before are useless as they are covered by the snapshot
+    _read_ahead.reset();
+    SnapshotStreamLoader* loader = done->stream_loader();
+    ret = loader ? loader->on_load(reader) : _fsm->on_snapshot_load(reader);
     if (ret != 0) {
         done->status().set_error(ret, "StateMachine on_snapshot_load failed");
         done->Run();
@@ -421,6 +648,9 @@ void FSMCaller::do_snapshot_load(LoadSnapshotClosure* done) {
     _last_applied_index.store(meta.last_included_index(),
                               butil::memory_order_release);
     _last_applied_term = meta.last_included_term();
+    if (_node) {
+        _node->on_applied(meta.last_included_index());
+    }
     done->Run();
 }
 
@@ -528,6 +758,16 @@ void FSMCaller::describe(std::ostream &os, bool use_html) {
         break;
     }
     os << newline;
+    os << "fsm_queue_delay_us: " << _queue_delay.latency()
+       << " max=" << _queue_delay.max_latency() << newline;
+}
+
+int64_t FSMCaller::apply_time_us_per_entry() const {
+    const int64_t entries = _applied_entries.load(butil::memory_order_relaxed);
+    if (entries <= 0) {
+        return 0;
+    }
+    return _apply_time_us.load(butil::memory_order_relaxed) / entries;
 }
 
 int64_t FSMCaller::applying_index() const {
@@ -546,12 +786,137 @@ void FSMCaller::join() {
     }
 }
 
+LogReadAhead::LogReadAhead()
+    : _lm(NULL)
+    , _tid(INVALID_BTHREAD)
+    , _running(false)
+    , _read_first_index(0)
+    , _read_last_index(0)
+    , _read_budget(0)
+    , _ready_pos(0)
+{}
+
+LogReadAhead::~LogReadAhead() {
+    reset();
+}
+
+void LogReadAhead::release(std::vector<LogEntry*>* entries, size_t from) {
+    for (size_t i = from; i < entries->size(); ++i) {
+        (*entries)[i]->Release();
+    }
+    entries->clear();
+}
+
+void LogReadAhead::join() {
+    if (_running) {
+        bthread_join(_tid, NULL);
+        _running = false;
+    }
+}
+
+void LogReadAhead::reset() {
+    join();
+    g_read_ahead_dropped_entries << (_ready.size() - _ready_pos)
+                                 << _reading.size();
+    release(&_reading, 0);
+    release(&_ready, _ready_pos);
+    _ready_pos = 0;
+}
+
+size_t LogReadAhead::fetch(int64_t first_index, int64_t last_index,
+                           std::vector<LogEntry*>* entries) {
+    const size_t saved_size = entries->size();
+    int64_t index = first_index;
+    while (index <= last_index) {
+        if (_ready_pos == _ready.size()) {
+            if (!_running || _read_first_index != index) {
+                break;
+            }
+            // Wait for the running read which starts exactly at |index|
+            join();
+            _ready.clear();
+            _ready.swap(_reading);
+            _ready_pos = 0;
+            if (_ready.empty()) {
+                break;
+            }
+        }
+        if (_ready[_ready_pos]->id.index != index) {
+            break;
+        }
+        // Pass the reference to the caller
+        entries->push_back(_ready[_ready_pos++]);
+        ++index;
+    }
+    g_read_ahead_hit_entries << (entries->size() - saved_size);
+    if (index <= last_index) {
+        if (_ready_pos != _ready.size() || _running) {
+            // Not sequential any more, drop all the prefetched logs
+            reset();
+        }
+        _lm->get_entries(index, last_index, entries);
+    }
+    return entries->size() - saved_size;
+}
+
+void LogReadAhead::start(int64_t first_index, int64_t last_index) {
+    int64_t budget = FLAGS_raft_fsm_caller_read_ahead_bytes;
+    if (_running || budget <= 0) {
+        return;
+    }
+    if (_ready_pos != _ready.size()) {
+        first_index = _ready.back()->id.index + 1;
+        // The logs read but not fetched yet count against the budget
+        for (size_t i = _ready_pos; i < _ready.size(); ++i) {
+            budget -= _ready[i]->data.size();
+        }
+        if (budget <= 0) {
+            return;
+        }
+    }
+    if (first_index > last_index || _lm->is_log_in_memory(first_index)) {
+        return;
+    }
+    _read_first_index = first_index;
+    _read_last_index = last_index;
+    _read_budget = budget;
+    _running = true;
+    if (bthread_start_background(&_tid, NULL, run_read, this) != 0) {
+        PLOG(ERROR) << "Fail to start bthread";
+        _running = false;
+    }
+}
+
+void* LogReadAhead::run_read(void* arg) {
+    static_cast<LogReadAhead*>(arg)->do_read();
+    return NULL;
+}
+
+void LogReadAhead::do_read() {
+    size_t read_bytes = 0;
+    int64_t index = _read_first_index;
+    while (index <= _read_last_index && read_bytes < _read_budget) {
+        const size_t saved_size = _reading.size();
+        const int64_t last_index = std::min(_read_last_index,
+                index + FLAGS_raft_fsm_caller_fetch_batch - 1);
+        const size_t n = _lm->get_entries(index, last_index, &_reading);
+        for (size_t i = saved_size; i < _reading.size(); ++i) {
+            read_bytes += _reading[i]->data.size();
+        }
+        if (n != (size_t)(last_index - index + 1)) {
+            break;
+        }
+        index = last_index + 1;
+    }
+}
+
 IteratorImpl::IteratorImpl(StateMachine* sm, LogManager* lm,
                           std::vector<Closure*> *closure, 
                           int64_t first_closure_index,
                           int64_t last_applied_index, 
                           int64_t committed_index,
-                          butil::atomic<int64_t>* applying_index)
+                          butil::atomic<int64_t>* applying_index,
+                          LogReadAhead* read_ahead)
         : _sm(sm)
         , _lm(lm)
         , _closure(closure)
@@ -560,8 +925,20 @@ IteratorImpl::IteratorImpl(StateMachine* sm, LogManager* lm,
         , _committed_index(committed_index)
         , _cur_entry(NULL)
         , _applying_index(applying_index)
+        , _read_ahead(read_ahead)
+        , _fetched_pos(0)
+        , _batch_first_index(0)
 { next(); }
 
+IteratorImpl::~IteratorImpl() {
+    finish_batch();
+    if (_cur_entry) {
+        _cur_entry->Release();
+        _cur_entry = NULL;
+    }
+    release_fetched_entries();
+}
+
 void IteratorImpl::next() {
     if (_cur_entry) {
         _cur_entry->Release();
@@ -570,7 +947,7 @@ void IteratorImpl::next() {
     if (_cur_index <= _committed_index) {
         ++_cur_index;
         if (_cur_index <= _committed_index) {
-            _cur_entry = _lm->get_entry(_cur_index);
+            _cur_entry = fetch_entry(_cur_index);
             if (_cur_entry == NULL) {
                 _error.set_type(ERROR_TYPE_LOG);
                 _error.status().set_error(-1,
@@ -583,6 +960,35 @@ void IteratorImpl::next() {
     }
 }
 
+LogEntry* IteratorImpl::fetch_entry(int64_t index) {
+    if (_fetched_pos >= _fetched.size()
+            || _fetched[_fetched_pos]->id.index != index) {
+        release_fetched_entries();
+        const int64_t last_index = std::min(_committed_index,
+                index + FLAGS_raft_fsm_caller_fetch_batch - 1);
+        const size_t nfetched = _read_ahead
+                ? _read_ahead->fetch(index, last_index, &_fetched)
+                : _lm->get_entries(index, last_index, &_fetched);
+        if (nfetched == 0) {
+            return NULL;
+        }
+        if (_read_ahead) {
+            // Overlap reading the next window with applying this one
+            _read_ahead->start(index + nfetched, _committed_index);
+        }
+    }
+    // Pass the reference to the caller
+    return _fetched[_fetched_pos++];
+}
+
+void IteratorImpl::release_fetched_entries() {
+    for (size_t i = _fetched_pos; i < _fetched.size(); ++i) {
+        _fetched[i]->Release();
+    }
+    _fetched.clear();
+    _fetched_pos = 0;
+}
+
 Closure* IteratorImpl::done() const {
     if (_cur_index < _first_closure_index) {
         return NULL;
@@ -601,6 +1007,10 @@ void IteratorImpl::set_error_and_rollback(
     } else {
         _cur_index -= (ntail - 1);
     }
+    set_rollback_error(st);
+}
+
+void IteratorImpl::set_rollback_error(const butil::Status* st) {
     if (_cur_entry) {
         _cur_entry->Release();
         _cur_entry = NULL;
@@ -612,12 +1022,56 @@ void IteratorImpl::set_error_and_rollback(
             (st ? st->error_cstr() : "none"));
 }
 
+size_t IteratorImpl::start_batch(size_t max_size) {
+    CHECK(_batch.empty());
+    _batch_first_index = _cur_index;
+    while (_batch.size() < max_size && is_good()
+            && _cur_entry->type == ENTRY_TYPE_DATA) {
+        // Take over the reference of the current entry
+        _batch.push_back(_cur_entry);
+        _cur_entry = NULL;
+        next();
+    }
+    _applying_index->store(_batch_first_index, butil::memory_order_relaxed);
+    return _batch.size();
+}
+
+void IteratorImpl::finish_batch() {
+    for (size_t i = 0; i < _batch.size(); ++i) {
+        _batch[i]->Release();
+    }
+    _batch.clear();
+}
+
+Closure* IteratorImpl::batch_done(size_t i) const {
+    const int64_t index = _batch_first_index + i;
+    if (index < _first_closure_index) {
+        return NULL;
+    }
+    return (*_closure)[index - _first_closure_index];
+}
+
+void IteratorImpl::set_batch_error_and_rollback(
+            size_t ntail, const butil::Status* st) {
+    if (ntail == 0 || ntail > _batch.size()) {
+        CHECK(false) << "Invalid ntail=" << ntail
+                     << " while batch_size=" << _batch.size();
+        return;
+    }
+    _cur_index = _batch_first_index + (_batch.size() - ntail);
+    set_rollback_error(st);
+}
+
 void IteratorImpl::run_the_rest_closure_with_error() {
+    run_the_rest_closure_with_error(_error.status());
+}
+
+void IteratorImpl::run_the_rest_closure_with_error(const butil::Status& st) {
     for (int64_t i = std::max(_cur_index, _first_closure_index);
             i <= _committed_index; ++i) {
         Closure* done = (*_closure)[i - _first_closure_index];
         if (done) {
-            done->status() = _error.status();
+            done->status() = st;
             run_closure_in_bthread(done);
         }
     }
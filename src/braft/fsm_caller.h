@@ -19,9 +19,12 @@
 #ifndef  BRAFT_FSM_CALLER_H
 #define  BRAFT_FSM_CALLER_H
 
+#include <deque>
 #include <butil/macros.h>                        // BAIDU_CACHELINE_ALIGNMENT
 #include <bthread/bthread.h>
 #include <bthread/execution_queue.h>
+#include <butil/time.h>
+#include <bvar/latency_recorder.h>
 #include "braft/ballot_box.h"
 #include "braft/closure_queue.h"
 #include "braft/macros.h"
@@ -38,6 +41,53 @@ class OnErrorClousre;
 struct LogEntry;
 class LeaderChangeContext;
 
+// Read the following committed logs from LogManager in background while the
+// StateMachine is applying the current ones, so that replaying logs which
+// have been evicted from memory (e.g. after restart or loading snapshot) is
+// not blocked on the synchronous reads of segments.
+// All the methods must be called in the thread of FSMCaller.
+class LogReadAhead {
+    DISALLOW_COPY_AND_ASSIGN(LogReadAhead);
+public:
+    LogReadAhead();
+    ~LogReadAhead();
+    void init(LogManager* lm) { _lm = lm; }
+
+    // Get logs in [first_index, last_index], taking the prefetched ones if
+    // possible.
+    // Returns the number of logs appended to |entries|
+    size_t fetch(int64_t first_index, int64_t last_index,
+                 std::vector<LogEntry*>* entries);
+
+    // Start reading the logs following the prefetched ones (or since
+    // |first_index| if there's none) in background, until |last_index| or
+    // the size of the read logs reaches |raft_fsm_caller_read_ahead_bytes|,
+    // which includes the prefetched logs not fetched yet.
+    // Nothing happens if a read is running or the logs are still in memory.
+    void start(int64_t first_index, int64_t last_index);
+
+    // Wait for the running read and drop all the prefetched logs
+    void reset();
+
+private:
+    static void* run_read(void* arg);
+    void do_read();
+    void join();
+    static void release(std::vector<LogEntry*>* entries, size_t from);
+
+    LogManager* _lm;
+    bthread_t _tid;
+    bool _running;
+    int64_t _read_first_index;
+    int64_t _read_last_index;
+    size_t _read_budget;
+    // Written by the background read only
+    std::vector<LogEntry*> _reading;
+    // Logs ready to be fetched, starting at _ready[_ready_pos]
+    std::vector<LogEntry*> _ready;
+    size_t _ready_pos;
+};
+
 // Backing implementation of Iterator
 class IteratorImpl {
     DISALLOW_COPY_AND_ASSIGN(IteratorImpl);
@@ -52,14 +102,31 @@ public:
     const Error& error() const { return _error; }
     int64_t index() const { return _cur_index; }
     void run_the_rest_closure_with_error();
+    void run_the_rest_closure_with_error(const butil::Status& st);
+
+    // Move the consecutive data entries starting from the current one into
+    // the batch, at most |max_size| entries. The iterator is positioned at
+    // the entry following the batch afterwards.
+    size_t start_batch(size_t max_size);
+    // Release the entries of the current batch
+    void finish_batch();
+    size_t batch_size() const { return _batch.size(); }
+    int64_t batch_first_index() const { return _batch_first_index; }
+    LogEntry* batch_entry(size_t i) const { return _batch[i]; }
+    Closure* batch_done(size_t i) const;
+    void set_batch_error_and_rollback(size_t ntail, const butil::Status* st);
 private:
     IteratorImpl(StateMachine* sm, LogManager* lm, 
                  std::vector<Closure*> *closure,
                  int64_t first_closure_index,
                  int64_t last_applied_index,
                  int64_t committed_index,
-                 butil::atomic<int64_t>* applying_index);
-    ~IteratorImpl() {}
+                 butil::atomic<int64_t>* applying_index,
+                 LogReadAhead* read_ahead);
+    ~IteratorImpl();
+    LogEntry* fetch_entry(int64_t index);
+    void release_fetched_entries();
+    void set_rollback_error(const butil::Status* st);
 friend class FSMCaller;
     StateMachine* _sm;
     LogManager* _lm;
@@ -70,6 +137,12 @@ friend class FSMCaller;
     LogEntry* _cur_entry;
     butil::atomic<int64_t>* _applying_index;
     Error _error;
+    LogReadAhead* _read_ahead;
+    // Entries read from LogManager in bulk but not iterated yet
+    std::vector<LogEntry*> _fetched;
+    size_t _fetched_pos;
+    std::vector<LogEntry*> _batch;
+    int64_t _batch_first_index;
 };
 
 struct FSMCallerOptions {
@@ -80,6 +153,9 @@ struct FSMCallerOptions {
         , closure_queue(NULL)
         , node(NULL)
         , usercode_in_pthread(false)
+        , apply_in_batch(false)
+        , run_done_after_apply(false)
+        , executor(NULL)
         , bootstrap_id()
     {}
     LogManager *log_manager;
@@ -88,6 +164,13 @@ struct FSMCallerOptions {
     ClosureQueue* closure_queue;
     NodeImpl* node;
     bool usercode_in_pthread;
+    bool apply_in_batch;
+    // Run the closures of the applied tasks in a background bthread once a
+    // batch is applied, rather than leaving them to the StateMachine
+    bool run_done_after_apply;
+    // Run the tasks in |executor| rather than in bthreads if it's not NULL,
+    // at most raft_fsm_executor_time_slice_us at once
+    bthread::Executor* executor;
     LogId bootstrap_id;
 };
 
@@ -101,6 +184,9 @@ class LoadSnapshotClosure : public Closure {
 public:
     // TODO: comments
     virtual SnapshotReader* start() = 0;
+    // The loader which has consumed the snapshot while it was downloaded,
+    // NULL if the snapshot is to be loaded by StateMachine::on_snapshot_load
+    virtual SnapshotStreamLoader* stream_loader() { return NULL; }
 };
 
 class BAIDU_CACHELINE_ALIGNMENT FSMCaller {
@@ -111,6 +197,8 @@ public:
     int shutdown();
     BRAFT_MOCK int on_committed(int64_t committed_index);
     BRAFT_MOCK int on_snapshot_load(LoadSnapshotClosure* done);
+    // Ask the StateMachine for a loader of the snapshot to be installed
+    SnapshotStreamLoader* new_snapshot_stream_loader(const SnapshotMeta& meta);
     BRAFT_MOCK int on_snapshot_save(SaveSnapshotClosure* done);
     int on_leader_stop(const butil::Status& status);
     int on_leader_start(int64_t term, int64_t lease_epoch);
@@ -121,6 +209,8 @@ public:
         return _last_applied_index.load(butil::memory_order_relaxed);
     }
     int64_t applying_index() const;
+    // Average time in microseconds taken to apply an entry, 0 if unknown
+    int64_t apply_time_us_per_entry() const;
     void describe(std::ostream& os, bool use_html);
     void join();
 private:
@@ -149,6 +239,11 @@ friend class IteratorImpl;
     };
 
     struct ApplyTask {
+        ApplyTask()
+            : type(IDLE)
+            , committed_index(0)
+            , enqueue_time_us(butil::cpuwide_time_us())
+        {}
         TaskType type;
         union {
             // For applying log entry (including configuration change)
@@ -166,12 +261,25 @@ friend class IteratorImpl;
             // For other operation
             Closure* done;
         };
+        int64_t enqueue_time_us;
     };
 
     static double get_cumulated_cpu_time(void* arg);
     static int run(void* meta, bthread::TaskIterator<ApplyTask>& iter);
+    // Run |tasks| until they're done or |deadline_us| (if positive) passes,
+    // leaving the rest in |tasks|
+    void execute_tasks(std::deque<ApplyTask>* tasks, int64_t deadline_us);
+    // Returns false if the logs till |committed_index| are not all applied
+    // when |deadline_us| passes
+    bool apply_committed(int64_t committed_index, int64_t deadline_us);
+    // Run a time slice of |tasks| in |_executor| and wait for it, shut down
+    // if |tasks| is NULL
+    struct ExecutorSlice;
+    static void* run_slice(void* arg);
+    void run_in_executor(std::deque<ApplyTask>* tasks);
     void do_shutdown(); //Closure* done);
     void do_committed(int64_t committed_index);
+    int do_ingest(const LogEntry* entry);
     void do_cleared(int64_t log_index, Closure* done, int error_code);
     void do_snapshot_save(SaveSnapshotClosure* done);
     void do_snapshot_load(LoadSnapshotClosure* done);
@@ -181,6 +289,9 @@ friend class IteratorImpl;
     void do_start_following(const LeaderChangeContext& start_following_context);
     void do_stop_following(const LeaderChangeContext& stop_following_context);
     void set_error(const Error& e);
+    void run_applied_closures(const std::vector<Closure*>& closure,
+                              int64_t first_closure_index,
+                              int64_t end_index);
     bool pass_by_status(Closure* done);
 
     bthread::ExecutionQueueId<ApplyTask> _queue_id;
@@ -193,8 +304,17 @@ friend class IteratorImpl;
     NodeImpl* _node;
     TaskType _cur_task;
     butil::atomic<int64_t> _applying_index;
+    // Entries applied and the time taken to apply them
+    butil::atomic<int64_t> _applied_entries;
+    butil::atomic<int64_t> _apply_time_us;
     Error _error;
     bool _queue_started;
+    bool _apply_in_batch;
+    bool _run_done_after_apply;
+    bool _usercode_in_pthread;
+    bthread::Executor* _executor;
+    LogReadAhead _read_ahead;
+    bvar::LatencyRecorder _queue_delay;
 };
 
 };
@@ -0,0 +1,192 @@
+// Copyright (c) 2019 Baidu.com, Inc. All Rights Reserved
+// 
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+// 
+//     http://www.apache.org/licenses/LICENSE-2.0
+// 
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <sched.h>
+#include <stdlib.h>
+#include <gflags/gflags.h>
+#include <bvar/bvar.h>
+#include <butil/build_config.h>
+#include <butil/logging.h>
+#include <butil/time.h>
+#include <butil/string_splitter.h>
+#include "braft/fsm_executor.h"
+
+namespace braft {
+
+DEFINE_int32(raft_fsm_executor_threads, 0,
+             "Number of pthreads running the StateMachine callbacks of all"
+             " the nodes, 0 to run them in bthreads (or in pthreads if"
+             " usercode_in_pthread is set) as before");
+DEFINE_string(raft_fsm_executor_cpus, "",
+              "Cpus that the FSM executor threads are pinned to, e.g. 0-3,8,"
+              " empty for no pinning");
+
+static bvar::LatencyRecorder g_fsm_executor_queue_delay(
+        "raft_fsm_executor_queue_delay");
+static bvar::Adder<int64_t> g_fsm_executor_pending_tasks(
+        "raft_fsm_executor_pending_tasks");
+
+int parse_cpu_list(const std::string& str, std::vector<int>* cpus) {
+    cpus->clear();
+    for (butil::StringSplitter sp(str.c_str(), ','); sp; ++sp) {
+        std::string range(sp.field(), sp.length());
+        char* end = NULL;
+        const long first = strtol(range.c_str(), &end, 10);
+        if (end == range.c_str() || first < 0) {
+            return -1;
+        }
+        long last = first;
+        if (*end == '-') {
+            const char* begin = end + 1;
+            last = strtol(begin, &end, 10);
+            if (end == begin || last < first) {
+                return -1;
+            }
+        }
+        if (*end != '\0') {
+            return -1;
+        }
+        for (long cpu = first; cpu <= last; ++cpu) {
+            cpus->push_back((int)cpu);
+        }
+    }
+    return 0;
+}
+
+FSMExecutor::FSMExecutor()
+    : _next_cpu(0)
+    , _stopped(false)
+{
+    pthread_mutex_init(&_mutex, NULL);
+    pthread_cond_init(&_cond, NULL);
+}
+
+FSMExecutor::~FSMExecutor() {
+    stop_and_join();
+    pthread_cond_destroy(&_cond);
+    pthread_mutex_destroy(&_mutex);
+}
+
+int FSMExecutor::start(int nthreads, const std::string& cpus) {
+    if (nthreads <= 0) {
+        return EINVAL;
+    }
+    if (parse_cpu_list(cpus, &_cpus) != 0) {
+        LOG(ERROR) << "Invalid cpu list `" << cpus << '\'';
+        return EINVAL;
+    }
+    for (int i = 0; i < nthreads; ++i) {
+        pthread_t tid;
+        const int rc = pthread_create(&tid, NULL, run_thread, this);
+        if (rc != 0) {
+            LOG(ERROR) << "Fail to create fsm executor thread, " << berror(rc);
+            stop_and_join();
+            return rc;
+        }
+        _threads.push_back(tid);
+    }
+    return 0;
+}
+
+int FSMExecutor::submit(void* (*fn)(void*), void* args) {
+    Task task;
+    task.fn = fn;
+    task.args = args;
+    task.submit_time_us = butil::cpuwide_time_us();
+    pthread_mutex_lock(&_mutex);
+    if (_stopped) {
+        pthread_mutex_unlock(&_mutex);
+        return -1;
+    }
+    _tasks.push_back(task);
+    pthread_mutex_unlock(&_mutex);
+    g_fsm_executor_pending_tasks << 1;
+    pthread_cond_signal(&_cond);
+    return 0;
+}
+
+void FSMExecutor::stop_and_join() {
+    pthread_mutex_lock(&_mutex);
+    _stopped = true;
+    pthread_mutex_unlock(&_mutex);
+    pthread_cond_broadcast(&_cond);
+    for (size_t i = 0; i < _threads.size(); ++i) {
+        pthread_join(_threads[i], NULL);
+    }
+    _threads.clear();
+}
+
+void* FSMExecutor::run_thread(void* arg) {
+    ((FSMExecutor*)arg)->run();
+    return NULL;
+}
+
+void FSMExecutor::run() {
+    pthread_mutex_lock(&_mutex);
+#if defined(OS_LINUX)
+    if (!_cpus.empty()) {
+        const int cpu = _cpus[_next_cpu++ % _cpus.size()];
+        cpu_set_t cpu_set;
+        CPU_ZERO(&cpu_set);
+        CPU_SET(cpu, &cpu_set);
+        const int rc = pthread_setaffinity_np(pthread_self(),
+                                              sizeof(cpu_set), &cpu_set);
+        LOG_IF(WARNING, rc != 0) << "Fail to pin fsm executor thread to cpu "
+                                 << cpu << ", " << berror(rc);
+    }
+#endif
+    while (true) {
+        while (_tasks.empty() && !_stopped) {
+            pthread_cond_wait(&_cond, &_mutex);
+        }
+        // Drain the pending tasks even if stopped, the execution queues
+        // depend on them to finish
+        if (_tasks.empty()) {
+            break;
+        }
+        Task task = _tasks.front();
+        _tasks.pop_front();
+        pthread_mutex_unlock(&_mutex);
+        g_fsm_executor_pending_tasks << -1;
+        g_fsm_executor_queue_delay << butil::cpuwide_time_us() - task.submit_time_us;
+        task.fn(task.args);
+        pthread_mutex_lock(&_mutex);
+    }
+    pthread_mutex_unlock(&_mutex);
+}
+
+static FSMExecutor* g_shared_fsm_executor = NULL;
+static pthread_once_t g_shared_fsm_executor_once = PTHREAD_ONCE_INIT;
+
+static void create_shared_fsm_executor() {
+    if (FLAGS_raft_fsm_executor_threads <= 0) {
+        return;
+    }
+    // Never destroyed, nodes may be still running on it at exit
+    FSMExecutor* executor = new FSMExecutor;
+    if (executor->start(FLAGS_raft_fsm_executor_threads,
+                        FLAGS_raft_fsm_executor_cpus) != 0) {
+        LOG(ERROR) << "Fail to start fsm executor, run StateMachine in bthreads";
+        delete executor;
+        return;
+    }
+    g_shared_fsm_executor = executor;
+}
+
+FSMExecutor* FSMExecutor::shared() {
+    pthread_once(&g_shared_fsm_executor_once, create_shared_fsm_executor);
+    return g_shared_fsm_executor;
+}
+
+}  //  namespace braft
@@ -0,0 +1,82 @@
+// Copyright (c) 2019 Baidu.com, Inc. All Rights Reserved
+// 
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+// 
+//     http://www.apache.org/licenses/LICENSE-2.0
+// 
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef BRAFT_FSM_EXECUTOR_H
+#define BRAFT_FSM_EXECUTOR_H
+
+#include <pthread.h>
+#include <deque>
+#include <string>
+#include <vector>
+#include <bthread/execution_queue.h>
+#include <butil/macros.h>
+
+namespace braft {
+
+// A pool of pthreads running the StateMachine callbacks of the nodes, so that
+// long apply batches don't occupy the bthread workers serving RPCs
+// (heartbeats included).
+//
+// Each FSMCaller submits the tasks of its group to the pool one time slice
+// (raft_fsm_executor_time_slice_us) after another and waits for each of them
+// in a bthread, so tasks of a group are still executed one after another and
+// a group occupies at most one thread at a time. Submissions are served in
+// FIFO order, so a group applying continuously goes back to the end of the
+// queue after each slice instead of starving the others.
+class FSMExecutor : public bthread::Executor {
+    DISALLOW_COPY_AND_ASSIGN(FSMExecutor);
+public:
+    FSMExecutor();
+    ~FSMExecutor();
+
+    // Start |nthreads| threads, pinning them to |cpus| (e.g. "0-3,8") if it's
+    // not empty.
+    int start(int nthreads, const std::string& cpus);
+
+    // Implement bthread::Executor
+    int submit(void* (*fn)(void*), void* args);
+
+    // Stop accepting new tasks, wait until the pending ones are done and the
+    // threads quit.
+    void stop_and_join();
+
+    // The pool shared by all the nodes in this process, which is started
+    // on the first call with raft_fsm_executor_threads threads pinned to
+    // raft_fsm_executor_cpus. Returns NULL if raft_fsm_executor_threads is 0.
+    static FSMExecutor* shared();
+
+private:
+    struct Task {
+        void* (*fn)(void*);
+        void* args;
+        int64_t submit_time_us;
+    };
+    static void* run_thread(void* arg);
+    void run();
+
+    pthread_mutex_t _mutex;
+    pthread_cond_t _cond;
+    std::deque<Task> _tasks;
+    std::vector<pthread_t> _threads;
+    std::vector<int> _cpus;
+    size_t _next_cpu;
+    bool _stopped;
+};
+
+// Parse a cpu list like "0-3,8" into |cpus|
+int parse_cpu_list(const std::string& str, std::vector<int>* cpus);
+
+}  //  namespace braft
+
+#endif  //BRAFT_FSM_EXECUTOR_H
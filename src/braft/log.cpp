@@ -32,6 +32,7 @@
 #include "braft/protobuf_file.h"
 #include "braft/util.h"
 #include "braft/fsync.h"
+#include "braft/snapshot_throttle.h"
 
 //#define BRAFT_SEGMENT_OPEN_PATTERN "log_inprogress_%020ld"
 //#define BRAFT_SEGMENT_CLOSED_PATTERN "log_%020ld_%020ld"
@@ -375,6 +376,7 @@ int Segment::append(const LogEntry* entry) {
     butil::IOBuf data;
     switch (entry->type) {
     case ENTRY_TYPE_DATA:
+    case ENTRY_TYPE_INGEST:
         data.append(entry->data);
         break;
     case ENTRY_TYPE_NO_OP:
@@ -465,6 +467,7 @@ LogEntry* Segment::get(const int64_t index) const {
         entry->AddRef();
         switch (header.type) {
         case ENTRY_TYPE_DATA:
+        case ENTRY_TYPE_INGEST:
             entry->data.swap(data);
             break;
         case ENTRY_TYPE_NO_OP:
@@ -751,8 +754,9 @@ int SegmentLogStorage::append_entries(const std::vector<LogEntry*>& entries, IOM
     }
     now = butil::cpuwide_time_us();
     last_segment->sync(_enable_sync);
+    delta_time_us = butil::cpuwide_time_us() - now;
+    record_log_sync_latency(delta_time_us);
     if (FLAGS_raft_trace_append_entry_latency && metric) {
-        delta_time_us = butil::cpuwide_time_us() - now;
         metric->sync_segment_time_us += delta_time_us;
         g_sync_segment_latency << delta_time_us; 
     }
@@ -14,6 +14,9 @@
 
 // Authors: Zhangyi Chen(chenzhangyi01@baidu.com)
 
+#include <new>
+#include <type_traits>
+#include <butil/object_pool.h>
 #include "braft/log_entry.h"
 #include "braft/local_storage.pb.h"
 
@@ -21,6 +24,38 @@ namespace braft {
 
 bvar::Adder<int64_t> g_nentries("raft_num_log_entries");
 
+// Raw memory of a LogEntry, which is constructed and destructed by
+// LogEntry::operator new/delete
+struct LogEntryBlock {
+    std::aligned_storage<sizeof(LogEntry),
+                         __alignof__(LogEntry)>::type storage;
+};
+
+void* LogEntry::operator new(size_t size) {
+    if (size != sizeof(LogEntry)) {
+        return ::operator new(size);
+    }
+    LogEntryBlock* block = butil::get_object<LogEntryBlock>();
+    if (block == NULL) {
+        throw std::bad_alloc();
+    }
+    return block;
+}
+
+void LogEntry::operator delete(void* ptr, size_t size) {
+    if (ptr == NULL) {
+        return;
+    }
+    if (size != sizeof(LogEntry)) {
+        return ::operator delete(ptr);
+    }
+    butil::return_object(static_cast<LogEntryBlock*>(ptr));
+}
+
+butil::ObjectPoolInfo describe_log_entry_pool() {
+    return butil::describe_objects<LogEntryBlock>();
+}
+
 LogEntry::LogEntry(): type(ENTRY_TYPE_UNKNOWN), peers(NULL), old_peers(NULL) {
     g_nentries << 1;
 }
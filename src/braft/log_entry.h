@@ -19,6 +19,7 @@
 
 #include <butil/iobuf.h>                         // butil::IOBuf
 #include <butil/memory/ref_counted.h>            // butil::RefCountedThreadSafe
+#include <butil/object_pool.h>                   // butil::ObjectPoolInfo
 #include <butil/third_party/murmurhash3/murmurhash3.h>  // fmix64
 #include "braft/configuration.h"
 #include "braft/raft.pb.h"
@@ -35,7 +36,9 @@ struct LogId {
 };
 
 // term start from 1, log index start from 1
-struct LogEntry : public butil::RefCountedThreadSafe<LogEntry> {
+// LogEntry is final and has no vtable, |type| fills the padding after the
+// reference count of the base.
+struct LogEntry final : public butil::RefCountedThreadSafe<LogEntry> {
 public:
     EntryType type; // log type
     LogId id;
@@ -45,10 +48,17 @@ public:
 
     LogEntry();
 
+    // LogEntries are created for every task on the leader and every entry
+    // received by the followers, so they're allocated from the thread-local
+    // caches of butil::ObjectPool rather than the global allocator. The
+    // memory is recycled by the pool but never returned to the system.
+    static void* operator new(size_t size);
+    static void operator delete(void* ptr, size_t size);
+
 private:
     DISALLOW_COPY_AND_ASSIGN(LogEntry);
     friend class butil::RefCountedThreadSafe<LogEntry>;
-    virtual ~LogEntry();
+    ~LogEntry();
 };
 
 // Comparators
@@ -94,6 +104,9 @@ inline std::ostream& operator<<(std::ostream& os, const LogId& id) {
     return os;
 }
 
+// Statistics of the pool which LogEntries are allocated from
+butil::ObjectPoolInfo describe_log_entry_pool();
+
 butil::Status parse_configuration_meta(const butil::IOBuf& data, LogEntry* entry);
 
 butil::Status serialize_configuration_meta(const LogEntry* entry, butil::IOBuf& data);
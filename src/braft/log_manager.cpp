@@ -50,6 +50,8 @@ static bvar::Adder<int64_t> g_storage_append_entries_concurrency(
 static bvar::CounterRecorder g_storage_flush_batch_counter(
                                         "raft_storage_flush_batch_counter");
 
+static const size_t MAX_APPENDED_BYTES_MARKS = 4096;
+
 
 void LogManager::StableClosure::update_metric(IOMetric* m) {
     metric.open_segment_time_us = m->open_segment_time_us;
@@ -71,6 +73,12 @@ LogManager::LogManager()
     , _next_wait_id(0)
     , _first_log_index(0)
     , _last_log_index(0)
+    , _appended_bytes(0)
+    , _appended_bytes_at_snapshot(0)
+    , _appended_entries(0)
+    , _retained_index(0)
+    , _snapshot_size_index(0)
+    , _snapshot_size(-1)
 {
     CHECK_EQ(0, start_disk_thread());
 }
@@ -429,6 +437,8 @@ void LogManager::append_entries(
     for (size_t i = 0; i < entries->size(); ++i) {
         // Add ref for disk_thread
         (*entries)[i]->AddRef();
+        _appended_bytes += (*entries)[i]->data.size();
+        ++_appended_entries;
         if ((*entries)[i]->type == ENTRY_TYPE_CONFIGURATION) {
             ConfigurationEntry conf_entry(*((*entries)[i]));
             _config_manager->add(conf_entry);
@@ -438,6 +448,8 @@ void LogManager::append_entries(
     if (!entries->empty()) {
         done->_first_log_index = entries->front()->id.index;
         _logs_in_memory.insert(_logs_in_memory.end(), entries->begin(), entries->end());
+        mark_appended_bytes(entries->front()->id.index,
+                            entries->back()->id.index);
     }
 
     done->_entries.swap(*entries);
@@ -643,6 +655,13 @@ void LogManager::set_snapshot(const SnapshotMeta* meta) {
     int64_t term = unsafe_get_term(meta->last_included_index());
 
     const LogId last_but_one_snapshot_id = _last_snapshot_id;
+    // Take the bytes appended till the snapshot index, the ones appended
+    // after it while the snapshot was being saved are still to compact
+    while (!_appended_bytes_marks.empty() && _appended_bytes_marks.front().first
+                <= meta->last_included_index()) {
+        _appended_bytes_at_snapshot = _appended_bytes_marks.front().second;
+        _appended_bytes_marks.pop_front();
+    }
     _last_snapshot_id.index = meta->last_included_index();
     _last_snapshot_id.term = meta->last_included_term();
     if (_last_snapshot_id > _applied_id) {
@@ -666,13 +685,31 @@ void LogManager::set_snapshot(const SnapshotMeta* meta) {
         // followers
         if (last_but_one_snapshot_id.index > 0) {
             // We have last snapshot index
-            _virtual_first_log_id = last_but_one_snapshot_id;
-            truncate_prefix(last_but_one_snapshot_id.index + 1, lck);
+            LogId last_id_truncated = last_but_one_snapshot_id;
+            if (_retained_index > 0
+                    && _retained_index <= last_but_one_snapshot_id.index) {
+                // Some follower is about to catch up with the logs after
+                // _retained_index, keep them until the next snapshot rather
+                // than making it install a snapshot
+                if (_retained_index <= _first_log_index) {
+                    return;
+                }
+                const int64_t retained_term =
+                        unsafe_get_term(_retained_index - 1);
+                if (retained_term != 0) {
+                    last_id_truncated = LogId(_retained_index - 1,
+                                              retained_term);
+                }
+            }
+            _virtual_first_log_id = last_id_truncated;
+            truncate_prefix(last_id_truncated.index + 1, lck);
         }
         return;
     } else {
         // TODO: check the result of reset.
         _virtual_first_log_id = _last_snapshot_id;
+        _appended_bytes_marks.clear();
+        _appended_bytes_at_snapshot = _appended_bytes;
         reset(meta->last_included_index() + 1, lck);
         return;
     }
@@ -778,6 +815,54 @@ LogEntry* LogManager::get_entry(const int64_t index) {
     return entry;
 }
 
+size_t LogManager::get_entries(const int64_t first_index,
+                               const int64_t last_index,
+                               std::vector<LogEntry*>* entries) {
+    std::vector<LogEntry*> in_memory;
+    int64_t last_in_storage = 0;
+    {
+        BAIDU_SCOPED_LOCK(_mutex);
+        if (first_index > last_index || first_index < _first_log_index
+                || first_index > _last_log_index) {
+            return 0;
+        }
+        const int64_t last = std::min(last_index, _last_log_index);
+        // Logs in memory are always a suffix of the whole log
+        int64_t first_in_memory = last + 1;
+        if (!_logs_in_memory.empty()) {
+            first_in_memory = std::min(last + 1, std::max(first_index,
+                                       _logs_in_memory.front()->id.index));
+        }
+        in_memory.reserve(std::max<int64_t>(last - first_in_memory + 1, 0));
+        for (int64_t index = first_in_memory; index <= last; ++index) {
+            LogEntry* entry = get_entry_from_memory(index);
+            entry->AddRef();
+            in_memory.push_back(entry);
+        }
+        last_in_storage = first_in_memory - 1;
+    }  // out of _mutex
+    const size_t saved_size = entries->size();
+    for (int64_t index = first_index; index <= last_in_storage; ++index) {
+        g_read_entry_from_storage << 1;
+        LogEntry* entry = _log_storage->get_entry(index);
+        if (!entry) {
+            report_error(EIO, "Corrupted entry at index=%" PRId64, index);
+            for (size_t i = 0; i < in_memory.size(); ++i) {
+                in_memory[i]->Release();
+            }
+            return entries->size() - saved_size;
+        }
+        entries->push_back(entry);
+    }
+    entries->insert(entries->end(), in_memory.begin(), in_memory.end());
+    return entries->size() - saved_size;
+}
+
+bool LogManager::is_log_in_memory(const int64_t index) {
+    BAIDU_SCOPED_LOCK(_mutex);
+    return get_entry_from_memory(index) != NULL;
+}
+
 void LogManager::get_configuration(const int64_t index, ConfigurationEntry* conf) {
     BAIDU_SCOPED_LOCK(_mutex);
     return _config_manager->get(index, conf);
@@ -922,6 +1007,60 @@ void LogManager::describe(std::ostream& os, bool use_html) {
     os << "last_log_id: " << last_log_id() << newline;
 }
 
+void LogManager::mark_appended_bytes(int64_t first_index, int64_t last_index) {
+    // The entries from |first_index| replace the conflicting ones
+    while (!_appended_bytes_marks.empty()
+            && _appended_bytes_marks.back().first >= first_index) {
+        _appended_bytes_marks.pop_back();
+    }
+    if (_appended_bytes_marks.size() >= MAX_APPENDED_BYTES_MARKS) {
+        // Keep every other mark, the baseline of the next snapshot may be
+        // taken a little earlier than its index then
+        size_t n = 0;
+        for (size_t i = 1; i < _appended_bytes_marks.size(); i += 2) {
+            _appended_bytes_marks[n++] = _appended_bytes_marks[i];
+        }
+        _appended_bytes_marks.resize(n);
+    }
+    _appended_bytes_marks.push_back(std::make_pair(last_index, _appended_bytes));
+}
+
+int64_t LogManager::bytes_since_snapshot() {
+    BAIDU_SCOPED_LOCK(_mutex);
+    return _appended_bytes - _appended_bytes_at_snapshot;
+}
+
+int64_t LogManager::average_entry_bytes() {
+    BAIDU_SCOPED_LOCK(_mutex);
+    if (_appended_entries == 0) {
+        return 0;
+    }
+    return _appended_bytes / _appended_entries;
+}
+
+int64_t LogManager::last_snapshot_index() {
+    BAIDU_SCOPED_LOCK(_mutex);
+    return _last_snapshot_id.index;
+}
+
+void LogManager::set_snapshot_size(int64_t index, int64_t bytes) {
+    BAIDU_SCOPED_LOCK(_mutex);
+    if (index >= _snapshot_size_index) {
+        _snapshot_size_index = index;
+        _snapshot_size = bytes;
+    }
+}
+
+int64_t LogManager::snapshot_size(int64_t index) {
+    BAIDU_SCOPED_LOCK(_mutex);
+    return index == _snapshot_size_index ? _snapshot_size : -1;
+}
+
+void LogManager::set_retained_index(int64_t index) {
+    BAIDU_SCOPED_LOCK(_mutex);
+    _retained_index = index;
+}
+
 void LogManager::get_status(LogManagerStatus* status) {
     if (!status) {
         return;
@@ -94,6 +94,19 @@ public:
     //  success return ptr, fail return null
     LogEntry* get_entry(const int64_t index);
 
+    // Get the logs in [first_index, last_index] in a bulk operation, the
+    // fetched logs are appended to |entries| and each of them is referenced
+    // once on behalf of the caller.
+    // Returns:
+    //  the number of the logs appended, which is less than requested if the
+    //  range is out of the log or some log is corrupted
+    size_t get_entries(const int64_t first_index, const int64_t last_index,
+                       std::vector<LogEntry*>* entries);
+
+    // Return true if the log at |index| is cached in memory, reading which
+    // doesn't touch LogStorage
+    bool is_log_in_memory(const int64_t index);
+
     // Get the log term at |index|
     // Returns:
     //  success return term > 0, fail return 0
@@ -146,6 +159,29 @@ public:
 
     void describe(std::ostream& os, bool use_html);
 
+    // Bytes of the entries appended after the last snapshot, only the entries
+    // appended since this LogManager started are counted
+    int64_t bytes_since_snapshot();
+
+    // Average data size of the entries appended since this LogManager started,
+    // 0 if there's none yet
+    int64_t average_entry_bytes();
+
+    // Index of the last snapshot
+    int64_t last_snapshot_index();
+
+    // Record the total size of the files of the snapshot at |index|, which is
+    // computed once the snapshot is saved or installed
+    void set_snapshot_size(int64_t index, int64_t bytes);
+
+    // Size of the snapshot at |index| recorded above, -1 if it's unknown
+    int64_t snapshot_size(int64_t index);
+
+    // Keep the logs from |index| on when truncating the logs before the last
+    // but one snapshot, for the followers which are about to catch up by
+    // replicating these logs. 0 means no such follower.
+    void set_retained_index(int64_t index);
+
     // Get the internal status of LogManager.
     void get_status(LogManagerStatus* status);
 
@@ -189,6 +225,10 @@ friend class AppendBatcher;
 
     int64_t unsafe_get_term(const int64_t index);
 
+    // Record the bytes appended till |last_index| after appending the
+    // entries in [first_index, last_index]
+    void mark_appended_bytes(int64_t first_index, int64_t last_index);
+
     // Start a independent thread to append log to LogStorage
     int start_disk_thread();
     int stop_disk_thread();
@@ -218,6 +258,18 @@ friend class AppendBatcher;
     int64_t _last_log_index;
     // the last snapshot's log_id
     LogId _last_snapshot_id;
+    // Bytes of the entries appended in total and till the last snapshot
+    int64_t _appended_bytes;
+    int64_t _appended_bytes_at_snapshot;
+    // (last index, _appended_bytes) after each append since the last
+    // snapshot, to find the bytes appended till the index of the next one.
+    // Thinned out once it has MAX_APPENDED_BYTES_MARKS elements.
+    std::deque<std::pair<int64_t, int64_t> > _appended_bytes_marks;
+    int64_t _appended_entries;
+    int64_t _retained_index;
+    // Size of the snapshot at _snapshot_size_index
+    int64_t _snapshot_size_index;
+    int64_t _snapshot_size;
     // the virtual first log, for finding next_index of replicator, which 
     // can avoid install_snapshot too often in extreme case where a follower's
     // install_snapshot is slower than leader's save_snapshot
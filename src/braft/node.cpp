@@ -16,6 +16,7 @@
 //          Zhangyi Chen(chenzhangyi01@baidu.com)
 //          Xiong,Kai(xiongkai@baidu.com)
 
+#include <sys/stat.h>
 #include <bthread/unstable.h>
 #include <brpc/errno.pb.h>
 #include <brpc/controller.h>
@@ -29,9 +30,11 @@
 #include "braft/raft_meta.h"
 #include "braft/snapshot.h"
 #include "braft/file_service.h"
+#include "braft/remote_file_copier.h"
 #include "braft/builtin_service_impl.h"
 #include "braft/node_manager.h"
 #include "braft/snapshot_executor.h"
+#include "braft/fsm_executor.h"
 #include "braft/errno.pb.h"
 
 namespace braft {
@@ -61,7 +64,20 @@ DEFINE_bool(raft_trace_append_entry_latency, false,
             "trace append entry latency");
 BRPC_VALIDATE_GFLAG(raft_trace_append_entry_latency, brpc::PassValidate);
 
+DEFINE_int32(raft_snapshot_policy_check_interval_ms, 10 * 1000,
+             "Interval at which the SnapshotPolicy of NodeOptions is asked"
+             " whether to save a snapshot, read when the node starts");
+BRPC_VALIDATE_GFLAG(raft_snapshot_policy_check_interval_ms,
+                    brpc::PositiveInteger);
+
+DEFINE_int32(raft_ingest_max_copy_rounds, 30,
+             "Max rounds of trying every peer, one round per second, to copy"
+             " the files ingested by a log. The node reports"
+             " ERROR_TYPE_STATE_MACHINE if it fails to apply the log");
+BRPC_VALIDATE_GFLAG(raft_ingest_max_copy_rounds, brpc::PositiveInteger);
+
 DECLARE_bool(raft_enable_leader_lease);
+DECLARE_int64(raft_install_snapshot_min_gap_bytes);
 
 #ifndef UNIT_TEST
 static bvar::Adder<int64_t> g_num_nodes("raft_node_count");
@@ -146,6 +162,10 @@ NodeImpl::NodeImpl(const GroupId& group_id, const PeerId& peer_id)
     , _waking_candidate(0)
     , _append_entries_cache(NULL)
     , _append_entries_cache_version(0)
+    , _pending_applying_bytes(0)
+    , _pending_applying_open_us(0)
+    , _pending_applying_batch_id(0)
+    , _apply_flush_scheduled_id(0)
     , _node_readonly(false)
     , _majority_nodes_readonly(false) {
     butil::string_printf(&_v_group_id, "%s_%d", _group_id.c_str(), _server_id.idx);
@@ -172,6 +192,10 @@ NodeImpl::NodeImpl()
     , _waking_candidate(0)
     , _append_entries_cache(NULL)
     , _append_entries_cache_version(0)
+    , _pending_applying_bytes(0)
+    , _pending_applying_open_us(0)
+    , _pending_applying_batch_id(0)
+    , _apply_flush_scheduled_id(0)
     , _node_readonly(false)
     , _majority_nodes_readonly(false) {
     butil::string_printf(&_v_group_id, "%s_%d", _group_id.c_str(), _server_id.idx);
@@ -180,6 +204,7 @@ NodeImpl::NodeImpl()
 }
 
 NodeImpl::~NodeImpl() {
+    release_ingested_files(true);
     if (_apply_queue) {
         // Wait until no flying task
         _apply_queue->stop();
@@ -316,9 +341,74 @@ void NodeImpl::handle_snapshot_timeout() {
     }
 
     lck.unlock();
-    // TODO: do_snapshot in another thread to avoid blocking the timer thread.
-    do_snapshot(NULL);
+    if (_options.snapshot_policy && !check_snapshot_policy()) {
+        return;
+    }
+    global_node_manager->snapshot_scheduler()->schedule(this, NULL, true);
+}
+
+bool NodeImpl::check_snapshot_policy() {
+    SnapshotPolicyStats stats;
+    int64_t last_snapshot_time_ms = 0;
+    _snapshot_executor->get_last_snapshot(&stats.last_snapshot_index,
+                                          &last_snapshot_time_ms);
+    stats.last_applied_index = _fsm_caller->last_applied_index();
+    stats.log_entries = std::max(
+            stats.last_applied_index - stats.last_snapshot_index, int64_t(0));
+    stats.log_bytes = _log_manager->bytes_since_snapshot();
+    stats.replay_time_ms =
+            stats.log_entries * _fsm_caller->apply_time_us_per_entry() / 1000;
+    stats.time_since_last_snapshot_ms =
+            butil::monotonic_time_ms() - last_snapshot_time_ms;
+    stats.snapshot_interval_ms = _options.snapshot_interval_s * 1000L;
+    std::string reason;
+    const bool should_snapshot =
+            _options.snapshot_policy->should_snapshot(stats, &reason);
+    BRAFT_VLOG << "node " << _group_id << ":" << _server_id
+               << (should_snapshot ? " saves" : " skips")
+               << " snapshot, " << reason;
+    BAIDU_SCOPED_LOCK(_mutex);
+    _snapshot_policy_decision.swap(reason);
+    _snapshot_policy_decision.insert(0, should_snapshot ? "save: " : "skip: ");
+    return should_snapshot;
+}
+
+static bool get_local_snapshot_path(const std::string& snapshot_uri,
+                                    std::string* path) {
+    butil::StringPiece uri(snapshot_uri);
+    butil::StringPiece protocol = parse_uri(&uri, path);
+    if (protocol != "local") {
+        return false;
+    }
+    const size_t pos = path->find('?');
+    if (pos != std::string::npos) {
+        path->resize(pos);
+    }
+    return true;
+}
+
+int64_t NodeImpl::snapshot_disk_id() {
+    std::string path;
+    if (!get_local_snapshot_path(_options.snapshot_uri, &path)) {
+        return 0;
+    }
+    struct stat st;
+    if (stat(path.c_str(), &st) != 0) {
+        return 0;
+    }
+    return st.st_dev;
+}
 
+int64_t NodeImpl::snapshot_log_entries() {
+    if (!_snapshot_executor || !_fsm_caller) {
+        return 0;
+    }
+    int64_t last_snapshot_index = 0;
+    int64_t last_snapshot_time_ms = 0;
+    _snapshot_executor->get_last_snapshot(&last_snapshot_index,
+                                          &last_snapshot_time_ms);
+    return std::max(_fsm_caller->last_applied_index() - last_snapshot_index,
+                    int64_t(0));
 }
 
 int NodeImpl::init_fsm_caller(const LogId& bootstrap_id) {
@@ -327,6 +417,12 @@ int NodeImpl::init_fsm_caller(const LogId& bootstrap_id) {
     // fsm caller init, node AddRef in init
     FSMCallerOptions fsm_caller_options;
     fsm_caller_options.usercode_in_pthread = _options.usercode_in_pthread;
+    fsm_caller_options.apply_in_batch = _options.apply_in_batch;
+    fsm_caller_options.run_done_after_apply = _options.run_done_after_apply;
+    fsm_caller_options.executor = _options.fsm_executor;
+    if (!fsm_caller_options.executor) {
+        fsm_caller_options.executor = FSMExecutor::shared();
+    }
     this->AddRef();
     fsm_caller_options.after_shutdown =
         brpc::NewCallback<NodeImpl*>(after_shutdown, this);
@@ -470,7 +566,12 @@ int NodeImpl::init(const NodeOptions& options) {
     CHECK_EQ(0, _vote_timer.init(this, options.election_timeout_ms + options.max_clock_drift_ms));
     CHECK_EQ(0, _election_timer.init(this, options.election_timeout_ms));
     CHECK_EQ(0, _stepdown_timer.init(this, options.election_timeout_ms));
-    CHECK_EQ(0, _snapshot_timer.init(this, options.snapshot_interval_s * 1000));
+    int snapshot_timeout_ms = options.snapshot_interval_s * 1000;
+    if (options.snapshot_policy && (snapshot_timeout_ms <= 0 ||
+            snapshot_timeout_ms > FLAGS_raft_snapshot_policy_check_interval_ms)) {
+        snapshot_timeout_ms = FLAGS_raft_snapshot_policy_check_interval_ms;
+    }
+    CHECK_EQ(0, _snapshot_timer.init(this, snapshot_timeout_ms));
 
     _config_manager = new ConfigurationManager();
 
@@ -519,6 +620,7 @@ int NodeImpl::init(const NodeOptions& options) {
     BallotBoxOptions ballot_box_options;
     ballot_box_options.waiter = _fsm_caller;
     ballot_box_options.closure_queue = _closure_queue;
+    ballot_box_options.batch_window = &_apply_batch_window;
     if (_ballot_box->init(ballot_box_options) != 0) {
         LOG(ERROR) << "node " << _group_id << ":" << _server_id
                    << " init _ballot_box failed";
@@ -542,6 +644,10 @@ int NodeImpl::init(const NodeOptions& options) {
         return -1;
     }
 
+    if (_snapshot_executor) {
+        load_ingested_files();
+    }
+
     _conf.id = LogId();
     // if have log using conf in log, else using conf in options
     if (_log_manager->last_log_index() > 0) {
@@ -586,7 +692,8 @@ int NodeImpl::init(const NodeOptions& options) {
               << " old_conf: " << _conf.old_conf;
 
     // start snapshot timer
-    if (_snapshot_executor && _options.snapshot_interval_s > 0) {
+    if (_snapshot_executor && (_options.snapshot_interval_s > 0
+                               || _options.snapshot_policy)) {
         BRAFT_VLOG << "node " << _group_id << ":" << _server_id
                    << " term " << _current_term << " start snapshot_timer";
         _snapshot_timer.start();
@@ -620,31 +727,123 @@ DEFINE_int32(raft_apply_batch, 32, "Max number of tasks that can be applied "
                                    " in a single batch");
 BRPC_VALIDATE_GFLAG(raft_apply_batch, ::brpc::PositiveInteger);
 
+DEFINE_int64(raft_apply_batch_max_bytes, 1024 * 1024,
+             "Max total data size of the tasks that can be applied in a single"
+             " batch");
+BRPC_VALIDATE_GFLAG(raft_apply_batch_max_bytes, ::brpc::PositiveInteger);
+
 int NodeImpl::execute_applying_tasks(
         void* meta, bthread::TaskIterator<LogEntryAndClosure>& iter) {
+    NodeImpl* m = (NodeImpl*)meta;
     if (iter.is_queue_stopped()) {
+        // Tasks waiting in the window would fail as the node is shut down
+        m->flush_applying_tasks(false);
         return 0;
     }
-    // TODO: the batch size should limited by both task size and the total log
-    // size
-    const size_t batch_size = FLAGS_raft_apply_batch;
-    DEFINE_SMALL_ARRAY(LogEntryAndClosure, tasks, batch_size, 256);
-    size_t cur_size = 0;
-    NodeImpl* m = (NodeImpl*)meta;
     for (; iter; ++iter) {
-        if (cur_size == batch_size) {
-            m->apply(tasks, cur_size);
-            cur_size = 0;
+        if (iter->batch) {
+            // Flush the pending tasks first to keep the order of submission,
+            // and then append the bulk as a whole
+            m->flush_applying_tasks(false);
+            std::vector<LogEntryAndClosure>* batch = iter->batch;
+            m->apply(&(*batch)[0], batch->size(), butil::cpuwide_time_us(), true);
+            delete batch;
+            continue;
+        }
+        if (iter->window_batch_id != 0) {
+            // The batching window is closed, unless the batch which the timer
+            // was armed for has been flushed already
+            if (iter->window_batch_id == m->_pending_applying_batch_id) {
+                m->flush_applying_tasks(false);
+            }
+            continue;
         }
-        tasks[cur_size++] = *iter;
+        m->add_applying_task(*iter);
     }
-    if (cur_size > 0) {
-        m->apply(tasks, cur_size);
+    if (!m->_pending_applying_tasks.empty()) {
+        if (m->_apply_batch_window.window_us() <= 0) {
+            m->flush_applying_tasks(false);
+        } else {
+            m->schedule_flush_applying_tasks();
+        }
     }
     return 0;
 }
 
+void NodeImpl::add_applying_task(const LogEntryAndClosure& task) {
+    if (_pending_applying_tasks.empty()) {
+        _pending_applying_open_us = butil::cpuwide_time_us();
+        ++_pending_applying_batch_id;
+    }
+    _pending_applying_tasks.push_back(task);
+    _pending_applying_bytes += task.entry->data.size();
+    if (_pending_applying_tasks.size() >= (size_t)FLAGS_raft_apply_batch
+            || _pending_applying_bytes >= (size_t)FLAGS_raft_apply_batch_max_bytes) {
+        flush_applying_tasks(true);
+    }
+}
+
+void NodeImpl::flush_applying_tasks(bool full) {
+    if (_pending_applying_tasks.empty()) {
+        return;
+    }
+    apply(&_pending_applying_tasks[0], _pending_applying_tasks.size(),
+          _pending_applying_open_us, full);
+    _pending_applying_tasks.clear();
+    _pending_applying_bytes = 0;
+}
+
+struct ApplyWindowTimerArg {
+    NodeImpl* node;
+    int64_t batch_id;
+};
+
+void NodeImpl::schedule_flush_applying_tasks() {
+    if (_apply_flush_scheduled_id == _pending_applying_batch_id) {
+        return;
+    }
+    const int64_t deadline_us = _pending_applying_open_us
+                                + _apply_batch_window.window_us();
+    const int64_t wait_us = deadline_us - butil::cpuwide_time_us();
+    if (wait_us <= 0) {
+        return flush_applying_tasks(false);
+    }
+    bthread_timer_t timer;
+    ApplyWindowTimerArg* arg = new ApplyWindowTimerArg;
+    arg->node = this;
+    arg->batch_id = _pending_applying_batch_id;
+    AddRef();
+    if (bthread_timer_add(&timer, butil::microseconds_from_now(wait_us),
+                          on_apply_batch_window_timedout, arg) != 0) {
+        delete arg;
+        Release();
+        LOG(ERROR) << "node " << _group_id << ":" << _server_id
+                   << " fail to add timer";
+        return flush_applying_tasks(false);
+    }
+    _apply_flush_scheduled_id = _pending_applying_batch_id;
+}
+
+void NodeImpl::on_apply_batch_window_timedout(void* arg) {
+    ApplyWindowTimerArg* a = (ApplyWindowTimerArg*)arg;
+    NodeImpl* node = a->node;
+    // Wake up execute_applying_tasks with an empty task, nothing to do if the
+    // queue has been stopped as the pending tasks are flushed on stopping.
+    LogEntryAndClosure m;
+    m.window_batch_id = a->batch_id;
+    delete a;
+    bthread::execution_queue_execute(node->_apply_queue_id, m);
+    node->Release();
+}
+
 void NodeImpl::apply(const Task& task) {
+    if (!_apply_admission.try_acquire(1, task.data->size())) {
+        if (task.done) {
+            task.done->status().set_error(EBUSY, "Too many inflight tasks");
+            run_closure_in_bthread(task.done);
+        }
+        return;
+    }
     LogEntry* entry = new LogEntry;
     entry->AddRef();
     entry->data.swap(*task.data);
@@ -652,13 +851,67 @@ void NodeImpl::apply(const Task& task) {
     m.entry = entry;
     m.done = task.done;
     m.expected_term = task.expected_term;
+    m.batch = NULL;
     if (_apply_queue->execute(m, &bthread::TASK_OPTIONS_INPLACE, NULL) != 0) {
+        _apply_admission.release(1, entry->data.size());
         task.done->status().set_error(EPERM, "Node is down");
         entry->Release();
         return run_closure_in_bthread(task.done);
     }
 }
 
+void NodeImpl::apply(const Task* tasks, size_t n) {
+    if (n == 0) {
+        return;
+    }
+    if (n == 1) {
+        return apply(tasks[0]);
+    }
+    int64_t bytes = 0;
+    for (size_t i = 0; i < n; ++i) {
+        bytes += tasks[i].data->size();
+    }
+    if (!_apply_admission.try_acquire(n, bytes)) {
+        for (size_t i = 0; i < n; ++i) {
+            if (tasks[i].done) {
+                tasks[i].done->status().set_error(
+                        EBUSY, "Too many inflight tasks");
+                run_closure_in_bthread_nosig(tasks[i].done);
+            }
+        }
+        bthread_flush();
+        return;
+    }
+    std::vector<LogEntryAndClosure>* batch = new std::vector<LogEntryAndClosure>;
+    batch->resize(n);
+    for (size_t i = 0; i < n; ++i) {
+        LogEntry* entry = new LogEntry;
+        entry->AddRef();
+        entry->data.swap(*tasks[i].data);
+        LogEntryAndClosure& t = (*batch)[i];
+        t.entry = entry;
+        t.done = tasks[i].done;
+        t.expected_term = tasks[i].expected_term;
+        t.batch = NULL;
+    }
+    LogEntryAndClosure m;
+    m.entry = NULL;
+    m.done = NULL;
+    m.expected_term = -1;
+    m.batch = batch;
+    if (_apply_queue->execute(m, &bthread::TASK_OPTIONS_INPLACE, NULL) != 0) {
+        _apply_admission.release(n, bytes);
+        for (size_t i = 0; i < n; ++i) {
+            (*batch)[i].entry->Release();
+            if ((*batch)[i].done) {
+                (*batch)[i].done->status().set_error(EPERM, "Node is down");
+                run_closure_in_bthread((*batch)[i].done);
+            }
+        }
+        delete batch;
+    }
+}
+
 void NodeImpl::on_configuration_change_done(int64_t term) {
     BAIDU_SCOPED_LOCK(_mutex);
     if (_state > STATE_TRANSFERRING || term != _current_term) {
@@ -910,13 +1163,15 @@ butil::Status NodeImpl::reset_peers(const Configuration& new_peers) {
 }
 
 void NodeImpl::snapshot(Closure* done) {
-    do_snapshot(done);
+    global_node_manager->snapshot_scheduler()->schedule(this, done, false);
 }
 
 void NodeImpl::do_snapshot(Closure* done) {
     LOG(INFO) << "node " << _group_id << ":" << _server_id 
               << " starts to do snapshot";
     if (_snapshot_executor) {
+        retain_logs_for_followers();
+        release_ingested_files(false);
         _snapshot_executor->do_snapshot(done);
     } else {
         if (done) {
@@ -926,6 +1181,522 @@ void NodeImpl::do_snapshot(Closure* done) {
     }
 }
 
+void NodeImpl::retain_logs_for_followers() {
+    int64_t retained_index = 0;
+    std::unique_lock<raft_mutex_t> lck(_mutex);
+    const int64_t entry_bytes = _log_manager->average_entry_bytes();
+    if (_state == STATE_LEADER && entry_bytes > 0
+            && FLAGS_raft_install_snapshot_min_gap_bytes > 0) {
+        const int64_t last_log_index = _log_manager->last_log_index();
+        std::vector<ReplicatorId> ids;
+        _replicator_group.list_replicators(&ids);
+        for (size_t i = 0; i < ids.size(); ++i) {
+            const int64_t next_index = Replicator::get_next_index(ids[i]);
+            if (next_index == 0 || (last_log_index - next_index + 1)
+                    * entry_bytes >= FLAGS_raft_install_snapshot_min_gap_bytes) {
+                continue;
+            }
+            if (retained_index == 0 || next_index < retained_index) {
+                retained_index = next_index;
+            }
+        }
+    }
+    lck.unlock();
+    _log_manager->set_retained_index(retained_index);
+}
+
+FileSystemAdaptor* NodeImpl::snapshot_file_system() {
+    if (_options.snapshot_file_system_adaptor
+            && *_options.snapshot_file_system_adaptor) {
+        return _options.snapshot_file_system_adaptor->get();
+    }
+    return default_file_system();
+}
+
+// The FileService reader id of the files ingested by the log |id| on |peer|,
+// which every peer derives alike to fetch the files from the others even
+// after |peer| restarted. Negative so that it never collides with the ids
+// allocated by FileServiceImpl::add_reader
+static int64_t ingest_reader_id(const GroupId& group_id, const PeerId& peer,
+                                const LogId& id) {
+    std::ostringstream os;
+    os << group_id << '/' << peer.addr << ':' << peer.idx << '/'
+       << id.index << '/' << id.term;
+    const std::string key = os.str();
+    uint64_t hash[2];
+    butil::MurmurHash3_x64_128(key.data(), key.size(), 0, hash);
+    return -(int64_t)(hash[0] >> 1) - 1;
+}
+
+static std::string ingest_path(const std::string& snapshot_path,
+                               const LogId& id) {
+    std::string path;
+    butil::string_printf(&path, "%s/ingest_%020" PRId64 "_%020" PRId64,
+                         snapshot_path.c_str(), id.index, id.term);
+    return path;
+}
+
+static const char* const INGEST_TEMP_PREFIX = "ingest_temp_";
+
+// Link |source| to |dest|, or copy it if they're on different file systems,
+// which reads and writes the whole file on the calling thread
+static bool link_or_copy_file(FileSystemAdaptor* fs, const std::string& source,
+                              const std::string& dest) {
+    if (fs->clone(source, dest) || fs->link(source, dest)) {
+        return true;
+    }
+    butil::File::Error e;
+    FileAdaptor* src = fs->open(source, O_RDONLY, NULL, &e);
+    if (src == NULL) {
+        LOG(WARNING) << "Fail to open " << source << " : " << e;
+        return false;
+    }
+    FileAdaptor* dst = fs->open(dest, O_CREAT | O_TRUNC | O_WRONLY, NULL, &e);
+    if (dst == NULL) {
+        LOG(WARNING) << "Fail to open " << dest << " : " << e;
+        delete src;
+        return false;
+    }
+    bool ok = true;
+    off_t offset = 0;
+    while (ok) {
+        butil::IOPortal data;
+        const ssize_t nr = src->read(&data, offset, 1024 * 1024);
+        if (nr <= 0) {
+            ok = (nr == 0);
+            break;
+        }
+        ok = (dst->write(data, offset) == nr);
+        offset += nr;
+    }
+    ok = ok && dst->sync();
+    dst->close();
+    src->close();
+    delete dst;
+    delete src;
+    LOG_IF(WARNING, !ok) << "Fail to copy " << source << " to " << dest;
+    return ok;
+}
+
+void NodeImpl::ingest(const std::string& path, Closure* done) {
+    FileSystemAdaptor* fs = snapshot_file_system();
+    std::string snapshot_path;
+    if (!get_local_snapshot_path(_options.snapshot_uri, &snapshot_path)) {
+        if (done) {
+            done->status().set_error(EINVAL, "Snapshot storage is not local");
+            run_closure_in_bthread(done);
+        }
+        return;
+    }
+    IngestMeta meta;
+    DirReader* dir_reader = fs->directory_reader(path);
+    if (!dir_reader->is_valid()) {
+        delete dir_reader;
+        LOG(WARNING) << "node " << _group_id << ":" << _server_id
+                     << " fail to list the files to ingest in " << path;
+        if (done) {
+            done->status().set_error(EINVAL, "Fail to list %s", path.c_str());
+            run_closure_in_bthread(done);
+        }
+        return;
+    }
+    std::vector<std::string> files;
+    while (dir_reader->next()) {
+        files.push_back(dir_reader->name());
+    }
+    delete dir_reader;
+    // Followers ingest the files in the same order
+    std::sort(files.begin(), files.end());
+    for (size_t i = 0; i < files.size(); ++i) {
+        meta.add_files(files[i]);
+    }
+    // Keep a private link of the files in the snapshot storage, which is
+    // served to the other peers until a snapshot covers the log, so that
+    // the caller is free to remove |path| afterwards. They're staged here and
+    // moved by apply once the index of the log is known.
+    std::string staging_path(snapshot_path + "/" + INGEST_TEMP_PREFIX);
+    butil::string_appendf(&staging_path, "staging_%" PRId64 "_%" PRIu64,
+                          butil::gettimeofday_us(), butil::fast_rand());
+    butil::File::Error e;
+    if (!fs->create_directory(staging_path, &e, true)) {
+        LOG(ERROR) << "Fail to create " << staging_path << " : " << e;
+        if (done) {
+            done->status().set_error(EIO, "Fail to create %s",
+                                     staging_path.c_str());
+            run_closure_in_bthread(done);
+        }
+        return;
+    }
+    for (size_t i = 0; i < files.size(); ++i) {
+        if (!link_or_copy_file(fs, path + "/" + files[i],
+                               staging_path + "/" + files[i])) {
+            fs->delete_file(staging_path, true);
+            if (done) {
+                done->status().set_error(EIO, "Fail to link %s/%s",
+                                         path.c_str(), files[i].c_str());
+                run_closure_in_bthread(done);
+            }
+            return;
+        }
+    }
+    meta.set_server_id(_server_id.to_string());
+    meta.set_path(path);
+
+    LogEntry* entry = new LogEntry;
+    entry->AddRef();
+    entry->type = ENTRY_TYPE_INGEST;
+    butil::IOBufAsZeroCopyOutputStream wrapper(&entry->data);
+    CHECK(meta.SerializeToZeroCopyStream(&wrapper));
+    // Goes through the apply queue like Node::apply, so that it's ordered
+    // after the tasks applied before and counted by the admission and the
+    // batching window
+    if (!_apply_admission.try_acquire(1, entry->data.size())) {
+        fs->delete_file(staging_path, true);
+        if (done) {
+            done->status().set_error(EBUSY, "Too many inflight tasks");
+            run_closure_in_bthread(done);
+        }
+        entry->Release();
+        return;
+    }
+    LogEntryAndClosure m;
+    m.entry = entry;
+    m.done = done;
+    m.ingest_staging_path = new std::string(staging_path);
+    if (_apply_queue->execute(m, &bthread::TASK_OPTIONS_INPLACE, NULL) != 0) {
+        _apply_admission.release(1, entry->data.size());
+        discard_ingest_staging(&m);
+        entry->Release();
+        if (done) {
+            done->status().set_error(EPERM, "Node is down");
+            run_closure_in_bthread(done);
+        }
+        return;
+    }
+    LOG(INFO) << "node " << _group_id << ":" << _server_id << " ingests "
+              << files.size() << " files in " << path << ", staged in "
+              << staging_path;
+}
+
+void NodeImpl::discard_ingest_staging(LogEntryAndClosure* task) {
+    if (task->ingest_staging_path) {
+        snapshot_file_system()->delete_file(*task->ingest_staging_path, true);
+        delete task->ingest_staging_path;
+        task->ingest_staging_path = NULL;
+    }
+}
+
+bool NodeImpl::keep_ingested_files(const std::string& staging_path,
+                                   const LogId& id) {
+    std::string snapshot_path;
+    CHECK(get_local_snapshot_path(_options.snapshot_uri, &snapshot_path));
+    FileSystemAdaptor* fs = snapshot_file_system();
+    const std::string final_path = ingest_path(snapshot_path, id);
+    fs->delete_file(final_path, true);
+    const int64_t reader_id = fs->rename(staging_path, final_path)
+            ? serve_ingested_files(final_path, id) : 0;
+    if (reader_id == 0) {
+        fs->delete_file(final_path, true);
+        return false;
+    }
+    _ingest_readers.push_back(std::make_pair(id, reader_id));
+    LOG(INFO) << "node " << _group_id << ":" << _server_id
+              << " keeps the files to ingest at index=" << id.index
+              << " in " << final_path;
+    return true;
+}
+
+struct IngestFetchArg {
+    NodeImpl* node;
+    IngestMeta meta;
+    LogId id;
+};
+
+void NodeImpl::start_ingest_fetch(const LogEntry& entry) {
+    if (_ingest_fetches.find(entry.id) != _ingest_fetches.end()) {
+        return;
+    }
+    IngestFetchArg* arg = new IngestFetchArg;
+    butil::IOBufAsZeroCopyInputStream wrapper(entry.data);
+    if (!arg->meta.ParseFromZeroCopyStream(&wrapper)) {
+        // Reported when the log is applied
+        delete arg;
+        return;
+    }
+    arg->node = this;
+    arg->id = entry.id;
+    AddRef();
+    bthread_t tid;
+    if (bthread_start_background(&tid, NULL, run_ingest_fetch, arg) != 0) {
+        // The files are copied when the log is applied instead
+        PLOG(WARNING) << "Fail to start bthread";
+        Release();
+        delete arg;
+        return;
+    }
+    _ingest_fetches[entry.id] = tid;
+}
+
+void* NodeImpl::run_ingest_fetch(void* arg) {
+    IngestFetchArg* a = (IngestFetchArg*)arg;
+    NodeImpl* node = a->node;
+    std::string path;
+    // The copy is tried again when the log is applied on failure
+    node->fetch_ingested_files(a->meta, a->id, &path);
+    {
+        BAIDU_SCOPED_LOCK(node->_mutex);
+        std::map<LogId, bthread_t>::iterator
+                it = node->_ingest_fetches.find(a->id);
+        if (it != node->_ingest_fetches.end() && it->second == bthread_self()) {
+            node->_ingest_fetches.erase(it);
+        }
+    }
+    delete a;
+    node->Release();
+    return NULL;
+}
+
+int NodeImpl::prepare_ingest(const IngestMeta& meta, const LogId& id,
+                             std::string* path) {
+    // Wait for the copy started when the log was appended
+    for (;;) {
+        bthread_t tid = INVALID_BTHREAD;
+        {
+            BAIDU_SCOPED_LOCK(_mutex);
+            std::map<LogId, bthread_t>::iterator it = _ingest_fetches.find(id);
+            if (it == _ingest_fetches.end()) {
+                // The log appended again doesn't start another copy meanwhile
+                _ingest_fetches[id] = INVALID_BTHREAD;
+                break;
+            }
+            tid = it->second;
+        }
+        CHECK_NE(tid, INVALID_BTHREAD);
+        bthread_join(tid, NULL);
+    }
+    const int rc = fetch_ingested_files(meta, id, path);
+    BAIDU_SCOPED_LOCK(_mutex);
+    _ingest_fetches.erase(id);
+    return rc;
+}
+
+int NodeImpl::fetch_ingested_files(const IngestMeta& meta, const LogId& id,
+                                   std::string* path) {
+    FileSystemAdaptor* fs = snapshot_file_system();
+    std::string snapshot_path;
+    if (!get_local_snapshot_path(_options.snapshot_uri, &snapshot_path)) {
+        LOG(ERROR) << "node " << _group_id << ":" << _server_id
+                   << " can't ingest files without local snapshot storage";
+        return EINVAL;
+    }
+    *path = ingest_path(snapshot_path, id);
+    if (fs->directory_exists(*path)) {
+        // Kept by ingest on the leader, or copied before
+        return 0;
+    }
+    std::string temp_path(snapshot_path + "/" + INGEST_TEMP_PREFIX);
+    butil::string_appendf(&temp_path, "%" PRId64 "_%" PRId64,
+                          id.index, id.term);
+    PeerId leader;
+    leader.parse(meta.server_id());
+    // Every peer which has applied the log serves the files, so that they're
+    // still available after the leader is gone
+    for (int nround = 0; nround < FLAGS_raft_ingest_max_copy_rounds; ++nround) {
+        for (int i = 0; nround > 0 && i < 10; ++i) {
+            bthread_usleep(100 * 1000L);
+            BAIDU_SCOPED_LOCK(_mutex);
+            if (_state >= STATE_SHUTTING) {
+                return ECANCELED;
+            }
+        }
+        std::vector<PeerId> sources;
+        if (leader != _server_id) {
+            sources.push_back(leader);
+        }
+        std::set<PeerId> peers;
+        {
+            BAIDU_SCOPED_LOCK(_mutex);
+            if (_state >= STATE_SHUTTING) {
+                return ECANCELED;
+            }
+            _conf.list_peers(&peers);
+        }
+        for (std::set<PeerId>::const_iterator
+                iter = peers.begin(); iter != peers.end(); ++iter) {
+            if (*iter != _server_id && *iter != leader) {
+                sources.push_back(*iter);
+            }
+        }
+        for (size_t i = 0; i < sources.size(); ++i) {
+            std::ostringstream uri;
+            uri << "remote://" << sources[i].addr << "/"
+                << ingest_reader_id(_group_id, sources[i], id);
+            const int rc = copy_ingested_files(meta, uri.str(), temp_path);
+            if (rc == ECANCELED) {
+                fs->delete_file(temp_path, true);
+                return ECANCELED;
+            }
+            if (rc != 0) {
+                continue;
+            }
+            if (!fs->rename(temp_path, *path)) {
+                PLOG(ERROR) << "Fail to rename " << temp_path << " to " << *path;
+                fs->delete_file(temp_path, true);
+                return EIO;
+            }
+            LOG(INFO) << "node " << _group_id << ":" << _server_id
+                      << " copied " << meta.files_size() << " files to ingest"
+                      << " at index=" << id.index << " from " << sources[i]
+                      << " to " << *path;
+            const int64_t reader_id = serve_ingested_files(*path, id);
+            if (reader_id != 0) {
+                BAIDU_SCOPED_LOCK(_mutex);
+                _ingest_readers.push_back(std::make_pair(id, reader_id));
+            }
+            return 0;
+        }
+        fs->delete_file(temp_path, true);
+        LOG(WARNING) << "node " << _group_id << ":" << _server_id
+                     << " fail to copy the files to ingest at index="
+                     << id.index << " from any of " << sources.size()
+                     << " peers, round " << nround + 1;
+    }
+    LOG(ERROR) << "node " << _group_id << ":" << _server_id
+               << " give up copying the files to ingest at index=" << id.index
+               << " after " << FLAGS_raft_ingest_max_copy_rounds << " rounds";
+    return EIO;
+}
+
+int NodeImpl::copy_ingested_files(const IngestMeta& meta,
+                                  const std::string& uri,
+                                  const std::string& dest_path) {
+    FileSystemAdaptor* fs = snapshot_file_system();
+    fs->delete_file(dest_path, true);
+    butil::File::Error e;
+    if (!fs->create_directory(dest_path, &e, true)) {
+        LOG(ERROR) << "Fail to create " << dest_path << " : " << e;
+        return EIO;
+    }
+    RemoteFileCopier copier;
+    SnapshotThrottle* throttle = _options.snapshot_throttle
+            ? _options.snapshot_throttle->get() : NULL;
+    if (copier.init(uri, fs, throttle) != 0) {
+        return EINVAL;
+    }
+    for (int i = 0; i < meta.files_size(); ++i) {
+        scoped_refptr<RemoteFileCopier::Session> session =
+                copier.start_to_copy_to_file(
+                        meta.files(i), dest_path + "/" + meta.files(i), NULL);
+        if (session == NULL) {
+            return EIO;
+        }
+        std::unique_lock<raft_mutex_t> lck(_mutex);
+        if (_state >= STATE_SHUTTING) {
+            lck.unlock();
+            session->cancel();
+            session->join();
+            return ECANCELED;
+        }
+        _ingest_sessions.push_back(session);
+        lck.unlock();
+        session->join();
+        lck.lock();
+        _ingest_sessions.erase(std::find(_ingest_sessions.begin(),
+                                         _ingest_sessions.end(), session));
+        lck.unlock();
+        const int rc = session->status().error_code();
+        if (rc != 0) {
+            LOG(WARNING) << "node " << _group_id << ":" << _server_id
+                         << " fail to copy " << meta.files(i) << " from "
+                         << uri << " : " << session->status();
+            return rc > 0 ? rc : EIO;
+        }
+    }
+    return 0;
+}
+
+int64_t NodeImpl::serve_ingested_files(const std::string& path,
+                                       const LogId& id) {
+    scoped_refptr<LocalDirReader> reader(
+            new LocalDirReader(snapshot_file_system(), path));
+    const int64_t reader_id = ingest_reader_id(_group_id, _server_id, id);
+    if (!reader->open() || file_service_add_with_id(reader.get(), reader_id) != 0) {
+        LOG(WARNING) << "node " << _group_id << ":" << _server_id
+                     << " fail to serve the ingested files in " << path;
+        return 0;
+    }
+    return reader_id;
+}
+
+void NodeImpl::load_ingested_files() {
+    std::string snapshot_path;
+    if (!get_local_snapshot_path(_options.snapshot_uri, &snapshot_path)) {
+        return;
+    }
+    FileSystemAdaptor* fs = snapshot_file_system();
+    DirReader* dir_reader = fs->directory_reader(snapshot_path);
+    if (!dir_reader->is_valid()) {
+        delete dir_reader;
+        return;
+    }
+    std::vector<std::string> names;
+    while (dir_reader->next()) {
+        names.push_back(dir_reader->name());
+    }
+    delete dir_reader;
+    const int64_t first_log_index = _log_manager->first_log_index();
+    for (size_t i = 0; i < names.size(); ++i) {
+        const std::string path(snapshot_path + "/" + names[i]);
+        if (butil::StringPiece(names[i]).starts_with(INGEST_TEMP_PREFIX)) {
+            fs->delete_file(path, true);
+            continue;
+        }
+        LogId id;
+        if (sscanf(names[i].c_str(), "ingest_%" SCNd64 "_%" SCNd64,
+                   &id.index, &id.term) != 2) {
+            continue;
+        }
+        if (id.index < first_log_index
+                || _log_manager->get_term(id.index) != id.term) {
+            // Covered by the snapshot, or the log was overwritten
+            fs->delete_file(path, true);
+            continue;
+        }
+        const int64_t reader_id = serve_ingested_files(path, id);
+        if (reader_id != 0) {
+            BAIDU_SCOPED_LOCK(_mutex);
+            _ingest_readers.push_back(std::make_pair(id, reader_id));
+        }
+    }
+}
+
+void NodeImpl::release_ingested_files(bool all) {
+    std::vector<std::pair<LogId, int64_t> > released;
+    {
+        const int64_t first_log_index = all ? 0 : _log_manager->first_log_index();
+        BAIDU_SCOPED_LOCK(_mutex);
+        size_t n = 0;
+        for (size_t i = 0; i < _ingest_readers.size(); ++i) {
+            if (all || _ingest_readers[i].first.index < first_log_index) {
+                released.push_back(_ingest_readers[i]);
+            } else {
+                _ingest_readers[n++] = _ingest_readers[i];
+            }
+        }
+        _ingest_readers.resize(n);
+    }
+    std::string snapshot_path;
+    const bool remove = !all
+            && get_local_snapshot_path(_options.snapshot_uri, &snapshot_path);
+    for (size_t i = 0; i < released.size(); ++i) {
+        file_service_remove(released[i].second);
+        if (remove) {
+            snapshot_file_system()->delete_file(
+                    ingest_path(snapshot_path, released[i].first), true);
+        }
+    }
+}
+
 void NodeImpl::shutdown(Closure* done) {
     // Note: shutdown is probably invoked more than once, make sure this method
     // is idempotent
@@ -947,9 +1718,18 @@ void NodeImpl::shutdown(Closure* done) {
                 step_down(_current_term, _state == STATE_LEADER, status);
             }
 
+            // Stop copying the files to ingest, the log is applied again
+            // after restart
+            for (size_t i = 0; i < _ingest_sessions.size(); ++i) {
+                _ingest_sessions[i]->cancel();
+            }
+
             // change state to shutdown
             _state = STATE_SHUTTING;
 
+            // Fail the callers waiting for admission
+            _apply_admission.stop();
+
             // Destroy all the timer
             _election_timer.destroy();
             _vote_timer.destroy();
@@ -1940,11 +2720,13 @@ void LeaderStableClosure::Run() {
     delete this;
 }
 
-void NodeImpl::apply(LogEntryAndClosure tasks[], size_t size) {
+void NodeImpl::apply(LogEntryAndClosure tasks[], size_t size,
+                     int64_t open_time_us, bool full) {
     g_apply_tasks_batch_counter << size;
 
     std::vector<LogEntry*> entries;
     entries.reserve(size);
+    int64_t appended_bytes = 0;
     std::unique_lock<raft_mutex_t> lck(_mutex);
     bool reject_new_user_logs = (_node_readonly || _majority_nodes_readonly);
     if (_state != STATE_LEADER || reject_new_user_logs) {
@@ -1959,6 +2741,8 @@ void NodeImpl::apply(LogEntryAndClosure tasks[], size_t size) {
         lck.unlock();
         BRAFT_VLOG << "node " << _group_id << ":" << _server_id << " can't apply : " << st;
         for (size_t i = 0; i < size; ++i) {
+            _apply_admission.release(1, tasks[i].entry->data.size());
+            discard_ingest_staging(&tasks[i]);
             tasks[i].entry->Release();
             if (tasks[i].done) {
                 tasks[i].done->status() = st;
@@ -1978,16 +2762,47 @@ void NodeImpl::apply(LogEntryAndClosure tasks[], size_t size) {
                         tasks[i].expected_term, _current_term);
                 run_closure_in_bthread(tasks[i].done);
             }
+            _apply_admission.release(1, tasks[i].entry->data.size());
+            discard_ingest_staging(&tasks[i]);
             tasks[i].entry->Release();
             continue;
         }
+        const bool ingest = (tasks[i].ingest_staging_path != NULL);
+        if (ingest) {
+            // Appending logs is serialized by _mutex on leader
+            const LogId id(_log_manager->last_log_index() + entries.size() + 1,
+                           _current_term);
+            const bool kept = keep_ingested_files(
+                    *tasks[i].ingest_staging_path, id);
+            discard_ingest_staging(&tasks[i]);
+            if (!kept) {
+                if (tasks[i].done) {
+                    tasks[i].done->status().set_error(
+                            EIO, "Fail to keep the files to ingest");
+                    run_closure_in_bthread(tasks[i].done);
+                }
+                _apply_admission.release(1, tasks[i].entry->data.size());
+                tasks[i].entry->Release();
+                continue;
+            }
+        }
+        appended_bytes += tasks[i].entry->data.size();
         entries.push_back(tasks[i].entry);
         entries.back()->id.term = _current_term;
-        entries.back()->type = ENTRY_TYPE_DATA;
+        entries.back()->type = ingest ? ENTRY_TYPE_INGEST : ENTRY_TYPE_DATA;
         _ballot_box->append_pending_task(_conf.conf,
                                          _conf.stable() ? NULL : &_conf.old_conf,
                                          tasks[i].done);
     }
+    const int64_t nappended = entries.size();
+    if (nappended > 0) {
+        // Record the tasks before they can be committed and applied.
+        // Appending logs is serialized by _mutex on leader, so the batch ends
+        // at this index
+        const int64_t last_index = _log_manager->last_log_index() + nappended;
+        _apply_admission.on_appended(last_index, nappended, appended_bytes);
+        _apply_batch_window.on_batch_appended(last_index, open_time_us, full);
+    }
     _log_manager->append_entries(&entries,
                                new LeaderStableClosure(
                                         NodeId(_group_id, _server_id),
@@ -2438,6 +3253,18 @@ void NodeImpl::handle_append_entries_request(brpc::Controller* cntl,
         _ballot_box->set_last_committed_index(
                 std::min(request->committed_index(),
                          prev_log_index));
+        // Let the leader know the snapshot other followers could install
+        // from, if it hasn't known it yet
+        if (_snapshot_executor) {
+            std::string snapshot_uri;
+            SnapshotMeta snapshot_meta;
+            if (_snapshot_executor->get_served_snapshot(
+                        request->known_snapshot_uri(),
+                        &snapshot_uri, &snapshot_meta)) {
+                response->set_snapshot_uri(snapshot_uri);
+                response->mutable_snapshot_meta()->Swap(&snapshot_meta);
+            }
+        }
         return;
     }
 
@@ -2473,6 +3300,11 @@ void NodeImpl::handle_append_entries_request(brpc::Controller* cntl,
                 int len = entry.data_len();
                 data_buf.cutn(&log_entry->data, len);
             }
+            if (log_entry->type == ENTRY_TYPE_INGEST) {
+                // Copy the files before the log is committed, so that
+                // applying it doesn't wait for them
+                start_ingest_fetch(*log_entry);
+            }
             entries.push_back(log_entry);
         }
     }
@@ -2656,6 +3488,7 @@ void NodeImpl::describe(std::ostream& os, bool use_html) {
     _replicator_group.list_replicators(&replicators);
     const int64_t leader_timestamp = _follower_lease.last_leader_timestamp();
     const bool readonly = (_node_readonly || _majority_nodes_readonly);
+    const std::string snapshot_policy_decision = _snapshot_policy_decision;
     lck.unlock();
     const char *newline = use_html ? "<br>" : "\r\n";
     os << "peer_id: " << _server_id << newline;
@@ -2740,7 +3573,14 @@ void NodeImpl::describe(std::ostream& os, bool use_html) {
     os << "snapshot_timer: ";
     _snapshot_timer.describe(os, use_html);
     os << newline;
+    if (!snapshot_policy_decision.empty()) {
+        os << "snapshot_policy: " << snapshot_policy_decision << newline;
+    }
 
+    if (st == STATE_LEADER) {
+        _apply_batch_window.describe(os, use_html);
+    }
+    _apply_admission.describe(os, use_html);
     _log_manager->describe(os, use_html);
     _fsm_caller->describe(os, use_html);
     _ballot_box->describe(os, use_html);
@@ -2789,6 +3629,8 @@ void NodeImpl::get_status(NodeStatus* status) {
     status->pending_queue_size = ballot_box_status.pending_queue_size;
 
     status->applying_index = _fsm_caller->applying_index();
+    status->inflight_apply_tasks = _apply_admission.inflight_tasks();
+    status->inflight_apply_bytes = _apply_admission.inflight_bytes();
     
     if (replicators.size() == 0) {
         return;
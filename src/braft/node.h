@@ -19,6 +19,7 @@
 #ifndef BRAFT_RAFT_NODE_H
 #define BRAFT_RAFT_NODE_H
 
+#include <map>
 #include <set>
 #include <butil/atomic_ref_count.h>
 #include <butil/memory/ref_counted.h>
@@ -36,6 +37,9 @@
 #include "braft/closure_queue.h"
 #include "braft/configuration_manager.h"
 #include "braft/repeated_timer_task.h"
+#include "braft/apply_batch_window.h"
+#include "braft/apply_admission.h"
+#include "braft/remote_file_copier.h"
 
 namespace braft {
 
@@ -91,6 +95,7 @@ friend class RaftStatImpl;
 friend class FollowerStableClosure;
 friend class ConfigurationChangeDone;
 friend class VoteBallotCtx;
+friend class SnapshotScheduler;
 public:
     NodeImpl(const GroupId& group_id, const PeerId& peer_id);
     NodeImpl();
@@ -133,6 +138,18 @@ public:
     //
     void apply(const Task& task);
 
+    // apply |n| tasks at once, see Node::apply(const Task*, size_t)
+    void apply(const Task* tasks, size_t n);
+
+    void wait_apply_admission(Closure* done) {
+        _apply_admission.wait(done);
+    }
+
+    // Called by FSMCaller once the logs before |applied_index| are applied
+    void on_applied(int64_t applied_index) {
+        _apply_admission.on_applied(applied_index);
+    }
+
     butil::Status list_peers(std::vector<PeerId>* peers);
 
     // @Node configuration change
@@ -144,6 +161,17 @@ public:
     // trigger snapshot
     void snapshot(Closure* done);
 
+    // ingest the files in |path| through the log
+    void ingest(const std::string& path, Closure* done);
+
+    // Get the local directory of the files to ingest by the log |id|,
+    // waiting for the copy started when the log was appended, or copying
+    // them from the peers into the snapshot storage if they're still not on
+    // this node. Returns ECANCELED if the node shuts down meanwhile, EIO if
+    // none of the peers serves them for raft_ingest_max_copy_rounds.
+    // Called by FSMCaller.
+    int prepare_ingest(const IngestMeta& meta, const LogId& id, std::string* path);
+
     // trigger vote
     butil::Status vote(int election_timeout);
 
@@ -182,6 +210,15 @@ public:
     void handle_vote_timeout();
     void handle_stepdown_timeout();
     void handle_snapshot_timeout();
+    // Ask the SnapshotPolicy whether to save a snapshot now
+    bool check_snapshot_policy();
+
+    // The device of the snapshot storage, the nodes on the same disk share
+    // the quota of concurrent snapshot saves
+    int64_t snapshot_disk_id();
+
+    // Number of the applied log entries not covered by the last snapshot
+    int64_t snapshot_log_entries();
     void handle_transfer_timeout(int64_t term, const PeerId& peer);
 
     // Closure call func
@@ -292,15 +329,50 @@ friend class butil::RefCountedThreadSafe<NodeImpl>;
 
     void do_snapshot(Closure* done);
 
+    // Tell LogManager to keep the logs needed by the followers which lack
+    // few logs when the snapshot truncates logs
+    void retain_logs_for_followers();
+
+    // Stop serving the ingested files whose logs were truncated and remove
+    // them, all the peers needing them install snapshots instead. Stop
+    // serving all of them but keep them on disk if |all| is true.
+    void release_ingested_files(bool all);
+    // Serve the ingested files kept in the snapshot storage since the last
+    // run, and remove the ones no longer referred to by the log
+    void load_ingested_files();
+    // Serve the ingested files of the log |id| in |path| under the reader id
+    // every peer derives alike. Returns the reader id, 0 on failure
+    int64_t serve_ingested_files(const std::string& path, const LogId& id);
+    // Move the files staged by ingest to the directory of the log |id|, and
+    // serve them. Called with _mutex held
+    bool keep_ingested_files(const std::string& staging_path, const LogId& id);
+    // Start copying the files ingested by the appended log |entry| from the
+    // peers in background. Called with _mutex held
+    void start_ingest_fetch(const LogEntry& entry);
+    static void* run_ingest_fetch(void* arg);
+    // Copy the files ingested by the log |id| to |path| from the peers
+    int fetch_ingested_files(const IngestMeta& meta, const LogId& id,
+                             std::string* path);
+    int copy_ingested_files(const IngestMeta& meta, const std::string& uri,
+                            const std::string& dest_path);
+
+    FileSystemAdaptor* snapshot_file_system();
+
     void after_shutdown();
     static void after_shutdown(NodeImpl* node);
 
     void do_apply(butil::IOBuf& data, Closure* done);
 
     struct LogEntryAndClosure;
+    void discard_ingest_staging(LogEntryAndClosure* task);
     static int execute_applying_tasks(
                 void* meta, bthread::TaskIterator<LogEntryAndClosure>& iter);
-    void apply(LogEntryAndClosure tasks[], size_t size);
+    void apply(LogEntryAndClosure tasks[], size_t size,
+               int64_t open_time_us, bool full);
+    void add_applying_task(const LogEntryAndClosure& task);
+    void flush_applying_tasks(bool full);
+    void schedule_flush_applying_tasks();
+    static void on_apply_batch_window_timedout(void* arg);
     void check_dead_nodes(const Configuration& conf, int64_t now_ms);
 
     bool handle_out_of_order_append_entries(brpc::Controller* cntl,
@@ -385,9 +457,23 @@ private:
     };
 
     struct LogEntryAndClosure {
+        LogEntryAndClosure()
+            : entry(NULL), done(NULL), expected_term(-1), batch(NULL)
+            , window_batch_id(0), ingest_staging_path(NULL) {}
         LogEntry* entry;
         Closure* done;
         int64_t expected_term;
+        // Non-NULL if this item carries all the tasks of a bulk apply, in
+        // which case the fields above are not used
+        std::vector<LogEntryAndClosure>* batch;
+        // Non-zero if this item marks the timeout of the batching window
+        // armed for the pending batch with this id, in which case the other
+        // fields are not used
+        int64_t window_batch_id;
+        // Non-NULL if |entry| ingests the files staged in this directory,
+        // which are moved once the index of |entry| is known. Owned by this
+        // item
+        std::string* ingest_staging_path;
     };
 
     struct AppendEntriesRpc : public butil::LinkNode<AppendEntriesRpc> {
@@ -515,12 +601,34 @@ private:
     VoteTimer _vote_timer;
     StepdownTimer _stepdown_timer;
     SnapshotTimer _snapshot_timer;
+    // The last decision of the SnapshotPolicy, shown by describe
+    std::string _snapshot_policy_decision;
+    // The log id and the FileService reader id of the ingested files
+    // served by this node
+    std::vector<std::pair<LogId, int64_t> > _ingest_readers;
+    // Copying the files to ingest from other peers, cancelled by shutdown
+    std::vector<scoped_refptr<RemoteFileCopier::Session> > _ingest_sessions;
+    // The logs whose ingested files are being copied, by the bthread in the
+    // value, or by FSMCaller if it's INVALID_BTHREAD
+    std::map<LogId, bthread_t> _ingest_fetches;
     bthread_timer_t _transfer_timer;
     StopTransferArg* _stop_transfer_arg;
     bool _vote_triggered;
     ReplicatorId _waking_candidate;
     bthread::ExecutionQueueId<LogEntryAndClosure> _apply_queue_id;
     bthread::ExecutionQueue<LogEntryAndClosure>::scoped_ptr_t _apply_queue;
+    // Tasks accumulated in the batching window, only accessed in
+    // execute_applying_tasks
+    std::vector<LogEntryAndClosure> _pending_applying_tasks;
+    size_t _pending_applying_bytes;
+    int64_t _pending_applying_open_us;
+    // Id of the batch being accumulated, and of the batch which the timer of
+    // the window was armed for, so that a stale timer doesn't close the
+    // following batch early
+    int64_t _pending_applying_batch_id;
+    int64_t _apply_flush_scheduled_id;
+    ApplyBatchWindow _apply_batch_window;
+    ApplyAdmission _apply_admission;
     AppendEntriesCache* _append_entries_cache;
     int64_t _append_entries_cache_version;
 
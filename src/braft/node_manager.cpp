@@ -14,6 +14,10 @@
 
 // Authors: Zhangyi Chen(chenzhangyi01@baidu.com)
 
+#include <gflags/gflags.h>
+#include <butil/fast_rand.h>
+#include <bthread/bthread.h>
+#include <brpc/reloadable_flags.h>
 #include "braft/node.h"
 #include "braft/node_manager.h"
 #include "braft/file_service.h"
@@ -22,6 +26,135 @@
 
 namespace braft {
 
+DEFINE_int32(raft_max_concurrent_snapshot_saves_per_disk, 2,
+             "Max number of nodes saving snapshots at the same time on the"
+             " same disk. 0 means no limit");
+BRPC_VALIDATE_GFLAG(raft_max_concurrent_snapshot_saves_per_disk,
+                    brpc::NonNegativeInteger);
+
+DEFINE_int32(raft_snapshot_schedule_jitter_ms, 1000,
+             "The periodic snapshot saves are delayed randomly by up to this"
+             " value so that they spread out");
+BRPC_VALIDATE_GFLAG(raft_snapshot_schedule_jitter_ms, brpc::NonNegativeInteger);
+
+class SnapshotScheduler::ScheduledSnapshotDone : public Closure {
+public:
+    ScheduledSnapshotDone(SnapshotScheduler* scheduler, int64_t disk_id,
+                          Closure* done)
+        : _scheduler(scheduler), _disk_id(disk_id), _done(done) {}
+
+    void Run() {
+        _scheduler->on_snapshot_done(_disk_id);
+        if (_done) {
+            _done->status() = status();
+            _done->Run();
+        }
+        delete this;
+    }
+
+private:
+    SnapshotScheduler* _scheduler;
+    int64_t _disk_id;
+    Closure* _done;
+};
+
+struct DelayedSnapshot {
+    scoped_refptr<NodeImpl> node;
+    Closure* done;
+    int64_t delay_ms;
+};
+
+SnapshotScheduler::~SnapshotScheduler() {}
+
+void SnapshotScheduler::schedule(NodeImpl* node, Closure* done, bool periodic) {
+    Request request;
+    request.node = node;
+    request.done = done;
+    request.periodic = periodic;
+    const int64_t disk_id = node->snapshot_disk_id();
+    std::unique_lock<raft_mutex_t> lck(_mutex);
+    Disk& disk = _disks[disk_id];
+    const int max_running = FLAGS_raft_max_concurrent_snapshot_saves_per_disk;
+    if (max_running > 0 && disk.nrunning >= max_running) {
+        for (size_t i = 0; periodic && i < disk.pending.size(); ++i) {
+            if (disk.pending[i].node.get() == node && disk.pending[i].periodic) {
+                // Saving once is enough
+                return;
+            }
+        }
+        disk.pending.push_back(request);
+        return;
+    }
+    ++disk.nrunning;
+    lck.unlock();
+    start(disk_id, request);
+}
+
+void SnapshotScheduler::start(int64_t disk_id, const Request& request) {
+    Closure* done = new ScheduledSnapshotDone(this, disk_id, request.done);
+    if (!request.periodic || FLAGS_raft_snapshot_schedule_jitter_ms <= 0) {
+        request.node->do_snapshot(done);
+        return;
+    }
+    DelayedSnapshot* ds = new DelayedSnapshot;
+    ds->node = request.node;
+    ds->done = done;
+    ds->delay_ms = butil::fast_rand_less_than(
+            FLAGS_raft_snapshot_schedule_jitter_ms);
+    bthread_t tid;
+    if (bthread_start_background(&tid, NULL, run_delayed_snapshot, ds) != 0) {
+        PLOG(WARNING) << "Fail to start bthread";
+        ds->delay_ms = 0;
+        run_delayed_snapshot(ds);
+    }
+}
+
+void* SnapshotScheduler::run_delayed_snapshot(void* arg) {
+    DelayedSnapshot* ds = (DelayedSnapshot*)arg;
+    if (ds->delay_ms > 0) {
+        bthread_usleep(ds->delay_ms * 1000);
+    }
+    ds->node->do_snapshot(ds->done);
+    delete ds;
+    return NULL;
+}
+
+void SnapshotScheduler::on_snapshot_done(int64_t disk_id) {
+    std::unique_lock<raft_mutex_t> lck(_mutex);
+    Disk& disk = _disks[disk_id];
+    if (disk.pending.empty()) {
+        --disk.nrunning;
+        return;
+    }
+    // The logs of the pending nodes keep growing while they wait, so they
+    // are ranked when the disk becomes available rather than when queued.
+    // The node with the most logs since its last snapshot goes first.
+    size_t next = 0;
+    int64_t next_priority = disk.pending[0].node->snapshot_log_entries();
+    for (size_t i = 1; i < disk.pending.size(); ++i) {
+        const int64_t priority = disk.pending[i].node->snapshot_log_entries();
+        if (priority > next_priority) {
+            next = i;
+            next_priority = priority;
+        }
+    }
+    const Request request = disk.pending[next];
+    disk.pending.erase(disk.pending.begin() + next);
+    lck.unlock();
+    start(disk_id, request);
+}
+
+void SnapshotScheduler::describe(std::ostream& os, bool use_html) {
+    const char* newline = use_html ? "<br>" : "\r\n";
+    BAIDU_SCOPED_LOCK(_mutex);
+    for (std::map<int64_t, Disk>::const_iterator
+            it = _disks.begin(); it != _disks.end(); ++it) {
+        os << "snapshot_scheduler: disk=" << it->first
+           << " running=" << it->second.nrunning
+           << " pending=" << it->second.pending.size() << newline;
+    }
+}
+
 NodeManager::NodeManager() {}
 
 NodeManager::~NodeManager() {}
@@ -17,6 +17,8 @@
 #ifndef  BRAFT_NODE_MANAGER_H
 #define  BRAFT_NODE_MANAGER_H
 
+#include <map>
+#include <vector>
 #include <butil/memory/singleton.h>
 #include <butil/containers/doubly_buffered_data.h>
 #include "braft/raft.h"
@@ -26,6 +28,44 @@ namespace braft {
 
 class NodeImpl;
 
+// Runs the snapshot saves of all the nodes in this process, so that at most
+// raft_max_concurrent_snapshot_saves_per_disk of them are running on the same
+// disk at a time. The waiting nodes with more logs to compact go first, and
+// the periodic saves are spread by a random delay, so that the groups don't
+// save snapshots in waves after the process restarts.
+class SnapshotScheduler {
+public:
+    SnapshotScheduler() {}
+    ~SnapshotScheduler();
+
+    // Save a snapshot of |node| once its disk is available and run |done|
+    // after that like Node::snapshot. |periodic| is true for the saves of
+    // SnapshotTimer, which are delayed randomly and not queued twice.
+    void schedule(NodeImpl* node, Closure* done, bool periodic);
+
+    void describe(std::ostream& os, bool use_html);
+
+private:
+    class ScheduledSnapshotDone;
+    struct Request {
+        scoped_refptr<NodeImpl> node;
+        Closure* done;
+        bool periodic;
+    };
+    struct Disk {
+        Disk() : nrunning(0) {}
+        int nrunning;
+        std::vector<Request> pending;
+    };
+
+    void start(int64_t disk_id, const Request& request);
+    void on_snapshot_done(int64_t disk_id);
+    static void* run_delayed_snapshot(void* arg);
+
+    raft_mutex_t _mutex;
+    std::map<int64_t, Disk> _disks;
+};
+
 class NodeManager {
 public:
     static NodeManager* GetInstance() {
@@ -57,6 +97,9 @@ public:
     // Remove the addr from _addr_set when the backing service is destroyed
     void remove_address(butil::EndPoint addr);
 
+    // The scheduler of the snapshot saves of all the nodes
+    SnapshotScheduler* snapshot_scheduler() { return &_snapshot_scheduler; }
+
 private:
     NodeManager();
     ~NodeManager();
@@ -80,6 +123,7 @@ private:
 
     raft_mutex_t _mutex;
     std::set<butil::EndPoint> _addr_set;
+    SnapshotScheduler _snapshot_scheduler;
 };
 
 #define global_node_manager NodeManager::GetInstance()
@@ -182,6 +182,14 @@ void Node::apply(const Task& task) {
     _impl->apply(task);
 }
 
+void Node::apply(const Task* tasks, size_t n) {
+    _impl->apply(tasks, n);
+}
+
+void Node::wait_apply_admission(Closure* done) {
+    _impl->wait_apply_admission(done);
+}
+
 butil::Status Node::list_peers(std::vector<PeerId>* peers) {
     return _impl->list_peers(peers);
 }
@@ -206,6 +214,10 @@ void Node::snapshot(Closure* done) {
     _impl->snapshot(done);
 }
 
+void Node::ingest(const std::string& path, Closure* done) {
+    _impl->ingest(path, done);
+}
+
 butil::Status Node::vote(int election_timeout) {
     return _impl->vote(election_timeout);
 }
@@ -269,6 +281,31 @@ void Iterator::set_error_and_rollback(size_t ntail, const butil::Status* st) {
     return _impl->set_error_and_rollback(ntail, st);
 }
 
+// ------------- ApplyBatch
+size_t ApplyBatch::size() const { return _impl->batch_size(); }
+
+int64_t ApplyBatch::first_index() const { return _impl->batch_first_index(); }
+
+int64_t ApplyBatch::index(size_t i) const {
+    return _impl->batch_entry(i)->id.index;
+}
+
+int64_t ApplyBatch::term(size_t i) const {
+    return _impl->batch_entry(i)->id.term;
+}
+
+const butil::IOBuf& ApplyBatch::data(size_t i) const {
+    return _impl->batch_entry(i)->data;
+}
+
+Closure* ApplyBatch::done(size_t i) const {
+    return _impl->batch_done(i);
+}
+
+void ApplyBatch::set_error_and_rollback(size_t ntail, const butil::Status* st) {
+    return _impl->set_batch_error_and_rollback(ntail, st);
+}
+
 // ------------- Default Implementation of StateMachine
 StateMachine::~StateMachine() {}
 void StateMachine::on_shutdown() {}
@@ -291,6 +328,29 @@ int StateMachine::on_snapshot_load(SnapshotReader* reader) {
     return -1;
 }
 
+SnapshotStreamLoader* StateMachine::new_snapshot_stream_loader(
+        const SnapshotMeta& meta) {
+    (void)meta;
+    return NULL;
+}
+
+int StateMachine::on_ingest(const std::string& path,
+                            const std::vector<std::string>& /*files*/,
+                            int64_t index) {
+    LOG(ERROR) << butil::class_name_str(*this)
+               << " didn't implement on_ingest while the files in " << path
+               << " are committed at index=" << index;
+    return -1;
+}
+
+void StateMachine::on_apply_batch(ApplyBatch& batch) {
+    LOG(ERROR) << butil::class_name_str(*this)
+               << " didn't implement on_apply_batch while apply_in_batch is set";
+    butil::Status st(-1, "%s didn't implement on_apply_batch",
+                     butil::class_name_str(*this).c_str());
+    batch.set_error_and_rollback(batch.size(), &st);
+}
+
 void StateMachine::on_leader_start(int64_t) {}
 void StateMachine::on_leader_stop(const butil::Status&) {}
 void StateMachine::on_error(const Error& e) {
@@ -314,6 +374,53 @@ void StateMachine::on_configuration_committed(const Configuration& conf, int64_t
 void StateMachine::on_stop_following(const LeaderChangeContext&) {}
 void StateMachine::on_start_following(const LeaderChangeContext&) {}
 
+LogSizeSnapshotPolicy::LogSizeSnapshotPolicy()
+    : max_log_entries(0)
+    , max_log_bytes(0)
+    , max_replay_time_ms(0)
+    , min_log_entries(1)
+{}
+
+bool LogSizeSnapshotPolicy::should_snapshot(const SnapshotPolicyStats& stats,
+                                            std::string* reason) {
+    reason->clear();
+    if (stats.log_entries < std::max(min_log_entries, int64_t(1))) {
+        butil::string_printf(reason, "log_entries=%" PRId64
+                             " is less than min_log_entries=%" PRId64,
+                             stats.log_entries, min_log_entries);
+        return false;
+    }
+    if (max_log_entries > 0 && stats.log_entries >= max_log_entries) {
+        butil::string_printf(reason, "log_entries=%" PRId64
+                             " reaches max_log_entries=%" PRId64,
+                             stats.log_entries, max_log_entries);
+        return true;
+    }
+    if (max_log_bytes > 0 && stats.log_bytes >= max_log_bytes) {
+        butil::string_printf(reason, "log_bytes=%" PRId64
+                             " reaches max_log_bytes=%" PRId64,
+                             stats.log_bytes, max_log_bytes);
+        return true;
+    }
+    if (max_replay_time_ms > 0 && stats.replay_time_ms >= max_replay_time_ms) {
+        butil::string_printf(reason, "replay_time_ms=%" PRId64
+                             " reaches max_replay_time_ms=%" PRId64,
+                             stats.replay_time_ms, max_replay_time_ms);
+        return true;
+    }
+    if (stats.snapshot_interval_ms > 0
+            && stats.time_since_last_snapshot_ms >= stats.snapshot_interval_ms) {
+        butil::string_printf(reason, "snapshot_interval_ms=%" PRId64 " passed",
+                             stats.snapshot_interval_ms);
+        return true;
+    }
+    butil::string_printf(reason, "log_entries=%" PRId64 " log_bytes=%" PRId64
+                         " replay_time_ms=%" PRId64 " are within limits",
+                         stats.log_entries, stats.log_bytes,
+                         stats.replay_time_ms);
+    return false;
+}
+
 BootstrapOptions::BootstrapOptions()
     : last_log_index(0)
     , fsm(NULL)
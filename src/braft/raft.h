@@ -36,6 +36,10 @@ namespace brpc {
 class Server;
 }  // namespace brpc
 
+namespace bthread {
+class Executor;
+}  // namespace bthread
+
 namespace braft {
 
 class SnapshotWriter;
@@ -156,6 +160,8 @@ public:
     // If done() is non-NULL, you must call done()->Run() after applying this
     // task no matter this operation succeeds or fails, otherwise the
     // corresponding resources would leak.
+    // If NodeOptions::run_done_after_apply is set, don't run done(), which
+    // is run by the framework after this batch, with the status set here.
     //
     // If this task is proposed by this Node when it was the leader of this 
     // group and the leadership has not changed before this point, done() is 
@@ -187,6 +193,86 @@ friend class FSMCaller;
     IteratorImpl* _impl;
 };
 
+// A span of consecutive committed tasks, fetched from the log in one shot and
+// passed to StateMachine::on_apply_batch. Task |i| of the batch is at log
+// index first_index() + i.
+//
+// Example:
+// void YouStateMachine::on_apply_batch(braft::ApplyBatch& batch) {
+//     WriteBatch wb;
+//     for (size_t i = 0; i < batch.size(); ++i) {
+//         wb.put(batch.data(i));
+//     }
+//     if (!_db->write(wb)) {
+//         batch.set_error_and_rollback(batch.size());
+//         return;
+//     }
+//     for (size_t i = 0; i < batch.size(); ++i) {
+//         brpc::ClosureGuard done_guard(batch.done(i));
+//     }
+// }
+class ApplyBatch {
+    DISALLOW_COPY_AND_ASSIGN(ApplyBatch);
+public:
+    // Number of tasks in this batch, which is always positive
+    size_t size() const;
+
+    // Index of the first task in this batch
+    int64_t first_index() const;
+
+    // The same as Iterator::index(), Iterator::term(), Iterator::data() and
+    // Iterator::done() of the |i|-th task in this batch
+    int64_t index(size_t i) const;
+    int64_t term(size_t i) const;
+    const butil::IOBuf& data(size_t i) const;
+    Closure* done(size_t i) const;
+
+    // Invoked when some critical error occurred. The last |ntail| tasks of
+    // this batch are considered as not applied, and the closures of them
+    // would be called with the error by the framework. The closures of the
+    // other tasks are still in your charge, unless
+    // NodeOptions::run_done_after_apply is set, in which case they are run
+    // by the framework as well. The following behavior is the same as
+    // Iterator::set_error_and_rollback.
+    void set_error_and_rollback(size_t ntail = 1, const butil::Status* st = NULL);
+
+private:
+friend class FSMCaller;
+    ApplyBatch(IteratorImpl* impl) : _impl(impl) {}
+    ~ApplyBatch() {}
+
+    // The ownership of _impl belongs to FSMCaller;
+    IteratorImpl* _impl;
+};
+
+// Consumes the files of a snapshot installed from the leader while they're
+// being downloaded, so that the state machine doesn't have to read them back
+// from the disk. The pieces of a file are passed in order and the ones of
+// different files may be passed concurrently. A piece at offset 0 starts the
+// file over. Not every file is passed: the ones reused from the local
+// snapshot, resumed from a former download or copied by the changed blocks
+// are never passed, and a file stops being passed if its data arrives out of
+// order. The files which are not ended with on_file_end have to be read from
+// the reader of on_load.
+class SnapshotStreamLoader {
+public:
+    virtual ~SnapshotStreamLoader() {}
+
+    // Consume a piece of |filename| starting at |offset|
+    // Returns 0 on success, otherwise the installing is aborted
+    virtual int on_file_data(const std::string& filename, int64_t offset,
+                             const butil::IOBuf& data) = 0;
+
+    // All the data of |filename| has been passed
+    virtual void on_file_end(const std::string& filename) = 0;
+
+    // Called in place of StateMachine::on_snapshot_load after the snapshot is
+    // downloaded, in the same way. The loader is destroyed after that, or
+    // without being called if the installing is aborted
+    // success return 0, fail return errno
+    virtual int on_load(::braft::SnapshotReader* reader) = 0;
+};
+
 // |StateMachine| is the sink of all the events of a very raft node.
 // Implement a specific StateMachine for your own business logic.
 //
@@ -210,12 +296,28 @@ public:
     // and report a error whose type is ERROR_TYPE_STATE_MACHINE.
     virtual void on_apply(::braft::Iterator& iter) = 0;
 
+    // Update the StateMachine with a batch of consecutive tasks.
+    //
+    // Invoked instead of on_apply when NodeOptions::apply_in_batch is true.
+    // Each call receives up to |raft_fsm_apply_batch_size| tasks which are
+    // read from the log in a bulk operation, so that the implementation is
+    // able to apply them with a single write to the backing storage.
+    //
+    // Once this function returns to the caller, we will regard all the tasks
+    // in |batch| as successfully applied unless set_error_and_rollback was
+    // called.
+    // Default: Rollback the whole batch and report ERROR_TYPE_STATE_MACHINE.
+    virtual void on_apply_batch(::braft::ApplyBatch& batch);
+
     // Invoked once when the raft node was shut down.
     // Default do nothing
     virtual void on_shutdown();
 
     // user defined snapshot generate function, this method will block on_apply.
     // user can make snapshot async when fsm can be cow(copy-on-write).
+    // e.g. take a consistent iterator of the state, write it through
+    // writer->open_stream in a background bthread and return, so that on_apply
+    // goes on while the snapshot is being written.
     // call done->Run() when snapshot finished.
     // success return 0, fail return errno
     // Default: Save nothing and returns error.
@@ -228,6 +330,27 @@ public:
     // Default: Load nothing and returns error.
     virtual int on_snapshot_load(::braft::SnapshotReader* reader);
 
+    // Create a loader to consume the snapshot described by |meta| while it's
+    // being installed from the leader. It's called out of the thread calling
+    // the other methods, so the loader must not touch the current state
+    // until on_load.
+    // Default: NULL, the snapshot is loaded by on_snapshot_load
+    virtual SnapshotStreamLoader* new_snapshot_stream_loader(
+            const ::braft::SnapshotMeta& meta);
+
+    // Ingest the pre-built |files| in the directory |path| at once, which
+    // were passed to Node::ingest on the leader and committed as the log at
+    // |index|. |path| is a private directory in the snapshot storage on every
+    // peer, which is served to the other peers and kept until a snapshot
+    // covers |index|, so link or copy the files to keep instead of referring
+    // to them, and never move or change them.
+    // Returns 0 on success, the node reports ERROR_TYPE_STATE_MACHINE
+    // otherwise.
+    // Default: Ingest nothing and returns error.
+    virtual int on_ingest(const std::string& path,
+                          const std::vector<std::string>& files,
+                          int64_t index);
+
     // Invoked when the belonging node becomes the leader of the group at |term|
     // Default: Do nothing
     virtual void on_leader_start(int64_t term);
@@ -380,6 +503,7 @@ struct NodeStatus {
         : state(STATE_END), readonly(false), term(0), committed_index(0), known_applied_index(0)
         , pending_index(0), pending_queue_size(0), applying_index(0), first_index(0)
         , last_index(-1), disk_index(0)
+        , inflight_apply_tasks(0), inflight_apply_bytes(0)
     {}
 
     State state;
@@ -422,6 +546,11 @@ struct NodeStatus {
     // The max log in disk.
     int64_t disk_index;
 
+    // Number and total size of the tasks accepted by apply() but not applied
+    // yet, which are bounded by admission control.
+    int64_t inflight_apply_tasks;
+    int64_t inflight_apply_bytes;
+
     // Stable followers are peers in current configuration.
     // If the node is not leader, this map is empty.
     PeerStatusMap stable_followers;
@@ -474,6 +603,62 @@ struct LeaderLeaseStatus {
     int64_t lease_epoch;
 };
 
+// What a SnapshotPolicy decides on
+struct SnapshotPolicyStats {
+    SnapshotPolicyStats()
+        : last_snapshot_index(0), last_applied_index(0), log_entries(0)
+        , log_bytes(0), replay_time_ms(0), time_since_last_snapshot_ms(0)
+        , snapshot_interval_ms(0)
+    {}
+    int64_t last_snapshot_index;
+    int64_t last_applied_index;
+    // Number of the entries applied after the last snapshot, which are to be
+    // replayed on restart
+    int64_t log_entries;
+    // Bytes of the entries appended after the last snapshot. It only counts
+    // the entries appended since the node started.
+    int64_t log_bytes;
+    // Estimated time to replay |log_entries|, from the average time the
+    // StateMachine has taken to apply an entry
+    int64_t replay_time_ms;
+    int64_t time_since_last_snapshot_ms;
+    // |snapshot_interval_s| of NodeOptions in milliseconds, <= 0 if disabled
+    int64_t snapshot_interval_ms;
+};
+
+// Decides when a node saves snapshots. It's checked every
+// raft_snapshot_policy_check_interval_ms in place of saving a snapshot every
+// |snapshot_interval_s| of NodeOptions.
+class SnapshotPolicy {
+public:
+    virtual ~SnapshotPolicy() {}
+
+    // Returns true to save a snapshot now. |reason| explains the decision,
+    // which is shown by Node::describe.
+    virtual bool should_snapshot(const SnapshotPolicyStats& stats,
+                                 std::string* reason) = 0;
+};
+
+// Save a snapshot once the log after the last snapshot reaches any of the
+// limits below, or |snapshot_interval_s| has passed, unless fewer than
+// |min_log_entries| entries would be compacted.
+class LogSizeSnapshotPolicy : public SnapshotPolicy {
+public:
+    LogSizeSnapshotPolicy();
+    virtual bool should_snapshot(const SnapshotPolicyStats& stats,
+                                 std::string* reason);
+
+    // Limits of the log after the last snapshot, <= 0 means no limit
+    // Default: 0
+    int64_t max_log_entries;
+    int64_t max_log_bytes;
+    int64_t max_replay_time_ms;
+
+    // Snapshots compacting fewer entries aren't worth the IO
+    // Default: 1
+    int64_t min_log_entries;
+};
+
 struct NodeOptions {
     // A follower would become a candidate if it doesn't receive any message 
     // from the leader in |election_timeout_ms| milliseconds
@@ -496,6 +681,12 @@ struct NodeOptions {
     // Default: 3600 (1 hour)
     int snapshot_interval_s;
 
+    // If set, it decides when to save snapshots instead of
+    // |snapshot_interval_s| alone, see SnapshotPolicy.
+    // It's not owned by the node and must outlive it.
+    // Default: NULL
+    SnapshotPolicy* snapshot_policy;
+
     // We will regard a adding peer as caught up if the margin between the
     // last_log_index of this peer and the last_log_index of leader is less than
     // |catchup_margin|
@@ -516,6 +707,36 @@ struct NodeOptions {
     // Default: false
     bool usercode_in_pthread;
 
+    // Pass committed tasks to StateMachine::on_apply_batch rather than
+    // StateMachine::on_apply
+    //
+    // Default: false
+    bool apply_in_batch;
+
+    // The StateMachine doesn't run done() of the tasks it applies, which are
+    // run together in a background bthread (pthread if usercode_in_pthread
+    // is set) after each batch is applied, with the status the StateMachine
+    // set on them. This takes the completion work (e.g. responding to
+    // clients) off the apply thread.
+    // The closures of a batch are run in the order of their logs, but those
+    // of different batches run in different bthreads and may complete out
+    // of order, i.e. a closure may run before the ones of the earlier
+    // batches. Don't rely on the order of done() across tasks.
+    // NOTE: the StateMachine must neither run nor delete done() with this
+    // option, and is still in charge of the closures of the other callbacks.
+    //
+    // Default: false
+    bool run_done_after_apply;
+
+    // Run the StateMachine callbacks in |fsm_executor| rather than in
+    // bthreads, which isolates them from the bthread workers serving RPCs.
+    // If it's NULL, the pool shared by all the nodes is used when
+    // raft_fsm_executor_threads is positive (see braft/fsm_executor.h).
+    // The executor is not owned by the node and must outlive it.
+    //
+    // Default: NULL
+    bthread::Executor* fsm_executor;
+
     // The specific StateMachine implemented your business logic, which must be
     // a valid instance.
     StateMachine* fsm;
@@ -599,8 +820,12 @@ inline NodeOptions::NodeOptions()
     , catchup_timeout_ms(0)
     , max_clock_drift_ms(1000)
     , snapshot_interval_s(3600)
+    , snapshot_policy(NULL)
     , catchup_margin(1000)
     , usercode_in_pthread(false)
+    , apply_in_batch(false)
+    , run_done_after_apply(false)
+    , fsm_executor(NULL)
     , fsm(NULL)
     , node_owns_fsm(false)
     , log_storage(NULL)
@@ -666,6 +891,26 @@ public:
     //
     void apply(const Task& task);
 
+    // [Thread-safe and wait-free]
+    // apply a batch of |n| tasks to the replicated-state-machine in one shot.
+    // The tasks are enqueued atomically and appended to the log as a whole,
+    // so they are never interleaved with tasks from other callers.
+    //
+    // The ownership of |tasks[i].data| and |tasks[i].done| is the same as
+    // apply(const Task&), and |expected_term| is checked for each task
+    // individually.
+    void apply(const Task* tasks, size_t n);
+
+    // Run |done| once this node is able to accept new tasks again.
+    //
+    // If admission control is enabled (see raft_max_inflight_apply_tasks and
+    // the related flags), apply() fails fast with EBUSY when the tasks which
+    // are accepted but not applied yet exceed the limits, and the content of
+    // |task.data| is left to the caller. Callers are supposed to wait on this
+    // method before retrying instead of spinning.
+    // done->status() would be EPERM if the node is shut down meanwhile.
+    void wait_apply_admission(Closure* done);
+
     // list peers of this raft group, only leader retruns ok
     // [NOTE] when list_peers concurrency with add_peer/remove_peer, maybe return peers is staled.
     // because add_peer/remove_peer immediately modify configuration in memory
@@ -697,6 +942,22 @@ public:
     // when the snapshot finishes, describing the detailed result.
     void snapshot(Closure* done);
 
+    // Ingest the files in the directory |path| into the state machines of the
+    // whole group through StateMachine::on_ingest, e.g. SST files built
+    // offline, instead of applying the data log by log. The files are linked
+    // into the snapshot storage of this node, or copied if they're on another
+    // file system, and the committed log only refers to them. The log is
+    // then applied like a Task, after the ones applied before. The peers copy
+    // the files from each other once the log is appended and keep them until
+    // a later snapshot truncates it, so |path| may be removed as soon as this
+    // returns, but don't change the linked files in place.
+    // done->Run() would be invoked when this node has ingested the files.
+    // NOTE: This node must be the leader and the snapshot storage of the
+    // peers must be local. This method blocks until the files are linked,
+    // which copies all of them on the calling thread if they're on another
+    // file system, so call it where blocking is fine in that case.
+    void ingest(const std::string& path, Closure* done);
+
     // user trigger vote
     // reset election_timeout, suggest some peer to become the leader in a
     // higher probability
@@ -26,7 +26,9 @@
 #include <bthread/bthread.h>
 #include <brpc/controller.h>
 #include "braft/util.h"
+#include "braft/raft.h"
 #include "braft/snapshot.h"
+#include "braft/file_reader.h"
 
 namespace braft {
 
@@ -41,6 +43,17 @@ DEFINE_bool(raft_enable_throttle_when_install_snapshot, true,
             "enable throttle when install snapshot, for both leader and follower");
 BRPC_VALIDATE_GFLAG(raft_enable_throttle_when_install_snapshot,
                     ::brpc::PassValidate);
+DEFINE_int32(raft_max_inflight_chunks_per_file, 1,
+             "Max number of GetFile RPCs in flight while copying a file, each"
+             " of which fetches at most raft_max_byte_count_per_rpc bytes."
+             " Set it to 1 if any peer doesn't support out-of-order reads");
+BRPC_VALIDATE_GFLAG(raft_max_inflight_chunks_per_file, brpc::PositiveInteger);
+DEFINE_int32(raft_file_transfer_compress_type, FILE_COMPRESS_NONE,
+             "The codec which the remote peer may compress file data with,"
+             " 0: none, 1: snappy, 2: zlib. Peers not supporting it always"
+             " send data uncompressed");
+BRPC_VALIDATE_GFLAG(raft_file_transfer_compress_type,
+                    brpc::NonNegativeInteger);
 
 RemoteFileCopier::RemoteFileCopier()
     : _reader_id(0)
@@ -69,6 +82,7 @@ int RemoteFileCopier::init(const std::string& uri, FileSystemAdaptor* fs,
         LOG(ERROR) << "Fail to init Channel to " << ip_and_port;
         return -1;
     }
+    _remote_addr = ip_and_port.as_string();
     _fs = fs;
     _throttle = throttle;
     return 0;
@@ -128,7 +142,8 @@ scoped_refptr<RemoteFileCopier::Session>
 RemoteFileCopier::start_to_copy_to_file(
                       const std::string& source,
                       const std::string& dest_path,
-                      const CopyOptions* options) {
+                      const CopyOptions* options,
+                      SnapshotStreamLoader* loader) {
     butil::File::Error e;
     FileAdaptor* file = _fs->open(dest_path, O_TRUNC | O_WRONLY | O_CREAT | O_CLOEXEC, NULL, &e);
     
@@ -141,8 +156,8 @@ RemoteFileCopier::start_to_copy_to_file(
     scoped_refptr<Session> session(new Session());
     session->_dest_path = dest_path;
     session->_file = file;
-    session->_request.set_filename(source);
-    session->_request.set_reader_id(_reader_id);
+    session->_source = source;
+    session->_reader_id = _reader_id;
     session->_channel = &_channel;
     if (options) {
         session->_options = *options;
@@ -151,7 +166,72 @@ RemoteFileCopier::start_to_copy_to_file(
     if (_throttle) {
         session->_throttle = _throttle;
     }
-    session->send_next_rpc();
+    session->_loader = loader;
+    // Data is passed to |loader| in order
+    session->start(loader ? 1 : FLAGS_raft_max_inflight_chunks_per_file);
+    return session;
+}
+
+scoped_refptr<RemoteFileCopier::Session> 
+RemoteFileCopier::resume_copying_to_file(
+                      const std::string& source,
+                      const std::string& dest_path,
+                      int64_t offset,
+                      const CopyOptions* options) {
+    butil::File::Error e;
+    FileAdaptor* file = _fs->open(dest_path, O_WRONLY | O_CREAT | O_CLOEXEC, NULL, &e);
+    if (!file) {
+        LOG(ERROR) << "Fail to open " << dest_path 
+                   << ", " << butil::File::ErrorToString(e);
+        return NULL;
+    }
+
+    scoped_refptr<Session> session(new Session());
+    session->_dest_path = dest_path;
+    session->_file = file;
+    session->_source = source;
+    session->_reader_id = _reader_id;
+    session->_channel = &_channel;
+    session->_next_offset = offset;
+    if (options) {
+        session->_options = *options;
+    }
+    if (_throttle) {
+        session->_throttle = _throttle;
+    }
+    session->start(FLAGS_raft_max_inflight_chunks_per_file);
+    return session;
+}
+
+scoped_refptr<RemoteFileCopier::Session> 
+RemoteFileCopier::start_to_copy_ranges_to_file(
+                      const std::string& source,
+                      const std::string& dest_path,
+                      const std::vector<std::pair<int64_t, int64_t> >& ranges,
+                      const CopyOptions* options) {
+    butil::File::Error e;
+    FileAdaptor* file = _fs->open(dest_path, O_WRONLY | O_CREAT | O_CLOEXEC, NULL, &e);
+    if (!file) {
+        LOG(ERROR) << "Fail to open " << dest_path 
+                   << ", " << butil::File::ErrorToString(e);
+        return NULL;
+    }
+
+    scoped_refptr<Session> session(new Session());
+    session->_dest_path = dest_path;
+    session->_file = file;
+    session->_source = source;
+    session->_reader_id = _reader_id;
+    session->_channel = &_channel;
+    session->_copy_ranges = true;
+    session->_ranges.assign(ranges.begin(), ranges.end());
+    if (options) {
+        session->_options = *options;
+    }
+    if (_throttle) {
+        session->_throttle = _throttle;
+    }
+    session->start(FLAGS_raft_max_inflight_chunks_per_file);
     return session;
 }
 
@@ -164,28 +244,43 @@ RemoteFileCopier::start_to_copy_to_iobuf(
     scoped_refptr<Session> session(new Session());
     session->_file = NULL;
     session->_buf = dest_buf;
-    session->_request.set_filename(source);
-    session->_request.set_reader_id(_reader_id);
+    session->_source = source;
+    session->_reader_id = _reader_id;
     session->_channel = &_channel;
     if (options) {
         session->_options = *options;
     }
-    session->send_next_rpc();
+    // Data is appended to |dest_buf| in order
+    session->start(1);
     return session;
 }
 
+RemoteFileCopier::Session::Chunk::Chunk()
+    : owner(NULL)
+    , offset(0)
+    , end_offset(0)
+    , retry_times(0)
+    , timer()
+    , rpc_call()
+    , throttle_token_acquire_time_us(1)
+{
+    done.chunk = this;
+}
+
 RemoteFileCopier::Session::Session() 
     : _channel(NULL)
+    , _reader_id(0)
     , _file(NULL)
-    , _retry_times(0)
     , _finished(false)
     , _buf(NULL)
-    , _timer()
+    , _next_offset(0)
+    , _eof_offset(INT64_MAX)
+    , _nactive_chunks(0)
+    , _copy_ranges(false)
+    , _loader(NULL)
+    , _loader_offset(0)
     , _throttle(NULL)
-    , _throttle_token_acquire_time_us(1)
-{
-    _done.owner = this;
-}
+{}
 
 RemoteFileCopier::Session::~Session() {
     if (_file) {
@@ -193,54 +288,114 @@ RemoteFileCopier::Session::~Session() {
         delete _file;
         _file = NULL;
     }
+    for (size_t i = 0; i < _chunks.size(); ++i) {
+        delete _chunks[i];
+    }
 }
 
-void RemoteFileCopier::Session::send_next_rpc() {
-    _cntl.Reset();
-    _response.Clear();
-    // Not clear request as we need some fields of the previous RPC
-    off_t offset = _request.offset() + _request.count();
-    const size_t max_count = 
-            (!_buf) ? FLAGS_raft_max_byte_count_per_rpc : UINT_MAX;
-    _cntl.set_timeout_ms(_options.timeout_ms);
-    _request.set_offset(offset);
-    // Read partly when throttled
-    _request.set_read_partly(FLAGS_raft_allow_read_partly_when_install_snapshot);
+void RemoteFileCopier::Session::start(int max_inflight_chunks) {
+    std::unique_lock<raft_mutex_t> lck(_mutex);
+    for (int i = 0; i < max_inflight_chunks; ++i) {
+        Chunk* chunk = new Chunk;
+        chunk->owner = this;
+        if (!assign_next_range(chunk)) {
+            delete chunk;
+            break;
+        }
+        _chunks.push_back(chunk);
+        ++_nactive_chunks;
+    }
+    if (_nactive_chunks == 0) {
+        // Nothing to copy
+        return on_finished();
+    }
+    lck.unlock();
+    // |_chunks| is not changed since here
+    for (size_t i = 0; i < _chunks.size(); ++i) {
+        send_next_rpc(_chunks[i]);
+    }
+}
+
+bool RemoteFileCopier::Session::assign_next_range(Chunk* chunk) {
+    if (_copy_ranges) {
+        if (_ranges.empty()) {
+            return false;
+        }
+        std::pair<int64_t, int64_t>& range = _ranges.front();
+        chunk->offset = range.first;
+        chunk->end_offset = std::min(range.second,
+                range.first + FLAGS_raft_max_byte_count_per_rpc);
+        chunk->retry_times = 0;
+        range.first = chunk->end_offset;
+        if (range.first >= range.second) {
+            _ranges.pop_front();
+        }
+        return true;
+    }
+    if (_next_offset >= _eof_offset) {
+        return false;
+    }
+    chunk->offset = _next_offset;
+    chunk->end_offset = (!_buf)
+            ? _next_offset + FLAGS_raft_max_byte_count_per_rpc : INT64_MAX;
+    chunk->retry_times = 0;
+    _next_offset = chunk->end_offset;
+    return true;
+}
+
+void RemoteFileCopier::Session::send_next_rpc(Chunk* chunk) {
+    chunk->cntl.Reset();
+    chunk->response.Clear();
     std::unique_lock<raft_mutex_t> lck(_mutex);
     if (_finished) {
         return;
     }
+    const size_t max_count = (!_buf)
+            ? (size_t)(chunk->end_offset - chunk->offset) : UINT_MAX;
+    chunk->cntl.set_timeout_ms(_options.timeout_ms);
+    chunk->request.set_reader_id(_reader_id);
+    chunk->request.set_filename(_source);
+    chunk->request.set_offset(chunk->offset);
+    // Read partly when throttled
+    chunk->request.set_read_partly(
+            FLAGS_raft_allow_read_partly_when_install_snapshot);
+    if (FileCompressType_IsValid(FLAGS_raft_file_transfer_compress_type)) {
+        chunk->request.set_compress_type(
+                (FileCompressType)FLAGS_raft_file_transfer_compress_type);
+    }
     // throttle
     size_t new_max_count = max_count;
     if (_throttle && FLAGS_raft_enable_throttle_when_install_snapshot) {
-        _throttle_token_acquire_time_us = butil::cpuwide_time_us();
+        chunk->throttle_token_acquire_time_us = butil::cpuwide_time_us();
         new_max_count = _throttle->throttled_by_throughput(max_count);
         if (new_max_count == 0) {
-            // Reset count to make next rpc retry the previous one
             BRAFT_VLOG << "Copy file throttled, path: " << _dest_path;
-            _request.set_count(0);
-            AddRef();
-            int64_t retry_interval_ms_when_throttled = 
-                                    _throttle->get_retry_interval_ms();
-            if (bthread_timer_add(
-                    &_timer, 
-                    butil::milliseconds_from_now(retry_interval_ms_when_throttled),
-                    on_timer, this) != 0) {
-                lck.unlock();
-                LOG(ERROR) << "Fail to add timer";
-                return on_timer(this);
-            }
-            return;
+            return retry_later(chunk, _throttle->get_retry_interval_ms(), lck);
         }
     }
-    _request.set_count(new_max_count);
-    _rpc_call = _cntl.call_id();
+    chunk->request.set_count(new_max_count);
+    chunk->rpc_call = chunk->cntl.call_id();
     FileService_Stub stub(_channel);
     AddRef();  // Release in on_rpc_returned
-    return stub.get_file(&_cntl, &_request, &_response, &_done);
+    return stub.get_file(&chunk->cntl, &chunk->request, &chunk->response,
+                         &chunk->done);
+}
+
+void RemoteFileCopier::Session::retry_later(
+        Chunk* chunk, int64_t retry_interval_ms,
+        std::unique_lock<raft_mutex_t>& lck) {
+    AddRef();
+    if (bthread_timer_add(
+                &chunk->timer, 
+                butil::milliseconds_from_now(retry_interval_ms),
+                on_timer, chunk) != 0) {
+        lck.unlock();
+        LOG(ERROR) << "Fail to add timer";
+        return on_timer(chunk);
+    }
 }
 
-void RemoteFileCopier::Session::on_rpc_returned() {
+void RemoteFileCopier::Session::on_rpc_returned(Chunk* chunk) {
     scoped_refptr<Session> ref_gurad;
     Session* this_ref = this;
     ref_gurad.swap(&this_ref);
@@ -248,59 +403,60 @@ void RemoteFileCopier::Session::on_rpc_returned() {
     if (_finished) {
         return;
     }
-    if (_cntl.Failed()) {
-        // Reset count to make next rpc retry the previous one
-        int64_t request_count = _request.count();
-        _request.set_count(0);
-        if (_cntl.ErrorCode() == ECANCELED) {
-            if (_st.ok()) {
-                _st.set_error(_cntl.ErrorCode(), _cntl.ErrorText());
-                return on_finished();
-            }
+    brpc::Controller& cntl = chunk->cntl;
+    if (cntl.Failed()) {
+        if (cntl.ErrorCode() == ECANCELED) {
+            _st.set_error(cntl.ErrorCode(), cntl.ErrorText());
+            return on_finished();
         }
-        // Throttled reading failure does not increase _retry_times
-        if (_cntl.ErrorCode() != EAGAIN && _retry_times++ >= _options.max_retry) {
-            if (_st.ok()) {
-                _st.set_error(_cntl.ErrorCode(), _cntl.ErrorText());
-                return on_finished();
-            }
+        // Throttled reading failure does not increase retry_times
+        if (cntl.ErrorCode() != EAGAIN
+                && chunk->retry_times++ >= _options.max_retry) {
+            _st.set_error(cntl.ErrorCode(), cntl.ErrorText());
+            return on_finished();
         }
         // set retry time interval
         int64_t retry_interval_ms = _options.retry_interval_ms; 
-        if (_cntl.ErrorCode() == EAGAIN && _throttle) {
+        if (cntl.ErrorCode() == EAGAIN && _throttle) {
             retry_interval_ms = _throttle->get_retry_interval_ms();
             // No token consumed, just return back, other nodes maybe able to use them
             if (FLAGS_raft_enable_throttle_when_install_snapshot) {
                 _throttle->return_unused_throughput(
-                        request_count, 0,
-                        butil::cpuwide_time_us() - _throttle_token_acquire_time_us);
+                        chunk->request.count(), 0,
+                        butil::cpuwide_time_us()
+                            - chunk->throttle_token_acquire_time_us);
             }
         }
-        AddRef();
-        if (bthread_timer_add(
-                    &_timer, 
-                    butil::milliseconds_from_now(retry_interval_ms),
-                    on_timer, this) != 0) {
-            lck.unlock();
-            LOG(ERROR) << "Fail to add timer";
-            return on_timer(this);
-        }
-        return;
+        return retry_later(chunk, retry_interval_ms, lck);
     }
     if (_throttle && FLAGS_raft_enable_throttle_when_install_snapshot &&
-        _request.count() > (int64_t)_cntl.response_attachment().size()) {
+        chunk->request.count() > (int64_t)cntl.response_attachment().size()) {
         _throttle->return_unused_throughput(
-                _request.count(), _cntl.response_attachment().size(),
-                butil::cpuwide_time_us() - _throttle_token_acquire_time_us);
+                chunk->request.count(), cntl.response_attachment().size(),
+                butil::cpuwide_time_us() - chunk->throttle_token_acquire_time_us);
+    }
+    // The throttle is charged with bytes on the wire, i.e. compressed
+    if (chunk->response.compress_type() != FILE_COMPRESS_NONE) {
+        butil::IOBuf decompressed;
+        if (!decompress_file_data(chunk->response.compress_type(),
+                                  cntl.response_attachment(), &decompressed)) {
+            LOG(WARNING) << "Fail to decompress data of " << _source
+                         << " with type=" << chunk->response.compress_type();
+            _st.set_error(EIO, "Fail to decompress file data");
+            return on_finished();
+        }
+        cntl.response_attachment().swap(decompressed);
     }
-    _retry_times = 0;
-    // Reset count to |real_read_size| to make next rpc get the right offset
-    if (_response.has_read_size() && (_response.read_size() != 0)
+    chunk->retry_times = 0;
+    // The real read size, the rest of the range is requested again
+    int64_t read_size = chunk->request.count();
+    if (chunk->response.has_read_size() && (chunk->response.read_size() != 0)
             && FLAGS_raft_allow_read_partly_when_install_snapshot) {
-        _request.set_count(_response.read_size());
+        read_size = chunk->response.read_size();
     }
     if (_file) {
-        FileSegData data(_cntl.response_attachment());
+        // Ranges of the file are written at their offsets in any order
+        FileSegData data(cntl.response_attachment());
         uint64_t seg_offset = 0;
         butil::IOBuf seg_data;
         while (0 != data.next(&seg_offset, &seg_data)) {
@@ -310,10 +466,26 @@ void RemoteFileCopier::Session::on_rpc_returned() {
                 _st.set_error(EIO, "%s", berror(EIO));
                 return on_finished();
             }
+            if (_loader && (int64_t)seg_offset != _loader_offset) {
+                // The loader reads the whole file from the snapshot instead
+                LOG(WARNING) << "Stop passing " << _source << " to the snapshot"
+                                " loader, got data at offset=" << seg_offset
+                             << " while expecting offset=" << _loader_offset;
+                _loader = NULL;
+            }
+            if (_loader) {
+                if (_loader->on_file_data(_source, seg_offset, seg_data) != 0) {
+                    LOG(WARNING) << "Fail to pass " << _source
+                                 << " to the snapshot loader";
+                    _st.set_error(EINVAL, "Snapshot loader failed");
+                    return on_finished();
+                }
+                _loader_offset += seg_data.size();
+            }
             seg_data.clear();
         }
     } else {
-        FileSegData data(_cntl.response_attachment());
+        FileSegData data(cntl.response_attachment());
         uint64_t seg_offset = 0;
         butil::IOBuf seg_data;
         while (0 != data.next(&seg_offset, &seg_data)) {
@@ -322,17 +494,49 @@ void RemoteFileCopier::Session::on_rpc_returned() {
             _buf->append(seg_data);
         }
     }
-    if (_response.eof()) {
-        on_finished();
-        return;
+    if (chunk->response.eof()) {
+        const int64_t file_size = chunk->offset + 
+                (chunk->response.has_read_size()
+                    ? chunk->response.read_size() : read_size);
+        _eof_offset = std::min(_eof_offset, file_size);
+        if (_copy_ranges && file_size < chunk->end_offset) {
+            LOG(WARNING) << "File " << _source << " is shorter than expected,"
+                            " size=" << file_size
+                         << " expected_end=" << chunk->end_offset;
+            _st.set_error(EIO, "File is shorter than expected");
+            return on_finished();
+        }
+        // The data of the last chunk is copied as well, which counts in
+        // copied_size() and the point to resume from
+        chunk->offset = file_size;
+        return on_chunk_done(chunk, lck);
+    }
+    chunk->offset += read_size;
+    if (chunk->offset >= chunk->end_offset || chunk->offset >= _eof_offset) {
+        return on_chunk_done(chunk, lck);
     }
     lck.unlock();
-    return send_next_rpc();
+    return send_next_rpc(chunk);
+}
+
+void RemoteFileCopier::Session::on_chunk_done(
+        Chunk* chunk, std::unique_lock<raft_mutex_t>& lck) {
+    if (assign_next_range(chunk)) {
+        lck.unlock();
+        return send_next_rpc(chunk);
+    }
+    if (--_nactive_chunks == 0) {
+        if (_loader) {
+            _loader->on_file_end(_source);
+        }
+        on_finished();
+    }
 }
 
 void* RemoteFileCopier::Session::send_next_rpc_on_timedout(void* arg) {
-    Session* m = (Session*)arg;
-    m->send_next_rpc();
+    Chunk* chunk = (Chunk*)arg;
+    Session* m = chunk->owner;
+    m->send_next_rpc(chunk);
     m->Release();
     return NULL;
 }
@@ -346,8 +550,22 @@ void RemoteFileCopier::Session::on_timer(void* arg) {
     }
 }
 
+void RemoteFileCopier::Session::cancel_chunks() {
+    for (size_t i = 0; i < _chunks.size(); ++i) {
+        brpc::StartCancel(_chunks[i]->rpc_call);
+        if (bthread_timer_del(_chunks[i]->timer) == 0) {
+            // Release reference of the timer task
+            Release();
+        }
+    }
+}
+
 void RemoteFileCopier::Session::on_finished() {
     if (!_finished) {
+        if (!_st.ok()) {
+            // Stop the other chunks in flight
+            cancel_chunks();
+        }
         if (_file) {
             if (!_file->sync() || !_file->close()) {
                 _st.set_error(EIO, "%s", berror(EIO));
@@ -365,17 +583,28 @@ void RemoteFileCopier::Session::cancel() {
     if (_finished) {
         return; 
     }
-    brpc::StartCancel(_rpc_call);
-    if (bthread_timer_del(_timer) == 0) {
-        // Release reference of the timer task
-        Release();
-    }
     if (_st.ok()) {
         _st.set_error(ECANCELED, "%s", berror(ECANCELED));
     }
     on_finished();
 }
 
+int64_t RemoteFileCopier::Session::copied_size() {
+    BAIDU_SCOPED_LOCK(_mutex);
+    if (_copy_ranges || _buf) {
+        return 0;
+    }
+    // Ranges are assigned in order, so everything before the first byte not
+    // written by the unfinished chunks has been written
+    int64_t size = std::min(_next_offset, _eof_offset);
+    for (size_t i = 0; i < _chunks.size(); ++i) {
+        if (_chunks[i]->offset < _chunks[i]->end_offset) {
+            size = std::min(size, _chunks[i]->offset);
+        }
+    }
+    return size;
+}
+
 void RemoteFileCopier::Session::join() {
     _finish_event.wait();
 }
@@ -19,6 +19,8 @@
 #ifndef  BRAFT_REMOTE_FILE_COPIER_H
 #define  BRAFT_REMOTE_FILE_COPIER_H
 
+#include <deque>
+#include <vector>
 #include <brpc/channel.h>
 #include <bthread/countdown_event.h>
 #include "braft/file_service.pb.h"
@@ -45,10 +47,15 @@ inline CopyOptions::CopyOptions()
 class FileAdaptor;
 class FileSystemAdaptor;
 class LocalSnapshotWriter;
+class SnapshotStreamLoader;
 
 class RemoteFileCopier {
 public:
-    // Stands for a copying session
+    // Stands for a copying session.
+    // A session copying to a file keeps up to raft_max_inflight_chunks_per_file
+    // GetFile RPCs in flight, each of which fetches a range of the file and
+    // writes it at its offset. A session copying to an IOBuf fetches the file
+    // in order with a single RPC at a time.
     class Session : public butil::RefCountedThreadSafe<Session> {
     public:
         Session();
@@ -59,18 +66,42 @@ public:
         void join();
 
         const butil::Status& status() const { return _st; }
+        // Size of the prefix of the file which has been written completely,
+        // stable once the session is finished
+        int64_t copied_size();
     private:
     friend class RemoteFileCopier;
-    friend class Closure;
-        struct Closure : google::protobuf::Closure {
-            void Run() {
-                owner->on_rpc_returned();
-            }
+        // A range of the file fetched by one RPC at a time, the remaining part
+        // is requested again if the server reads it partly
+        struct Chunk {
+            struct Done : google::protobuf::Closure {
+                void Run() {
+                    chunk->owner->on_rpc_returned(chunk);
+                }
+                Chunk* chunk;
+            };
+            Chunk();
             Session* owner;
+            int64_t offset;
+            int64_t end_offset;
+            int retry_times;
+            bthread_timer_t timer;
+            brpc::CallId rpc_call;
+            int64_t throttle_token_acquire_time_us;
+            Done done;
+            brpc::Controller cntl;
+            GetFileRequest request;
+            GetFileResponse response;
         };
-        void on_rpc_returned();
-        void send_next_rpc();
+        void start(int max_inflight_chunks);
+        bool assign_next_range(Chunk* chunk);
+        void on_rpc_returned(Chunk* chunk);
+        void send_next_rpc(Chunk* chunk);
+        void retry_later(Chunk* chunk, int64_t retry_interval_ms,
+                         std::unique_lock<raft_mutex_t>& lck);
+        void on_chunk_done(Chunk* chunk, std::unique_lock<raft_mutex_t>& lck);
         void on_finished();
+        void cancel_chunks();
         static void on_timer(void* arg);
         static void* send_next_rpc_on_timedout(void* arg);
 
@@ -78,20 +109,26 @@ public:
         butil::Status _st;
         brpc::Channel* _channel;
         std::string _dest_path;
+        std::string _source;
+        int64_t _reader_id;
         FileAdaptor* _file;
-        int _retry_times;
         bool _finished;
-        brpc::CallId _rpc_call;
         butil::IOBuf* _buf;
-        bthread_timer_t _timer;
+        // The offset of the next range to be fetched, and the size of the
+        // file once known
+        int64_t _next_offset;
+        int64_t _eof_offset;
+        int _nactive_chunks;
+        // Only these ranges are fetched if _copy_ranges is true
+        bool _copy_ranges;
+        std::deque<std::pair<int64_t, int64_t> > _ranges;
+        // Receives the data in order, until it's out of order
+        SnapshotStreamLoader* _loader;
+        int64_t _loader_offset;
+        std::vector<Chunk*> _chunks;
         CopyOptions _options;
-        Closure _done;
-        brpc::Controller _cntl;
-        GetFileRequest _request;
-        GetFileResponse _response;
         bthread::CountdownEvent _finish_event;
         scoped_refptr<SnapshotThrottle> _throttle;   
-        int64_t _throttle_token_acquire_time_us;
     };
 
     RemoteFileCopier();
@@ -105,20 +142,39 @@ public:
     int copy_to_iobuf(const std::string& source,
                       butil::IOBuf* dest_buf, 
                       const CopyOptions* options);
+    // The data is also passed to |loader| in order if it's not NULL
     scoped_refptr<Session> start_to_copy_to_file(
                       const std::string& source,
                       const std::string& dest_path,
-                      const CopyOptions* options);
+                      const CopyOptions* options,
+                      SnapshotStreamLoader* loader = NULL);
     scoped_refptr<Session> start_to_copy_to_iobuf(
                       const std::string& source,
                       butil::IOBuf* dest_buf,
                       const CopyOptions* options);
+    // Copy `source' to dest_path from |offset|, keeping the existing data
+    // of dest_path before it
+    scoped_refptr<Session> resume_copying_to_file(
+                      const std::string& source,
+                      const std::string& dest_path,
+                      int64_t offset,
+                      const CopyOptions* options);
+    // Address of the remote peer, in the form of ip:port
+    const std::string& remote_addr() const { return _remote_addr; }
+    // Copy the ranges [first, second) of `source' to the same offsets of
+    // dest_path, leaving the other parts of dest_path untouched
+    scoped_refptr<Session> start_to_copy_ranges_to_file(
+                      const std::string& source,
+                      const std::string& dest_path,
+                      const std::vector<std::pair<int64_t, int64_t> >& ranges,
+                      const CopyOptions* options);
 private:
     int read_piece_of_file(butil::IOBuf* buf, const std::string& source,
                            off_t offset, size_t max_count,
                            long timeout_ms, bool* is_eof);
     DISALLOW_COPY_AND_ASSIGN(RemoteFileCopier);
     brpc::Channel _channel;
+    std::string _remote_addr;
     int64_t _reader_id;
     scoped_refptr<FileSystemAdaptor> _fs;
     scoped_refptr<SnapshotThrottle> _throttle;
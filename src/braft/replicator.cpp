@@ -49,6 +49,27 @@ DEFINE_int32(raft_retry_replicate_interval_ms, 1000,
 BRPC_VALIDATE_GFLAG(raft_retry_replicate_interval_ms,
                     brpc::PositiveInteger);
 
+DEFINE_bool(raft_install_snapshot_from_followers, false,
+            "Followers report their last snapshots in heartbeat responses, and"
+            " the leader lets a follower which falls behind install the"
+            " snapshot of another follower instead of its own when possible");
+BRPC_VALIDATE_GFLAG(raft_install_snapshot_from_followers, ::brpc::PassValidate);
+
+DEFINE_int32(raft_max_snapshot_installs_per_follower, 1,
+             "Max number of followers installing snapshot from the same"
+             " follower at the same time");
+BRPC_VALIDATE_GFLAG(raft_max_snapshot_installs_per_follower,
+                    brpc::PositiveInteger);
+
+DEFINE_int64(raft_install_snapshot_min_gap_bytes, 0,
+             "When the logs a follower lacks are estimated to be larger than"
+             " this value, the leader installs its snapshot instead if that's"
+             " estimated to be faster. The leader also keeps the logs needed"
+             " by the followers lacking fewer logs when it truncates logs."
+             " 0 (the default) disables both");
+BRPC_VALIDATE_GFLAG(raft_install_snapshot_min_gap_bytes,
+                    brpc::NonNegativeInteger);
+
 DECLARE_int64(raft_append_entry_high_lat_us);
 DECLARE_bool(raft_trace_append_entry_latency);
 
@@ -65,6 +86,7 @@ ReplicatorOptions::ReplicatorOptions()
     , node(NULL)
     , term(0)
     , snapshot_storage(NULL)
+    , snapshot_sources(NULL)
 {
 }
 
@@ -81,7 +103,12 @@ Replicator::Replicator()
     , _wait_id(0)
     , _is_waiter_canceled(false)
     , _reader(NULL)
+    , _snapshot_source_failed(false)
     , _catchup_closure(NULL)
+    , _append_entries_bytes_per_s(0)
+    , _install_snapshot_bytes_per_s(0)
+    , _install_snapshot_start_us(0)
+    , _install_snapshot_bytes(-1)
 {
     _install_snapshot_in_fly.value = 0;
     _heartbeat_in_fly.value = 0;
@@ -320,6 +347,10 @@ void Replicator::_on_heartbeat_returned(
         return;
     }
 
+    if (response->has_snapshot_uri() && r->_options.snapshot_sources) {
+        r->_options.snapshot_sources->update(r->_options.peer_id,
+                response->snapshot_uri(), response->snapshot_meta());
+    }
     bool readonly = response->has_readonly() && response->readonly();
     BRAFT_VLOG << ss.str() << " readonly " << readonly;
     r->_update_last_rpc_send_timestamp(rpc_send_time);
@@ -493,6 +524,17 @@ void Replicator::_on_rpc_returned(ReplicatorId id, brpc::Controller* cntl,
             g_normalized_send_entries_latency << 
                 cntl->latency_us() * 1024 / cntl->request_attachment().size();
         }
+        // Only the large requests sent when the follower falls behind tell
+        // how fast it catches up
+        const int64_t request_bytes = cntl->request_attachment().size();
+        if (request_bytes >= FLAGS_raft_max_body_size / 2
+                && cntl->latency_us() > 0) {
+            const int64_t bytes_per_s =
+                    request_bytes * 1000000L / cntl->latency_us();
+            r->_append_entries_bytes_per_s =
+                    r->_append_entries_bytes_per_s == 0 ? bytes_per_s
+                    : (r->_append_entries_bytes_per_s * 7 + bytes_per_s) / 8;
+        }
     }
     // A rpc is marked as success, means all request before it are success,
     // erase them sequentially.
@@ -550,6 +592,11 @@ void Replicator::_send_empty_entries(bool is_heartbeat) {
         // _id is unlock in _install_snapshot
         return _install_snapshot();
     }
+    if (_options.snapshot_sources) {
+        // The peer reports its snapshot only when it changes
+        request->set_known_snapshot_uri(
+                _options.snapshot_sources->get_uri(_options.peer_id));
+    }
     if (is_heartbeat) {
         _heartbeat_in_fly = cntl->call_id();
         _heartbeat_counter++;
@@ -634,6 +681,10 @@ void Replicator::_send_entries() {
         return;
     }
 
+    if (_append_entries_in_fly.empty() && _should_install_snapshot()) {
+        return _install_snapshot();
+    }
+
     std::unique_ptr<brpc::Controller> cntl(new brpc::Controller);
     std::unique_ptr<AppendEntriesRequest> request(new AppendEntriesRequest);
     std::unique_ptr<AppendEntriesResponse> response(new AppendEntriesResponse);
@@ -697,6 +748,68 @@ void Replicator::_send_entries() {
     _wait_more_entries();
 }
 
+bool Replicator::_should_install_snapshot() {
+    if (FLAGS_raft_install_snapshot_min_gap_bytes <= 0 || !_has_succeeded
+            || _options.snapshot_storage == NULL) {
+        return false;
+    }
+    LogManager* log_manager = _options.log_manager;
+    const int64_t entry_bytes = log_manager->average_entry_bytes();
+    if (entry_bytes <= 0) {
+        return false;
+    }
+    const int64_t last_log_index = log_manager->last_log_index();
+    const int64_t gap_bytes = (last_log_index - _next_index + 1) * entry_bytes;
+    if (gap_bytes < FLAGS_raft_install_snapshot_min_gap_bytes) {
+        return false;
+    }
+    // The follower has to replicate the logs after the snapshot anyway, it
+    // saves nothing if the snapshot doesn't cover the logs it lacks
+    const int64_t snapshot_index = log_manager->last_snapshot_index();
+    if (snapshot_index < _next_index) {
+        return false;
+    }
+    // Recorded when the snapshot was saved, so it's not opened here with
+    // the replicator locked
+    const int64_t snapshot_bytes = log_manager->snapshot_size(snapshot_index);
+    if (snapshot_bytes < 0) {
+        return false;
+    }
+    double catch_up_s = 0;
+    double install_s = 0;
+    if (!is_snapshot_install_faster(
+                gap_bytes, snapshot_bytes,
+                (last_log_index - snapshot_index) * entry_bytes,
+                _append_entries_bytes_per_s, _install_snapshot_bytes_per_s,
+                &catch_up_s, &install_s)) {
+        return false;
+    }
+    LOG(INFO) << "node " << _options.group_id << ":" << _options.server_id
+              << " installs snapshot to " << _options.peer_id
+              << " instead of replicating logs from " << _next_index
+              << ", estimated " << install_s << "s for snapshot_bytes="
+              << snapshot_bytes << " vs " << catch_up_s << "s for log_bytes="
+              << gap_bytes;
+    return true;
+}
+
+bool is_snapshot_install_faster(int64_t gap_bytes, int64_t snapshot_bytes,
+                                int64_t after_snapshot_bytes,
+                                int64_t append_bytes_per_s,
+                                int64_t install_bytes_per_s,
+                                double* catch_up_s, double* install_s) {
+    if (append_bytes_per_s <= 0) {
+        append_bytes_per_s = std::max(install_bytes_per_s, int64_t(1));
+    }
+    if (install_bytes_per_s <= 0) {
+        install_bytes_per_s = append_bytes_per_s;
+    }
+    *catch_up_s = (double)gap_bytes / append_bytes_per_s;
+    *install_s = (double)snapshot_bytes / install_bytes_per_s
+            + (double)after_snapshot_bytes / append_bytes_per_s;
+    return *install_s < *catch_up_s;
+}
+
 int Replicator::_continue_sending(void* arg, int error_code) {
     Replicator* r = NULL;
     bthread_id_t id = { (uint64_t)arg };
@@ -789,7 +902,20 @@ void Replicator::_install_snapshot() {
         node_impl->Release();
         return;
     } 
-    std::string uri = _reader->generate_uri_for_copy();
+    SnapshotMeta meta;
+    std::string uri;
+    // Prefer the snapshot of another follower which still covers the logs to
+    // be sent after installing, to offload the leader
+    if (FLAGS_raft_install_snapshot_from_followers && _options.snapshot_sources
+            && !_snapshot_source_failed
+            && _options.snapshot_sources->acquire(
+                    _options.peer_id,
+                    _options.log_manager->first_log_index() - 1,
+                    &_snapshot_source, &uri, &meta)) {
+        return _send_install_snapshot(uri, meta);
+    }
+    _snapshot_source.reset();
+    uri = _reader->generate_uri_for_copy();
     // NOTICE: If uri is something wrong, retry later instead of reporting error
     // immediately(making raft Node error), as FileSystemAdaptor layer of _reader is 
     // user defined and may need some control logic when opened
@@ -800,7 +926,6 @@ void Replicator::_install_snapshot() {
         _close_reader();
         return _block(butil::gettimeofday_us(), EBUSY); 
     }
-    SnapshotMeta meta;
     // report error on failure
     if (_reader->load_meta(&meta) != 0) {
         std::string snapshot_path = _reader->get_path();
@@ -814,6 +939,11 @@ void Replicator::_install_snapshot() {
         node_impl->Release();
         return;
     } 
+    return _send_install_snapshot(uri, meta);
+}
+
+void Replicator::_send_install_snapshot(const std::string& uri,
+                                        const SnapshotMeta& meta) {
     brpc::Controller* cntl = new brpc::Controller;
     cntl->set_max_retry(0);
     cntl->set_timeout_ms(-1);
@@ -833,6 +963,13 @@ void Replicator::_install_snapshot() {
 
     _install_snapshot_in_fly = cntl->call_id();
     _install_snapshot_counter++;
+    _install_snapshot_start_us = butil::gettimeofday_us();
+    // Recorded when the snapshot was saved, so it's not opened here with the
+    // replicator locked. A follower's snapshot is served by that follower and
+    // doesn't tell how fast the leader installs its own.
+    _install_snapshot_bytes = _snapshot_source.is_empty()
+            ? _options.log_manager->snapshot_size(meta.last_included_index())
+            : -1;
     _st.last_log_included = meta.last_included_index();
     _st.last_term_included = meta.last_included_term();
     google::protobuf::Closure* done = brpc::NewCallback<
@@ -865,11 +1002,19 @@ void Replicator::_on_install_snapshot_returned(
             r->_options.snapshot_throttle->finish_one_task(true);
         }
     }
+    const PeerId source = r->_snapshot_source;
+    if (!source.is_empty()) {
+        r->_options.snapshot_sources->release(source);
+        r->_snapshot_source.reset();
+    }
     std::stringstream ss;
     ss << "received InstallSnapshotResponse from "
        << r->_options.group_id << ":" << r->_options.peer_id
        << " last_included_index " << request->meta().last_included_index()
        << " last_included_term " << request->meta().last_included_term();
+    if (!source.is_empty()) {
+        ss << " source " << source;
+    }
     do {
         if (cntl->Failed()) {
             ss << " error: " << cntl->ErrorText();
@@ -892,6 +1037,15 @@ void Replicator::_on_install_snapshot_returned(
         }
         // Success 
         r->_next_index = request->meta().last_included_index() + 1;
+        const int64_t elapsed_us =
+                butil::gettimeofday_us() - r->_install_snapshot_start_us;
+        if (r->_install_snapshot_bytes > 0 && elapsed_us > 0) {
+            const int64_t bytes_per_s =
+                    r->_install_snapshot_bytes * 1000000L / elapsed_us;
+            r->_install_snapshot_bytes_per_s =
+                    r->_install_snapshot_bytes_per_s == 0 ? bytes_per_s
+                    : (r->_install_snapshot_bytes_per_s + bytes_per_s) / 2;
+        }
         ss << " success.";
         LOG(INFO) << ss.str();
     } while (0);
@@ -899,8 +1053,11 @@ void Replicator::_on_install_snapshot_returned(
     // We don't retry installing the snapshot explicitly. 
     // dummy_id is unlock in _send_entries
     if (!succ) {
+        // Install the snapshot of the leader next time
+        r->_snapshot_source_failed = !source.is_empty();
         return r->_block(butil::gettimeofday_us(), cntl->ErrorCode());
     }
+    r->_snapshot_source_failed = false;
     r->_has_succeeded = true;
     r->_notify_on_caught_up(0, false);
     if (r->_timeout_now_index > 0 && r->_timeout_now_index < r->_min_flying_index()) {
@@ -1315,6 +1472,76 @@ void Replicator::_close_reader() {
             _options.snapshot_throttle->finish_one_task(true);
         }
     }
+    if (!_snapshot_source.is_empty()) {
+        _options.snapshot_sources->release(_snapshot_source);
+        _snapshot_source.reset();
+    }
+}
+
+// ==================== SnapshotSourceTable ==========================
+
+void SnapshotSourceTable::update(const PeerId& peer, const std::string& uri,
+                                 const SnapshotMeta& meta) {
+    BAIDU_SCOPED_LOCK(_mutex);
+    Source& source = _sources[peer];
+    source.uri = uri;
+    source.meta = meta;
+}
+
+std::string SnapshotSourceTable::get_uri(const PeerId& peer) {
+    BAIDU_SCOPED_LOCK(_mutex);
+    std::map<PeerId, Source>::const_iterator it = _sources.find(peer);
+    return it != _sources.end() ? it->second.uri : std::string();
+}
+
+void SnapshotSourceTable::remove(const PeerId& peer) {
+    BAIDU_SCOPED_LOCK(_mutex);
+    _sources.erase(peer);
+}
+
+void SnapshotSourceTable::clear() {
+    BAIDU_SCOPED_LOCK(_mutex);
+    _sources.clear();
+}
+
+bool SnapshotSourceTable::acquire(const PeerId& target, int64_t min_index,
+                                  PeerId* source, std::string* uri,
+                                  SnapshotMeta* meta) {
+    BAIDU_SCOPED_LOCK(_mutex);
+    std::map<PeerId, Source>::iterator best = _sources.end();
+    for (std::map<PeerId, Source>::iterator
+            it = _sources.begin(); it != _sources.end(); ++it) {
+        const Source& s = it->second;
+        if (it->first == target
+                || s.meta.last_included_index() < min_index
+                || s.ninstalls >= FLAGS_raft_max_snapshot_installs_per_follower) {
+            continue;
+        }
+        // Prefer the least loaded one, then the newest snapshot
+        if (best == _sources.end()
+                || s.ninstalls < best->second.ninstalls
+                || (s.ninstalls == best->second.ninstalls
+                    && s.meta.last_included_index()
+                            > best->second.meta.last_included_index())) {
+            best = it;
+        }
+    }
+    if (best == _sources.end()) {
+        return false;
+    }
+    ++best->second.ninstalls;
+    *source = best->first;
+    *uri = best->second.uri;
+    *meta = best->second.meta;
+    return true;
+}
+
+void SnapshotSourceTable::release(const PeerId& source) {
+    BAIDU_SCOPED_LOCK(_mutex);
+    std::map<PeerId, Source>::iterator it = _sources.find(source);
+    if (it != _sources.end() && it->second.ninstalls > 0) {
+        --it->second.ninstalls;
+    }
 }
 
 // ==================== ReplicatorGroup ==========================
@@ -1352,6 +1579,7 @@ int ReplicatorGroup::init(const NodeId& node_id, const ReplicatorGroupOptions& o
     _common_options.snapshot_storage = options.snapshot_storage;
     _common_options.snapshot_throttle = options.snapshot_throttle;
     _common_options.replicator_status = NULL;
+    _common_options.snapshot_sources = &_snapshot_sources;
     return 0;
 }
 
@@ -1403,6 +1631,7 @@ int ReplicatorGroup::stop_replicator(const PeerId &peer) {
     // Calling ReplicatorId::stop might lead to calling stop_replicator again, 
     // erase iter first to avoid race condition
     _rmap.erase(iter);
+    _snapshot_sources.remove(peer);
     return Replicator::stop(rid);
 }
 
@@ -1414,6 +1643,7 @@ int ReplicatorGroup::stop_all() {
         rids.push_back(iter->second.id);
     }
     _rmap.clear();
+    _snapshot_sources.clear();
     for (size_t i = 0; i < rids.size(); ++i) {
         Replicator::stop(rids[i]);
     }
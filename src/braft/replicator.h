@@ -43,6 +43,47 @@ struct ReplicatorStatus : public butil::RefCountedThreadSafe<ReplicatorStatus> {
     ReplicatorStatus() : last_rpc_send_timestamp(0) {}
 };
 
+// The snapshots served by the followers, from which the other followers are
+// able to install snapshots instead of from the leader
+class SnapshotSourceTable {
+public:
+    SnapshotSourceTable() {}
+    // Called when |peer| reports its snapshot in the heartbeat response
+    void update(const PeerId& peer, const std::string& uri,
+                const SnapshotMeta& meta);
+    void remove(const PeerId& peer);
+    void clear();
+    // Get the uri of the snapshot reported by |peer|, empty if there's none
+    std::string get_uri(const PeerId& peer);
+    // Pick the least loaded peer other than |target| whose snapshot is not
+    // older than |min_index|, the load is added until release() is called.
+    // Returns false if there's no such peer
+    bool acquire(const PeerId& target, int64_t min_index, PeerId* source,
+                 std::string* uri, SnapshotMeta* meta);
+    void release(const PeerId& source);
+private:
+    DISALLOW_COPY_AND_ASSIGN(SnapshotSourceTable);
+    struct Source {
+        Source() : ninstalls(0) {}
+        std::string uri;
+        SnapshotMeta meta;
+        int ninstalls;
+    };
+    raft_mutex_t _mutex;
+    std::map<PeerId, Source> _sources;
+};
+
+// Whether installing a snapshot of |snapshot_bytes| and then replicating
+// |after_snapshot_bytes| of logs is estimated to be faster than replicating
+// |gap_bytes| of logs. A throughput which isn't measured yet (0) is assumed
+// to be the same as the other one. The estimated seconds of both ways are
+// returned in |catch_up_s| and |install_s|.
+bool is_snapshot_install_faster(int64_t gap_bytes, int64_t snapshot_bytes,
+                                int64_t after_snapshot_bytes,
+                                int64_t append_bytes_per_s,
+                                int64_t install_bytes_per_s,
+                                double* catch_up_s, double* install_s);
+
 struct ReplicatorOptions {
     ReplicatorOptions();
     int* dynamic_heartbeat_timeout_ms;
@@ -57,6 +98,7 @@ struct ReplicatorOptions {
     SnapshotStorage* snapshot_storage;
     SnapshotThrottle* snapshot_throttle;
     ReplicatorStatus* replicator_status;
+    SnapshotSourceTable* snapshot_sources;
 };
 
 typedef uint64_t ReplicatorId;
@@ -155,6 +197,8 @@ private:
                             bool is_heartbeat);
     void _block(long start_time_us, int error_code);
     void _install_snapshot();
+    void _send_install_snapshot(const std::string& uri,
+                                const SnapshotMeta& meta);
     void _start_heartbeat_timer(long start_time_us);
     void _send_timeout_now(bool unlock_id, bool stop_after_finish,
                            int timeout_ms = -1);
@@ -213,6 +257,7 @@ private:
         return true;
     }
     void _close_reader();
+    bool _should_install_snapshot();
     int64_t _last_rpc_send_timestamp() {
         return _options.replicator_status->last_rpc_send_timestamp.load(butil::memory_order_relaxed);
     }
@@ -253,7 +298,17 @@ private:
     ReplicatorOptions _options;
     bthread_timer_t _heartbeat_timer;
     SnapshotReader* _reader;
+    // The follower which the running install is sourced from, empty if it's
+    // the leader itself
+    PeerId _snapshot_source;
+    bool _snapshot_source_failed;
     CatchupClosure *_catchup_closure;
+    // Measured throughputs of replicating logs and installing snapshots to
+    // this follower, 0 if not measured yet
+    int64_t _append_entries_bytes_per_s;
+    int64_t _install_snapshot_bytes_per_s;
+    int64_t _install_snapshot_start_us;
+    int64_t _install_snapshot_bytes;
 };
 
 struct ReplicatorGroupOptions {
@@ -364,6 +419,7 @@ private:
     };
 
     std::map<PeerId, ReplicatorIdAndStatus> _rmap;
+    SnapshotSourceTable _snapshot_sources;
     ReplicatorOptions _common_options;
     int _dynamic_timeout_ms;
     int _election_timeout_ms;
@@ -17,9 +17,18 @@
 //          Zheng,Pengfei(zhengpengfei@baidu.com)
 //          Xiong,Kai(xiongkai@baidu.com)
 
+#include <sys/stat.h>
 #include <butil/time.h>
+#include <butil/memory/singleton_on_pthread_once.h>
 #include <butil/string_printf.h>                     // butil::string_appendf
+#include <butil/atomicops.h>
+#include <bthread/bthread.h>
+#include <deque>
+#include <list>
+#include <map>
+#include <gflags/gflags.h>
 #include <brpc/uri.h>
+#include <brpc/reloadable_flags.h>
 #include "braft/util.h"
 #include "braft/protobuf_file.h"
 #include "braft/local_storage.pb.h"
@@ -31,9 +40,50 @@
 //#define BRAFT_SNAPSHOT_PATTERN "snapshot_%020ld"
 #define BRAFT_SNAPSHOT_PATTERN "snapshot_%020" PRId64
 #define BRAFT_SNAPSHOT_META_FILE "__raft_snapshot_meta"
+#define BRAFT_SNAPSHOT_DOWNLOAD_PROGRESS_FILE "__raft_snapshot_download_progress"
 
 namespace braft {
 
+DEFINE_int32(raft_max_concurrent_files_per_copy, 1,
+             "Max number of files being copied concurrently while installing"
+             " a snapshot. Set it to 1 if any peer doesn't support concurrent"
+             " reads");
+BRPC_VALIDATE_GFLAG(raft_max_concurrent_files_per_copy, brpc::PositiveInteger);
+
+DEFINE_int64(raft_snapshot_block_checksum_size, 0,
+             "Compute crc32c of every block of this size of the local files"
+             " when a snapshot is saved, so that peers installing it only copy"
+             " the blocks which differ from their last snapshot. 0 disables it");
+BRPC_VALIDATE_GFLAG(raft_snapshot_block_checksum_size, brpc::NonNegativeInteger);
+
+DEFINE_bool(raft_resume_snapshot_download, false,
+            "Keep the partly copied files when installing a snapshot fails, so"
+            " that the next install of the same snapshot continues from where"
+            " it stopped");
+BRPC_VALIDATE_GFLAG(raft_resume_snapshot_download, ::brpc::PassValidate);
+
+DEFINE_int32(raft_snapshot_stream_buffer_size, 1024 * 1024,
+             "Bytes appended to a snapshot stream which are buffered before"
+             " being written to the file in background");
+BRPC_VALIDATE_GFLAG(raft_snapshot_stream_buffer_size, brpc::PositiveInteger);
+
+DEFINE_int32(raft_snapshot_checksum_cache_size, 100000,
+             "Max number of local files whose checksums are cached by inode,"
+             " so that the files shared by snapshots through links are read"
+             " only once. 0 disables the cache");
+BRPC_VALIDATE_GFLAG(raft_snapshot_checksum_cache_size, brpc::NonNegativeInteger);
+
+DEFINE_bool(raft_snapshot_auto_checksum, false,
+            "Compute crc32c of the local files added to a snapshot without"
+            " checksum when it's saved, so that peers installing it skip the"
+            " files they already have");
+BRPC_VALIDATE_GFLAG(raft_snapshot_auto_checksum, ::brpc::PassValidate);
+
+DEFINE_int32(raft_snapshot_checksum_concurrency, 4,
+             "Max number of files read concurrently to compute their checksums"
+             " when a snapshot is saved");
+BRPC_VALIDATE_GFLAG(raft_snapshot_checksum_concurrency, brpc::PositiveInteger);
+
 const char* LocalSnapshotStorage::_s_temp_path = "temp";
 
 LocalSnapshotMetaTable::LocalSnapshotMetaTable() {}
@@ -144,6 +194,20 @@ void LocalSnapshotMetaTable::list_files(std::vector<std::string>* files) const {
     }
 }
 
+int64_t LocalSnapshotMetaTable::total_file_size(
+        std::vector<std::string>* unsized_files) const {
+    int64_t total_size = 0;
+    for (Map::const_iterator
+            iter = _file_map.begin(); iter != _file_map.end(); ++iter) {
+        if (iter->second.has_file_size()) {
+            total_size += iter->second.file_size();
+        } else if (unsized_files) {
+            unsized_files->push_back(iter->first);
+        }
+    }
+    return total_size;
+}
+
 int LocalSnapshotMetaTable::get_file_meta(const std::string& filename, 
                                           LocalFileMeta* file_meta) const {
     Map::const_iterator iter = _file_map.find(filename);
@@ -195,6 +259,20 @@ int LocalSnapshotWriter::init() {
         return EIO;
     }
 
+    // Files being copied by an interrupted install are kept
+    std::set<std::string> downloading;
+    std::string progress_path = _path + "/" BRAFT_SNAPSHOT_DOWNLOAD_PROGRESS_FILE;
+    if (_fs->path_exists(progress_path)) {
+        ProtoBufFile pb_file(progress_path, _fs);
+        SnapshotDownloadProgress progress;
+        if (pb_file.load(&progress) == 0) {
+            for (int i = 0; i < progress.files_size(); ++i) {
+                const std::string& name = progress.files(i).name();
+                downloading.insert(name.substr(0, name.find('/')));
+            }
+        }
+    }
+
     // remove file if meta_path not exist or it's not in _meta_table 
     // to avoid dirty data
     {
@@ -208,7 +286,9 @@ int LocalSnapshotWriter::init() {
          }
          while (dir_reader->next()) {
              std::string filename = dir_reader->name();
-             if (filename != BRAFT_SNAPSHOT_META_FILE) {
+             if (filename != BRAFT_SNAPSHOT_META_FILE
+                     && filename != BRAFT_SNAPSHOT_DOWNLOAD_PROGRESS_FILE
+                     && downloading.count(filename) == 0) {
                  if (get_file_meta(filename, NULL) != 0) {
                      to_remove.push_back(filename);
                  }
@@ -246,6 +326,218 @@ int LocalSnapshotWriter::add_file(
     return _meta_table.add_file(filename, meta);
 }
 
+// crc32c of a whole file and of its consecutive blocks
+struct FileChecksums {
+    FileChecksums() : file_size(0), checksum(0), block_size(0) {}
+    int64_t file_size;
+    uint32_t checksum;
+    int64_t block_size;
+    std::vector<uint32_t> block_checksums;
+};
+
+// The checksums generated by braft are the only key to tell whether two files
+// are the same when filtering files before copying, so the file size is part
+// of them to make a collision of the 32-bit crc32c much less likely.
+static std::string checksum_to_string(uint32_t checksum, int64_t file_size) {
+    return butil::string_printf("%08x-%" PRId64, checksum, file_size);
+}
+
+static void set_block_checksums(const FileChecksums& checksums,
+                                LocalFileMeta* meta) {
+    meta->clear_block_checksums();
+    for (size_t i = 0; i < checksums.block_checksums.size(); ++i) {
+        meta->add_block_checksums(checksums.block_checksums[i]);
+    }
+    meta->set_block_size(checksums.block_size);
+    meta->set_file_size(checksums.file_size);
+}
+
+class LocalSnapshotStreamWriter : public SnapshotStreamWriter {
+public:
+    LocalSnapshotStreamWriter(LocalSnapshotWriter* writer,
+                              const std::string& filename,
+                              FileAdaptor* file,
+                              int64_t block_size)
+        : _writer(writer), _filename(filename), _file(file), _offset(0)
+        , _writing(false), _write_failed(false)
+        , _checksum(0), _block_size(block_size), _block_checksum(0)
+        , _block_filled(0) {}
+
+    ~LocalSnapshotStreamWriter() {
+        wait_writing();
+        if (_file) {
+            _file->close();
+            delete _file;
+        }
+    }
+
+    int append(const butil::IOBuf& data) {
+        if (_file == NULL) {
+            return -1;
+        }
+        update_checksums(data);
+        _buf.append(data);
+        if (_buf.size() >= (size_t)FLAGS_raft_snapshot_stream_buffer_size) {
+            return flush();
+        }
+        return 0;
+    }
+
+    int append(const void* data, size_t size) {
+        butil::IOBuf buf;
+        buf.append(data, size);
+        return append(buf);
+    }
+
+    int close(const ::google::protobuf::Message* file_meta);
+
+private:
+    // Write the buffered data in background, while the following data is
+    // appended to a new buffer. At most one write is in flight, so the caller
+    // is throttled by the disk and the memory is bounded by two buffers.
+    int flush() {
+        if (wait_writing() != 0) {
+            return -1;
+        }
+        if (_buf.empty()) {
+            return 0;
+        }
+        _writing_buf.swap(_buf);
+        if (bthread_start_background(&_write_tid, NULL, run_write, this) != 0) {
+            PLOG(WARNING) << "Fail to start bthread";
+            run_write(this);
+            return _write_failed ? -1 : 0;
+        }
+        _writing = true;
+        return 0;
+    }
+
+    // Returns -1 if any of the previous writes failed
+    int wait_writing() {
+        if (_writing) {
+            bthread_join(_write_tid, NULL);
+            _writing = false;
+        }
+        return _write_failed ? -1 : 0;
+    }
+
+    static void* run_write(void* arg) {
+        LocalSnapshotStreamWriter* w = (LocalSnapshotStreamWriter*)arg;
+        const ssize_t nwritten = w->_file->write(w->_writing_buf, w->_offset);
+        if (nwritten != (ssize_t)w->_writing_buf.size()) {
+            LOG(WARNING) << "Fail to write " << w->_filename << " at offset="
+                         << w->_offset << " of snapshot "
+                         << w->_writer->get_path();
+            w->_write_failed = true;
+        } else {
+            w->_offset += nwritten;
+        }
+        w->_writing_buf.clear();
+        return NULL;
+    }
+
+    void update_checksums(const butil::IOBuf& data) {
+        const size_t block_num = data.backing_block_num();
+        for (size_t i = 0; i < block_num; ++i) {
+            butil::StringPiece sp = data.backing_block(i);
+            if (sp.empty()) {
+                continue;
+            }
+            _checksum = butil::crc32c::Extend(_checksum, sp.data(), sp.size());
+            while (_block_size > 0 && !sp.empty()) {
+                const size_t n = std::min((int64_t)sp.size(),
+                                          _block_size - _block_filled);
+                _block_checksum = butil::crc32c::Extend(
+                        _block_checksum, sp.data(), n);
+                _block_filled += n;
+                sp.remove_prefix(n);
+                if (_block_filled == _block_size) {
+                    _block_checksums.push_back(_block_checksum);
+                    _block_checksum = 0;
+                    _block_filled = 0;
+                }
+            }
+        }
+    }
+
+    LocalSnapshotWriter* _writer;
+    std::string _filename;
+    FileAdaptor* _file;
+    butil::IOBuf _buf;
+    // Written by the bthread |_write_tid| at |_offset| if |_writing| is true
+    butil::IOBuf _writing_buf;
+    int64_t _offset;
+    bthread_t _write_tid;
+    bool _writing;
+    bool _write_failed;
+    uint32_t _checksum;
+    int64_t _block_size;
+    uint32_t _block_checksum;
+    int64_t _block_filled;
+    std::vector<uint32_t> _block_checksums;
+};
+
+int LocalSnapshotStreamWriter::close(
+        const ::google::protobuf::Message* file_meta) {
+    if (_file == NULL) {
+        return -1;
+    }
+    int ret = flush();
+    if (wait_writing() != 0) {
+        ret = -1;
+    }
+    if (ret == 0 && !_file->sync()) {
+        LOG(WARNING) << "Fail to sync " << _filename << " of snapshot "
+                     << _writer->get_path();
+        ret = -1;
+    }
+    if (!_file->close()) {
+        ret = -1;
+    }
+    delete _file;
+    _file = NULL;
+    if (ret != 0) {
+        return ret;
+    }
+    LocalFileMeta meta;
+    if (file_meta) {
+        meta.CopyFrom(*file_meta);
+    }
+    meta.set_source(FILE_SOURCE_LOCAL);
+    if (!meta.has_checksum()) {
+        meta.set_checksum(checksum_to_string(_checksum, _offset));
+    }
+    if (_block_size > 0) {
+        if (_block_filled > 0) {
+            _block_checksums.push_back(_block_checksum);
+        }
+        meta.clear_block_checksums();
+        for (size_t i = 0; i < _block_checksums.size(); ++i) {
+            meta.add_block_checksums(_block_checksums[i]);
+        }
+        meta.set_block_size(_block_size);
+        meta.set_file_size(_offset);
+    }
+    return _writer->add_file(_filename, &meta);
+}
+
+SnapshotStreamWriter* LocalSnapshotWriter::open_stream(
+        const std::string& filename) {
+    const std::string path(_path + '/' + filename);
+    butil::File::Error e;
+    FileAdaptor* file = _fs->open(path,
+            O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, NULL, &e);
+    if (!file) {
+        LOG(WARNING) << "Fail to open " << path
+                     << ", " << butil::File::ErrorToString(e);
+        return NULL;
+    }
+    // The file is overwritten
+    _meta_table.remove_file(filename);
+    return new LocalSnapshotStreamWriter(
+            this, filename, file, FLAGS_raft_snapshot_block_checksum_size);
+}
+
 void LocalSnapshotWriter::list_files(std::vector<std::string> *files) {
     return _meta_table.list_files(files);
 }
@@ -267,6 +559,265 @@ int LocalSnapshotWriter::save_meta(const SnapshotMeta& meta) {
     return 0;
 }
 
+static int64_t mtime_ns(const struct stat& st) {
+#ifdef __APPLE__
+    return st.st_mtimespec.tv_sec * 1000000000L + st.st_mtimespec.tv_nsec;
+#else
+    return st.st_mtim.tv_sec * 1000000000L + st.st_mtim.tv_nsec;
+#endif
+}
+
+static bvar::Adder<int64_t> g_checksum_cache_hit(
+        "raft_snapshot_checksum_cache_hit_count");
+
+// Checksums of the files cached by inode, so that the immutable files shared
+// by snapshots through links or reflinks are read only once. The least
+// recently used one is evicted when the cache is full.
+class FileChecksumCache {
+public:
+    FileChecksumCache() {}
+
+    bool get(const struct stat& st, int64_t block_size,
+             FileChecksums* checksums) {
+        BAIDU_SCOPED_LOCK(_mutex);
+        Map::iterator it = _map.find(Key(st.st_dev, st.st_ino));
+        if (it == _map.end()
+                || it->second->mtime_ns != mtime_ns(st)
+                || it->second->checksums.file_size != st.st_size
+                || it->second->checksums.block_size != block_size) {
+            return false;
+        }
+        _lru.splice(_lru.begin(), _lru, it->second);
+        *checksums = it->second->checksums;
+        g_checksum_cache_hit << 1;
+        return true;
+    }
+
+    void put(const struct stat& st, const FileChecksums& checksums) {
+        BAIDU_SCOPED_LOCK(_mutex);
+        const Key key(st.st_dev, st.st_ino);
+        Map::iterator it = _map.find(key);
+        if (it != _map.end()) {
+            _lru.erase(it->second);
+            _map.erase(it);
+        }
+        while (!_lru.empty() && _lru.size()
+                    >= (size_t)FLAGS_raft_snapshot_checksum_cache_size) {
+            _map.erase(_lru.back().key);
+            _lru.pop_back();
+        }
+        _lru.push_front(Entry());
+        Entry& entry = _lru.front();
+        entry.key = key;
+        entry.mtime_ns = mtime_ns(st);
+        entry.checksums = checksums;
+        _map[key] = _lru.begin();
+    }
+
+private:
+    typedef std::pair<dev_t, ino_t> Key;
+    struct Entry {
+        Key key;
+        int64_t mtime_ns;
+        FileChecksums checksums;
+    };
+    // Ordered from the most recently used to the least
+    typedef std::list<Entry> List;
+    typedef std::map<Key, List::iterator> Map;
+
+    raft_mutex_t _mutex;
+    List _lru;
+    Map _map;
+};
+
+static int compute_file_checksums(FileSystemAdaptor* fs,
+                           const std::string& path,
+                           const LocalFileMeta* meta,
+                           int64_t block_size,
+                           FileChecksums* checksums) {
+    // Only the files of the local file system are identified by inode
+    FileChecksumCache* cache = butil::get_leaky_singleton<FileChecksumCache>();
+    struct stat st;
+    const bool cacheable = FLAGS_raft_snapshot_checksum_cache_size > 0
+            && dynamic_cast<PosixFileSystemAdaptor*>(fs) != NULL
+            && ::stat(path.c_str(), &st) == 0;
+    if (cacheable && cache->get(st, block_size, checksums)) {
+        return 0;
+    }
+    butil::File::Error e;
+    FileAdaptor* file = fs->open(path, O_RDONLY | O_CLOEXEC, meta, &e);
+    if (!file) {
+        LOG(WARNING) << "Fail to open " << path
+                     << ", " << butil::File::ErrorToString(e);
+        return -1;
+    }
+    *checksums = FileChecksums();
+    checksums->block_size = block_size;
+    const int64_t read_size = block_size > 0 ? block_size : 1024 * 1024;
+    int ret = 0;
+    int64_t offset = 0;
+    while (true) {
+        butil::IOPortal buf;
+        const ssize_t nread = file->read(&buf, offset, read_size);
+        if (nread < 0) {
+            LOG(WARNING) << "Fail to read " << path << " at offset=" << offset;
+            ret = -1;
+            break;
+        }
+        if (nread == 0) {
+            break;
+        }
+        const size_t block_num = buf.backing_block_num();
+        for (size_t i = 0; i < block_num; ++i) {
+            butil::StringPiece sp = buf.backing_block(i);
+            checksums->checksum = butil::crc32c::Extend(
+                    checksums->checksum, sp.data(), sp.size());
+        }
+        if (block_size > 0) {
+            checksums->block_checksums.push_back(crc32(buf));
+        }
+        offset += nread;
+        if (nread < read_size) {
+            break;
+        }
+    }
+    file->close();
+    delete file;
+    checksums->file_size = offset;
+    if (ret == 0 && cacheable) {
+        // Don't cache the checksums if the file changed while being read
+        struct stat st2;
+        if (::stat(path.c_str(), &st2) == 0 && st2.st_ino == st.st_ino
+                && mtime_ns(st2) == mtime_ns(st) && st2.st_size == offset) {
+            cache->put(st, *checksums);
+        }
+    }
+    return ret;
+}
+
+int LocalSnapshotWriter::link_file(const std::string& filename,
+                                   const std::string& source_path,
+                                   const ::google::protobuf::Message* file_meta) {
+    LocalFileMeta meta;
+    if (file_meta) {
+        meta.CopyFrom(*file_meta);
+    }
+    meta.set_source(FILE_SOURCE_LOCAL);
+    if (!meta.has_checksum()) {
+        // Checksum |source_path| rather than the link, so that the cache is
+        // hit by the reflinks as well, which have their own inodes
+        FileChecksums checksums;
+        if (compute_file_checksums(_fs, source_path, NULL,
+                                   FLAGS_raft_snapshot_block_checksum_size,
+                                   &checksums) != 0) {
+            return -1;
+        }
+        meta.set_checksum(checksum_to_string(checksums.checksum,
+                                             checksums.file_size));
+        if (checksums.block_size > 0) {
+            set_block_checksums(checksums, &meta);
+        }
+    }
+    const std::string path(_path + '/' + filename);
+    _fs->delete_file(path, false);
+    if (!_fs->clone(source_path, path) && !_fs->link(source_path, path)) {
+        PLOG(WARNING) << "Fail to link " << source_path << " to " << path;
+        return -1;
+    }
+    _meta_table.remove_file(filename);
+    return _meta_table.add_file(filename, meta);
+}
+
+// Files of a snapshot whose checksums are computed in parallel
+struct FillChecksumsArg {
+    FileSystemAdaptor* fs;
+    std::string path;
+    int64_t block_size;
+    struct File {
+        std::string name;
+        LocalFileMeta meta;
+        FileChecksums checksums;
+        int ret;
+    };
+    std::vector<File> files;
+    butil::atomic<size_t> next;
+};
+
+static void* run_fill_checksums(void* arg) {
+    FillChecksumsArg* fa = (FillChecksumsArg*)arg;
+    while (true) {
+        const size_t i = fa->next.fetch_add(1, butil::memory_order_relaxed);
+        if (i >= fa->files.size()) {
+            return NULL;
+        }
+        FillChecksumsArg::File& file = fa->files[i];
+        file.ret = compute_file_checksums(fa->fs, fa->path + '/' + file.name,
+                                          &file.meta, fa->block_size,
+                                          &file.checksums);
+    }
+}
+
+void LocalSnapshotWriter::fill_checksums(int64_t block_size, bool whole_file) {
+    FillChecksumsArg arg;
+    arg.fs = _fs.get();
+    arg.path = _path;
+    arg.block_size = block_size;
+    arg.next.store(0, butil::memory_order_relaxed);
+    std::vector<std::string> files;
+    _meta_table.list_files(&files);
+    for (size_t i = 0; i < files.size(); ++i) {
+        LocalFileMeta meta;
+        if (_meta_table.get_file_meta(files[i], &meta) != 0
+                || meta.source() != FILE_SOURCE_LOCAL) {
+            continue;
+        }
+        const bool need_blocks = block_size > 0
+                && (meta.block_size() != block_size || !meta.has_file_size());
+        const bool need_checksum = whole_file && !meta.has_checksum();
+        if (!need_blocks && !need_checksum) {
+            continue;
+        }
+        arg.files.push_back(FillChecksumsArg::File());
+        arg.files.back().name = files[i];
+        arg.files.back().meta.Swap(&meta);
+        arg.files.back().ret = -1;
+    }
+    if (arg.files.empty()) {
+        return;
+    }
+    const size_t concurrency = std::min(arg.files.size(),
+            (size_t)FLAGS_raft_snapshot_checksum_concurrency);
+    std::vector<bthread_t> tids;
+    for (size_t i = 1; i < concurrency; ++i) {
+        bthread_t tid;
+        if (bthread_start_background(&tid, NULL, run_fill_checksums, &arg) != 0) {
+            LOG(WARNING) << "Fail to start bthread to compute checksums";
+            break;
+        }
+        tids.push_back(tid);
+    }
+    run_fill_checksums(&arg);
+    for (size_t i = 0; i < tids.size(); ++i) {
+        bthread_join(tids[i], NULL);
+    }
+    for (size_t i = 0; i < arg.files.size(); ++i) {
+        FillChecksumsArg::File& file = arg.files[i];
+        if (file.ret != 0) {
+            // Peers just copy the whole file
+            continue;
+        }
+        if (whole_file && !file.meta.has_checksum()) {
+            file.meta.set_checksum(checksum_to_string(
+                        file.checksums.checksum, file.checksums.file_size));
+        }
+        if (block_size > 0) {
+            set_block_checksums(file.checksums, &file.meta);
+        }
+        _meta_table.remove_file(file.name);
+        _meta_table.add_file(file.name, file.meta);
+    }
+}
+
 int LocalSnapshotWriter::sync() {
     const int rc = _meta_table.save_to_file(_fs, _path + "/" BRAFT_SNAPSHOT_META_FILE);
     if (rc != 0 && ok()) {
@@ -336,6 +887,26 @@ int LocalSnapshotReader::get_file_meta(const std::string& filename,
     return _meta_table.get_file_meta(filename, meta);
 }
 
+int64_t LocalSnapshotReader::get_total_size() {
+    std::vector<std::string> unsized_files;
+    int64_t total_size = _meta_table.total_file_size(&unsized_files);
+    for (size_t i = 0; i < unsized_files.size(); ++i) {
+        const std::string path(_path + '/' + unsized_files[i]);
+        FileAdaptor* file = _fs->open(path, O_RDONLY | O_CLOEXEC, NULL, NULL);
+        if (file == NULL) {
+            PLOG(WARNING) << "Fail to open " << path;
+            return -1;
+        }
+        const ssize_t size = file->size();
+        delete file;
+        if (size < 0) {
+            return -1;
+        }
+        total_size += size;
+    }
+    return total_size;
+}
+
 class SnapshotFileReader : public LocalDirReader {
 public:
     SnapshotFileReader(FileSystemAdaptor* fs,
@@ -397,6 +968,22 @@ public:
         return LocalDirReader::read_file_with_meta(
                 out, filename, &file_meta, offset, new_max_count, read_count, is_eof);
     }
+
+    FileCompressType compress(const std::string& filename,
+                              FileCompressType type,
+                              const butil::IOBuf& data,
+                              butil::IOBuf* out) const {
+        const FileCompressType ret =
+                LocalDirReader::compress(filename, type, data, out);
+        // The throttle was charged with bytes read from disk, charge it with
+        // bytes on the wire instead
+        if (ret != FILE_COMPRESS_NONE && _snapshot_throttle
+                && FLAGS_raft_enable_throttle_when_install_snapshot) {
+            _snapshot_throttle->return_unused_throughput(
+                    data.size(), out->size(), 0);
+        }
+        return ret;
+    }
    
 private:
     LocalSnapshotMetaTable _meta_table;
@@ -571,8 +1158,14 @@ SnapshotWriter* LocalSnapshotStorage::create(bool from_empty) {
 }
 
 SnapshotCopier* LocalSnapshotStorage::start_to_copy_from(const std::string& uri) {
+    return start_to_stream_from(uri, NULL);
+}
+
+SnapshotCopier* LocalSnapshotStorage::start_to_stream_from(
+        const std::string& uri, SnapshotStreamLoader* loader) {
     LocalSnapshotCopier* copier = new LocalSnapshotCopier();
     copier->_storage = this;
+    copier->_loader = loader;
     copier->_filter_before_copy_remote = _filter_before_copy_remote;
     copier->_fs = _fs.get();
     copier->_throttle = _snapshot_throttle.get();
@@ -614,6 +1207,11 @@ int LocalSnapshotStorage::close(SnapshotWriter* writer_base,
         if (0 != ret) {
             break;
         }
+        if (FLAGS_raft_snapshot_block_checksum_size > 0
+                || FLAGS_raft_snapshot_auto_checksum) {
+            writer->fill_checksums(FLAGS_raft_snapshot_block_checksum_size,
+                                   FLAGS_raft_snapshot_auto_checksum);
+        }
         ret = writer->sync();
         if (ret != 0) {
             break;
@@ -742,7 +1340,9 @@ LocalSnapshotCopier::LocalSnapshotCopier()
     , _writer(NULL)
     , _storage(NULL)
     , _reader(NULL)
-    , _cur_session(NULL)
+    , _loader(NULL)
+    , _last_snapshot(NULL)
+    , _resume(false)
 {}
 
 LocalSnapshotCopier::~LocalSnapshotCopier() {
@@ -767,10 +1367,25 @@ void LocalSnapshotCopier::copy() {
         }
         std::vector<std::string> files;
         _remote_snapshot.list_files(&files);
-        for (size_t i = 0; i < files.size() && ok(); ++i) {
-            copy_file(files[i]);
+        _last_snapshot = _storage->open();
+        copy_files(files);
+        if (_last_snapshot) {
+            _storage->close(_last_snapshot);
+            _last_snapshot = NULL;
         }
     } while (0);
+    if (_resume && _writer) {
+        if (ok()) {
+            // Remove the partly copied files which are not in this snapshot
+            for (std::map<std::string, PartialFile>::const_iterator
+                    it = _partial_files.begin(); it != _partial_files.end(); ++it) {
+                _fs->delete_file(_writer->get_path() + "/" + it->first, false);
+            }
+            _partial_files.clear();
+        } else {
+            save_download_progress();
+        }
+    }
     if (!ok() && _writer && _writer->ok()) {
         LOG(WARNING) << "Fail to copy, error_code " << error_code()
                      << " error_msg " << error_cstr() 
@@ -780,7 +1395,8 @@ void LocalSnapshotCopier::copy() {
     if (_writer) {
         // set_error for copier only when failed to close writer and copier was 
         // ok before this moment 
-        if (_storage->close(_writer, _filter_before_copy_remote) != 0 && ok()) {
+        if (_storage->close(_writer, _filter_before_copy_remote || _resume) != 0
+                && ok()) {
             set_error(EIO, "Fail to close writer");
         }
         _writer = NULL;
@@ -800,11 +1416,11 @@ void LocalSnapshotCopier::load_meta_table() {
     scoped_refptr<RemoteFileCopier::Session> session
             = _copier.start_to_copy_to_iobuf(BRAFT_SNAPSHOT_META_FILE,
                                             &meta_buf, NULL);
-    _cur_session = session.get();
+    _cur_sessions.insert(session.get());
     lck.unlock();
     session->join();
     lck.lock();
-    _cur_session = NULL;
+    _cur_sessions.erase(session.get());
     lck.unlock();
     if (!session->status().ok()) {
         LOG(WARNING) << "Fail to copy meta file : " << session->status();
@@ -908,11 +1524,23 @@ int LocalSnapshotCopier::filter_before_copy(LocalSnapshotWriter* writer,
 }
 
 void LocalSnapshotCopier::filter() {
-    _writer = (LocalSnapshotWriter*)_storage->create(!_filter_before_copy_remote);
+    _resume = FLAGS_raft_resume_snapshot_download;
+    _writer = (LocalSnapshotWriter*)_storage->create(
+            !_filter_before_copy_remote && !_resume);
     if (_writer == NULL) {
         set_error(EIO, "Fail to create snapshot writer");
         return;
     }
+    if (_resume && !load_download_progress() && !_filter_before_copy_remote) {
+        // Data in the writer doesn't belong to this snapshot
+        _writer->set_error(-1, "Discard the interrupted install");
+        _storage->close(_writer, false);
+        _writer = (LocalSnapshotWriter*)_storage->create(true);
+        if (_writer == NULL) {
+            set_error(EIO, "Fail to create snapshot writer");
+            return;
+        }
+    }
 
     if (_filter_before_copy_remote) {
         SnapshotReader* reader = _storage->open();
@@ -939,11 +1567,69 @@ void LocalSnapshotCopier::filter() {
     }
 }
 
-void LocalSnapshotCopier::copy_file(const std::string& filename) {
+void LocalSnapshotCopier::copy_files(const std::vector<std::string>& files) {
+    // Keep up to raft_max_concurrent_files_per_copy files being copied, the
+    // files are added to the writer in the order they're started
+    struct CopyingFile {
+        std::string filename;
+        scoped_refptr<RemoteFileCopier::Session> session;
+        bool copy_ranges;
+    };
+    std::deque<CopyingFile> copying;
+    size_t next = 0;
+    while (true) {
+        while (ok() && next < files.size() && copying.size()
+                    < (size_t)FLAGS_raft_max_concurrent_files_per_copy) {
+            CopyingFile f;
+            f.filename = files[next++];
+            f.copy_ranges = true;
+            f.session = start_to_copy_file(f.filename, &f.copy_ranges);
+            if (f.session) {
+                copying.push_back(f);
+            }
+        }
+        if (copying.empty()) {
+            break;
+        }
+        CopyingFile& f = copying.front();
+        f.session->join();
+        std::unique_lock<raft_mutex_t> lck(_mutex);
+        _cur_sessions.erase(f.session.get());
+        lck.unlock();
+        const butil::Status st = f.session->status();
+        if (ok() && f.copy_ranges && !st.ok() && st.error_code() != ECANCELED) {
+            LOG(WARNING) << "Fail to copy the changed blocks of " << f.filename
+                         << " path: " << _writer->get_path() << ", " << st
+                         << ", copy the whole file instead";
+            f.copy_ranges = false;
+            f.session = start_to_copy_file(f.filename, &f.copy_ranges);
+            if (f.session) {
+                continue;
+            }
+        } else if (ok()) {
+            finish_copying_file(f.filename, f.session.get());
+        }
+        if (!ok()) {
+            if (f.session) {
+                record_download_progress(f.filename, f.session.get());
+            }
+            // Stop the others in flight
+            for (size_t i = 1; i < copying.size(); ++i) {
+                copying[i].session->cancel();
+            }
+        }
+        copying.pop_front();
+    }
+}
+
+scoped_refptr<RemoteFileCopier::Session> LocalSnapshotCopier::start_to_copy_file(
+        const std::string& filename, bool* copy_ranges) {
+    const bool allow_ranges = *copy_ranges;
+    *copy_ranges = false;
     if (_writer->get_file_meta(filename, NULL) == 0) {
         LOG(INFO) << "Skipped downloading " << filename
                   << " path: " << _writer->get_path();
-        return;
+        return NULL;
     }
     std::string file_path = _writer->get_path() + '/' + filename;
     butil::FilePath sub_path(filename);
@@ -965,31 +1651,150 @@ void LocalSnapshotCopier::copy_file(const std::string& filename) {
                       "Fail to create directory");
         }
     }
-    LocalFileMeta meta;
-    _remote_snapshot.get_file_meta(filename, &meta);
+    LocalFileMeta remote_meta;
+    _remote_snapshot.get_file_meta(filename, &remote_meta);
+    const int64_t resume_offset = _resume
+            ? take_download_progress(filename, remote_meta, file_path) : 0;
+    std::vector<std::pair<int64_t, int64_t> > ranges;
+    if (allow_ranges && resume_offset == 0 && _last_snapshot
+            && remote_meta.block_checksums_size() > 0
+            && remote_meta.has_file_size()) {
+        *copy_ranges = build_from_last_snapshot(
+                filename, remote_meta, file_path, &ranges) == 0;
+        if (*copy_ranges && ranges.empty()) {
+            finish_copying_file(filename, NULL);
+            return NULL;
+        }
+    }
     std::unique_lock<raft_mutex_t> lck(_mutex);
     if (_cancelled) {
         set_error(ECANCELED, "%s", berror(ECANCELED));
-        return;
+        return NULL;
+    }
+    scoped_refptr<RemoteFileCopier::Session> session;
+    if (*copy_ranges) {
+        session = _copier.start_to_copy_ranges_to_file(
+                filename, file_path, ranges, NULL);
+    } else if (resume_offset > 0) {
+        session = _copier.resume_copying_to_file(
+                filename, file_path, resume_offset, NULL);
+    } else {
+        session = _copier.start_to_copy_to_file(filename, file_path, NULL,
+                                                _loader);
     }
-    scoped_refptr<RemoteFileCopier::Session> session
-        = _copier.start_to_copy_to_file(filename, file_path, NULL);
     if (session == NULL) {
         LOG(WARNING) << "Fail to copy " << filename
                      << " path: " << _writer->get_path();
         set_error(-1, "Fail to copy %s", filename.c_str());
-        return;
+        return NULL;
     }
-    _cur_session = session.get();
-    lck.unlock();
-    session->join();
-    lck.lock();
-    _cur_session = NULL;
-    lck.unlock();
-    if (!session->status().ok()) {
+    _cur_sessions.insert(session.get());
+    return session;
+}
+
+int LocalSnapshotCopier::build_from_last_snapshot(
+        const std::string& filename, const LocalFileMeta& remote_meta,
+        const std::string& dest_path,
+        std::vector<std::pair<int64_t, int64_t> >* ranges) {
+    const int64_t block_size = remote_meta.block_size();
+    const int64_t nblocks = remote_meta.block_checksums_size();
+    if (block_size <= 0
+            || remote_meta.file_size() <= (nblocks - 1) * block_size
+            || remote_meta.file_size() > nblocks * block_size) {
+        LOG(WARNING) << "Invalid block checksums of " << filename;
+        return -1;
+    }
+    LocalFileMeta local_meta;
+    if (_last_snapshot->get_file_meta(filename, &local_meta) != 0
+            || local_meta.source() != FILE_SOURCE_LOCAL) {
+        return -1;
+    }
+    const std::string source_path = _last_snapshot->get_path() + '/' + filename;
+    butil::File::Error e;
+    FileAdaptor* source = _fs->open(source_path, O_RDONLY | O_CLOEXEC,
+                                    &local_meta, &e);
+    if (!source) {
+        LOG(WARNING) << "Fail to open " << source_path
+                     << ", " << butil::File::ErrorToString(e);
+        return -1;
+    }
+    FileAdaptor* dest = _fs->open(dest_path,
+                                  O_TRUNC | O_WRONLY | O_CREAT | O_CLOEXEC,
+                                  NULL, &e);
+    if (!dest) {
+        LOG(WARNING) << "Fail to open " << dest_path
+                     << ", " << butil::File::ErrorToString(e);
+        source->close();
+        delete source;
+        return -1;
+    }
+    // Blocks with different known checksums are not even read
+    const bool has_local_checksums = local_meta.block_size() == block_size
+                                     && local_meta.has_file_size();
+    int ret = 0;
+    int64_t reused = 0;
+    for (int i = 0; i < remote_meta.block_checksums_size(); ++i) {
+        const int64_t offset = i * block_size;
+        const int64_t len = std::min(block_size,
+                                     remote_meta.file_size() - offset);
+        bool same = false;
+        if (!has_local_checksums
+                || (i < local_meta.block_checksums_size()
+                    && local_meta.block_checksums(i)
+                            == remote_meta.block_checksums(i))) {
+            butil::IOPortal buf;
+            const ssize_t nread = source->read(&buf, offset, len);
+            if (nread < 0) {
+                LOG(WARNING) << "Fail to read " << source_path;
+                ret = -1;
+                break;
+            }
+            // Verify the data actually read rather than trusting the meta
+            if (nread == len && crc32(buf) == remote_meta.block_checksums(i)) {
+                if (dest->write(buf, offset) != len) {
+                    LOG(WARNING) << "Fail to write " << dest_path;
+                    ret = -1;
+                    break;
+                }
+                same = true;
+                reused += len;
+            }
+        }
+        if (!same) {
+            if (!ranges->empty() && ranges->back().second == offset) {
+                ranges->back().second = offset + len;
+            } else {
+                ranges->push_back(std::make_pair(offset, offset + len));
+            }
+        }
+    }
+    if (ret == 0 && !dest->sync()) {
+        ret = -1;
+    }
+    source->close();
+    delete source;
+    if (!dest->close()) {
+        ret = -1;
+    }
+    delete dest;
+    if (ret != 0) {
+        ranges->clear();
+        return -1;
+    }
+    LOG(INFO) << "Reused " << reused << " of " << remote_meta.file_size()
+              << " bytes of " << filename
+              << " from last_snapshot=" << _last_snapshot->get_path();
+    return 0;
+}
+
+void LocalSnapshotCopier::finish_copying_file(
+        const std::string& filename, RemoteFileCopier::Session* session) {
+    if (session && !session->status().ok()) {
         set_error(session->status().error_code(), session->status().error_cstr());
         return;
     }
+    LocalFileMeta meta;
+    _remote_snapshot.get_file_meta(filename, &meta);
     if (_writer->add_file(filename, &meta) != 0) {
         set_error(EIO, "Fail to add file to writer");
         return;
@@ -1000,6 +1805,176 @@ void LocalSnapshotCopier::copy_file(const std::string& filename) {
     }
 }
 
+static int checksum_of_prefix(FileSystemAdaptor* fs, const std::string& path,
+                              int64_t size, uint32_t* checksum) {
+    butil::File::Error e;
+    FileAdaptor* file = fs->open(path, O_RDONLY | O_CLOEXEC, NULL, &e);
+    if (!file) {
+        LOG(WARNING) << "Fail to open " << path
+                     << ", " << butil::File::ErrorToString(e);
+        return -1;
+    }
+    int ret = 0;
+    uint32_t crc = 0;
+    int64_t offset = 0;
+    while (offset < size) {
+        butil::IOPortal buf;
+        const ssize_t nread = file->read(
+                &buf, offset, std::min(size - offset, (int64_t)1024 * 1024));
+        if (nread <= 0) {
+            ret = -1;
+            break;
+        }
+        const size_t block_num = buf.backing_block_num();
+        for (size_t i = 0; i < block_num; ++i) {
+            butil::StringPiece sp = buf.backing_block(i);
+            crc = butil::crc32c::Extend(crc, sp.data(), sp.size());
+        }
+        offset += nread;
+    }
+    file->close();
+    delete file;
+    *checksum = crc;
+    return ret;
+}
+
+bool LocalSnapshotCopier::load_download_progress() {
+    _partial_files.clear();
+    _partial_source.clear();
+    const std::string path = _writer->get_path()
+                             + "/" BRAFT_SNAPSHOT_DOWNLOAD_PROGRESS_FILE;
+    if (!_fs->path_exists(path)) {
+        return false;
+    }
+    ProtoBufFile pb_file(path, _fs);
+    SnapshotDownloadProgress progress;
+    if (pb_file.load(&progress) != 0) {
+        LOG(WARNING) << "Fail to load " << path;
+    }
+    const SnapshotMeta& meta = _remote_snapshot._meta_table.meta();
+    const bool same_snapshot =
+            progress.meta().last_included_index() == meta.last_included_index()
+            && progress.meta().last_included_term() == meta.last_included_term();
+    _partial_source = progress.source();
+    for (int i = 0; i < progress.files_size(); ++i) {
+        const SnapshotDownloadProgress::File& f = progress.files(i);
+        if (!same_snapshot || !is_resumable(f.meta(), f.meta())) {
+            if (_writer->get_file_meta(f.name(), NULL) != 0) {
+                _fs->delete_file(_writer->get_path() + "/" + f.name(), false);
+            }
+            continue;
+        }
+        PartialFile& partial = _partial_files[f.name()];
+        partial.offset = f.offset();
+        partial.checksum = f.checksum();
+        partial.meta = f.meta();
+    }
+    _fs->delete_file(path, false);
+    if (!same_snapshot) {
+        _partial_files.clear();
+        return false;
+    }
+    if (!_filter_before_copy_remote) {
+        // Drop the copied files which may differ from the remote ones
+        std::vector<std::string> files;
+        _writer->list_files(&files);
+        for (size_t i = 0; i < files.size(); ++i) {
+            LocalFileMeta local_meta;
+            LocalFileMeta remote_meta;
+            _writer->get_file_meta(files[i], &local_meta);
+            if (_remote_snapshot.get_file_meta(files[i], &remote_meta) != 0
+                    || !is_resumable(local_meta, remote_meta)) {
+                _writer->remove_file(files[i]);
+                _fs->delete_file(_writer->get_path() + "/" + files[i], false);
+            }
+        }
+    }
+    LOG(INFO) << "Continue the interrupted install of snapshot "
+              << meta.last_included_index() << " with "
+              << _partial_files.size() << " partly copied files"
+              << " in " << _writer->get_path();
+    return true;
+}
+
+bool LocalSnapshotCopier::is_resumable(const LocalFileMeta& local_meta,
+                                       const LocalFileMeta& remote_meta) {
+    if (local_meta.SerializeAsString() != remote_meta.SerializeAsString()) {
+        return false;
+    }
+    // The files of the same snapshot saved by different peers may differ,
+    // they're identified by checksums if any
+    return remote_meta.has_checksum() || remote_meta.block_checksums_size() > 0
+            || _partial_source == _copier.remote_addr();
+}
+
+int64_t LocalSnapshotCopier::take_download_progress(
+        const std::string& filename, const LocalFileMeta& remote_meta,
+        const std::string& file_path) {
+    std::map<std::string, PartialFile>::iterator
+            it = _partial_files.find(filename);
+    if (it == _partial_files.end()) {
+        return 0;
+    }
+    const PartialFile partial = it->second;
+    _partial_files.erase(it);
+    if (!is_resumable(partial.meta, remote_meta)) {
+        return 0;
+    }
+    // Validate the data before reusing it
+    uint32_t checksum = 0;
+    if (checksum_of_prefix(_fs, file_path, partial.offset, &checksum) != 0
+            || checksum != partial.checksum) {
+        LOG(WARNING) << "Fail to verify the copied " << partial.offset
+                     << " bytes of " << file_path << ", copy it again";
+        return 0;
+    }
+    LOG(INFO) << "Continue copying " << filename << " from offset="
+              << partial.offset;
+    return partial.offset;
+}
+
+void LocalSnapshotCopier::record_download_progress(
+        const std::string& filename, RemoteFileCopier::Session* session) {
+    if (!_resume) {
+        return;
+    }
+    const int64_t size = session->copied_size();
+    if (size <= 0) {
+        return;
+    }
+    PartialFile partial;
+    partial.offset = size;
+    if (checksum_of_prefix(_fs, _writer->get_path() + '/' + filename,
+                           size, &partial.checksum) != 0) {
+        return;
+    }
+    _remote_snapshot.get_file_meta(filename, &partial.meta);
+    _partial_files[filename] = partial;
+}
+
+void LocalSnapshotCopier::save_download_progress() {
+    if (!_remote_snapshot._meta_table.has_meta()) {
+        return;
+    }
+    SnapshotDownloadProgress progress;
+    *progress.mutable_meta() = _remote_snapshot._meta_table.meta();
+    progress.set_source(_copier.remote_addr());
+    for (std::map<std::string, PartialFile>::const_iterator
+            it = _partial_files.begin(); it != _partial_files.end(); ++it) {
+        SnapshotDownloadProgress::File* f = progress.add_files();
+        f->set_name(it->first);
+        f->set_offset(it->second.offset);
+        f->set_checksum(it->second.checksum);
+        *f->mutable_meta() = it->second.meta;
+    }
+    ProtoBufFile pb_file(_writer->get_path()
+                         + "/" BRAFT_SNAPSHOT_DOWNLOAD_PROGRESS_FILE, _fs);
+    if (pb_file.save(&progress, true) != 0) {
+        LOG(WARNING) << "Fail to save the progress of copying snapshot to "
+                     << _writer->get_path();
+    }
+}
+
 void LocalSnapshotCopier::start() {
     if (bthread_start_background(
                 &_tid, NULL, start_copy, this) != 0) {
@@ -1018,8 +1993,9 @@ void LocalSnapshotCopier::cancel() {
         return;
     }
     _cancelled = true;
-    if (_cur_session) {
-        _cur_session->cancel();
+    for (std::set<RemoteFileCopier::Session*>::iterator
+            it = _cur_sessions.begin(); it != _cur_sessions.end(); ++it) {
+        (*it)->cancel();
     }
 }
 
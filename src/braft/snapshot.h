@@ -20,6 +20,8 @@
 #ifndef BRAFT_RAFT_SNAPSHOT_H
 #define BRAFT_RAFT_SNAPSHOT_H
 
+#include <map>
+#include <set>
 #include <string>
 #include "braft/storage.h"
 #include "braft/macros.h"
@@ -42,6 +44,9 @@ public:
     int load_from_file(FileSystemAdaptor* fs, const std::string& path);
     int get_file_meta(const std::string& filename, LocalFileMeta* file_meta) const;
     void list_files(std::vector<std::string> *files) const;
+    // Sum of the recorded file sizes, the files without a recorded size are
+    // appended to |unsized_files|
+    int64_t total_file_size(std::vector<std::string>* unsized_files) const;
     bool has_meta() { return _meta.IsInitialized(); }
     const SnapshotMeta& meta() { return _meta; }
     void set_meta(const SnapshotMeta& meta) { _meta = meta; }
@@ -73,6 +78,16 @@ public:
     // Remove a file from the snapshot, it doesn't guarantees that the real file
     // would be removed from the storage.
     virtual int remove_file(const std::string& filename);
+    // Open a stream which writes |filename| in the snapshot directory with
+    // buffered writes, computing its checksum and block checksums on the fly
+    virtual SnapshotStreamWriter* open_stream(const std::string& filename);
+    // Add |source_path| as |filename| by reflinking to it if the file system
+    // supports it, or hardlinking otherwise. The checksums of the file are
+    // cached by inode, so linking the same file to the next snapshot doesn't
+    // read it again.
+    virtual int link_file(const std::string& filename,
+                          const std::string& source_path,
+                          const ::google::protobuf::Message* file_meta);
     // List all the existing files in the Snapshot currently
     virtual void list_files(std::vector<std::string> *files);
 
@@ -81,6 +96,11 @@ public:
                               ::google::protobuf::Message* file_meta);
     // Sync meta table to disk
     int sync();
+    // Compute the block checksums for |block_size| (if positive) and, if
+    // |whole_file| is true, the checksums of the local files whose metas
+    // don't have them. Files are read by up to
+    // raft_snapshot_checksum_concurrency bthreads in parallel
+    void fill_checksums(int64_t block_size, bool whole_file);
     FileSystemAdaptor* file_system() { return _fs.get(); }
 private:
     // Users shouldn't create LocalSnapshotWriter Directly
@@ -110,6 +130,9 @@ public:
     // Get the implementation-defined file_meta
     virtual int get_file_meta(const std::string& filename, 
                               ::google::protobuf::Message* file_meta);
+    // Get the total size of the files from the meta table, the files whose
+    // sizes are not recorded are opened to get their sizes
+    virtual int64_t get_total_size();
 private:
     // Users shouldn't create LocalSnapshotReader Directly
     LocalSnapshotReader(const std::string& path,
@@ -160,7 +183,27 @@ private:
     int filter_before_copy(LocalSnapshotWriter* writer, 
                            SnapshotReader* last_snapshot);
     void filter();
-    void copy_file(const std::string& filename);
+    // Only the changed ranges of |filename| are copied if *copy_ranges is
+    // true and they can be found from the last snapshot, *copy_ranges is set
+    // to whether it's the case
+    scoped_refptr<RemoteFileCopier::Session> start_to_copy_file(
+            const std::string& filename, bool* copy_ranges);
+    void finish_copying_file(const std::string& filename,
+                             RemoteFileCopier::Session* session);
+    int build_from_last_snapshot(
+            const std::string& filename, const LocalFileMeta& remote_meta,
+            const std::string& dest_path,
+            std::vector<std::pair<int64_t, int64_t> >* ranges);
+    void copy_files(const std::vector<std::string>& files);
+    bool load_download_progress();
+    void save_download_progress();
+    void record_download_progress(const std::string& filename,
+                                  RemoteFileCopier::Session* session);
+    int64_t take_download_progress(const std::string& filename,
+                                   const LocalFileMeta& remote_meta,
+                                   const std::string& file_path);
+    bool is_resumable(const LocalFileMeta& local_meta,
+                      const LocalFileMeta& remote_meta);
 
     raft_mutex_t _mutex;
     bthread_t _tid;
@@ -171,7 +214,23 @@ private:
     LocalSnapshotWriter* _writer;
     LocalSnapshotStorage* _storage;
     SnapshotReader* _reader;
-    RemoteFileCopier::Session* _cur_session;
+    // The files copied entirely from the remote are also passed to it
+    SnapshotStreamLoader* _loader;
+    // Blocks of the files in this snapshot are reused if they are the same
+    // as the ones in the remote snapshot
+    SnapshotReader* _last_snapshot;
+    // Partly copied files of the interrupted install of the same snapshot,
+    // which are continued from where they stopped
+    struct PartialFile {
+        int64_t offset;
+        uint32_t checksum;
+        LocalFileMeta meta;
+    };
+    bool _resume;
+    std::string _partial_source;
+    std::map<std::string, PartialFile> _partial_files;
+    // Sessions in progress, which are to be cancelled by cancel()
+    std::set<RemoteFileCopier::Session*> _cur_sessions;
     LocalSnapshot _remote_snapshot;
     RemoteFileCopier _copier;
 };
@@ -194,6 +253,8 @@ public:
     virtual int close(SnapshotReader* reader);
     virtual SnapshotReader* copy_from(const std::string& uri) WARN_UNUSED_RESULT;
     virtual SnapshotCopier* start_to_copy_from(const std::string& uri);
+    virtual SnapshotCopier* start_to_stream_from(const std::string& uri,
+                                                 SnapshotStreamLoader* loader);
     virtual int close(SnapshotCopier* copier);
     virtual int set_filter_before_copy_remote();
     virtual int set_file_system_adaptor(FileSystemAdaptor* fs);
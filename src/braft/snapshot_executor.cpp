@@ -27,6 +27,8 @@ DEFINE_int32(raft_do_snapshot_min_index_gap, 1,
              " last_snapshot_index is equal to or larger than this value");
 BRPC_VALIDATE_GFLAG(raft_do_snapshot_min_index_gap, brpc::PositiveInteger);
 
+DECLARE_bool(raft_install_snapshot_from_followers);
+
 class SaveSnapshotDone : public SaveSnapshotClosure {
 public:
     SaveSnapshotDone(SnapshotExecutor* node, SnapshotWriter* writer, Closure* done);
@@ -47,14 +49,17 @@ private:
 class InstallSnapshotDone : public LoadSnapshotClosure {
 public:
     InstallSnapshotDone(SnapshotExecutor* se,
-                        SnapshotReader* reader);
+                        SnapshotReader* reader,
+                        SnapshotStreamLoader* loader);
     virtual ~InstallSnapshotDone();
 
     SnapshotReader* start();
+    SnapshotStreamLoader* stream_loader() { return _loader; }
     virtual void Run();
 private:
     SnapshotExecutor* _se;
     SnapshotReader* _reader;
+    SnapshotStreamLoader* _loader;
 };
 
 class FirstSnapshotLoadDone : public LoadSnapshotClosure {
@@ -84,18 +89,21 @@ private:
 SnapshotExecutor::SnapshotExecutor()
     : _last_snapshot_term(0)
     , _last_snapshot_index(0)
+    , _last_snapshot_time_ms(butil::monotonic_time_ms())
     , _term(0)
     , _saving_snapshot(false)
     , _loading_snapshot(false)
     , _stopped(false)
     , _snapshot_storage(NULL)
     , _cur_copier(NULL)
+    , _cur_loader(NULL)
     , _fsm_caller(NULL)
     , _node(NULL)
     , _log_manager(NULL)
     , _downloading_snapshot(NULL)
     , _running_jobs(0)
     , _snapshot_throttle(NULL)
+    , _served_reader(NULL)
 {
 }
 
@@ -106,6 +114,10 @@ SnapshotExecutor::~SnapshotExecutor() {
     CHECK(!_cur_copier);
     CHECK(!_loading_snapshot);
     CHECK(!_downloading_snapshot.load(butil::memory_order_relaxed));
+    if (_served_reader) {
+        _snapshot_storage->close(_served_reader);
+        _served_reader = NULL;
+    }
     if (_snapshot_storage) {
         delete _snapshot_storage;
     }
@@ -228,11 +240,14 @@ int SnapshotExecutor::on_snapshot_save_done(
     if (ret == 0) {
         _last_snapshot_index = meta.last_included_index();
         _last_snapshot_term = meta.last_included_term();
+        _last_snapshot_time_ms = butil::monotonic_time_ms();
         lck.unlock();
         ss << "snapshot_save_done, last_included_index=" << meta.last_included_index()
            << " last_included_term=" << meta.last_included_term(); 
         LOG(INFO) << ss.str();
         _log_manager->set_snapshot(&meta);
+        record_last_snapshot_size();
+        serve_last_snapshot();
         lck.lock();
     }
     if (ret == EIO) {
@@ -253,6 +268,7 @@ void SnapshotExecutor::on_snapshot_load_done(const butil::Status& st) {
     if (st.ok()) {
         _last_snapshot_index = _loading_snapshot_meta.last_included_index();
         _last_snapshot_term = _loading_snapshot_meta.last_included_term();
+        _last_snapshot_time_ms = butil::monotonic_time_ms();
         _log_manager->set_snapshot(&_loading_snapshot_meta);
     }
     std::stringstream ss;
@@ -267,6 +283,10 @@ void SnapshotExecutor::on_snapshot_load_done(const butil::Status& st) {
         // FIXME: race with set_peer, not sure if this is fine
         _node->update_configuration_after_installing_snapshot();
     }
+    if (st.ok()) {
+        record_last_snapshot_size();
+        serve_last_snapshot();
+    }
     lck.lock();
     _loading_snapshot = false;
     _downloading_snapshot.store(NULL, butil::memory_order_release);
@@ -466,6 +486,8 @@ void SnapshotExecutor::load_downloading_snapshot(DownloadingSnapshot* ds,
                             _cur_copier->error_cstr());
         _snapshot_storage->close(_cur_copier);
         _cur_copier = NULL;
+        delete _cur_loader;
+        _cur_loader = NULL;
         _downloading_snapshot.store(NULL, butil::memory_order_relaxed);
         // Release the lock before responding the RPC
         lck.unlock();
@@ -474,7 +496,10 @@ void SnapshotExecutor::load_downloading_snapshot(DownloadingSnapshot* ds,
     }
     _snapshot_storage->close(_cur_copier);
     _cur_copier = NULL;
+    SnapshotStreamLoader* loader = _cur_loader;
+    _cur_loader = NULL;
     if (reader == NULL || !reader->ok()) {
+        delete loader;
         if (reader) {
             _snapshot_storage->close(reader);
         }
@@ -494,7 +519,7 @@ void SnapshotExecutor::load_downloading_snapshot(DownloadingSnapshot* ds,
     _loading_snapshot_meta = meta;
     lck.unlock();
     InstallSnapshotDone* install_snapshot_done =
-            new InstallSnapshotDone(this, reader);
+            new InstallSnapshotDone(this, reader, loader);
     int ret = _fsm_caller->on_snapshot_load(install_snapshot_done);
     if (ret != 0) {
         LOG(WARNING) << "node " << _node->node_id() << " fail to call on_snapshot_load";
@@ -504,6 +529,21 @@ void SnapshotExecutor::load_downloading_snapshot(DownloadingSnapshot* ds,
 }
 
 int SnapshotExecutor::register_downloading_snapshot(DownloadingSnapshot* ds) {
+    bool may_download = false;
+    {
+        BAIDU_SCOPED_LOCK(_mutex);
+        may_download = !_stopped && ds->request->term() == _term
+            && ds->request->meta().last_included_index() > _last_snapshot_index
+            && !_saving_snapshot
+            && !_downloading_snapshot.load(butil::memory_order_relaxed);
+    }
+    // The loader is created by user code out of _mutex, and it's destroyed
+    // without being used if the state has changed in the meantime
+    std::unique_ptr<SnapshotStreamLoader> loader_guard;
+    if (may_download) {
+        loader_guard.reset(_fsm_caller->new_snapshot_stream_loader(
+                                ds->request->meta()));
+    }
     std::unique_lock<raft_mutex_t> lck(_mutex);
     if (_stopped) {
         LOG(WARNING) << "Register failed: node is stopped.";
@@ -534,7 +574,9 @@ int SnapshotExecutor::register_downloading_snapshot(DownloadingSnapshot* ds) {
         _downloading_snapshot.store(ds, butil::memory_order_relaxed);
         // Now this session has the right to download the snapshot.
         CHECK(!_cur_copier);
-        _cur_copier = _snapshot_storage->start_to_copy_from(ds->request->uri());
+        CHECK(!_cur_loader);
+        _cur_copier = _snapshot_storage->start_to_stream_from(
+                ds->request->uri(), loader_guard.get());
         if (_cur_copier == NULL) {
             _downloading_snapshot.store(NULL, butil::memory_order_relaxed);
             lck.unlock();
@@ -543,6 +585,7 @@ int SnapshotExecutor::register_downloading_snapshot(DownloadingSnapshot* ds) {
                                 ds->request->uri().c_str());
             return -1;
         }
+        _cur_loader = loader_guard.release();
         _running_jobs.add_count(1);
         return 0;
     }
@@ -627,6 +670,12 @@ void SnapshotExecutor::report_error(int error_code, const char* fmt, ...) {
     _fsm_caller->on_error(e);
 }
 
+void SnapshotExecutor::get_last_snapshot(int64_t* index, int64_t* time_ms) {
+    BAIDU_SCOPED_LOCK(_mutex);
+    *index = _last_snapshot_index;
+    *time_ms = _last_snapshot_time_ms;
+}
+
 void SnapshotExecutor::describe(std::ostream&os, bool use_html) {
     SnapshotMeta meta;
     InstallSnapshotRequest request;
@@ -673,18 +722,80 @@ void SnapshotExecutor::shutdown() {
     std::unique_lock<raft_mutex_t> lck(_mutex);
     const int64_t saved_term = _term;
     _stopped = true;
+    SnapshotReader* served_reader = _served_reader;
+    _served_reader = NULL;
+    _served_uri.clear();
     lck.unlock();
+    if (served_reader) {
+        _snapshot_storage->close(served_reader);
+    }
     interrupt_downloading_snapshot(saved_term);
 }
 
+void SnapshotExecutor::record_last_snapshot_size() {
+    SnapshotReader* reader = _snapshot_storage->open();
+    if (reader == NULL) {
+        return;
+    }
+    SnapshotMeta meta;
+    if (reader->load_meta(&meta) == 0) {
+        _log_manager->set_snapshot_size(meta.last_included_index(),
+                                        reader->get_total_size());
+    }
+    _snapshot_storage->close(reader);
+}
+
+void SnapshotExecutor::serve_last_snapshot() {
+    if (!FLAGS_raft_install_snapshot_from_followers) {
+        return;
+    }
+    SnapshotReader* reader = _snapshot_storage->open();
+    if (reader == NULL) {
+        return;
+    }
+    SnapshotMeta meta;
+    std::string uri = reader->generate_uri_for_copy();
+    if (uri.empty() || reader->load_meta(&meta) != 0) {
+        _snapshot_storage->close(reader);
+        return;
+    }
+    std::unique_lock<raft_mutex_t> lck(_mutex);
+    if (_stopped) {
+        lck.unlock();
+        _snapshot_storage->close(reader);
+        return;
+    }
+    std::swap(reader, _served_reader);
+    _served_uri.swap(uri);
+    _served_meta.Swap(&meta);
+    lck.unlock();
+    if (reader) {
+        // Peers copying the previous snapshot fail and try another source
+        _snapshot_storage->close(reader);
+    }
+}
+
+bool SnapshotExecutor::get_served_snapshot(const std::string& known_uri,
+                                           std::string* uri,
+                                           SnapshotMeta* meta) {
+    BAIDU_SCOPED_LOCK(_mutex);
+    if (!_served_reader || _served_uri == known_uri) {
+        return false;
+    }
+    *uri = _served_uri;
+    *meta = _served_meta;
+    return true;
+}
+
 void SnapshotExecutor::join() {
     // Wait until all the running jobs finishes
     _running_jobs.wait();
 }
 
 InstallSnapshotDone::InstallSnapshotDone(SnapshotExecutor* se, 
-                                         SnapshotReader* reader)
-    : _se(se) , _reader(reader) {
+                                         SnapshotReader* reader,
+                                         SnapshotStreamLoader* loader)
+    : _se(se) , _reader(reader), _loader(loader) {
     // node not need AddRef, FSMCaller::shutdown will flush running InstallSnapshot task
 }
 
@@ -692,6 +803,7 @@ InstallSnapshotDone::~InstallSnapshotDone() {
     if (_reader) {
         _se->snapshot_storage()->close(_reader);
     }
+    delete _loader;
 }
 
 SnapshotReader* InstallSnapshotDone::start() {
@@ -107,8 +107,18 @@ public:
     // Return the backing snapshot storage
     SnapshotStorage* snapshot_storage() { return _snapshot_storage; }
 
+    // Get the uri and meta of the last snapshot, which is kept open for the
+    // other peers to copy if raft_install_snapshot_from_followers is set.
+    // Returns false if there's no such snapshot, or its uri is |known_uri|
+    bool get_served_snapshot(const std::string& known_uri,
+                             std::string* uri, SnapshotMeta* meta);
+
     void describe(std::ostream& os, bool use_html);
 
+    // Get the last_included_index of the last snapshot and the monotonic time
+    // in ms when it was saved or installed, or when this executor started
+    void get_last_snapshot(int64_t* index, int64_t* time_ms);
+
     // Shutdown the SnapshotExecutor and all the following jobs would be refused
     void shutdown();
 
@@ -140,10 +150,15 @@ friend class InstallSnapshotDone;
     void load_downloading_snapshot(DownloadingSnapshot* ds,
                                   const SnapshotMeta& meta);
     void report_error(int error_code, const char* fmt, ...);
+    void serve_last_snapshot();
+    // Tell LogManager the size of the last snapshot, so that the replicators
+    // don't have to open it on their sending path
+    void record_last_snapshot_size();
 
     raft_mutex_t _mutex;
     int64_t _last_snapshot_term;
     int64_t _last_snapshot_index;
+    int64_t _last_snapshot_time_ms;
     int64_t _term;
     bool _saving_snapshot;
     bool _loading_snapshot;
@@ -151,6 +166,8 @@ friend class InstallSnapshotDone;
     bool _usercode_in_pthread;
     SnapshotStorage* _snapshot_storage;
     SnapshotCopier* _cur_copier;
+    // Consumes the snapshot being downloaded if the StateMachine supports it
+    SnapshotStreamLoader* _cur_loader;
     FSMCaller* _fsm_caller;
     NodeImpl* _node;
     LogManager* _log_manager;
@@ -163,6 +180,9 @@ friend class InstallSnapshotDone;
     SnapshotMeta _loading_snapshot_meta;
     bthread::CountdownEvent _running_jobs;
     scoped_refptr<SnapshotThrottle> _snapshot_throttle;
+    SnapshotReader* _served_reader;
+    std::string _served_uri;
+    SnapshotMeta _served_meta;
 };
 
 inline SnapshotExecutorOptions::SnapshotExecutorOptions() 
@@ -34,6 +34,32 @@ DEFINE_int32(raft_max_install_snapshot_tasks_num, 1000,
 BRPC_VALIDATE_GFLAG(raft_max_install_snapshot_tasks_num, 
                     brpc::PositiveInteger);
 
+DEFINE_int64(raft_adaptive_throttle_max_log_sync_latency_us, 20 * 1000,
+             "AdaptiveSnapshotThrottle backs off when the average latency of"
+             " log syncs exceeds this value");
+BRPC_VALIDATE_GFLAG(raft_adaptive_throttle_max_log_sync_latency_us,
+                    brpc::PositiveInteger);
+DEFINE_int64(raft_adaptive_throttle_max_apply_queue_delay_us, 50 * 1000,
+             "AdaptiveSnapshotThrottle backs off when the average time the"
+             " tasks wait to be applied exceeds this value");
+BRPC_VALIDATE_GFLAG(raft_adaptive_throttle_max_apply_queue_delay_us,
+                    brpc::PositiveInteger);
+DEFINE_int32(raft_adaptive_throttle_adjust_interval_ms, 1000,
+             "Interval between two adjustments of AdaptiveSnapshotThrottle");
+BRPC_VALIDATE_GFLAG(raft_adaptive_throttle_adjust_interval_ms,
+                    brpc::NonNegativeInteger);
+
+static bvar::IntRecorder g_log_sync_latency;
+static bvar::IntRecorder g_apply_queue_delay;
+
+void record_log_sync_latency(int64_t latency_us) {
+    g_log_sync_latency << latency_us;
+}
+
+void record_apply_queue_delay(int64_t delay_us) {
+    g_apply_queue_delay << delay_us;
+}
+
 ThroughputSnapshotThrottle::ThroughputSnapshotThrottle(
         int64_t throttle_throughput_bytes, int64_t check_cycle) 
     : _throttle_throughput_bytes(throttle_throughput_bytes)
@@ -49,7 +75,7 @@ ThroughputSnapshotThrottle::~ThroughputSnapshotThrottle() {}
 size_t ThroughputSnapshotThrottle::throttled_by_throughput(int64_t bytes) {
     size_t available_size = bytes;
     int64_t now = butil::cpuwide_time_us();
-    int64_t limit_throughput_bytes_s = std::max(_throttle_throughput_bytes,
+    int64_t limit_throughput_bytes_s = std::max(throughput_limit(),
                 FLAGS_raft_minimal_throttle_threshold_mb * 1024 *1024);
     int64_t limit_per_cycle = limit_throughput_bytes_s / _check_cycle;
     std::unique_lock<raft_mutex_t> lck(_mutex);
@@ -125,4 +151,73 @@ void ThroughputSnapshotThrottle::return_unused_throughput(
             _cur_throughput_bytes - (acquired - consumed), int64_t(0));
 }
 
+AdaptiveSnapshotThrottle::AdaptiveSnapshotThrottle(
+        int64_t min_throughput_bytes, int64_t max_throughput_bytes,
+        int64_t check_cycle)
+    : ThroughputSnapshotThrottle(max_throughput_bytes, check_cycle)
+    , _min_throughput_bytes(min_throughput_bytes)
+    , _max_throughput_bytes(std::max(min_throughput_bytes, max_throughput_bytes))
+    , _cur_throughput_bytes(min_throughput_bytes)
+    , _last_adjust_time_us(butil::cpuwide_time_us())
+    , _last_log_sync_latency(g_log_sync_latency.get_value())
+    , _last_apply_queue_delay(g_apply_queue_delay.get_value())
+{}
+
+AdaptiveSnapshotThrottle::~AdaptiveSnapshotThrottle() {}
+
+int AdaptiveSnapshotThrottle::expose(const butil::StringPiece& prefix) {
+    std::string name(prefix.data(), prefix.size());
+    if (_cur_throughput_bytes.expose(name + "_throughput") != 0) {
+        return -1;
+    }
+    return _backoff_count.expose(name + "_backoff_count");
+}
+
+size_t AdaptiveSnapshotThrottle::throttled_by_throughput(int64_t bytes) {
+    maybe_adjust();
+    return ThroughputSnapshotThrottle::throttled_by_throughput(bytes);
+}
+
+static int64_t average_since(const bvar::Stat& last, const bvar::Stat& now) {
+    const int64_t num = now.num - last.num;
+    return num > 0 ? (now.sum - last.sum) / num : 0;
+}
+
+void AdaptiveSnapshotThrottle::maybe_adjust() {
+    const int64_t now = butil::cpuwide_time_us();
+    std::unique_lock<raft_mutex_t> lck(_adjust_mutex);
+    if (now - _last_adjust_time_us <
+            FLAGS_raft_adaptive_throttle_adjust_interval_ms * 1000L) {
+        return;
+    }
+    _last_adjust_time_us = now;
+    const bvar::Stat log_sync_latency = g_log_sync_latency.get_value();
+    const bvar::Stat apply_queue_delay = g_apply_queue_delay.get_value();
+    const int64_t avg_log_sync_latency =
+            average_since(_last_log_sync_latency, log_sync_latency);
+    const int64_t avg_apply_queue_delay =
+            average_since(_last_apply_queue_delay, apply_queue_delay);
+    _last_log_sync_latency = log_sync_latency;
+    _last_apply_queue_delay = apply_queue_delay;
+
+    const int64_t cur = _cur_throughput_bytes.get_value();
+    int64_t next = cur;
+    if (avg_log_sync_latency > FLAGS_raft_adaptive_throttle_max_log_sync_latency_us
+            || avg_apply_queue_delay
+                    > FLAGS_raft_adaptive_throttle_max_apply_queue_delay_us) {
+        next = std::max(cur / 2, _min_throughput_bytes);
+        _backoff_count << 1;
+    } else {
+        next = std::min(cur + std::max(_max_throughput_bytes / 10, int64_t(1)),
+                        _max_throughput_bytes);
+    }
+    _cur_throughput_bytes.set_value(next);
+    lck.unlock();
+    if (next != cur) {
+        BRAFT_VLOG << "Adjust snapshot throughput from " << cur << " to " << next
+                   << ", log_sync_latency_us=" << avg_log_sync_latency
+                   << " apply_queue_delay_us=" << avg_apply_queue_delay;
+    }
+}
+
 }  //  namespace braft
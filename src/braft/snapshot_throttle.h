@@ -18,6 +18,7 @@
 #define  BRAFT_SNAPSHOT_THROTTLE_H
 
 #include <butil/memory/ref_counted.h>                // butil::RefCountedThreadSafe
+#include <bvar/bvar.h>
 #include "braft/util.h"
 
 namespace braft {
@@ -53,7 +54,7 @@ private:
 class ThroughputSnapshotThrottle : public SnapshotThrottle {
 public:
     ThroughputSnapshotThrottle(int64_t throttle_throughput_bytes, int64_t check_cycle);
-    int64_t get_throughput() const { return _throttle_throughput_bytes; }
+    int64_t get_throughput() const { return throughput_limit(); }
     int64_t get_cycle() const { return _check_cycle; }
     size_t throttled_by_throughput(int64_t bytes);
     bool add_one_more_task(bool is_leader);
@@ -62,8 +63,14 @@ public:
     void return_unused_throughput(
             int64_t acquired, int64_t consumed, int64_t elaspe_time_us);
 
+protected:
+    virtual ~ThroughputSnapshotThrottle();
+    // Throughput threshold applied to the next cycles, bytes per second
+    virtual int64_t throughput_limit() const {
+        return _throttle_throughput_bytes;
+    }
+
 private:
-    ~ThroughputSnapshotThrottle();
     // user defined throughput threshold for raft, bytes per second
     int64_t _throttle_throughput_bytes;
     // user defined check cycles of throughput per second
@@ -75,6 +82,45 @@ private:
     raft_mutex_t _mutex;
 };
 
+// SnapshotThrottle whose throughput threshold follows the latency of the
+// foreground IO of all the nodes in this process, i.e. the log syncs and the
+// queueing of the tasks to apply. The threshold is raised by a tenth of
+// |max_throughput_bytes| every adjusting interval while they're fast enough,
+// and halved once they slow down, within [min_throughput_bytes,
+// max_throughput_bytes].
+class AdaptiveSnapshotThrottle : public ThroughputSnapshotThrottle {
+public:
+    AdaptiveSnapshotThrottle(int64_t min_throughput_bytes,
+                             int64_t max_throughput_bytes,
+                             int64_t check_cycle);
+    size_t throttled_by_throughput(int64_t bytes);
+    // Expose the current threshold and the times of backing off as bvars
+    // named |prefix|_throughput and |prefix|_backoff_count
+    int expose(const butil::StringPiece& prefix);
+
+protected:
+    int64_t throughput_limit() const {
+        return _cur_throughput_bytes.get_value();
+    }
+
+private:
+    ~AdaptiveSnapshotThrottle();
+    void maybe_adjust();
+
+    int64_t _min_throughput_bytes;
+    int64_t _max_throughput_bytes;
+    bvar::Status<int64_t> _cur_throughput_bytes;
+    bvar::Adder<int64_t> _backoff_count;
+    raft_mutex_t _adjust_mutex;
+    int64_t _last_adjust_time_us;
+    bvar::Stat _last_log_sync_latency;
+    bvar::Stat _last_apply_queue_delay;
+};
+
+// Report the foreground IO watched by AdaptiveSnapshotThrottle
+void record_log_sync_latency(int64_t latency_us);
+void record_apply_queue_delay(int64_t delay_us);
+
 inline int64_t caculate_check_time_us(int64_t current_time_us, 
         int64_t check_cycle) {
     int64_t base_aligning_time_us = 1000 * 1000 / check_cycle;
@@ -22,6 +22,7 @@
 #include <vector>
 #include <gflags/gflags.h>
 #include <butil/status.h>
+#include <butil/iobuf.h>
 #include <butil/class_name.h>
 #include <brpc/extension.h>
 #include <butil/strings/string_piece.h>
@@ -235,6 +236,27 @@ public:
     }
 };
 
+// Writes a file of a snapshot from the data appended to it, see
+// SnapshotWriter::open_stream
+class SnapshotStreamWriter {
+public:
+    virtual ~SnapshotStreamWriter() {}
+
+    // Append |data| to the end of the file. The data is buffered and written
+    // in background, an error of the write is returned by a later append or
+    // close.
+    // Returns 0 on success, -1 otherwise
+    virtual int append(const butil::IOBuf& data) = 0;
+    virtual int append(const void* data, size_t size) = 0;
+
+    // Write out all the appended data and add the file to the snapshot with
+    // |file_meta| like SnapshotWriter::add_file. Nothing can be appended after
+    // that.
+    // Returns 0 on success, -1 otherwise
+    virtual int close(const ::google::protobuf::Message* file_meta) = 0;
+    int close() { return close(NULL); }
+};
+
 class SnapshotWriter : public Snapshot {
 public:
     SnapshotWriter() {}
@@ -261,6 +283,33 @@ public:
     // Note that whether the file will be removed from the backing storage is
     // implementation-defined.
     virtual int remove_file(const std::string& filename) = 0;
+
+    // Add the file at |source_path| to the snapshot as |filename| without
+    // copying its data, which is meant for immutable files like the tables of
+    // LSM trees. The file must not be modified in place afterwards.
+    // Returns 0 on success, -1 if it fails or the implementation doesn't
+    // support it.
+    virtual int link_file(const std::string& filename,
+                          const std::string& source_path,
+                          const ::google::protobuf::Message* file_meta) {
+        (void)filename;
+        (void)source_path;
+        (void)file_meta;
+        return -1;
+    }
+
+    // Open a stream writing the file |filename| of the snapshot, so that
+    // state machines living in memory don't have to create the files by
+    // themselves. Different streams can be appended concurrently, but
+    // opening and closing them is not thread-safe with the other methods of
+    // the writer. The stream must be closed and deleted before the writer; it
+    // is discarded if it's deleted without being closed.
+    // Returns NULL if the stream can't be opened or the implementation
+    // doesn't support it.
+    virtual SnapshotStreamWriter* open_stream(const std::string& filename) {
+        (void)filename;
+        return NULL;
+    }
 };
 
 class SnapshotReader : public Snapshot {
@@ -274,6 +323,11 @@ public:
     // Generate uri for other peers to copy this snapshot.
     // Return an empty string if some error has occcured
     virtual std::string generate_uri_for_copy() = 0;
+
+    // Get the total size of the files in this snapshot, which the leader
+    // weighs against the logs to replicate to a follower falling behind.
+    // Returns -1 if it's unknown.
+    virtual int64_t get_total_size() { return -1; }
 };
 
 // Copy Snapshot from the given resource
@@ -291,6 +345,7 @@ public:
 class SnapshotHook;
 class FileSystemAdaptor;
 class SnapshotThrottle;
+class SnapshotStreamLoader;
 
 class SnapshotStorage {
 public:
@@ -334,6 +389,14 @@ public:
     // Copy snapshot from uri and open it as a SnapshotReader
     virtual SnapshotReader* copy_from(const std::string& uri) WARN_UNUSED_RESULT = 0;
     virtual SnapshotCopier* start_to_copy_from(const std::string& uri) = 0;
+    // Same as start_to_copy_from, and the downloaded data is also passed to
+    // |loader|, see SnapshotStreamLoader for which files are passed.
+    // Default: ignore |loader|
+    virtual SnapshotCopier* start_to_stream_from(const std::string& uri,
+                                                 SnapshotStreamLoader* loader) {
+        (void)loader;
+        return start_to_copy_from(uri);
+    }
     virtual int close(SnapshotCopier* copier) = 0;
 
     // Create an instance of this kind of SnapshotStorage with the parameters encoded 
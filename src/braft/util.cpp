@@ -283,6 +283,35 @@ void run_closure_in_bthread_nosig(google::protobuf::Closure* closure,
     }
 }
 
+static void* run_closures(void* arg) {
+    std::vector<google::protobuf::Closure*>* closures =
+            (std::vector<google::protobuf::Closure*>*)arg;
+    for (size_t i = 0; i < closures->size(); ++i) {
+        (*closures)[i]->Run();
+    }
+    delete closures;
+    return NULL;
+}
+
+void run_closures_in_bthread(
+        std::vector<google::protobuf::Closure*>* closures, bool in_pthread) {
+    if (closures->empty()) {
+        return;
+    }
+    std::vector<google::protobuf::Closure*>* saved_closures =
+            new std::vector<google::protobuf::Closure*>;
+    saved_closures->swap(*closures);
+    bthread_t tid;
+    bthread_attr_t attr = (in_pthread) 
+                          ? BTHREAD_ATTR_PTHREAD : BTHREAD_ATTR_NORMAL;
+    int ret = bthread_start_background(&tid, &attr, run_closures,
+                                       saved_closures);
+    if (0 != ret) {
+        PLOG(ERROR) << "Fail to start bthread";
+        run_closures(saved_closures);
+    }
+}
+
 ssize_t file_pread(butil::IOPortal* portal, int fd, off_t offset, size_t size) {
     off_t orig_offset = offset;
     ssize_t left = size;
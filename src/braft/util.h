@@ -25,6 +25,7 @@
 #include <stdlib.h>
 #include <string>
 #include <set>
+#include <vector>
 #include <butil/third_party/murmurhash3/murmurhash3.h>
 #include <butil/endpoint.h>
 #include <butil/scoped_lock.h>
@@ -240,6 +241,12 @@ typedef std::unique_ptr<google::protobuf::Closure, RunClosureInBthread>
 void run_closure_in_bthread_nosig(::google::protobuf::Closure* closure,
                                   bool in_pthread = false);
 
+// Start a single bthread to run all the closures in |closures| in order,
+// |closures| is cleared.
+void run_closures_in_bthread(
+        std::vector< ::google::protobuf::Closure*>* closures,
+        bool in_pthread = false);
+
 struct RunClosureInBthreadNoSig {
     void operator()(google::protobuf::Closure* done) {
         return run_closure_in_bthread_nosig(done);
@@ -0,0 +1,159 @@
+// libraft - Quorum-based replication of states across machines.
+// Copyright (c) 2019 Baidu.com, Inc. All Rights Reserved
+
+#include <gtest/gtest.h>
+#include <gflags/gflags.h>
+#include <bthread/countdown_event.h>
+#include "braft/apply_admission.h"
+
+namespace braft {
+DECLARE_int64(raft_max_inflight_apply_tasks);
+DECLARE_int64(raft_max_inflight_apply_bytes);
+DECLARE_int64(raft_max_process_inflight_apply_bytes);
+}
+
+class ApplyAdmissionTest : public testing::Test {
+protected:
+    void SetUp() {
+        braft::FLAGS_raft_max_inflight_apply_tasks = 4;
+        braft::FLAGS_raft_max_inflight_apply_bytes = 100;
+    }
+    void TearDown() {
+        braft::FLAGS_raft_max_inflight_apply_tasks = 0;
+        braft::FLAGS_raft_max_inflight_apply_bytes = 0;
+        braft::FLAGS_raft_max_process_inflight_apply_bytes = 0;
+    }
+};
+
+class WaitClosure : public braft::Closure {
+public:
+    WaitClosure() : _event(1) {}
+    void Run() { _event.signal(); }
+    void join() { _event.wait(); }
+private:
+    bthread::CountdownEvent _event;
+};
+
+TEST_F(ApplyAdmissionTest, admission) {
+    braft::ApplyAdmission admission;
+    // A single task of an idle node is always admitted
+    ASSERT_TRUE(admission.try_acquire(1, 1000));
+    ASSERT_FALSE(admission.try_acquire(1, 10));
+    admission.release(1, 1000);
+    ASSERT_EQ(0, admission.inflight_tasks());
+    // But not a bulk over the limits
+    ASSERT_FALSE(admission.try_acquire(5, 50));
+    ASSERT_FALSE(admission.try_acquire(2, 200));
+    ASSERT_EQ(0, admission.inflight_tasks());
+    ASSERT_EQ(0, admission.inflight_bytes());
+
+    ASSERT_TRUE(admission.try_acquire(2, 20));
+    ASSERT_TRUE(admission.try_acquire(2, 20));
+    // Over the limit of tasks
+    ASSERT_FALSE(admission.try_acquire(1, 10));
+    ASSERT_EQ(4, admission.inflight_tasks());
+    ASSERT_EQ(40, admission.inflight_bytes());
+    admission.release(2, 20);
+    // Over the limit of bytes
+    ASSERT_FALSE(admission.try_acquire(1, 90));
+    ASSERT_TRUE(admission.try_acquire(1, 60));
+    ASSERT_EQ(3, admission.inflight_tasks());
+    ASSERT_EQ(80, admission.inflight_bytes());
+    admission.release(3, 80);
+}
+
+TEST_F(ApplyAdmissionTest, process_limits) {
+    braft::FLAGS_raft_max_process_inflight_apply_bytes = 100;
+    braft::ApplyAdmission admission1;
+    braft::ApplyAdmission admission2;
+    ASSERT_TRUE(admission1.try_acquire(1, 80));
+    // The single task of another idle node is still bounded by the limits
+    // of the process
+    ASSERT_FALSE(admission2.try_acquire(1, 80));
+    ASSERT_TRUE(admission2.try_acquire(1, 20));
+    admission2.release(1, 20);
+    admission1.release(1, 80);
+    // Unless the whole process is idle
+    ASSERT_TRUE(admission2.try_acquire(1, 1000));
+    admission2.release(1, 1000);
+    ASSERT_EQ(0, admission1.inflight_bytes());
+    ASSERT_EQ(0, admission2.inflight_bytes());
+}
+
+TEST_F(ApplyAdmissionTest, release_on_rejection) {
+    braft::ApplyAdmission admission;
+    ASSERT_TRUE(admission.try_acquire(4, 40));
+    // The rejected tasks take no quota
+    for (int i = 0; i < 10; ++i) {
+        ASSERT_FALSE(admission.try_acquire(1, 10));
+    }
+    ASSERT_EQ(4, admission.inflight_tasks());
+    ASSERT_EQ(40, admission.inflight_bytes());
+    // The tasks rejected after being admitted, e.g. as the node is not the
+    // leader, give their quota back
+    admission.release(1, 10);
+    ASSERT_TRUE(admission.try_acquire(1, 10));
+    admission.release(4, 40);
+    ASSERT_EQ(0, admission.inflight_tasks());
+    ASSERT_EQ(0, admission.inflight_bytes());
+}
+
+TEST_F(ApplyAdmissionTest, release_on_applied) {
+    braft::ApplyAdmission admission;
+    ASSERT_TRUE(admission.try_acquire(2, 20));
+    admission.on_appended(10, 2, 20);
+    ASSERT_TRUE(admission.try_acquire(2, 20));
+    admission.on_appended(12, 2, 20);
+    admission.on_applied(9);
+    ASSERT_EQ(4, admission.inflight_tasks());
+    admission.on_applied(11);
+    ASSERT_EQ(2, admission.inflight_tasks());
+    ASSERT_EQ(20, admission.inflight_bytes());
+    admission.on_applied(12);
+    ASSERT_EQ(0, admission.inflight_tasks());
+    ASSERT_EQ(0, admission.inflight_bytes());
+}
+
+TEST_F(ApplyAdmissionTest, applied_before_appended) {
+    braft::ApplyAdmission admission;
+    ASSERT_TRUE(admission.try_acquire(4, 40));
+    WaitClosure waiter;
+    admission.wait(&waiter);
+    // The logs are applied before they are recorded, the quota must not be
+    // held until a later apply
+    admission.on_applied(20);
+    ASSERT_EQ(4, admission.inflight_tasks());
+    admission.on_appended(20, 4, 40);
+    ASSERT_EQ(0, admission.inflight_tasks());
+    ASSERT_EQ(0, admission.inflight_bytes());
+    waiter.join();
+    ASSERT_TRUE(waiter.status().ok());
+    ASSERT_TRUE(admission.try_acquire(4, 40));
+    admission.on_appended(21, 4, 40);
+    ASSERT_EQ(4, admission.inflight_tasks());
+    admission.on_applied(21);
+    ASSERT_EQ(0, admission.inflight_tasks());
+}
+
+TEST_F(ApplyAdmissionTest, wait_and_stop) {
+    braft::ApplyAdmission admission;
+    ASSERT_TRUE(admission.try_acquire(4, 40));
+    admission.on_appended(4, 4, 40);
+    WaitClosure waiter;
+    admission.wait(&waiter);
+    admission.on_applied(4);
+    waiter.join();
+    ASSERT_TRUE(waiter.status().ok());
+
+    ASSERT_TRUE(admission.try_acquire(4, 40));
+    WaitClosure failed_waiter;
+    admission.wait(&failed_waiter);
+    admission.stop();
+    failed_waiter.join();
+    ASSERT_EQ(EPERM, failed_waiter.status().error_code());
+    WaitClosure late_waiter;
+    admission.wait(&late_waiter);
+    late_waiter.join();
+    ASSERT_EQ(EPERM, late_waiter.status().error_code());
+    admission.release(4, 40);
+}
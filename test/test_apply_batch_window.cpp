@@ -0,0 +1,81 @@
+// libraft - Quorum-based replication of states across machines.
+// Copyright (c) 2019 Baidu.com, Inc. All Rights Reserved
+
+#include <gtest/gtest.h>
+#include <gflags/gflags.h>
+#include <butil/time.h>
+#include "braft/apply_batch_window.h"
+
+namespace braft {
+DECLARE_int32(raft_apply_batch_max_wait_us);
+DECLARE_int32(raft_apply_batch_p99_target_us);
+DECLARE_int32(raft_apply_batch_window_samples);
+}
+
+class ApplyBatchWindowTest : public testing::Test {
+protected:
+    void SetUp() {
+        braft::FLAGS_raft_apply_batch_max_wait_us = 1000;
+        braft::FLAGS_raft_apply_batch_p99_target_us = 10 * 1000;
+        braft::FLAGS_raft_apply_batch_window_samples = 10;
+    }
+    void TearDown() {
+        braft::FLAGS_raft_apply_batch_max_wait_us = 0;
+        braft::FLAGS_raft_apply_batch_p99_target_us = 0;
+        braft::FLAGS_raft_apply_batch_window_samples = 128;
+    }
+};
+
+TEST_F(ApplyBatchWindowTest, fixed_window) {
+    braft::ApplyBatchWindow window;
+    braft::FLAGS_raft_apply_batch_p99_target_us = 0;
+    ASSERT_EQ(1000, window.window_us());
+    braft::FLAGS_raft_apply_batch_max_wait_us = 0;
+    ASSERT_EQ(0, window.window_us());
+}
+
+TEST_F(ApplyBatchWindowTest, grow_and_back_off) {
+    braft::ApplyBatchWindow window;
+    ASSERT_EQ(0, window.window_us());
+    // Fast batches make the window grow until the max wait
+    for (int i = 0; i < 1000; ++i) {
+        window.on_batch_committed(butil::cpuwide_time_us(), false);
+    }
+    ASSERT_EQ(1000, window.window_us());
+    // Full batches don't need a longer window
+    braft::FLAGS_raft_apply_batch_max_wait_us = 2000;
+    for (int i = 0; i < 100; ++i) {
+        window.on_batch_committed(butil::cpuwide_time_us(), true);
+    }
+    ASSERT_EQ(1000, window.window_us());
+    // Slow batches halve the window
+    for (int i = 0; i < 10; ++i) {
+        window.on_batch_committed(butil::cpuwide_time_us() - 20 * 1000, false);
+    }
+    ASSERT_EQ(500, window.window_us());
+}
+
+TEST_F(ApplyBatchWindowTest, commit_latency) {
+    braft::ApplyBatchWindow window;
+    // Fast batches are only sampled once committed
+    for (int i = 1; i <= 10; ++i) {
+        window.on_batch_appended(i, butil::cpuwide_time_us(), false);
+    }
+    window.on_committed(9);
+    ASSERT_EQ(0, window.window_us());
+    window.on_committed(10);
+    ASSERT_EQ(62, window.window_us());
+    // The batches committed slowly halve the window
+    for (int i = 11; i <= 20; ++i) {
+        window.on_batch_appended(i, butil::cpuwide_time_us() - 20 * 1000, false);
+    }
+    window.on_committed(20);
+    ASSERT_EQ(31, window.window_us());
+    // The batches of a leader which stepped down are never sampled
+    for (int i = 21; i <= 30; ++i) {
+        window.on_batch_appended(i, butil::cpuwide_time_us() - 20 * 1000, false);
+    }
+    window.clear();
+    window.on_committed(30);
+    ASSERT_EQ(31, window.window_us());
+}
@@ -0,0 +1,138 @@
+// libraft - Quorum-based replication of states across machines.
+// Copyright (c) 2019 Baidu.com, Inc. All Rights Reserved
+
+#include <pthread.h>
+#include <gtest/gtest.h>
+#include <butil/atomicops.h>
+#include "braft/closure_queue.h"
+#include "braft/raft.h"
+
+class ClosureQueueTest : public testing::Test {
+protected:
+    void SetUp() {}
+    void TearDown() {}
+};
+
+class CountClosure : public braft::Closure {
+public:
+    CountClosure(butil::atomic<int>* ok, butil::atomic<int>* failed)
+        : _ok(ok), _failed(failed) {}
+    void Run() {
+        if (status().ok()) {
+            _ok->fetch_add(1);
+        } else {
+            _failed->fetch_add(1);
+        }
+        delete this;
+    }
+private:
+    butil::atomic<int>* _ok;
+    butil::atomic<int>* _failed;
+};
+
+TEST_F(ClosureQueueTest, pop_by_index) {
+    butil::atomic<int> ok(0);
+    butil::atomic<int> failed(0);
+    braft::ClosureQueue cq(false);
+    std::vector<braft::Closure*> out;
+    int64_t first_index = 0;
+    // Nothing pending on followers
+    ASSERT_EQ(0, cq.pop_closure_until(100, &out, &first_index));
+    ASSERT_TRUE(out.empty());
+    ASSERT_EQ(101, first_index);
+
+    cq.reset_first_index(10);
+    // More closures than the initial capacity of the ring
+    const int N = 5000;
+    for (int i = 0; i < N; ++i) {
+        cq.append_pending_closure(new CountClosure(&ok, &failed));
+    }
+    ASSERT_EQ(0, cq.pop_closure_until(9, &out, &first_index));
+    ASSERT_TRUE(out.empty());
+    ASSERT_EQ(10, first_index);
+    ASSERT_EQ(0, cq.pop_closure_until(1009, &out, &first_index));
+    ASSERT_EQ(1000u, out.size());
+    ASSERT_EQ(10, first_index);
+    for (size_t i = 0; i < out.size(); ++i) {
+        out[i]->Run();
+    }
+    ASSERT_EQ(0, cq.pop_closure_until(1010, &out, &first_index));
+    ASSERT_EQ(1u, out.size());
+    ASSERT_EQ(1010, first_index);
+    out[0]->Run();
+    ASSERT_EQ(1001, ok.load());
+
+    cq.clear();
+    while (failed.load() != N - 1001) {
+        usleep(1000);
+    }
+    ASSERT_EQ(0, cq.pop_closure_until(2000, &out, &first_index));
+    ASSERT_TRUE(out.empty());
+    ASSERT_EQ(2001, first_index);
+
+    // A new term may start at a lower index than the cleared one
+    cq.reset_first_index(500);
+    cq.append_pending_closure(new CountClosure(&ok, &failed));
+    ASSERT_EQ(0, cq.pop_closure_until(500, &out, &first_index));
+    ASSERT_EQ(1u, out.size());
+    ASSERT_EQ(500, first_index);
+    out[0]->Run();
+    ASSERT_EQ(1002, ok.load());
+}
+
+struct ConsumerArg {
+    braft::ClosureQueue* cq;
+    butil::atomic<int64_t>* committed_index;
+    butil::atomic<bool>* stop;
+};
+
+static void* consume(void* arg) {
+    ConsumerArg* a = (ConsumerArg*)arg;
+    std::vector<braft::Closure*> out;
+    int64_t first_index = 0;
+    int64_t last_index = 0;
+    while (!a->stop->load()) {
+        const int64_t index = a->committed_index->load();
+        if (index == last_index) {
+            continue;
+        }
+        EXPECT_EQ(0, a->cq->pop_closure_until(index, &out, &first_index));
+        for (size_t i = 0; i < out.size(); ++i) {
+            out[i]->Run();
+        }
+        last_index = index;
+    }
+    return NULL;
+}
+
+TEST_F(ClosureQueueTest, concurrent_append_pop_and_clear) {
+    butil::atomic<int> ok(0);
+    butil::atomic<int> failed(0);
+    butil::atomic<int64_t> committed_index(0);
+    butil::atomic<bool> stop(false);
+    braft::ClosureQueue cq(false);
+    ConsumerArg arg = { &cq, &committed_index, &stop };
+    pthread_t tid;
+    ASSERT_EQ(0, pthread_create(&tid, NULL, consume, &arg));
+    const int TERMS = 10;
+    const int N = 100000;
+    int64_t next_index = 1;
+    for (int term = 0; term < TERMS; ++term) {
+        cq.reset_first_index(next_index);
+        for (int i = 0; i < N; ++i) {
+            cq.append_pending_closure(new CountClosure(&ok, &failed));
+            ++next_index;
+            if (i % 3 == 0) {
+                committed_index.store(next_index - 1);
+            }
+        }
+        // Step down while the consumer may still be popping
+        cq.clear();
+    }
+    stop.store(true);
+    pthread_join(tid, NULL);
+    while (ok.load() + failed.load() != TERMS * N) {
+        usleep(1000);
+    }
+    ASSERT_GT(ok.load(), 0);
+}
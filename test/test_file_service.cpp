@@ -16,6 +16,9 @@
 
 namespace braft {
 DECLARE_bool(raft_file_check_hole);
+DECLARE_int32(raft_max_byte_count_per_rpc);
+DECLARE_int32(raft_max_inflight_chunks_per_file);
+DECLARE_int32(raft_file_transfer_compress_type);
 }
 
 int g_port = 0;
@@ -90,6 +93,60 @@ TEST_F(FileServiceTest, sanity) {
     ASSERT_EQ(0, system("rm -rf a; rm -rf b;"));
 }
 
+TEST_F(FileServiceTest, inflight_chunks) {
+    braft::FileSystemAdaptor* fs = braft::default_file_system();
+    scoped_refptr<braft::LocalDirReader> reader(new braft::LocalDirReader(fs, "a"));
+    int64_t reader_id = 0;
+    ASSERT_EQ(0, braft::file_service_add(reader.get(), &reader_id));
+    std::string uri;
+    butil::string_printf(&uri, "remote://127.0.0.1:%d/%" PRId64, g_port, reader_id);
+    braft::RemoteFileCopier copier;
+    ASSERT_EQ(0, copier.init(uri, fs, NULL));
+    ASSERT_EQ(0, system("rm -rf a; rm -rf b; mkdir a; mkdir b"));
+
+    std::string data;
+    for (int i = 0; i < 100000; ++i) {
+        butil::string_appendf(&data, "%d,", i);
+    }
+    ASSERT_EQ((int)data.size(), butil::WriteFile(
+                butil::FilePath("a/c"), data.data(), data.size()));
+    const int32_t saved_byte_count = braft::FLAGS_raft_max_byte_count_per_rpc;
+    braft::FLAGS_raft_max_byte_count_per_rpc = 1000;
+    braft::FLAGS_raft_max_inflight_chunks_per_file = 8;
+    // Ranges are fetched and written out of order
+    ASSERT_EQ(0, copier.copy_to_file("c", "./b/c", NULL));
+    std::string copied;
+    ASSERT_TRUE(butil::ReadFileToString(butil::FilePath("b/c"), &copied));
+    ASSERT_EQ(data, copied);
+    // The size of the file is a multiple of the range
+    data.resize(data.size() / 1000 * 1000);
+    ASSERT_EQ((int)data.size(), butil::WriteFile(
+                butil::FilePath("a/d"), data.data(), data.size()));
+    ASSERT_EQ(0, copier.copy_to_file("d", "./b/d", NULL));
+    ASSERT_TRUE(butil::ReadFileToString(butil::FilePath("b/d"), &copied));
+    ASSERT_EQ(data, copied);
+    // Empty file
+    ASSERT_EQ(0, system("touch a/e"));
+    ASSERT_EQ(0, copier.copy_to_file("e", "./b/e", NULL));
+    ASSERT_TRUE(butil::ReadFileToString(butil::FilePath("b/e"), &copied));
+    ASSERT_TRUE(copied.empty());
+    // Non-existed file
+    ASSERT_NE(0, copier.copy_to_file("f", "./b/f", NULL));
+    // The last chunk counts in the size copied
+    scoped_refptr<braft::RemoteFileCopier::Session> session =
+            copier.start_to_copy_to_file("c", "./b/g", NULL);
+    ASSERT_TRUE(session != NULL);
+    session->join();
+    ASSERT_TRUE(session->status().ok());
+    ASSERT_TRUE(butil::ReadFileToString(butil::FilePath("b/g"), &copied));
+    ASSERT_EQ((int64_t)copied.size(), session->copied_size());
+    braft::FLAGS_raft_max_byte_count_per_rpc = saved_byte_count;
+    braft::FLAGS_raft_max_inflight_chunks_per_file = 1;
+
+    ASSERT_EQ(0, braft::file_service_remove(reader_id));
+    ASSERT_EQ(0, system("rm -rf a; rm -rf b;"));
+}
+
 TEST_F(FileServiceTest, hole_file) {
     int ret = 0;
     ASSERT_EQ(0, system("rm -rf a; rm -rf b; rm -rf c; mkdir a;"));
@@ -126,3 +183,156 @@ TEST_F(FileServiceTest, hole_file) {
     ret = system("diff ./a/hole.data ./c/hole.data");
     ASSERT_EQ(0, ret);
 }
+
+TEST_F(FileServiceTest, read_ahead) {
+    ASSERT_EQ(0, system("rm -rf a; mkdir a;"));
+    std::string data;
+    for (int i = 0; i < 1000; ++i) {
+        butil::string_appendf(&data, "%08d", i);
+    }
+    ASSERT_EQ((int)data.size(), butil::WriteFile(
+            butil::FilePath("./a/data"), data.data(), data.size()));
+    braft::FileSystemAdaptor* fs = braft::default_file_system();
+    scoped_refptr<braft::LocalDirReader> reader(new braft::LocalDirReader(fs, "a"));
+
+    // Sequential reads are served by the chunks read ahead
+    std::string content;
+    bool is_eof = false;
+    while (!is_eof) {
+        butil::IOBuf buf;
+        size_t read_count = 0;
+        ASSERT_EQ(0, reader->read_file(&buf, "data", content.size(), 1000,
+                                       false, &read_count, &is_eof));
+        ASSERT_EQ(buf.size(), read_count);
+        content.append(buf.to_string());
+        usleep(1000);
+    }
+    ASSERT_EQ(data, content);
+
+    // Two chunks in flight, the chunk following the highest one is read ahead
+    content.clear();
+    content.resize(data.size());
+    for (size_t offset = 0; offset < data.size(); offset += 2000) {
+        for (size_t i = 0; i < 2 && offset + i * 1000 < data.size(); ++i) {
+            butil::IOBuf buf;
+            size_t read_count = 0;
+            ASSERT_EQ(0, reader->read_file(&buf, "data", offset + i * 1000,
+                                           1000, false, &read_count, &is_eof));
+            ASSERT_EQ(1000u, read_count);
+            buf.copy_to(&content[offset + i * 1000], read_count);
+        }
+        usleep(1000);
+    }
+    ASSERT_EQ(data, content);
+
+    // Reads at other offsets or of other sizes don't use the chunk read ahead
+    for (size_t offset = 0; offset < data.size(); offset += 3000) {
+        butil::IOBuf buf;
+        size_t read_count = 0;
+        ASSERT_EQ(0, reader->read_file(&buf, "data", offset, 500,
+                                       false, &read_count, &is_eof));
+        ASSERT_EQ(data.substr(offset, 500), buf.to_string());
+        ASSERT_FALSE(is_eof);
+    }
+    butil::IOBuf buf;
+    size_t read_count = 0;
+    ASSERT_EQ(0, reader->read_file(&buf, "data", 7500, 1000,
+                                   false, &read_count, &is_eof));
+    ASSERT_EQ(data.substr(7500), buf.to_string());
+    ASSERT_TRUE(is_eof);
+}
+
+TEST_F(FileServiceTest, shared_chunk_cache) {
+    ASSERT_EQ(0, system("rm -rf a; mkdir a;"));
+    const std::string data1(3000, 'a');
+    ASSERT_EQ((int)data1.size(), butil::WriteFile(
+            butil::FilePath("./a/data"), data1.data(), data1.size()));
+    braft::FileSystemAdaptor* fs = braft::default_file_system();
+    scoped_refptr<braft::LocalDirReader> reader1(new braft::LocalDirReader(fs, "a"));
+    scoped_refptr<braft::LocalDirReader> reader2(new braft::LocalDirReader(fs, "a"));
+
+    butil::IOBuf buf;
+    size_t read_count = 0;
+    bool is_eof = false;
+    ASSERT_EQ(0, reader1->read_file(&buf, "data", 1000, 2000,
+                                    false, &read_count, &is_eof));
+    ASSERT_TRUE(is_eof);
+
+    // The other reader of the directory gets the chunk from the cache rather
+    // than the rewritten file
+    const std::string data2(3000, 'b');
+    ASSERT_EQ((int)data2.size(), butil::WriteFile(
+            butil::FilePath("./a/data"), data2.data(), data2.size()));
+    buf.clear();
+    ASSERT_EQ(0, reader2->read_file(&buf, "data", 1000, 1000,
+                                    false, &read_count, &is_eof));
+    ASSERT_EQ(data1.substr(1000, 1000), buf.to_string());
+    ASSERT_FALSE(is_eof);
+    buf.clear();
+    ASSERT_EQ(0, reader2->read_file(&buf, "data", 1000, 4000,
+                                    false, &read_count, &is_eof));
+    ASSERT_EQ(data1.substr(1000), buf.to_string());
+    ASSERT_TRUE(is_eof);
+    // Not cached
+    buf.clear();
+    ASSERT_EQ(0, reader2->read_file(&buf, "data", 0, 1000,
+                                    false, &read_count, &is_eof));
+    ASSERT_EQ(data2.substr(0, 1000), buf.to_string());
+
+    // The chunks are dropped with the last reader of the directory
+    reader1 = NULL;
+    reader2 = NULL;
+    scoped_refptr<braft::LocalDirReader> reader3(new braft::LocalDirReader(fs, "a"));
+    buf.clear();
+    ASSERT_EQ(0, reader3->read_file(&buf, "data", 1000, 2000,
+                                    false, &read_count, &is_eof));
+    ASSERT_EQ(data2.substr(1000), buf.to_string());
+}
+
+TEST_F(FileServiceTest, compress) {
+    braft::FileSystemAdaptor* fs = braft::default_file_system();
+    scoped_refptr<braft::LocalDirReader> reader(new braft::LocalDirReader(fs, "a"));
+    int64_t reader_id = 0;
+    ASSERT_EQ(0, braft::file_service_add(reader.get(), &reader_id));
+    std::string uri;
+    butil::string_printf(&uri, "remote://127.0.0.1:%d/%" PRId64, g_port, reader_id);
+    braft::RemoteFileCopier copier;
+    ASSERT_EQ(0, copier.init(uri, fs, NULL));
+    ASSERT_EQ(0, system("rm -rf a; rm -rf b; mkdir a; mkdir b"));
+
+    std::string text;
+    for (int i = 0; i < 100000; ++i) {
+        butil::string_appendf(&text, "%d,", i % 100);
+    }
+    ASSERT_EQ((int)text.size(), butil::WriteFile(
+                butil::FilePath("a/text"), text.data(), text.size()));
+    // Random data is sent uncompressed
+    std::string random(text.size(), '\0');
+    for (size_t i = 0; i < random.size(); ++i) {
+        random[i] = (char)butil::fast_rand();
+    }
+    ASSERT_EQ((int)random.size(), butil::WriteFile(
+                butil::FilePath("a/random"), random.data(), random.size()));
+    const int32_t saved_byte_count = braft::FLAGS_raft_max_byte_count_per_rpc;
+    braft::FLAGS_raft_max_byte_count_per_rpc = 4096;
+    const int types[] = { braft::FILE_COMPRESS_SNAPPY, braft::FILE_COMPRESS_ZLIB };
+    for (size_t i = 0; i < ARRAY_SIZE(types); ++i) {
+        braft::FLAGS_raft_file_transfer_compress_type = types[i];
+        std::string copied;
+        ASSERT_EQ(0, copier.copy_to_file("text", "./b/text", NULL));
+        ASSERT_TRUE(butil::ReadFileToString(butil::FilePath("b/text"), &copied));
+        ASSERT_EQ(text, copied);
+        ASSERT_EQ(0, copier.copy_to_file("random", "./b/random", NULL));
+        ASSERT_TRUE(butil::ReadFileToString(butil::FilePath("b/random"), &copied));
+        ASSERT_EQ(random, copied);
+        butil::IOBuf buf;
+        ASSERT_EQ(0, copier.copy_to_iobuf("text", &buf, NULL));
+        ASSERT_TRUE(buf.equals(text));
+        ASSERT_EQ(0, system("rm -f b/text b/random"));
+    }
+    braft::FLAGS_raft_file_transfer_compress_type = braft::FILE_COMPRESS_NONE;
+    braft::FLAGS_raft_max_byte_count_per_rpc = saved_byte_count;
+
+    ASSERT_EQ(0, braft::file_service_remove(reader_id));
+    ASSERT_EQ(0, system("rm -rf a; rm -rf b;"));
+}
@@ -108,6 +108,18 @@ TEST_F(TestFileSystemAdaptorSuits, rename) {
     ::system("rm -rf test_dir1");
 }
 
+TEST_F(TestFileSystemAdaptorSuits, link_count) {
+    ::system("rm -f test_file test_file2");
+    ::system("touch test_file");
+    scoped_refptr<braft::FileSystemAdaptor> fs = new braft::PosixFileSystemAdaptor();
+    ASSERT_EQ(1, fs->link_count("test_file"));
+    ASSERT_TRUE(fs->link("test_file", "test_file2"));
+    ASSERT_EQ(2, fs->link_count("test_file"));
+    ASSERT_EQ(2, fs->link_count("test_file2"));
+    ASSERT_EQ(-1, fs->link_count("test_file3"));
+    ::system("rm -f test_file test_file2");
+}
+
 TEST_F(TestFileSystemAdaptorSuits, create_directory) {
     ::system("rm -rf test_dir");
     scoped_refptr<braft::FileSystemAdaptor> fs = new braft::PosixFileSystemAdaptor();
@@ -4,13 +4,22 @@
 // Date: 2015/12/01 17:03:46
 
 #include <gtest/gtest.h>
+#include <gflags/gflags.h>
 #include <butil/string_printf.h>
 #include <butil/memory/scoped_ptr.h>
+#include <bvar/bvar.h>
 #include "braft/fsm_caller.h"
 #include "braft/raft.h"
 #include "braft/log.h"
 #include "braft/configuration.h"
 #include "braft/log_manager.h"
+#include "braft/fsm_executor.h"
+
+namespace braft {
+DECLARE_int32(raft_fsm_caller_fetch_batch);
+DECLARE_int64(raft_fsm_caller_read_ahead_bytes);
+DECLARE_int32(raft_fsm_executor_time_slice_us);
+}
 
 class FSMCallerTest : public testing::Test {
 protected:
@@ -146,6 +155,166 @@ TEST_F(FSMCallerTest, sanity) {
     ASSERT_EQ(fsm._expected_next, N);
 }
 
+class BatchStateMachine : public OrderedStateMachine {
+public:
+    BatchStateMachine() : _nbatch(0) {}
+    void on_apply(braft::Iterator& iter) {
+        ASSERT_TRUE(false) << "Should never be called";
+    }
+    void on_apply_batch(braft::ApplyBatch& batch) {
+        ASSERT_GT(batch.size(), 0u);
+        ++_nbatch;
+        for (size_t i = 0; i < batch.size(); ++i) {
+            ASSERT_EQ(batch.first_index() + (int64_t)i, batch.index(i));
+            std::string expected;
+            butil::string_printf(&expected, "hello_%" PRIu64, _expected_next++);
+            ASSERT_EQ(expected, batch.data(i).to_string());
+            ASSERT_TRUE(batch.done(i) == NULL);
+        }
+    }
+    size_t _nbatch;
+};
+
+TEST_F(FSMCallerTest, apply_in_batch) {
+    system("rm -rf ./data");
+    scoped_ptr<braft::ConfigurationManager> cm(
+                                new braft::ConfigurationManager);
+    scoped_ptr<braft::SegmentLogStorage> storage(
+                                new braft::SegmentLogStorage("./data"));
+    scoped_ptr<braft::LogManager> lm(new braft::LogManager());
+    braft::LogManagerOptions log_opt;
+    log_opt.log_storage = storage.get();
+    log_opt.configuration_manager = cm.get();
+    ASSERT_EQ(0, lm->init(log_opt));
+
+    braft::ClosureQueue cq(false);
+
+    BatchStateMachine fsm;
+    fsm._expected_next = 0;
+
+    braft::FSMCallerOptions opt;
+    opt.log_manager = lm.get();
+    opt.after_shutdown = NULL;
+    opt.fsm = &fsm;
+    opt.closure_queue = &cq;
+    opt.apply_in_batch = true;
+
+    braft::FSMCaller caller;
+    ASSERT_EQ(0, caller.init(opt));
+
+    const size_t N = 1000;
+
+    std::vector<braft::LogEntry*> entries;
+    for (size_t i = 0; i < N; ++i) {
+        braft::LogEntry* entry = new braft::LogEntry;
+        entry->AddRef();
+        entry->type = braft::ENTRY_TYPE_DATA;
+        std::string buf;
+        butil::string_printf(&buf, "hello_%lld", (long long)i);
+        entry->data.append(buf);
+        entry->id.index = i + 1;
+        entry->id.term = 1;
+        entries.push_back(entry);
+    }
+    SyncClosure c;
+    lm->append_entries(&entries, &c);
+    c.join();
+    ASSERT_TRUE(c.status().ok()) << c.status();
+    ASSERT_EQ(0, caller.on_committed(N));
+    ASSERT_EQ(0, caller.shutdown());
+    fsm.join();
+    ASSERT_EQ(fsm._expected_next, N);
+    ASSERT_LT(fsm._nbatch, N);
+    ASSERT_EQ(N, (size_t)caller.last_applied_index());
+}
+
+class DeferDoneStateMachine : public OrderedStateMachine {
+public:
+    void on_apply(braft::Iterator& iter) {
+        for (; iter.valid(); iter.next()) {
+            ++_expected_next;
+            // Fail the tasks at odd indexes, and leave done() to the caller
+            if (iter.done() && iter.index() % 2 == 1) {
+                iter.done()->status().set_error(EINVAL, "odd index");
+            }
+        }
+    }
+};
+
+class StatusCountClosure : public braft::Closure {
+public:
+    StatusCountClosure(butil::atomic<int>* ok, butil::atomic<int>* failed)
+        : _ok(ok), _failed(failed) {}
+    void Run() {
+        if (status().ok()) {
+            _ok->fetch_add(1);
+        } else {
+            _failed->fetch_add(1);
+        }
+        delete this;
+    }
+private:
+    butil::atomic<int>* _ok;
+    butil::atomic<int>* _failed;
+};
+
+TEST_F(FSMCallerTest, run_done_after_apply) {
+    system("rm -rf ./data");
+    scoped_ptr<braft::ConfigurationManager> cm(
+                                new braft::ConfigurationManager);
+    scoped_ptr<braft::SegmentLogStorage> storage(
+                                new braft::SegmentLogStorage("./data"));
+    scoped_ptr<braft::LogManager> lm(new braft::LogManager());
+    braft::LogManagerOptions log_opt;
+    log_opt.log_storage = storage.get();
+    log_opt.configuration_manager = cm.get();
+    ASSERT_EQ(0, lm->init(log_opt));
+
+    braft::ClosureQueue cq(false);
+    cq.reset_first_index(1);
+
+    DeferDoneStateMachine fsm;
+    fsm._expected_next = 0;
+
+    braft::FSMCallerOptions opt;
+    opt.log_manager = lm.get();
+    opt.after_shutdown = NULL;
+    opt.fsm = &fsm;
+    opt.closure_queue = &cq;
+    opt.run_done_after_apply = true;
+
+    braft::FSMCaller caller;
+    ASSERT_EQ(0, caller.init(opt));
+
+    const int N = 1000;
+    butil::atomic<int> ok(0);
+    butil::atomic<int> failed(0);
+    std::vector<braft::LogEntry*> entries;
+    for (int i = 0; i < N; ++i) {
+        braft::LogEntry* entry = new braft::LogEntry;
+        entry->AddRef();
+        entry->type = braft::ENTRY_TYPE_DATA;
+        entry->data.append("hello");
+        entry->id.index = i + 1;
+        entry->id.term = 1;
+        entries.push_back(entry);
+        cq.append_pending_closure(new StatusCountClosure(&ok, &failed));
+    }
+    SyncClosure c;
+    lm->append_entries(&entries, &c);
+    c.join();
+    ASSERT_TRUE(c.status().ok()) << c.status();
+    ASSERT_EQ(0, caller.on_committed(N));
+    ASSERT_EQ(0, caller.shutdown());
+    fsm.join();
+    ASSERT_EQ((uint64_t)N, fsm._expected_next);
+    while (ok.load() + failed.load() != N) {
+        bthread_usleep(1000);
+    }
+    ASSERT_EQ(N / 2, ok.load());
+    ASSERT_EQ(N / 2, failed.load());
+}
+
 TEST_F(FSMCallerTest, on_leader_start_and_stop) {
     scoped_ptr<braft::LogManager> lm(new braft::LogManager());
     OrderedStateMachine fsm;
@@ -286,3 +455,209 @@ TEST_F(FSMCallerTest, snapshot) {
     ASSERT_EQ(1, load_snapshot_done._start_times);
 }
 
+
+static int64_t get_bvar_value(const char* name) {
+    return strtoll(bvar::Variable::describe_exposed(name).c_str(), NULL, 10);
+}
+
+TEST_F(FSMCallerTest, read_ahead) {
+    system("rm -rf ./data");
+    scoped_ptr<braft::ConfigurationManager> cm(
+                                new braft::ConfigurationManager);
+    scoped_ptr<braft::SegmentLogStorage> storage(
+                                new braft::SegmentLogStorage("./data"));
+    scoped_ptr<braft::LogManager> lm(new braft::LogManager());
+    braft::LogManagerOptions log_opt;
+    log_opt.log_storage = storage.get();
+    log_opt.configuration_manager = cm.get();
+    ASSERT_EQ(0, lm->init(log_opt));
+
+    const int N = 100;
+    for (int i = 1; i <= N; ++i) {
+        std::vector<braft::LogEntry*> entries;
+        braft::LogEntry* entry = new braft::LogEntry;
+        entry->AddRef();
+        entry->type = braft::ENTRY_TYPE_DATA;
+        std::string buf;
+        butil::string_printf(&buf, "hello_%03d", i);
+        entry->data.append(buf);
+        entry->id.index = i;
+        entry->id.term = 1;
+        entries.push_back(entry);
+        SyncClosure c;
+        lm->append_entries(&entries, &c);
+        c.join();
+        ASSERT_TRUE(c.status().ok()) << c.status();
+    }
+    // All the logs are only in storage
+    lm->set_applied_id(braft::LogId(N, 1));
+    while (lm->is_log_in_memory(N)) {
+        bthread_usleep(1000);
+    }
+
+    const char* hit_name = "raft_fsm_caller_read_ahead_hit_count";
+    const char* dropped_name = "raft_fsm_caller_read_ahead_dropped_count";
+    const int64_t saved_budget = braft::FLAGS_raft_fsm_caller_read_ahead_bytes;
+    const int32_t saved_fetch_batch = braft::FLAGS_raft_fsm_caller_fetch_batch;
+    braft::FLAGS_raft_fsm_caller_read_ahead_bytes = 4 * 1024 * 1024;
+    const int64_t hit = get_bvar_value(hit_name);
+    const int64_t dropped = get_bvar_value(dropped_name);
+    braft::LogReadAhead read_ahead;
+    read_ahead.init(lm.get());
+    std::vector<braft::LogEntry*> entries;
+
+    // Nothing is prefetched yet
+    ASSERT_EQ(10u, read_ahead.fetch(1, 10, &entries));
+    ASSERT_EQ(hit, get_bvar_value(hit_name));
+    // Sequential fetches take the logs read in background
+    read_ahead.start(11, N);
+    ASSERT_EQ(10u, read_ahead.fetch(11, 20, &entries));
+    ASSERT_EQ(hit + 10, get_bvar_value(hit_name));
+    // All the logs till N are ready, nothing more to read
+    read_ahead.start(21, N);
+
+    // A non-sequential fetch drops the prefetched logs
+    ASSERT_EQ(5u, read_ahead.fetch(50, 54, &entries));
+    ASSERT_EQ(hit + 10, get_bvar_value(hit_name));
+    ASSERT_EQ(dropped + (N - 20), get_bvar_value(dropped_name));
+
+    // The read stops once the budget is used up: 2 batches of 2 logs of 9
+    // bytes each are read with a budget of 20 bytes
+    braft::FLAGS_raft_fsm_caller_fetch_batch = 2;
+    braft::FLAGS_raft_fsm_caller_read_ahead_bytes = 20;
+    read_ahead.start(55, N);
+    ASSERT_EQ(10u, read_ahead.fetch(55, 64, &entries));
+    ASSERT_EQ(hit + 14, get_bvar_value(hit_name));
+    ASSERT_EQ(dropped + (N - 20), get_bvar_value(dropped_name));
+
+    // The logs not fetched yet use up the budget, so no more is read until
+    // they're fetched
+    read_ahead.start(65, N);
+    ASSERT_EQ(1u, read_ahead.fetch(65, 65, &entries));
+    read_ahead.start(66, N);
+    ASSERT_EQ(5u, read_ahead.fetch(66, 70, &entries));
+    ASSERT_EQ(hit + 18, get_bvar_value(hit_name));
+    ASSERT_EQ(dropped + (N - 20), get_bvar_value(dropped_name));
+
+    const int64_t expected_first[] = { 1, 11, 50, 55, 65, 66 };
+    const size_t counts[] = { 10, 10, 5, 10, 1, 5 };
+    size_t pos = 0;
+    for (size_t i = 0; i < ARRAY_SIZE(counts); ++i) {
+        for (size_t j = 0; j < counts[i]; ++j, ++pos) {
+            ASSERT_LT(pos, entries.size());
+            const int64_t index = expected_first[i] + j;
+            ASSERT_EQ(index, entries[pos]->id.index);
+            std::string expected;
+            butil::string_printf(&expected, "hello_%03d", (int)index);
+            ASSERT_EQ(expected, entries[pos]->data.to_string());
+        }
+    }
+    ASSERT_EQ(pos, entries.size());
+    for (size_t i = 0; i < entries.size(); ++i) {
+        entries[i]->Release();
+    }
+    read_ahead.reset();
+    braft::FLAGS_raft_fsm_caller_read_ahead_bytes = saved_budget;
+    braft::FLAGS_raft_fsm_caller_fetch_batch = saved_fetch_batch;
+}
+
+class SlowStateMachine : public braft::StateMachine {
+public:
+    SlowStateMachine() : applied(0), leader_start_times(0), stopped(false) {}
+    void on_apply(braft::Iterator& iter) {
+        for (; iter.valid(); iter.next()) {
+            usleep(1000);
+            applied.fetch_add(1);
+        }
+    }
+    void on_leader_start(int64_t term) {
+        leader_start_times.fetch_add(1);
+    }
+    void on_shutdown() {
+        stopped.store(true);
+    }
+    void join() {
+        while (!stopped.load()) {
+            bthread_usleep(100);
+        }
+    }
+    butil::atomic<int64_t> applied;
+    butil::atomic<int> leader_start_times;
+    butil::atomic<bool> stopped;
+};
+
+TEST_F(FSMCallerTest, executor_time_slice) {
+    system("rm -rf ./data ./data_idle");
+    const int32_t saved_time_slice_us = braft::FLAGS_raft_fsm_executor_time_slice_us;
+    braft::FLAGS_raft_fsm_executor_time_slice_us = 5 * 1000;
+    braft::FSMExecutor executor;
+    ASSERT_EQ(0, executor.start(1, ""));
+
+    scoped_ptr<braft::ConfigurationManager> cm(new braft::ConfigurationManager);
+    scoped_ptr<braft::SegmentLogStorage> storage(
+                                new braft::SegmentLogStorage("./data"));
+    scoped_ptr<braft::LogManager> lm(new braft::LogManager());
+    braft::LogManagerOptions log_opt;
+    log_opt.log_storage = storage.get();
+    log_opt.configuration_manager = cm.get();
+    ASSERT_EQ(0, lm->init(log_opt));
+    scoped_ptr<braft::SegmentLogStorage> idle_storage(
+                                new braft::SegmentLogStorage("./data_idle"));
+    scoped_ptr<braft::LogManager> idle_lm(new braft::LogManager());
+    log_opt.log_storage = idle_storage.get();
+    ASSERT_EQ(0, idle_lm->init(log_opt));
+
+    const int N = 1000;
+    for (int i = 1; i <= N; ++i) {
+        std::vector<braft::LogEntry*> entries;
+        braft::LogEntry* entry = new braft::LogEntry;
+        entry->AddRef();
+        entry->type = braft::ENTRY_TYPE_DATA;
+        entry->data.append("hello");
+        entry->id.index = i;
+        entry->id.term = 1;
+        entries.push_back(entry);
+        SyncClosure c;
+        lm->append_entries(&entries, &c);
+        c.join();
+        ASSERT_TRUE(c.status().ok()) << c.status();
+    }
+
+    // Both groups share the only thread of the executor
+    braft::ClosureQueue cq(false);
+    braft::ClosureQueue idle_cq(false);
+    SlowStateMachine hot_fsm;
+    SlowStateMachine idle_fsm;
+    braft::FSMCallerOptions opt;
+    opt.log_manager = lm.get();
+    opt.fsm = &hot_fsm;
+    opt.closure_queue = &cq;
+    opt.executor = &executor;
+    braft::FSMCaller hot_caller;
+    ASSERT_EQ(0, hot_caller.init(opt));
+    opt.log_manager = idle_lm.get();
+    opt.fsm = &idle_fsm;
+    opt.closure_queue = &idle_cq;
+    braft::FSMCaller idle_caller;
+    ASSERT_EQ(0, idle_caller.init(opt));
+
+    // The hot group takes about 1s to apply all the logs
+    ASSERT_EQ(0, hot_caller.on_committed(N));
+    while (hot_fsm.applied.load() == 0) {
+        bthread_usleep(1000);
+    }
+    // The idle group still gets the thread in a few time slices
+    ASSERT_EQ(0, idle_caller.on_leader_start(1, 0));
+    while (idle_fsm.leader_start_times.load() == 0) {
+        bthread_usleep(1000);
+    }
+    ASSERT_LT(hot_fsm.applied.load(), N / 2);
+
+    ASSERT_EQ(0, hot_caller.shutdown());
+    ASSERT_EQ(0, idle_caller.shutdown());
+    hot_fsm.join();
+    idle_fsm.join();
+    ASSERT_EQ(N, hot_fsm.applied.load());
+    executor.stop_and_join();
+    braft::FLAGS_raft_fsm_executor_time_slice_us = saved_time_slice_us;
+}
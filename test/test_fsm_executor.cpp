@@ -0,0 +1,77 @@
+// libraft - Quorum-based replication of states across machines.
+// Copyright (c) 2019 Baidu.com, Inc. All Rights Reserved
+
+#include <gtest/gtest.h>
+#include <butil/atomicops.h>
+#include <bthread/execution_queue.h>
+#include "braft/fsm_executor.h"
+
+class FSMExecutorTest : public testing::Test {
+protected:
+    void SetUp() {}
+    void TearDown() {}
+};
+
+TEST_F(FSMExecutorTest, parse_cpu_list) {
+    std::vector<int> cpus;
+    ASSERT_EQ(0, braft::parse_cpu_list("", &cpus));
+    ASSERT_TRUE(cpus.empty());
+    ASSERT_EQ(0, braft::parse_cpu_list("0-2,5", &cpus));
+    ASSERT_EQ(4u, cpus.size());
+    ASSERT_EQ(0, cpus[0]);
+    ASSERT_EQ(2, cpus[2]);
+    ASSERT_EQ(5, cpus[3]);
+    ASSERT_NE(0, braft::parse_cpu_list("3-1", &cpus));
+    ASSERT_NE(0, braft::parse_cpu_list("a", &cpus));
+    ASSERT_NE(0, braft::parse_cpu_list("1-", &cpus));
+}
+
+struct QueueState {
+    QueueState() : running(0), executed(0), overlapped(false) {}
+    butil::atomic<int> running;
+    butil::atomic<int> executed;
+    bool overlapped;
+};
+
+static int consume(void* meta, bthread::TaskIterator<int>& iter) {
+    QueueState* state = (QueueState*)meta;
+    if (iter.is_queue_stopped()) {
+        return 0;
+    }
+    if (state->running.fetch_add(1) != 0) {
+        state->overlapped = true;
+    }
+    for (; iter; ++iter) {
+        state->executed.fetch_add(1);
+    }
+    state->running.fetch_sub(1);
+    return 0;
+}
+
+TEST_F(FSMExecutorTest, serial_per_queue) {
+    braft::FSMExecutor executor;
+    ASSERT_EQ(0, executor.start(4, ""));
+    const int NQUEUE = 8;
+    const int NTASK = 10000;
+    QueueState states[NQUEUE];
+    bthread::ExecutionQueueId<int> ids[NQUEUE];
+    bthread::ExecutionQueueOptions options;
+    options.executor = &executor;
+    for (int i = 0; i < NQUEUE; ++i) {
+        ASSERT_EQ(0, bthread::execution_queue_start(
+                        &ids[i], &options, consume, &states[i]));
+    }
+    for (int j = 0; j < NTASK; ++j) {
+        for (int i = 0; i < NQUEUE; ++i) {
+            ASSERT_EQ(0, bthread::execution_queue_execute(ids[i], j));
+        }
+    }
+    for (int i = 0; i < NQUEUE; ++i) {
+        ASSERT_EQ(0, bthread::execution_queue_stop(ids[i]));
+        ASSERT_EQ(0, bthread::execution_queue_join(ids[i]));
+        ASSERT_EQ(NTASK, states[i].executed.load());
+        ASSERT_FALSE(states[i].overlapped);
+    }
+    executor.stop_and_join();
+    ASSERT_NE(0, executor.submit(NULL, NULL));
+}
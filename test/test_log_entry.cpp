@@ -49,3 +49,33 @@ TEST_F(TestUsageSuits, LogEntry) {
 
     entry->Release();
 }
+
+TEST_F(TestUsageSuits, pooled_allocation) {
+    const size_t N = 100;
+    std::vector<braft::LogEntry*> entries;
+    for (size_t i = 0; i < N; ++i) {
+        braft::LogEntry* entry = new braft::LogEntry();
+        entry->AddRef();
+        entry->data.append("hello");
+        entries.push_back(entry);
+    }
+    for (size_t i = 0; i < N; ++i) {
+        entries[i]->Release();
+    }
+    entries.clear();
+    // The released entries are recycled by the pool, so allocating them
+    // again takes no new item from it, and they're constructed again
+    const size_t item_num = braft::describe_log_entry_pool().item_num;
+    for (size_t i = 0; i < N; ++i) {
+        braft::LogEntry* entry = new braft::LogEntry();
+        entry->AddRef();
+        ASSERT_EQ(braft::ENTRY_TYPE_UNKNOWN, entry->type);
+        ASSERT_TRUE(entry->data.empty());
+        ASSERT_TRUE(entry->peers == NULL);
+        entries.push_back(entry);
+    }
+    ASSERT_EQ(item_num, braft::describe_log_entry_pool().item_num);
+    for (size_t i = 0; i < N; ++i) {
+        entries[i]->Release();
+    }
+}
@@ -681,3 +681,124 @@ TEST_F(LogManagerTest, set_snapshot_and_get_log_term) {
     ASSERT_EQ(1L, lm->get_term(N - 1));
     LOG(INFO) << "Last_index=" << lm->last_log_index();
 }
+
+TEST_F(LogManagerTest, retain_logs_for_followers) {
+    system("rm -rf ./data");
+    scoped_ptr<braft::ConfigurationManager> cm(
+            new braft::ConfigurationManager);
+    scoped_ptr<braft::SegmentLogStorage> storage(
+            new braft::SegmentLogStorage("./data"));
+    scoped_ptr<braft::LogManager> lm(new braft::LogManager());
+    braft::LogManagerOptions opt;
+    opt.log_storage = storage.get();
+    opt.configuration_manager = cm.get();
+    ASSERT_EQ(0, lm->init(opt));
+    const int N = 100;
+    for (int i = 0; i < N; ++i) {
+        append_entry(lm.get(), "dummy", i + 1, 1);
+    }
+    ASSERT_EQ(5, lm->average_entry_bytes());
+    braft::SnapshotMeta meta;
+    meta.set_last_included_index(30);
+    meta.set_last_included_term(1);
+    lm->set_snapshot(&meta);
+    ASSERT_EQ(30, lm->last_snapshot_index());
+    ASSERT_EQ(1, lm->first_log_index());
+
+    // A follower still needs the logs from 20 on
+    lm->set_retained_index(20);
+    meta.set_last_included_index(60);
+    lm->set_snapshot(&meta);
+    ASSERT_EQ(60, lm->last_snapshot_index());
+    ASSERT_EQ(20, lm->first_log_index());
+    ASSERT_EQ(1L, lm->get_term(19));
+
+    lm->set_retained_index(0);
+    meta.set_last_included_index(90);
+    lm->set_snapshot(&meta);
+    ASSERT_EQ(61, lm->first_log_index());
+}
+
+TEST_F(LogManagerTest, bytes_since_snapshot) {
+    system("rm -rf ./data");
+    scoped_ptr<braft::ConfigurationManager> cm(
+            new braft::ConfigurationManager);
+    scoped_ptr<braft::SegmentLogStorage> storage(
+            new braft::SegmentLogStorage("./data"));
+    scoped_ptr<braft::LogManager> lm(new braft::LogManager());
+    braft::LogManagerOptions opt;
+    opt.log_storage = storage.get();
+    opt.configuration_manager = cm.get();
+    ASSERT_EQ(0, lm->init(opt));
+    const int N = 100;
+    for (int i = 0; i < N; ++i) {
+        ASSERT_EQ(0, append_entry(lm.get(), "dummy", i + 1, 1));
+    }
+    ASSERT_EQ(5 * N, lm->bytes_since_snapshot());
+
+    // The entries appended after the snapshot index while the snapshot was
+    // being saved are still counted
+    braft::SnapshotMeta meta;
+    meta.set_last_included_index(30);
+    meta.set_last_included_term(1);
+    lm->set_snapshot(&meta);
+    ASSERT_EQ(5 * (N - 30), lm->bytes_since_snapshot());
+    meta.set_last_included_index(90);
+    lm->set_snapshot(&meta);
+    ASSERT_EQ(5 * (N - 90), lm->bytes_since_snapshot());
+    ASSERT_EQ(0, append_entry(lm.get(), "dummy_v2", N + 1, 1));
+    ASSERT_EQ(5 * (N - 90) + 8, lm->bytes_since_snapshot());
+    meta.set_last_included_index(N + 1);
+    lm->set_snapshot(&meta);
+    ASSERT_EQ(0, lm->bytes_since_snapshot());
+}
+
+TEST_F(LogManagerTest, get_entries_with_partly_evicted_memory_logs) {
+    system("rm -rf ./data");
+    scoped_ptr<braft::ConfigurationManager> cm(
+            new braft::ConfigurationManager);
+    scoped_ptr<braft::SegmentLogStorage> storage(
+            new braft::SegmentLogStorage("./data"));
+    scoped_ptr<braft::LogManager> lm(new braft::LogManager());
+    braft::LogManagerOptions opt;
+    opt.log_storage = storage.get();
+    opt.configuration_manager = cm.get();
+    ASSERT_EQ(0, lm->init(opt));
+    const int N = 100;
+    for (int i = 0; i < N; ++i) {
+        std::string data;
+        butil::string_printf(&data, "hello_%d", i + 1);
+        ASSERT_EQ(0, append_entry(lm.get(), data, i + 1));
+    }
+    // Logs before 51 are only in storage
+    lm->set_applied_id(braft::LogId(50, 1));
+    // The disk id might be set after the closures of appending are run
+    while (lm->is_log_in_memory(50)) {
+        bthread_usleep(1000);
+    }
+    ASSERT_TRUE(lm->is_log_in_memory(51));
+
+    // The range before the logs in memory reads no more than requested
+    std::vector<braft::LogEntry*> entries;
+    ASSERT_EQ(10u, lm->get_entries(1, 10, &entries));
+    // Across storage and memory
+    ASSERT_EQ(11u, lm->get_entries(45, 55, &entries));
+    // Beyond the last log
+    ASSERT_EQ(5u, lm->get_entries(96, 200, &entries));
+    ASSERT_EQ(26u, entries.size());
+    const int64_t expected[] = { 1, 45, 96 };
+    size_t pos = 0;
+    const size_t counts[] = { 10, 11, 5 };
+    for (size_t i = 0; i < ARRAY_SIZE(counts); ++i) {
+        for (size_t j = 0; j < counts[i]; ++j, ++pos) {
+            const int64_t index = expected[i] + j;
+            ASSERT_EQ(index, entries[pos]->id.index);
+            std::string data;
+            butil::string_printf(&data, "hello_%" PRId64, index);
+            ASSERT_EQ(data, entries[pos]->data.to_string());
+        }
+    }
+    for (size_t i = 0; i < entries.size(); ++i) {
+        entries[i]->Release();
+    }
+}
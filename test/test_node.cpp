@@ -9,6 +9,7 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <sstream>
 #include <butil/logging.h>
 #include <butil/files/file_path.h>
 #include <butil/file_util.h>
@@ -24,6 +25,9 @@ extern bvar::Adder<int64_t> g_num_nodes;
 DECLARE_int32(raft_max_parallel_append_entries_rpc_num);
 DECLARE_bool(raft_enable_append_entries_cache);
 DECLARE_int32(raft_max_append_entries_cache_size);
+DECLARE_bool(raft_install_snapshot_from_followers);
+DECLARE_int32(raft_max_concurrent_snapshot_saves_per_disk);
+DECLARE_int32(raft_snapshot_policy_check_interval_ms);
 }
 
 using braft::raft_mutex_t;
@@ -157,6 +161,66 @@ TEST_P(NodeTest, SingleNode) {
     server.Join();
 }
 
+TEST_P(NodeTest, SingleNodeApplyBatch) {
+    brpc::Server server;
+    int ret = braft::add_service(&server, 5006);
+    server.Start(5006, NULL);
+    ASSERT_EQ(0, ret);
+
+    braft::PeerId peer;
+    peer.addr.ip = butil::my_ip();
+    peer.addr.port = 5006;
+    peer.idx = 0;
+    std::vector<braft::PeerId> peers;
+    peers.push_back(peer);
+
+    braft::NodeOptions options;
+    options.election_timeout_ms = 300;
+    options.initial_conf = braft::Configuration(peers);
+    MockFSM* fsm = new MockFSM(butil::EndPoint());
+    options.fsm = fsm;
+    options.node_owns_fsm = true;
+    options.log_uri = "local://./data/log";
+    options.raft_meta_uri = "local://./data/raft_meta";
+    options.snapshot_uri = "local://./data/snapshot";
+
+    braft::Node node("unittest", peer);
+    ASSERT_EQ(0, node.init(options));
+    while (!node.is_leader()) {
+        usleep(10 * 1000);
+    }
+
+    const int N = 10;
+    bthread::CountdownEvent cond(N);
+    butil::IOBuf data[N];
+    braft::Task tasks[N];
+    for (int i = 0; i < N; i++) {
+        char data_buf[128];
+        snprintf(data_buf, sizeof(data_buf), "hello: %d", i + 1);
+        data[i].append(data_buf);
+        tasks[i].data = &data[i];
+        tasks[i].done = NEW_APPLYCLOSURE(&cond, 0);
+    }
+    node.apply(tasks, N);
+    cond.wait();
+
+    fsm->lock();
+    ASSERT_EQ((size_t)N, fsm->logs.size());
+    for (int i = 0; i < N; i++) {
+        char data_buf[128];
+        snprintf(data_buf, sizeof(data_buf), "hello: %d", i + 1);
+        ASSERT_EQ(data_buf, fsm->logs[i].to_string());
+    }
+    fsm->unlock();
+
+    cond.reset(1);
+    node.shutdown(NEW_SHUTDOWNCLOSURE(&cond, 0));
+    cond.wait();
+
+    server.Stop(200);
+    server.Join();
+}
+
 TEST_P(NodeTest, NoLeader) {
     std::vector<braft::PeerId> peers;
     for (int i = 0; i < 3; i++) {
@@ -1359,6 +1423,282 @@ TEST_P(NodeTest, RestoreSnapshot) {
     cluster.stop_all();
 }
 
+TEST_P(NodeTest, snapshot_scheduler) {
+    braft::FLAGS_raft_max_concurrent_snapshot_saves_per_disk = 1;
+    std::vector<braft::PeerId> peers;
+    for (int i = 0; i < 3; i++) {
+        braft::PeerId peer;
+        peer.addr.ip = butil::my_ip();
+        peer.addr.port = 5006 + i;
+        peer.idx = 0;
+
+        peers.push_back(peer);
+    }
+
+    // start cluster
+    Cluster cluster("unittest", peers);
+    for (size_t i = 0; i < peers.size(); i++) {
+        ASSERT_EQ(0, cluster.start(peers[i].addr));
+    }
+
+    // elect leader
+    cluster.wait_leader();
+    braft::Node* leader = cluster.leader();
+    ASSERT_TRUE(leader != NULL);
+    LOG(WARNING) << "leader is " << leader->node_id();
+
+    std::vector<braft::Node*> nodes;
+    cluster.all_nodes(&nodes);
+    ASSERT_EQ(3u, nodes.size());
+
+    // apply something, node 0 and node 1 save snapshots in between, so that
+    // node 2 has the most logs since its last snapshot, then node 0, then
+    // node 1
+    bthread::CountdownEvent cond;
+    for (int round = 0; round < 3; ++round) {
+        cond.reset(10);
+        for (int i = 0; i < 10; i++) {
+            butil::IOBuf data;
+            char data_buf[128];
+            snprintf(data_buf, sizeof(data_buf), "hello: %d", round * 10 + i + 1);
+            data.append(data_buf);
+
+            braft::Task task;
+            task.data = &data;
+            task.done = NEW_APPLYCLOSURE(&cond, 0);
+            leader->apply(task);
+        }
+        cond.wait();
+        cluster.ensure_same();
+        if (round < 2) {
+            cond.reset(1);
+            nodes[round]->snapshot(NEW_SNAPSHOTCLOSURE(&cond, 0));
+            cond.wait();
+        }
+    }
+
+    // all the nodes share the same disk, the saves are queued instead of
+    // running together, and all of them succeed. Node 1 takes the disk first,
+    // the pending ones are ranked by their logs when it's done.
+    SnapshotSaveRecorder recorder;
+    recorder.save_delay_us = 200 * 1000;
+    for (size_t i = 0; i < nodes.size(); ++i) {
+        static_cast<MockFSM*>(nodes[i]->_impl->_options.fsm)
+                ->_snapshot_save_recorder = &recorder;
+    }
+    cond.reset(nodes.size());
+    nodes[1]->snapshot(NEW_SNAPSHOTCLOSURE(&cond, 0));
+    nodes[0]->snapshot(NEW_SNAPSHOTCLOSURE(&cond, 0));
+    nodes[2]->snapshot(NEW_SNAPSHOTCLOSURE(&cond, 0));
+    cond.wait();
+    for (size_t i = 0; i < nodes.size(); ++i) {
+        static_cast<MockFSM*>(nodes[i]->_impl->_options.fsm)
+                ->_snapshot_save_recorder = NULL;
+    }
+    ASSERT_EQ(1, recorder.max_running);
+    ASSERT_EQ(3u, recorder.saved.size());
+    ASSERT_EQ(nodes[1]->node_id().peer_id.addr, recorder.saved[0]);
+    ASSERT_EQ(nodes[2]->node_id().peer_id.addr, recorder.saved[1]);
+    ASSERT_EQ(nodes[0]->node_id().peer_id.addr, recorder.saved[2]);
+
+    LOG(WARNING) << "cluster stop";
+    cluster.stop_all();
+    braft::FLAGS_raft_max_concurrent_snapshot_saves_per_disk = 2;
+}
+
+TEST_P(NodeTest, ingest) {
+    std::vector<braft::PeerId> peers;
+    for (int i = 0; i < 3; i++) {
+        braft::PeerId peer;
+        peer.addr.ip = butil::my_ip();
+        peer.addr.port = 5006 + i;
+        peer.idx = 0;
+
+        peers.push_back(peer);
+    }
+
+    // start cluster
+    Cluster cluster("unittest", peers);
+    for (size_t i = 0; i < peers.size(); i++) {
+        ASSERT_EQ(0, cluster.start(peers[i].addr));
+    }
+
+    // elect leader
+    cluster.wait_leader();
+    braft::Node* leader = cluster.leader();
+    ASSERT_TRUE(leader != NULL);
+    LOG(WARNING) << "leader is " << leader->node_id();
+
+    // apply something
+    bthread::CountdownEvent cond(10);
+    for (int i = 0; i < 10; i++) {
+        butil::IOBuf data;
+        char data_buf[128];
+        snprintf(data_buf, sizeof(data_buf), "hello: %d", i + 1);
+        data.append(data_buf);
+
+        braft::Task task;
+        task.data = &data;
+        task.done = NEW_APPLYCLOSURE(&cond, 0);
+        leader->apply(task);
+    }
+    cond.wait();
+
+    // build the files to ingest
+    system("rm -rf ./ingest_data && mkdir ./ingest_data");
+    const int nfiles = 3;
+    for (int i = 0; i < nfiles; ++i) {
+        std::string content(100 * 1024 * (i + 1), 'a' + i);
+        char path[64];
+        snprintf(path, sizeof(path), "./ingest_data/%d.sst", i);
+        int fd = ::open(path, O_CREAT | O_WRONLY | O_TRUNC, 0644);
+        ASSERT_GE(fd, 0);
+        ASSERT_EQ((ssize_t)content.size(),
+                  ::write(fd, content.data(), content.size()));
+        ::close(fd);
+    }
+
+    // not leader
+    std::vector<braft::Node*> followers;
+    cluster.followers(&followers);
+    ASSERT_EQ(2u, followers.size());
+    cond.reset(1);
+    followers[0]->ingest("./ingest_data", NEW_APPLYCLOSURE(&cond, EPERM));
+    cond.wait();
+
+    cond.reset(1);
+    leader->ingest("./ingest_data", NEW_APPLYCLOSURE(&cond, 0));
+    cond.wait();
+
+    // followers copy the files and ingest them in the same order
+    ASSERT_TRUE(cluster.ensure_same(30));
+
+    // the files are ingested after the tasks applied before, and before the
+    // ones applied after
+    cond.reset(3);
+    for (int i = 0; i < 2; ++i) {
+        butil::IOBuf data;
+        data.append(i == 0 ? "before ingest" : "after ingest");
+        braft::Task task;
+        task.data = &data;
+        task.done = NEW_APPLYCLOSURE(&cond, 0);
+        leader->apply(task);
+        if (i == 0) {
+            leader->ingest("./ingest_data", NEW_APPLYCLOSURE(&cond, 0));
+        }
+    }
+    cond.wait();
+    ASSERT_TRUE(cluster.ensure_same(30));
+    MockFSM* fsm = static_cast<MockFSM*>(leader->_impl->_options.fsm);
+    fsm->lock();
+    const size_t nlogs = fsm->logs.size();
+    ASSERT_EQ(10u + 2 * nfiles + 2, nlogs);
+    ASSERT_EQ("before ingest", fsm->logs[nlogs - nfiles - 2].to_string());
+    ASSERT_EQ(std::string(100 * 1024, 'a'),
+              fsm->logs[nlogs - nfiles - 1].to_string());
+    ASSERT_EQ("after ingest", fsm->logs[nlogs - 1].to_string());
+    fsm->unlock();
+
+    LOG(WARNING) << "cluster stop";
+    cluster.stop_all();
+    system("rm -rf ./ingest_data");
+}
+
+TEST_P(NodeTest, ingest_after_leader_stops) {
+    std::vector<braft::PeerId> peers;
+    for (int i = 0; i < 3; i++) {
+        braft::PeerId peer;
+        peer.addr.ip = butil::my_ip();
+        peer.addr.port = 5006 + i;
+        peer.idx = 0;
+
+        peers.push_back(peer);
+    }
+
+    // start cluster
+    Cluster cluster("unittest", peers);
+    for (size_t i = 0; i < peers.size(); i++) {
+        ASSERT_EQ(0, cluster.start(peers[i].addr));
+    }
+
+    // elect leader
+    cluster.wait_leader();
+    braft::Node* leader = cluster.leader();
+    ASSERT_TRUE(leader != NULL);
+    LOG(WARNING) << "leader is " << leader->node_id();
+
+    bthread::CountdownEvent cond(10);
+    for (int i = 0; i < 10; i++) {
+        butil::IOBuf data;
+        char data_buf[128];
+        snprintf(data_buf, sizeof(data_buf), "hello: %d", i + 1);
+        data.append(data_buf);
+
+        braft::Task task;
+        task.data = &data;
+        task.done = NEW_APPLYCLOSURE(&cond, 0);
+        leader->apply(task);
+    }
+    cond.wait();
+    ASSERT_TRUE(cluster.ensure_same(30));
+
+    system("rm -rf ./ingest_data && mkdir ./ingest_data");
+    const int nfiles = 3;
+    for (int i = 0; i < nfiles; ++i) {
+        std::string content(100 * 1024 * (i + 1), 'a' + i);
+        char path[64];
+        snprintf(path, sizeof(path), "./ingest_data/%d.sst", i);
+        int fd = ::open(path, O_CREAT | O_WRONLY | O_TRUNC, 0644);
+        ASSERT_GE(fd, 0);
+        ASSERT_EQ((ssize_t)content.size(),
+                  ::write(fd, content.data(), content.size()));
+        ::close(fd);
+    }
+
+    // stop one follower, which applies the log after the leader is gone
+    std::vector<braft::Node*> followers;
+    cluster.followers(&followers);
+    ASSERT_EQ(2u, followers.size());
+    const butil::EndPoint leader_addr = leader->node_id().peer_id.addr;
+    const butil::EndPoint lagging_addr = followers[0]->node_id().peer_id.addr;
+    MockFSM* fsm = static_cast<MockFSM*>(followers[1]->_impl->_options.fsm);
+    cluster.stop(lagging_addr);
+
+    cond.reset(1);
+    leader->ingest("./ingest_data", NEW_APPLYCLOSURE(&cond, 0));
+    cond.wait();
+    // the leader keeps its own link of the files
+    system("rm -rf ./ingest_data");
+
+    for (int i = 0; i < 300; ++i) {
+        fsm->lock();
+        const size_t nlogs = fsm->logs.size();
+        fsm->unlock();
+        if (nlogs == 10u + nfiles) {
+            break;
+        }
+        usleep(100 * 1000);
+    }
+    fsm->lock();
+    ASSERT_EQ(10u + nfiles, fsm->logs.size());
+    fsm->unlock();
+
+    // the lagging follower copies the files from the remaining follower
+    cluster.stop(leader_addr);
+    ASSERT_EQ(0, cluster.start(lagging_addr));
+    cluster.wait_leader();
+    leader = cluster.leader();
+    ASSERT_TRUE(leader != NULL);
+    ASSERT_NE(lagging_addr, leader->node_id().peer_id.addr);
+
+    // the old leader replays the log from the files it kept
+    ASSERT_EQ(0, cluster.start(leader_addr));
+    ASSERT_TRUE(cluster.ensure_same(30));
+
+    LOG(WARNING) << "cluster stop";
+    cluster.stop_all();
+}
+
 TEST_P(NodeTest, InstallSnapshot) {
     std::vector<braft::PeerId> peers;
     for (int i = 0; i < 3; i++) {
@@ -1461,6 +1801,242 @@ TEST_P(NodeTest, InstallSnapshot) {
     cluster.stop_all();
 }
 
+TEST(SnapshotPolicyTest, log_size_snapshot_policy) {
+    braft::LogSizeSnapshotPolicy policy;
+    policy.max_log_entries = 1000;
+    policy.max_log_bytes = 1024 * 1024;
+    policy.max_replay_time_ms = 60 * 1000;
+    policy.min_log_entries = 10;
+
+    braft::SnapshotPolicyStats stats;
+    stats.snapshot_interval_ms = 3600 * 1000;
+    std::string reason;
+    stats.log_entries = 100;
+    ASSERT_FALSE(policy.should_snapshot(stats, &reason));
+    LOG(INFO) << reason;
+
+    stats.log_entries = 1000;
+    ASSERT_TRUE(policy.should_snapshot(stats, &reason));
+    stats.log_entries = 100;
+    stats.log_bytes = 1024 * 1024;
+    ASSERT_TRUE(policy.should_snapshot(stats, &reason));
+    stats.log_bytes = 0;
+    stats.replay_time_ms = 60 * 1000;
+    ASSERT_TRUE(policy.should_snapshot(stats, &reason));
+    stats.replay_time_ms = 0;
+    stats.time_since_last_snapshot_ms = 3600 * 1000;
+    ASSERT_TRUE(policy.should_snapshot(stats, &reason));
+    LOG(INFO) << reason;
+
+    // Too few entries to be worth a snapshot even if the interval passed
+    stats.log_entries = 9;
+    ASSERT_FALSE(policy.should_snapshot(stats, &reason));
+    LOG(INFO) << reason;
+}
+
+TEST(ReplicatorTest, is_snapshot_install_faster) {
+    const int64_t MB = 1024 * 1024;
+    double catch_up_s = 0;
+    double install_s = 0;
+    // Both throughputs are assumed to be the same before being measured
+    ASSERT_TRUE(braft::is_snapshot_install_faster(
+                100 * MB, 10 * MB, 1 * MB, 0, 0, &catch_up_s, &install_s));
+    ASSERT_LT(install_s, catch_up_s);
+    ASSERT_FALSE(braft::is_snapshot_install_faster(
+                100 * MB, 100 * MB, 1 * MB, 0, 0, &catch_up_s, &install_s));
+
+    // Installing is much slower than replicating logs to this follower
+    ASSERT_FALSE(braft::is_snapshot_install_faster(
+                100 * MB, 20 * MB, 0, 100 * MB, 10 * MB,
+                &catch_up_s, &install_s));
+    ASSERT_DOUBLE_EQ(1, catch_up_s);
+    ASSERT_DOUBLE_EQ(2, install_s);
+    ASSERT_TRUE(braft::is_snapshot_install_faster(
+                100 * MB, 5 * MB, 0, 100 * MB, 10 * MB,
+                &catch_up_s, &install_s));
+
+    // Only installing is measured, replicating logs is assumed as fast
+    ASSERT_TRUE(braft::is_snapshot_install_faster(
+                100 * MB, 20 * MB, 10 * MB, 0, 10 * MB,
+                &catch_up_s, &install_s));
+    ASSERT_DOUBLE_EQ(10, catch_up_s);
+    ASSERT_DOUBLE_EQ(3, install_s);
+}
+
+class EntryCountSnapshotPolicy : public braft::SnapshotPolicy {
+public:
+    EntryCountSnapshotPolicy() : save_log_bytes(0) {}
+
+    virtual bool should_snapshot(const braft::SnapshotPolicyStats& stats,
+                                 std::string* reason) {
+        if (stats.log_entries < 10) {
+            *reason = "too few entries";
+            return false;
+        }
+        save_log_bytes.store(stats.log_bytes);
+        *reason = "enough entries";
+        return true;
+    }
+
+    butil::atomic<int64_t> save_log_bytes;
+};
+
+TEST_P(NodeTest, snapshot_policy) {
+    brpc::Server server;
+    int ret = braft::add_service(&server, 5006);
+    server.Start(5006, NULL);
+    ASSERT_EQ(0, ret);
+
+    braft::PeerId peer;
+    peer.addr.ip = butil::my_ip();
+    peer.addr.port = 5006;
+    peer.idx = 0;
+    std::vector<braft::PeerId> peers;
+    peers.push_back(peer);
+
+    // The policy is checked at its own interval rather than every
+    // snapshot_interval_s
+    const int32_t saved_interval_ms =
+            braft::FLAGS_raft_snapshot_policy_check_interval_ms;
+    braft::FLAGS_raft_snapshot_policy_check_interval_ms = 100;
+    EntryCountSnapshotPolicy policy;
+    braft::NodeOptions options;
+    options.election_timeout_ms = 300;
+    options.initial_conf = braft::Configuration(peers);
+    MockFSM* fsm = new MockFSM(butil::EndPoint());
+    options.fsm = fsm;
+    options.node_owns_fsm = true;
+    options.log_uri = "local://./data/log";
+    options.raft_meta_uri = "local://./data/raft_meta";
+    options.snapshot_uri = "local://./data/snapshot";
+    options.snapshot_interval_s = 3600;
+    options.snapshot_policy = &policy;
+
+    braft::Node node("unittest", peer);
+    ASSERT_EQ(0, node.init(options));
+    braft::FLAGS_raft_snapshot_policy_check_interval_ms = saved_interval_ms;
+    while (!node.is_leader()) {
+        usleep(10 * 1000);
+    }
+
+    const int N = 10;
+    int64_t data_bytes = 0;
+    bthread::CountdownEvent cond(N);
+    for (int i = 0; i < N; i++) {
+        butil::IOBuf data;
+        char data_buf[128];
+        snprintf(data_buf, sizeof(data_buf), "hello: %d", i + 1);
+        data.append(data_buf);
+        data_bytes += data.size();
+        braft::Task task;
+        task.data = &data;
+        task.done = NEW_APPLYCLOSURE(&cond, 0);
+        node.apply(task);
+    }
+    cond.wait();
+
+    // Saved by the policy and skipped afterwards as nothing is appended
+    std::string description;
+    for (int i = 0; i < 100; ++i) {
+        std::ostringstream os;
+        node._impl->describe(os, false);
+        description = os.str();
+        if (description.find("snapshot_policy: skip: too few entries")
+                != std::string::npos && fsm->snapshot_index > 0) {
+            break;
+        }
+        usleep(50 * 1000);
+    }
+    LOG(INFO) << description;
+    ASSERT_NE(std::string::npos,
+              description.find("snapshot_policy: skip: too few entries"));
+    ASSERT_EQ(N + 1, fsm->snapshot_index);
+    ASSERT_GE(policy.save_log_bytes.load(), data_bytes);
+
+    cond.reset(1);
+    node.shutdown(NEW_SHUTDOWNCLOSURE(&cond, 0));
+    cond.wait();
+    node.join();
+
+    server.Stop(200);
+    server.Join();
+}
+
+TEST_P(NodeTest, install_snapshot_from_follower) {
+    braft::FLAGS_raft_install_snapshot_from_followers = true;
+    std::vector<braft::PeerId> peers;
+    for (int i = 0; i < 3; i++) {
+        braft::PeerId peer;
+        peer.addr.ip = butil::my_ip();
+        peer.addr.port = 5006 + i;
+        peer.idx = 0;
+
+        peers.push_back(peer);
+    }
+
+    // start cluster
+    Cluster cluster("unittest", peers);
+    for (size_t i = 0; i < peers.size(); i++) {
+        ASSERT_EQ(0, cluster.start(peers[i].addr));
+    }
+
+    // elect leader
+    cluster.wait_leader();
+    braft::Node* leader = cluster.leader();
+    ASSERT_TRUE(leader != NULL);
+    LOG(WARNING) << "leader is " << leader->node_id();
+
+    std::vector<braft::Node*> nodes;
+    cluster.followers(&nodes);
+    ASSERT_EQ(2, nodes.size());
+
+    // stop follower
+    LOG(WARNING) << "stop follower";
+    butil::EndPoint follower_addr = nodes[0]->node_id().peer_id.addr;
+    cluster.stop(follower_addr);
+
+    // apply something
+    bthread::CountdownEvent cond(20);
+    for (int i = 0; i < 20; i++) {
+        butil::IOBuf data;
+        char data_buf[128];
+        snprintf(data_buf, sizeof(data_buf), "hello: %d", i + 1);
+        data.append(data_buf);
+
+        braft::Task task;
+        task.data = &data;
+        task.done = NEW_APPLYCLOSURE(&cond, 0);
+        leader->apply(task);
+    }
+    cond.wait();
+
+    // trigger leader snapshot twice to compact logs
+    for (int i = 0; i < 2; i++) {
+        cond.reset(1);
+        leader->snapshot(NEW_SNAPSHOTCLOSURE(&cond, 0));
+        cond.wait();
+    }
+
+    // the other follower saves a snapshot which covers the leader's one,
+    // and reports it in the following heartbeat responses
+    usleep(100 * 1000);
+    cond.reset(1);
+    nodes[1]->snapshot(NEW_SNAPSHOTCLOSURE(&cond, 0));
+    cond.wait();
+    usleep(500 * 1000);
+
+    LOG(WARNING) << "restart follower";
+    ASSERT_EQ(0, cluster.start(follower_addr));
+
+    sleep(2);
+
+    cluster.ensure_same();
+
+    LOG(WARNING) << "cluster stop";
+    cluster.stop_all();
+    braft::FLAGS_raft_install_snapshot_from_followers = false;
+}
+
 TEST_P(NodeTest, install_snapshot_exceed_max_task_num) {
     GFLAGS_NS::SetCommandLineOption("raft_max_install_snapshot_tasks_num", "1");
     std::vector<braft::PeerId> peers;
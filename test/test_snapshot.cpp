@@ -8,12 +8,17 @@
 #include <gflags/gflags.h>
 #include <butil/logging.h>
 #include <butil/file_util.h>
+#include <butil/string_printf.h>
 #include <errno.h>
+#include <unistd.h>
 #include <brpc/server.h>
+#include <bvar/bvar.h>
 #include "braft/snapshot.h"
 #include "braft/raft.h"
 #include "braft/util.h"
 #include "braft/local_file_meta.pb.h"
+#include "braft/local_storage.pb.h"
+#include "braft/protobuf_file.h"
 #include "braft/snapshot_throttle.h"
 #include "memory_file_system_adaptor.h"
 
@@ -21,6 +26,15 @@ namespace logging {
 DECLARE_int32(minloglevel);
 };
 
+namespace braft {
+DECLARE_int64(raft_snapshot_block_checksum_size);
+DECLARE_bool(raft_snapshot_auto_checksum);
+DECLARE_bool(raft_resume_snapshot_download);
+DECLARE_int32(raft_adaptive_throttle_adjust_interval_ms);
+DECLARE_int64(raft_adaptive_throttle_max_log_sync_latency_us);
+DECLARE_int32(raft_snapshot_stream_buffer_size);
+}
+
 class SnapshotTest : public testing::Test {
 protected:
     void SetUp() {}
@@ -1052,3 +1066,499 @@ TEST_F(SnapshotTest, dynamically_change_throttle_threshold) {
     FOR_EACH_FILE_SYSTEM_ADAPTOR_END;
     GFLAGS_NS::SetCommandLineOption("raft_minimal_throttle_threshold_mb", "0");
 }
+
+TEST_F(SnapshotTest, copy_changed_blocks_only) {
+    braft::FileSystemAdaptor* fs;
+    FOR_EACH_FILE_SYSTEM_ADAPTOR_BEGIN(fs);
+
+    if (fs == NULL) {
+        ::system("rm -rf data data2");
+    } else {
+        fs->delete_file("data", true);
+        fs->delete_file("data2", true);
+    }
+    braft::FLAGS_raft_snapshot_block_checksum_size = 4;
+
+    brpc::Server server;
+    ASSERT_EQ(0, braft::add_service(&server, "0.0.0.0:6006"));
+    ASSERT_EQ(0, server.Start(6006, NULL));
+
+    braft::SnapshotMeta meta;
+    meta.set_last_included_index(1000);
+    meta.set_last_included_term(2);
+    *meta.add_peers() = braft::PeerId("1.2.3.4:1000").to_string();
+
+    braft::LocalSnapshotStorage* storage1 = new braft::LocalSnapshotStorage("./data");
+    if (fs) {
+        ASSERT_EQ(storage1->set_file_system_adaptor(fs), 0);
+    }
+    ASSERT_EQ(0, storage1->init());
+    storage1->set_server_addr(butil::EndPoint(butil::my_ip(), 6006));
+    braft::SnapshotWriter* writer1 = storage1->create();
+    ASSERT_TRUE(writer1 != NULL);
+    const std::string data1("aaaabbbbccccddddeeeefff");
+    add_file_meta(fs, writer1, 1, NULL, data1);
+    add_file_meta(fs, writer1, 2, NULL, data1);
+    ASSERT_EQ(0, writer1->save_meta(meta));
+    ASSERT_EQ(0, storage1->close(writer1));
+
+    braft::SnapshotReader* reader1 = storage1->open();
+    ASSERT_TRUE(reader1 != NULL);
+    braft::LocalFileMeta file_meta;
+    ASSERT_EQ(0, reader1->get_file_meta("file1", &file_meta));
+    ASSERT_EQ(4, file_meta.block_size());
+    ASSERT_EQ(int64_t(data1.size() + 7), file_meta.file_size());
+    ASSERT_EQ(8, file_meta.block_checksums_size());
+    std::string uri = reader1->generate_uri_for_copy();
+
+    // The last snapshot of storage2 has a different version of file1 in
+    // which some blocks are the same, the others are to be copied
+    braft::SnapshotStorage* storage2 = new braft::LocalSnapshotStorage("./data2");
+    if (fs) {
+        ASSERT_EQ(storage2->set_file_system_adaptor(fs), 0);
+    }
+    ASSERT_EQ(0, storage2->init());
+    braft::SnapshotWriter* writer2 = storage2->create();
+    ASSERT_TRUE(writer2 != NULL);
+    meta.set_last_included_index(900);
+    add_file_meta(fs, writer2, 1, NULL, "aaaaXXXXccccddddYYYY");
+    ASSERT_EQ(0, writer2->save_meta(meta));
+    ASSERT_EQ(0, storage2->close(writer2));
+
+    braft::SnapshotReader* reader2 = storage2->copy_from(uri);
+    ASSERT_TRUE(reader2 != NULL);
+    ASSERT_EQ(0, storage1->close(reader1));
+    ASSERT_EQ(0, storage2->close(reader2));
+
+    const std::string snapshot_path("data2/snapshot_00000000000000001000");
+    for (int i = 1; i <= 2; ++i) {
+        std::stringstream content;
+        content << "file" << i << ": " << data1;
+        ASSERT_EQ(content.str(), read_from_file(fs, snapshot_path, i));
+    }
+
+    braft::FLAGS_raft_snapshot_block_checksum_size = 0;
+    delete storage2;
+    delete storage1;
+
+    FOR_EACH_FILE_SYSTEM_ADAPTOR_END;
+}
+
+TEST_F(SnapshotTest, copy_whole_file_if_copying_blocks_fails) {
+    ::system("rm -rf data data2");
+    braft::FLAGS_raft_snapshot_block_checksum_size = 4;
+
+    brpc::Server server;
+    ASSERT_EQ(0, braft::add_service(&server, "0.0.0.0:6006"));
+    ASSERT_EQ(0, server.Start(6006, NULL));
+
+    braft::SnapshotMeta meta;
+    meta.set_last_included_index(1000);
+    meta.set_last_included_term(2);
+    *meta.add_peers() = braft::PeerId("1.2.3.4:1000").to_string();
+
+    braft::LocalSnapshotStorage* storage1 = new braft::LocalSnapshotStorage("./data");
+    ASSERT_EQ(0, storage1->init());
+    storage1->set_server_addr(butil::EndPoint(butil::my_ip(), 6006));
+    braft::SnapshotWriter* writer1 = storage1->create();
+    ASSERT_TRUE(writer1 != NULL);
+    add_file_meta(NULL, writer1, 1, NULL, "aaaabbbbccccddddeeeefff");
+    ASSERT_EQ(0, writer1->save_meta(meta));
+    ASSERT_EQ(0, storage1->close(writer1));
+    braft::SnapshotReader* reader1 = storage1->open();
+    ASSERT_TRUE(reader1 != NULL);
+    std::string uri = reader1->generate_uri_for_copy();
+    // The file is shorter than its meta says, so fetching the changed blocks
+    // at the end of it fails
+    const std::string remote_path = reader1->get_path() + "/file1";
+    ASSERT_EQ(0, ::truncate(remote_path.c_str(), 12));
+
+    braft::SnapshotStorage* storage2 = new braft::LocalSnapshotStorage("./data2");
+    ASSERT_EQ(0, storage2->init());
+    braft::SnapshotWriter* writer2 = storage2->create();
+    ASSERT_TRUE(writer2 != NULL);
+    meta.set_last_included_index(900);
+    add_file_meta(NULL, writer2, 1, NULL, "aaaaXXXXccccddddYYYY");
+    ASSERT_EQ(0, writer2->save_meta(meta));
+    ASSERT_EQ(0, storage2->close(writer2));
+
+    braft::SnapshotReader* reader2 = storage2->copy_from(uri);
+    ASSERT_TRUE(reader2 != NULL);
+    std::string content;
+    ASSERT_TRUE(butil::ReadFileToString(
+            butil::FilePath(reader2->get_path() + "/file1"), &content));
+    ASSERT_EQ("file1: aaaab", content);
+    ASSERT_EQ(0, storage1->close(reader1));
+    ASSERT_EQ(0, storage2->close(reader2));
+
+    braft::FLAGS_raft_snapshot_block_checksum_size = 0;
+    delete storage2;
+    delete storage1;
+}
+
+TEST_F(SnapshotTest, resume_interrupted_copy) {
+    ::system("rm -rf data data2");
+    // The flag is restored when the test returns, even on a failed assertion
+    google::FlagSaver saver;
+    braft::FLAGS_raft_resume_snapshot_download = true;
+    brpc::Server server;
+    ASSERT_EQ(0, braft::add_service(&server, "0.0.0.0:6006"));
+    ASSERT_EQ(0, server.Start(6006, NULL));
+
+    braft::SnapshotMeta meta;
+    meta.set_last_included_index(1000);
+    meta.set_last_included_term(2);
+    *meta.add_peers() = braft::PeerId("1.2.3.4:1000").to_string();
+
+    braft::LocalSnapshotStorage* storage1 = new braft::LocalSnapshotStorage("./data");
+    ASSERT_EQ(0, storage1->init());
+    const butil::EndPoint addr(butil::my_ip(), 6006);
+    storage1->set_server_addr(addr);
+    braft::SnapshotWriter* writer1 = storage1->create();
+    ASSERT_TRUE(writer1 != NULL);
+    const std::string data1("aaaabbbbccccdddd");
+    add_file_meta(NULL, writer1, 1, NULL, data1);
+    add_file_meta(NULL, writer1, 2, NULL, data1);
+    ASSERT_EQ(0, writer1->save_meta(meta));
+    ASSERT_EQ(0, storage1->close(writer1));
+    braft::SnapshotReader* reader1 = storage1->open();
+    ASSERT_TRUE(reader1 != NULL);
+    std::string uri = reader1->generate_uri_for_copy();
+
+    // Leave the state of an interrupted install in data2/temp: file1 is
+    // partly copied with the right data, file2 with corrupted data
+    const std::string content = "file1: " + data1;
+    ::system("mkdir -p data2/temp");
+    write_file(NULL, "data2/temp/file1", content.substr(0, 10));
+    write_file(NULL, "data2/temp/file2", "file2: xxx");
+    braft::SnapshotDownloadProgress progress;
+    *progress.mutable_meta() = meta;
+    progress.set_source(butil::endpoint2str(addr).c_str());
+    for (int i = 1; i <= 2; ++i) {
+        braft::SnapshotDownloadProgress::File* f = progress.add_files();
+        f->set_name(i == 1 ? "file1" : "file2");
+        f->set_offset(10);
+        f->set_checksum(braft::crc32(content.data(), 10));
+        f->mutable_meta();
+    }
+    braft::ProtoBufFile pb_file("data2/temp/__raft_snapshot_download_progress");
+    ASSERT_EQ(0, pb_file.save(&progress, true));
+
+    braft::SnapshotStorage* storage2 = new braft::LocalSnapshotStorage("./data2");
+    ASSERT_EQ(0, storage2->init());
+    braft::SnapshotReader* reader2 = storage2->copy_from(uri);
+    ASSERT_TRUE(reader2 != NULL);
+    ASSERT_EQ(0, storage1->close(reader1));
+    ASSERT_EQ(0, storage2->close(reader2));
+
+    const std::string snapshot_path("data2/snapshot_00000000000000001000");
+    for (int i = 1; i <= 2; ++i) {
+        std::stringstream expected;
+        expected << "file" << i << ": " << data1;
+        ASSERT_EQ(expected.str(), read_from_file(NULL, snapshot_path, i));
+    }
+    ASSERT_FALSE(butil::PathExists(butil::FilePath(
+            snapshot_path + "/__raft_snapshot_download_progress")));
+
+    delete storage2;
+    delete storage1;
+}
+
+class MockStreamLoader : public braft::SnapshotStreamLoader {
+public:
+    int on_file_data(const std::string& filename, int64_t offset,
+                     const butil::IOBuf& data) {
+        BAIDU_SCOPED_LOCK(_mutex);
+        std::string& content = _files[filename];
+        EXPECT_EQ(int64_t(content.size()), offset);
+        content.append(data.to_string());
+        return 0;
+    }
+    void on_file_end(const std::string& filename) {
+        BAIDU_SCOPED_LOCK(_mutex);
+        _ended.insert(filename);
+    }
+    int on_load(braft::SnapshotReader* /*reader*/) { return 0; }
+
+    bthread::Mutex _mutex;
+    std::map<std::string, std::string> _files;
+    std::set<std::string> _ended;
+};
+
+TEST_F(SnapshotTest, stream_to_loader) {
+    ::system("rm -rf data data2");
+    brpc::Server server;
+    ASSERT_EQ(0, braft::add_service(&server, "0.0.0.0:6006"));
+    ASSERT_EQ(0, server.Start(6006, NULL));
+
+    braft::SnapshotMeta meta;
+    meta.set_last_included_index(1000);
+    meta.set_last_included_term(2);
+    *meta.add_peers() = braft::PeerId("1.2.3.4:1000").to_string();
+
+    braft::LocalSnapshotStorage* storage1 = new braft::LocalSnapshotStorage("./data");
+    ASSERT_EQ(0, storage1->init());
+    storage1->set_server_addr(butil::EndPoint(butil::my_ip(), 6006));
+    braft::SnapshotWriter* writer1 = storage1->create();
+    ASSERT_TRUE(writer1 != NULL);
+    add_file_meta(NULL, writer1, 1, NULL, "aaaabbbbcccc");
+    add_file_meta(NULL, writer1, 2, NULL, "");
+    ASSERT_EQ(0, writer1->save_meta(meta));
+    ASSERT_EQ(0, storage1->close(writer1));
+
+    braft::SnapshotReader* reader1 = storage1->open();
+    ASSERT_TRUE(reader1 != NULL);
+    std::string uri = reader1->generate_uri_for_copy();
+
+    braft::SnapshotStorage* storage2 = new braft::LocalSnapshotStorage("./data2");
+    ASSERT_EQ(0, storage2->init());
+    MockStreamLoader loader;
+    braft::SnapshotCopier* copier = storage2->start_to_stream_from(uri, &loader);
+    ASSERT_TRUE(copier != NULL);
+    copier->join();
+    ASSERT_TRUE(copier->ok());
+    ASSERT_EQ(0, storage1->close(reader1));
+    ASSERT_EQ(0, storage2->close(copier));
+
+    // The loader consumes the same data as the one written to the disk
+    const std::string snapshot_path("data2/snapshot_00000000000000001000");
+    ASSERT_EQ(2u, loader._ended.size());
+    for (int i = 1; i <= 2; ++i) {
+        std::stringstream filename;
+        filename << "file" << i;
+        ASSERT_EQ(1u, loader._ended.count(filename.str()));
+        ASSERT_EQ(read_from_file(NULL, snapshot_path, i),
+                  loader._files[filename.str()]);
+    }
+
+    delete storage2;
+    delete storage1;
+}
+
+TEST_F(SnapshotTest, stream_writer) {
+    ::system("rm -rf data");
+    google::FlagSaver saver;
+    braft::FLAGS_raft_snapshot_block_checksum_size = 4;
+    // The appended data is written in background while the following data
+    // is buffered
+    braft::FLAGS_raft_snapshot_stream_buffer_size = 4;
+
+    braft::SnapshotMeta meta;
+    meta.set_last_included_index(1000);
+    meta.set_last_included_term(2);
+    *meta.add_peers() = braft::PeerId("1.2.3.4:1000").to_string();
+
+    braft::LocalSnapshotStorage* storage = new braft::LocalSnapshotStorage("./data");
+    ASSERT_EQ(0, storage->init());
+    braft::SnapshotWriter* writer = storage->create();
+    ASSERT_TRUE(writer != NULL);
+
+    braft::SnapshotStreamWriter* stream = writer->open_stream("stream");
+    ASSERT_TRUE(stream != NULL);
+    butil::IOBuf data;
+    data.append("aaaabb");
+    ASSERT_EQ(0, stream->append(data));
+    ASSERT_EQ(0, stream->append("bbccccd", 7));
+    braft::LocalFileMeta user_meta;
+    user_meta.set_user_meta("user");
+    ASSERT_EQ(0, stream->close(&user_meta));
+    ASSERT_EQ(-1, stream->append("e", 1));
+    delete stream;
+
+    // Deleted without being closed
+    stream = writer->open_stream("discarded");
+    ASSERT_TRUE(stream != NULL);
+    ASSERT_EQ(0, stream->append("e", 1));
+    delete stream;
+
+    ASSERT_EQ(0, writer->save_meta(meta));
+    ASSERT_EQ(0, storage->close(writer));
+
+    braft::SnapshotReader* reader = storage->open();
+    ASSERT_TRUE(reader != NULL);
+    std::vector<std::string> files;
+    reader->list_files(&files);
+    ASSERT_EQ(1u, files.size());
+    ASSERT_EQ("stream", files[0]);
+    braft::LocalFileMeta file_meta;
+    ASSERT_EQ(0, reader->get_file_meta("stream", &file_meta));
+    ASSERT_EQ("user", file_meta.user_meta());
+    ASSERT_EQ(braft::FILE_SOURCE_LOCAL, file_meta.source());
+    ASSERT_EQ(butil::string_printf("%08x-13", braft::crc32("aaaabbbbccccd", 13)),
+              file_meta.checksum());
+    ASSERT_EQ(13, file_meta.file_size());
+    ASSERT_EQ(4, file_meta.block_size());
+    ASSERT_EQ(4, file_meta.block_checksums_size());
+    ASSERT_EQ(braft::crc32("bbbb", 4), file_meta.block_checksums(1));
+    ASSERT_EQ(braft::crc32("d", 1), file_meta.block_checksums(3));
+    std::string content;
+    ASSERT_TRUE(butil::ReadFileToString(
+            butil::FilePath(reader->get_path() + "/stream"), &content));
+    ASSERT_EQ("aaaabbbbccccd", content);
+    ASSERT_EQ(0, storage->close(reader));
+
+    delete storage;
+}
+
+TEST_F(SnapshotTest, link_file) {
+    ::system("rm -rf data tables");
+    ASSERT_TRUE(butil::CreateDirectory(butil::FilePath("tables")));
+    const std::string table1("aaaabbbbcc");
+    ASSERT_EQ((int)table1.size(), butil::WriteFile(
+            butil::FilePath("tables/table1"), table1.data(), table1.size()));
+
+    braft::SnapshotMeta meta;
+    meta.set_last_included_index(1000);
+    meta.set_last_included_term(2);
+    *meta.add_peers() = braft::PeerId("1.2.3.4:1000").to_string();
+
+    braft::LocalSnapshotStorage* storage = new braft::LocalSnapshotStorage("./data");
+    ASSERT_EQ(0, storage->init());
+    const char* hit_name = "raft_snapshot_checksum_cache_hit_count";
+    const int64_t hit = strtoll(
+            bvar::Variable::describe_exposed(hit_name).c_str(), NULL, 10);
+    for (int i = 0; i < 2; ++i) {
+        // The checksums are cached by inode in the second round
+        braft::SnapshotWriter* writer = storage->create();
+        ASSERT_TRUE(writer != NULL);
+        ASSERT_EQ(0, writer->link_file("table1", "tables/table1", NULL));
+        ASSERT_EQ(hit + i, strtoll(
+                bvar::Variable::describe_exposed(hit_name).c_str(), NULL, 10));
+        ASSERT_EQ(-1, writer->link_file("table2", "tables/table2", NULL));
+        meta.set_last_included_index(1000 + i);
+        ASSERT_EQ(0, writer->save_meta(meta));
+        ASSERT_EQ(0, storage->close(writer));
+
+        braft::SnapshotReader* reader = storage->open();
+        ASSERT_TRUE(reader != NULL);
+        std::vector<std::string> files;
+        reader->list_files(&files);
+        ASSERT_EQ(1u, files.size());
+        braft::LocalFileMeta file_meta;
+        ASSERT_EQ(0, reader->get_file_meta("table1", &file_meta));
+        ASSERT_EQ(butil::string_printf("%08x-%d",
+                          braft::crc32(table1.data(), table1.size()),
+                          (int)table1.size()),
+                  file_meta.checksum());
+        std::string content;
+        ASSERT_TRUE(butil::ReadFileToString(
+                butil::FilePath(reader->get_path() + "/table1"), &content));
+        ASSERT_EQ(table1, content);
+        ASSERT_EQ(0, storage->close(reader));
+    }
+
+    // A rewritten file isn't taken from the cache
+    const std::string table1_v2("ddddeeee");
+    ASSERT_TRUE(butil::DeleteFile(butil::FilePath("tables/table1"), false));
+    ASSERT_EQ((int)table1_v2.size(), butil::WriteFile(
+            butil::FilePath("tables/table1"), table1_v2.data(), table1_v2.size()));
+    braft::SnapshotWriter* writer = storage->create();
+    ASSERT_TRUE(writer != NULL);
+    ASSERT_EQ(0, writer->link_file("table1", "tables/table1", NULL));
+    braft::LocalFileMeta file_meta;
+    ASSERT_EQ(0, writer->get_file_meta("table1", &file_meta));
+    ASSERT_EQ(butil::string_printf("%08x-%d",
+                      braft::crc32(table1_v2.data(), table1_v2.size()),
+                      (int)table1_v2.size()),
+              file_meta.checksum());
+    ASSERT_EQ(0, storage->close(writer));
+
+    delete storage;
+}
+
+TEST_F(SnapshotTest, auto_checksum) {
+    ::system("rm -rf data");
+    braft::FLAGS_raft_snapshot_auto_checksum = true;
+    braft::FLAGS_raft_snapshot_block_checksum_size = 4;
+
+    braft::SnapshotMeta meta;
+    meta.set_last_included_index(1000);
+    meta.set_last_included_term(2);
+    *meta.add_peers() = braft::PeerId("1.2.3.4:1000").to_string();
+
+    braft::LocalSnapshotStorage* storage = new braft::LocalSnapshotStorage("./data");
+    ASSERT_EQ(0, storage->init());
+    braft::SnapshotWriter* writer = storage->create();
+    ASSERT_TRUE(writer != NULL);
+    std::vector<std::string> contents;
+    for (int i = 0; i < 10; ++i) {
+        std::string content;
+        for (int j = 0; j <= i; ++j) {
+            butil::string_appendf(&content, "%d%d", i, j);
+        }
+        const std::string name = butil::string_printf("file%d", i);
+        ASSERT_EQ((int)content.size(), butil::WriteFile(
+                butil::FilePath(writer->get_path() + '/' + name),
+                content.data(), content.size()));
+        braft::LocalFileMeta file_meta;
+        if (i == 0) {
+            // The checksum given by the user is kept
+            file_meta.set_checksum("user");
+        }
+        ASSERT_EQ(0, writer->add_file(name, &file_meta));
+        contents.push_back(content);
+    }
+    ASSERT_EQ(0, writer->save_meta(meta));
+    ASSERT_EQ(0, storage->close(writer));
+
+    braft::SnapshotReader* reader = storage->open();
+    ASSERT_TRUE(reader != NULL);
+    for (int i = 0; i < 10; ++i) {
+        braft::LocalFileMeta file_meta;
+        ASSERT_EQ(0, reader->get_file_meta(
+                        butil::string_printf("file%d", i), &file_meta));
+        const std::string& content = contents[i];
+        if (i == 0) {
+            ASSERT_EQ("user", file_meta.checksum());
+        } else {
+            ASSERT_EQ(butil::string_printf("%08x-%d",
+                              braft::crc32(content.data(), content.size()),
+                              (int)content.size()),
+                      file_meta.checksum());
+        }
+        ASSERT_EQ((int64_t)content.size(), file_meta.file_size());
+        ASSERT_EQ(4, file_meta.block_size());
+        ASSERT_EQ(((int)content.size() + 3) / 4, file_meta.block_checksums_size());
+        ASSERT_EQ(braft::crc32(content.data(), std::min(content.size(), (size_t)4)),
+                  file_meta.block_checksums(0));
+    }
+    ASSERT_EQ(0, storage->close(reader));
+
+    braft::FLAGS_raft_snapshot_block_checksum_size = 0;
+    braft::FLAGS_raft_snapshot_auto_checksum = false;
+    delete storage;
+}
+
+TEST_F(SnapshotTest, adaptive_snapshot_throttle) {
+    braft::FLAGS_raft_adaptive_throttle_adjust_interval_ms = 0;
+    scoped_refptr<braft::AdaptiveSnapshotThrottle> throttle(
+            new braft::AdaptiveSnapshotThrottle(100, 1000, 10));
+    ASSERT_EQ(0, throttle->expose("test_adaptive_snapshot_throttle"));
+    ASSERT_EQ(100, throttle->get_throughput());
+
+    // Raised while the foreground IO is healthy, up to the max
+    throttle->throttled_by_throughput(1);
+    ASSERT_EQ(200, throttle->get_throughput());
+    for (int i = 0; i < 20; ++i) {
+        throttle->throttled_by_throughput(1);
+    }
+    ASSERT_EQ(1000, throttle->get_throughput());
+
+    // Halved once log syncs slow down, down to the min
+    const int64_t slow_sync_us =
+            braft::FLAGS_raft_adaptive_throttle_max_log_sync_latency_us + 1;
+    braft::record_log_sync_latency(slow_sync_us);
+    throttle->throttled_by_throughput(1);
+    ASSERT_EQ(500, throttle->get_throughput());
+    for (int i = 0; i < 10; ++i) {
+        braft::record_log_sync_latency(slow_sync_us);
+        throttle->throttled_by_throughput(1);
+    }
+    ASSERT_EQ(100, throttle->get_throughput());
+
+    // No more syncs since the last adjustment counts as healthy
+    throttle->throttled_by_throughput(1);
+    ASSERT_EQ(200, throttle->get_throughput());
+
+    braft::FLAGS_raft_adaptive_throttle_adjust_interval_ms = 1000;
+}
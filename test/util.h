@@ -26,6 +26,17 @@
 using namespace braft;
 bool g_dont_print_apply_log = false;
 
+// Records the snapshot saves of the MockFSMs sharing it, each save lasts at
+// least |save_delay_us| so that concurrent saves overlap
+struct SnapshotSaveRecorder {
+    SnapshotSaveRecorder() : save_delay_us(0), nrunning(0), max_running(0) {}
+    int64_t save_delay_us;
+    raft_mutex_t mutex;
+    int nrunning;
+    int max_running;
+    std::vector<butil::EndPoint> saved;
+};
+
 class MockFSM : public braft::StateMachine {
 public:
     MockFSM(const butil::EndPoint& address_)
@@ -36,6 +47,7 @@ public:
         , _on_stop_following_times(0)
         , _leader_term(-1)
         , _on_leader_start_closure(NULL)
+        , _snapshot_save_recorder(NULL)
     {
         pthread_mutex_init(&mutex, NULL);
     }
@@ -52,6 +64,7 @@ public:
     int64_t _on_stop_following_times;
     volatile int64_t _leader_term;
     braft::Closure* _on_leader_start_closure;
+    SnapshotSaveRecorder* _snapshot_save_recorder;
 
     void lock() {
         pthread_mutex_lock(&mutex);
@@ -104,6 +117,14 @@ public:
         brpc::ClosureGuard done_guard(done);
 
         LOG(INFO) << "on_snapshot_save to " << file_path;
+        SnapshotSaveRecorder* recorder = _snapshot_save_recorder;
+        if (recorder) {
+            std::lock_guard<raft_mutex_t> guard(recorder->mutex);
+            ++recorder->nrunning;
+            recorder->max_running = std::max(recorder->max_running,
+                                             recorder->nrunning);
+            recorder->saved.push_back(address);
+        }
 
         int fd = ::creat(file_path.c_str(), 0644);
         if (fd < 0) {
@@ -124,6 +145,11 @@ public:
         snapshot_index = applied_index;
         unlock();
         writer->add_file("data");
+        if (recorder) {
+            usleep(recorder->save_delay_us);
+            std::lock_guard<raft_mutex_t> guard(recorder->mutex);
+            --recorder->nrunning;
+        }
     }
 
     virtual int on_snapshot_load(braft::SnapshotReader* reader) {
@@ -157,6 +183,30 @@ public:
         return 0;
     }
 
+    virtual int on_ingest(const std::string& path,
+                          const std::vector<std::string>& files,
+                          int64_t index) {
+        LOG(INFO) << "on_ingest " << files.size() << " files from " << path;
+        lock();
+        // each file is ingested as a log
+        for (size_t i = 0; i < files.size(); ++i) {
+            const std::string file_path = path + "/" + files[i];
+            int fd = ::open(file_path.c_str(), O_RDONLY);
+            if (fd < 0) {
+                LOG(ERROR) << "open file failed, path: " << file_path << " err: " << berror();
+                unlock();
+                return EIO;
+            }
+            butil::IOPortal data;
+            while (data.append_from_file_descriptor(fd, 1024 * 1024) > 0) {}
+            ::close(fd);
+            logs.push_back(data);
+        }
+        unlock();
+        applied_index = index;
+        return 0;
+    }
+
     virtual void on_start_following(const braft::LeaderChangeContext& start_following_context) {
         LOG(TRACE) << "address " << address << " start following new leader: " 
                    <<  start_following_context;